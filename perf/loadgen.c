@@ -0,0 +1,510 @@
+/*
+ * Load generator and echo servers for perf_run.sh.
+ *
+ *   loadgen udp-echo <ip:port>
+ *   loadgen tcp-echo <ip:port>
+ *   loadgen udp <ip:port> [-r pps] [-s size] [-t sec] [-c flows]
+ *   loadgen tcp <ip:port> -x <socks ip:port> [-s size] [-t sec] [-c conns]
+ *               [-w window]
+ *
+ * Every message starts with its monotonic send time, echoes carry it back
+ * so round trip time is measured by the sender alone. Namespaces share the
+ * clock, so this works across them.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define LOADGEN_MAX_FLOWS  256
+#define LOADGEN_MAX_SIZE   65507
+#define LOADGEN_DRAIN_MS   1000
+#define LOADGEN_BATCH      256
+
+struct loadgen_config
+{
+    struct sockaddr_in target;
+    struct sockaddr_in socks;
+    uint32_t rate;
+    size_t size;
+    uint32_t seconds;
+    size_t flows;
+    size_t window;
+};
+
+struct loadgen_result
+{
+    uint64_t sent;
+    uint64_t received;
+    uint64_t bytes;
+    uint64_t elapsed_ns;
+    struct stats_histogram rtt;
+};
+
+struct loadgen_conn
+{
+    int fd;
+    size_t inflight;
+    size_t tx_off;
+    size_t rx_off;
+    uint8_t *tx;
+    uint8_t *rx;
+};
+
+static uint64_t _now_ns()
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int _parse_addr(char const *str, struct sockaddr_in *addr)
+{
+    char ip[INET_ADDRSTRLEN] = { 0 };
+    char const *colon = strchr(str, ':');
+
+    if (!colon || (size_t)(colon - str) >= sizeof(ip)) {
+        return -1;
+    }
+    memcpy(ip, str, colon - str);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(atoi(colon + 1));
+
+    return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+static int _listen(struct sockaddr_in const *addr, int type)
+{
+    int one = 1;
+    int fd = socket(AF_INET, type, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr const *)addr, sizeof(*addr)) < 0
+        || (type == SOCK_STREAM && listen(fd, 128) < 0)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int _udp_echo(struct sockaddr_in const *addr)
+{
+    uint8_t buf[LOADGEN_MAX_SIZE];
+    int fd = _listen(addr, SOCK_DGRAM);
+
+    if (fd < 0) {
+        perror("udp echo");
+        return -1;
+    }
+
+    while (1) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        ssize_t bytes = recvfrom(fd, buf, sizeof(buf), 0,
+                                 (struct sockaddr *)&peer, &len);
+        if (bytes > 0) {
+            sendto(fd, buf, bytes, 0, (struct sockaddr *)&peer, len);
+        }
+    }
+}
+
+static void *_tcp_echo_conn(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    uint8_t buf[LOADGEN_MAX_SIZE];
+    ssize_t bytes = 0;
+
+    while ((bytes = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t done = 0; done < bytes;) {
+            ssize_t sent = send(fd, buf + done, bytes - done, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                close(fd);
+                return NULL;
+            }
+            done += sent;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static int _tcp_echo(struct sockaddr_in const *addr)
+{
+    int fd = _listen(addr, SOCK_STREAM);
+
+    if (fd < 0) {
+        perror("tcp echo");
+        return -1;
+    }
+
+    while (1) {
+        pthread_t thread;
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            continue;
+        }
+        if (pthread_create(&thread, NULL, _tcp_echo_conn,
+                           (void *)(intptr_t)conn)
+            != 0) {
+            close(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+static void _record(struct loadgen_result *res, uint8_t const *msg,
+                    size_t size)
+{
+    uint64_t sent_ns = 0;
+
+    memcpy(&sent_ns, msg, sizeof(sent_ns));
+    stats_histogram_record(&res->rtt, _now_ns() - sent_ns);
+    res->received++;
+    res->bytes += size;
+}
+
+static int _udp_load(struct loadgen_config const *cfg,
+                     struct loadgen_result *res)
+{
+    struct pollfd fds[LOADGEN_MAX_FLOWS];
+    uint8_t buf[LOADGEN_MAX_SIZE] = { 0 };
+    uint64_t start_ns = _now_ns();
+    uint64_t end_ns = start_ns + cfg->seconds * 1000000000ULL;
+    uint64_t drain_ns = end_ns + LOADGEN_DRAIN_MS * 1000000ULL;
+    uint64_t gap_ns = cfg->rate ? 1000000000ULL / cfg->rate : 0;
+    uint64_t next_ns = start_ns;
+    size_t flow = 0;
+
+    for (size_t i = 0; i < cfg->flows; i++) {
+        fds[i].fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        fds[i].events = POLLIN;
+        if (fds[i].fd < 0
+            || connect(fds[i].fd, (struct sockaddr const *)&cfg->target,
+                       sizeof(cfg->target))
+                   < 0) {
+            perror("udp socket");
+            return -1;
+        }
+    }
+
+    while (1) {
+        uint64_t now_ns = _now_ns();
+        if (now_ns >= drain_ns
+            || (now_ns >= end_ns && res->received == res->sent)) {
+            break;
+        }
+
+        /* paced in millisecond bursts, or a batch per pass when rate is
+         * unlimited */
+        for (size_t i = 0; i < LOADGEN_BATCH && now_ns < end_ns
+                           && (!gap_ns || now_ns >= next_ns);
+             i++) {
+            uint64_t stamp = _now_ns();
+            memcpy(buf, &stamp, sizeof(stamp));
+            if (send(fds[flow].fd, buf, cfg->size, 0) == (ssize_t)cfg->size) {
+                res->sent++;
+            }
+            flow = (flow + 1) % cfg->flows;
+            next_ns += gap_ns;
+        }
+
+        int timeout = 0;
+        now_ns = _now_ns();
+        if (gap_ns && now_ns < end_ns && next_ns > now_ns) {
+            timeout = (next_ns - now_ns + 999999) / 1000000;
+        }
+        else if (now_ns >= end_ns) {
+            timeout = 10;
+        }
+
+        if (poll(fds, cfg->flows, timeout) <= 0) {
+            continue;
+        }
+
+        for (size_t i = 0; i < cfg->flows; i++) {
+            ssize_t bytes = 0;
+            while (fds[i].revents & POLLIN
+                   && (bytes = recv(fds[i].fd, buf, sizeof(buf), 0)) > 0) {
+                _record(res, buf, bytes);
+            }
+        }
+    }
+
+    res->elapsed_ns = end_ns - start_ns;
+
+    for (size_t i = 0; i < cfg->flows; i++) {
+        close(fds[i].fd);
+    }
+
+    return 0;
+}
+
+static int _read_exact(int fd, uint8_t *buf, size_t size)
+{
+    for (size_t done = 0; done < size;) {
+        ssize_t bytes = read(fd, buf + done, size - done);
+        if (bytes <= 0) {
+            return -1;
+        }
+        done += bytes;
+    }
+
+    return 0;
+}
+
+/* no auth, CONNECT to ipv4 target, reply is always 10 bytes for ipv4 */
+static int _socks5_connect(struct loadgen_config const *cfg)
+{
+    uint8_t greeting[3] = { 5, 1, 0 };
+    uint8_t request[10] = { 5, 1, 0, 1 };
+    uint8_t reply[10];
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memcpy(request + 4, &cfg->target.sin_addr, 4);
+    memcpy(request + 8, &cfg->target.sin_port, 2);
+
+    if (fd < 0
+        || connect(fd, (struct sockaddr const *)&cfg->socks,
+                   sizeof(cfg->socks))
+               < 0
+        || write(fd, greeting, sizeof(greeting)) != sizeof(greeting)
+        || _read_exact(fd, reply, 2) < 0 || reply[1] != 0
+        || write(fd, request, sizeof(request)) != sizeof(request)
+        || _read_exact(fd, reply, sizeof(reply)) < 0 || reply[1] != 0) {
+        perror("socks5 connect");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+
+/* keeps window messages in flight on every connection */
+static int _tcp_load(struct loadgen_config const *cfg,
+                     struct loadgen_result *res)
+{
+    struct loadgen_conn conns[LOADGEN_MAX_FLOWS] = { 0 };
+    struct pollfd fds[LOADGEN_MAX_FLOWS];
+    uint64_t start_ns = 0;
+    uint64_t end_ns = 0;
+    uint64_t drain_ns = 0;
+
+    for (size_t i = 0; i < cfg->flows; i++) {
+        conns[i].fd = _socks5_connect(cfg);
+        conns[i].tx = calloc(1, cfg->size);
+        conns[i].rx = calloc(1, cfg->size);
+        if (conns[i].fd < 0 || !conns[i].tx || !conns[i].rx) {
+            return -1;
+        }
+        fds[i].fd = conns[i].fd;
+    }
+
+    start_ns = _now_ns();
+    end_ns = start_ns + cfg->seconds * 1000000000ULL;
+    drain_ns = end_ns + LOADGEN_DRAIN_MS * 1000000ULL;
+
+    while (1) {
+        uint64_t now_ns = _now_ns();
+        bool busy = false;
+
+        for (size_t i = 0; i < cfg->flows; i++) {
+            struct loadgen_conn *c = &conns[i];
+            bool more = now_ns < end_ns && c->inflight < cfg->window;
+            busy |= c->inflight > 0;
+            fds[i].events = POLLIN | (c->tx_off || more ? POLLOUT : 0);
+        }
+
+        if (now_ns >= drain_ns || (now_ns >= end_ns && !busy)) {
+            break;
+        }
+
+        if (poll(fds, cfg->flows, 10) <= 0) {
+            continue;
+        }
+
+        for (size_t i = 0; i < cfg->flows; i++) {
+            struct loadgen_conn *c = &conns[i];
+
+            while (fds[i].revents & POLLOUT) {
+                if (!c->tx_off) {
+                    if (now_ns >= end_ns || c->inflight >= cfg->window) {
+                        break;
+                    }
+                    uint64_t stamp = _now_ns();
+                    memcpy(c->tx, &stamp, sizeof(stamp));
+                }
+                ssize_t bytes = send(c->fd, c->tx + c->tx_off,
+                                     cfg->size - c->tx_off, MSG_NOSIGNAL);
+                if (bytes <= 0) {
+                    break;
+                }
+                c->tx_off += bytes;
+                if (c->tx_off == cfg->size) {
+                    c->tx_off = 0;
+                    c->inflight++;
+                    res->sent++;
+                }
+            }
+
+            while (fds[i].revents & POLLIN) {
+                ssize_t bytes = recv(c->fd, c->rx + c->rx_off,
+                                     cfg->size - c->rx_off, 0);
+                if (bytes <= 0) {
+                    break;
+                }
+                c->rx_off += bytes;
+                if (c->rx_off == cfg->size) {
+                    c->rx_off = 0;
+                    c->inflight--;
+                    _record(res, c->rx, cfg->size);
+                }
+            }
+        }
+    }
+
+    res->elapsed_ns = end_ns - start_ns;
+
+    for (size_t i = 0; i < cfg->flows; i++) {
+        close(conns[i].fd);
+        free(conns[i].tx);
+        free(conns[i].rx);
+    }
+
+    return 0;
+}
+
+static void _report(char const *mode, struct loadgen_config const *cfg,
+                    struct loadgen_result const *res)
+{
+    double seconds = res->elapsed_ns / 1e9;
+
+    printf("%s: size %zu, flows %zu, sent %llu, received %llu (loss %.2f%%), "
+           "%.0f %s, %.1f Mbit/s, rtt p50 %.1f us, p90 %.1f us, "
+           "p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+           mode, cfg->size, cfg->flows, (unsigned long long)res->sent,
+           (unsigned long long)res->received,
+           res->sent ? 100.0 * (res->sent - res->received) / res->sent : 0.0,
+           res->received / seconds, strcmp(mode, "tcp") ? "pps" : "msg/s",
+           res->bytes * 8 / seconds / 1e6,
+           stats_histogram_percentile(&res->rtt, 50) / 1e3,
+           stats_histogram_percentile(&res->rtt, 90) / 1e3,
+           stats_histogram_percentile(&res->rtt, 99) / 1e3,
+           stats_histogram_percentile(&res->rtt, 99.9) / 1e3,
+           res->rtt.max / 1e3);
+}
+
+static void _usage()
+{
+    fprintf(stderr, "loadgen udp-echo <ip:port>\n"
+                    "loadgen tcp-echo <ip:port>\n"
+                    "loadgen udp <ip:port> [-r pps] [-s size] [-t sec] "
+                    "[-c flows]\n"
+                    "loadgen tcp <ip:port> -x <socks ip:port> [-s size] "
+                    "[-t sec] [-c conns] [-w window]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static struct loadgen_result res;
+    struct loadgen_config cfg = {
+        .rate = 10000,
+        .size = 64,
+        .seconds = 5,
+        .flows = 1,
+        .window = 4,
+    };
+    bool socks = false;
+    int opt = 0;
+
+    if (argc < 3 || _parse_addr(argv[2], &cfg.target) < 0) {
+        _usage();
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "udp-echo")) {
+        return _udp_echo(&cfg.target) < 0 ? 1 : 0;
+    }
+    if (!strcmp(argv[1], "tcp-echo")) {
+        return _tcp_echo(&cfg.target) < 0 ? 1 : 0;
+    }
+
+    optind = 3;
+    while ((opt = getopt(argc, argv, "r:s:t:c:w:x:")) != -1) {
+        switch (opt) {
+            case 'r':
+                cfg.rate = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                cfg.size = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                cfg.seconds = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                cfg.flows = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                cfg.window = strtoul(optarg, NULL, 10);
+                break;
+            case 'x':
+                socks = _parse_addr(optarg, &cfg.socks) == 0;
+                break;
+            default:
+                _usage();
+                return 1;
+        }
+    }
+
+    if (cfg.size < sizeof(uint64_t) || cfg.size > LOADGEN_MAX_SIZE
+        || !cfg.flows || cfg.flows > LOADGEN_MAX_FLOWS || !cfg.seconds
+        || !cfg.window) {
+        _usage();
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "udp")) {
+        if (_udp_load(&cfg, &res) < 0) {
+            return 1;
+        }
+    }
+    else if (!strcmp(argv[1], "tcp") && socks) {
+        if (_tcp_load(&cfg, &res) < 0) {
+            return 1;
+        }
+    }
+    else {
+        _usage();
+        return 1;
+    }
+
+    _report(argv[1], &cfg, &res);
+
+    return 0;
+}
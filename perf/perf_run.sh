@@ -0,0 +1,146 @@
+#! /bin/sh
+
+# end to end run of tuntap and socks5 halves together on one box:
+#
+#   tp_client 10.201.0.2 --- 10.201.0.1 tp_proxy 10.201.1.1 --- 10.201.1.2 tp_server
+#                                       tunproxy                          10.202.0.1 (lo)
+#
+# client udp is forwarded by tp_proxy into tuntap, goes over mux connection
+# to tunproxy's own socks5 listener and leaves through its marked socket.
+# client tcp uses that listener directly with CONNECT. echo servers sit on
+# an address tp_proxy only reaches through its default route, so policy
+# rules don't see a more specific route and steer it into tuntap.
+
+# load settings, environment overrides them
+duration=${DURATION:-5}
+udp_rate=${UDP_RATE:-10000}
+udp_size=${UDP_SIZE:-512}
+udp_flows=${UDP_FLOWS:-16}
+tcp_size=${TCP_SIZE:-16384}
+tcp_conns=${TCP_CONNS:-4}
+tcp_window=${TCP_WINDOW:-4}
+
+# extra tunproxy arguments, e.g. "--mux-connections 2 --pipelined"
+tunproxy_args=${TUNPROXY_ARGS:-}
+
+# 1 runs udp load once without tunproxy for reference
+baseline=${BASELINE:-1}
+
+script_dir=$(dirname "$(realpath $0)")
+repo_dir=$script_dir/..
+tunproxy=$repo_dir/tunproxy
+work=$(mktemp -d /tmp/perf_run.XXXXXX)
+
+client="ip netns exec tp_client"
+proxy="ip netns exec tp_proxy"
+server="ip netns exec tp_server"
+echo_addr=10.202.0.1:9000
+socks_addr=10.201.0.1:1080
+
+tunproxy_pid=""
+clk_tck=$(getconf CLK_TCK)
+
+cleanup() {
+    [ -n "$tunproxy_pid" ] && kill -INT $tunproxy_pid 2>/dev/null && wait $tunproxy_pid
+    for ns in tp_client tp_proxy tp_server; do
+        ip netns pids $ns 2>/dev/null | xargs -r kill 2>/dev/null
+        ip netns del $ns 2>/dev/null
+    done
+    rm -rf $work
+}
+
+# tunproxy cpu time in ticks (utime + stime)
+cpu_ticks() {
+    awk '{ print $14 + $15 }' /proc/$tunproxy_pid/stat
+}
+
+# run load generator in client namespace, print its report and cpu per
+# packet tunproxy spent on it
+run_load() {
+    name=$1
+    shift
+    before=$(cpu_ticks)
+    out=$($client $work/loadgen "$@") || { echo "$name: load generator failed"; return 1; }
+    after=$(cpu_ticks)
+    received=$(echo "$out" | sed -n 's/.* received \([0-9]*\).*/\1/p')
+    echo "$out"
+    echo "$name: tunproxy cpu $(((after - before) * 1000 / clk_tck)) ms, $(((after - before) * 1000000000 / clk_tck / (received > 0 ? received : 1))) ns per packet"
+}
+
+if [ "$(id -u)" != 0 ]; then
+    echo "needs root (network namespaces, tuntap)"
+    exit 1
+fi
+
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+# dependencies
+# make only rebuilds what changed, a stale binary would be measured otherwise
+make -C $repo_dir || exit 1
+gcc -O2 -Wall -Werror -pthread -I$repo_dir/src/stats -I$repo_dir/src/util -I$repo_dir/log/src \
+    $script_dir/loadgen.c $repo_dir/src/stats/stats.c $repo_dir/log/src/log.c \
+    -o $work/loadgen || exit 1
+
+echo -n "setting up namespaces..."
+for ns in tp_client tp_proxy tp_server; do
+    ip netns del $ns 2>/dev/null
+    ip netns add $ns
+    ip -n $ns link set lo up
+done
+
+ip link add tp_c type veth peer name tp_pc
+ip link add tp_s type veth peer name tp_ps
+ip link set tp_c netns tp_client
+ip link set tp_pc netns tp_proxy
+ip link set tp_ps netns tp_proxy
+ip link set tp_s netns tp_server
+
+$client sh -c 'ip addr add 10.201.0.2/24 dev tp_c && ip link set tp_c up && ip route add default via 10.201.0.1'
+$proxy sh -c 'ip addr add 10.201.0.1/24 dev tp_pc && ip link set tp_pc up
+              ip addr add 10.201.1.1/24 dev tp_ps && ip link set tp_ps up
+              ip route add default via 10.201.1.2'
+$server sh -c 'ip addr add 10.201.1.2/24 dev tp_s && ip link set tp_s up
+               ip addr add 10.202.0.1/32 dev lo && ip route add default via 10.201.1.1'
+
+$proxy sysctl -qw net.ipv4.ip_forward=1
+$proxy sysctl -qw net.ipv4.conf.all.rp_filter=0
+$proxy sysctl -qw net.ipv4.conf.default.rp_filter=0
+echo "done"
+
+$server $work/loadgen udp-echo $echo_addr &
+$server $work/loadgen tcp-echo $echo_addr &
+sleep 0.2
+
+if [ "$baseline" = 1 ]; then
+    echo ""
+    echo "baseline (forwarding only, no tunproxy):"
+    $client $work/loadgen udp $echo_addr -r $udp_rate -s $udp_size -c $udp_flows -t $duration || exit 1
+fi
+
+cd $work
+$proxy $tunproxy $tunproxy_args $socks_addr > $work/tunproxy.out 2>&1 &
+tunproxy_pid=$!
+sleep 1.5
+if ! kill -0 $tunproxy_pid 2>/dev/null; then
+    tunproxy_pid=""
+    echo "tunproxy didn't start:"
+    cat $work/tunproxy.out
+    exit 1
+fi
+$proxy sysctl -qw net.ipv4.conf.tun0.rp_filter=0 2>/dev/null
+
+echo ""
+echo "udp through tuntap and mux:"
+run_load udp udp $echo_addr -r $udp_rate -s $udp_size -c $udp_flows -t $duration || exit 1
+
+echo ""
+echo "tcp through socks5 CONNECT:"
+run_load tcp tcp $echo_addr -x $socks_addr -s $tcp_size -c $tcp_conns -w $tcp_window -t $duration || exit 1
+
+# counters of every module end up in tunproxy log
+kill -USR1 $tunproxy_pid
+sleep 0.3
+echo ""
+echo "tunproxy stats:"
+sed -n '/---- stats ----/,$p' "$work"/*[0-9][0-9][0-9][0-9] 2>/dev/null | cut -c1-200
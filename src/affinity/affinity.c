@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+#include <dirent.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "stats.h"
+
+struct affinity_start
+{
+    void *(*fn)(void *);
+    void *arg;
+    int node;
+};
+
+static struct
+{
+    bool enabled;
+    int cpus[AFFINITY_MAX_CPUS];
+    int nodes[AFFINITY_MAX_CPUS];
+    size_t count;
+    unsigned int next;
+    unsigned long threads[AFFINITY_MAX_CPUS];
+} _affinity;
+
+static char const *const _role_names[AFFINITY_ROLE_COUNT] = {
+    [AFFINITY_TUNTAP] = "tuntap",
+    [AFFINITY_SOCKS5_ACCEPT] = "socks5 accept",
+    [AFFINITY_SOCKS5_CLIENT] = "socks5 client",
+    [AFFINITY_SOCKS5_UDP] = "socks5 udp relay",
+    [AFFINITY_TUNTAP_READER] = "tuntap reader",
+    [AFFINITY_TUNTAP_WRITER] = "tuntap writer",
+    [AFFINITY_TUNTAP_CONNECTOR] = "tuntap connector",
+};
+
+static int _cpu_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+
+    int node = 0;
+    struct dirent *entry = NULL;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!strncmp(entry->d_name, "node", 4)) {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+
+    return node;
+}
+
+static int _add_cpu(int cpu, cpu_set_t const *allowed)
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, allowed)) {
+        errno = -EINVAL;
+        log_error("cpu %d not available! (%d / %s)", cpu, errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    if (_affinity.count == AFFINITY_MAX_CPUS) {
+        errno = -ENOSPC;
+        return -1;
+    }
+
+    _affinity.cpus[_affinity.count] = cpu;
+    _affinity.nodes[_affinity.count] = _cpu_node(cpu);
+    _affinity.count++;
+
+    return 0;
+}
+
+/* staged tuntap reader / writer take the cores right after data path */
+static size_t _stage_core(enum affinity_role role)
+{
+    size_t index = role == AFFINITY_TUNTAP_READER ? 1 : 2;
+    return index < _affinity.count ? index : _affinity.count - 1;
+}
+
+/*
+ * tuntap data path owns the first core, socks5 threads are spread over
+ * the rest (or share the only core)
+ */
+static size_t _pick(enum affinity_role role)
+{
+    if (role == AFFINITY_TUNTAP || _affinity.count == 1) {
+        return 0;
+    }
+
+    if (role == AFFINITY_TUNTAP_READER || role == AFFINITY_TUNTAP_WRITER) {
+        return _stage_core(role);
+    }
+
+    unsigned int next = __atomic_fetch_add(&_affinity.next, 1,
+                                           __ATOMIC_RELAXED);
+    return 1 + next % (_affinity.count - 1);
+}
+
+static void *_trampoline(void *arg)
+{
+    struct affinity_start start = *(struct affinity_start *)arg;
+    free(arg);
+
+    /* buffers and flow state allocated by worker stay on its node */
+    unsigned long nodemask = 1UL << start.node;
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask,
+                sizeof(nodemask) * 8)
+        < 0) {
+        log_error("failed to set memory policy node %d! (%d / %s)",
+                  start.node, errno, strerror(errno));
+    }
+
+    return start.fn(start.arg);
+}
+
+static void _affinity_report()
+{
+    if (!_affinity.enabled) {
+        log_info("affinity: disabled");
+        return;
+    }
+
+    log_info("affinity: %s on cpu %d (node %d)", _role_names[AFFINITY_TUNTAP],
+             _affinity.cpus[0], _affinity.nodes[0]);
+    for (size_t i = 0; i < _affinity.count; i++) {
+        log_info("affinity: cpu %d (node %d) %lu threads started",
+                 _affinity.cpus[i], _affinity.nodes[i],
+                 __atomic_load_n(&_affinity.threads[i], __ATOMIC_RELAXED));
+    }
+}
+
+int affinity_init(char const *cpu_list)
+{
+    cpu_set_t allowed;
+
+    memset(&_affinity, 0, sizeof(_affinity));
+    stats_register(_affinity_report);
+
+    if (!cpu_list) {
+        return 0;
+    }
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        log_error("failed to get allowed cpus! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    char const *p = cpu_list;
+    while (*p) {
+        char *end = NULL;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            break;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                break;
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (_add_cpu(cpu, &allowed) < 0) {
+                _affinity.count = 0;
+                return -1;
+            }
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    if (*p || !_affinity.count) {
+        errno = -EINVAL;
+        log_error("invalid cpu list '%s'! (%d / %s)", cpu_list, errno,
+                  strerror(errno));
+        _affinity.count = 0;
+        return -1;
+    }
+
+    _affinity.enabled = true;
+
+    for (int role = 0; role < AFFINITY_ROLE_COUNT; role++) {
+        size_t first = role == AFFINITY_TUNTAP || _affinity.count == 1 ? 0 : 1;
+        size_t last = role == AFFINITY_TUNTAP ? 0 : _affinity.count - 1;
+        if (role == AFFINITY_TUNTAP_READER || role == AFFINITY_TUNTAP_WRITER) {
+            first = last = _stage_core(role);
+        }
+        log_info("affinity: %s threads on cpus %d - %d", _role_names[role],
+                 _affinity.cpus[first], _affinity.cpus[last]);
+    }
+
+    return 0;
+}
+
+int affinity_thread_create(pthread_t *thread, enum affinity_role role,
+                           void *(*fn)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (role == AFFINITY_SOCKS5_CLIENT) {
+        pthread_attr_setstacksize(&attr, AFFINITY_CLIENT_STACK_SIZE);
+    }
+
+    if (!_affinity.enabled) {
+        int ret = pthread_create(thread, &attr, fn, arg);
+        pthread_attr_destroy(&attr);
+        return ret;
+    }
+
+    size_t index = _pick(role);
+    struct affinity_start *start = malloc(sizeof(*start));
+    if (!start) {
+        pthread_attr_destroy(&attr);
+        return ENOMEM;
+    }
+
+    start->fn = fn;
+    start->arg = arg;
+    start->node = _affinity.nodes[index];
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(_affinity.cpus[index], &set);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+    int ret = pthread_create(thread, &attr, _trampoline, start);
+    pthread_attr_destroy(&attr);
+
+    if (ret != 0) {
+        free(start);
+        return ret;
+    }
+
+    __atomic_add_fetch(&_affinity.threads[index], 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static int _write_file(char const *path, char const *value)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        return -1;
+    }
+
+    int ret = fputs(value, fp) < 0 ? -1 : 0;
+    if (fclose(fp) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* sysfs cpu mask: comma separated 32 bit hex words, most significant first */
+static void _format_mask(int const *cpus, size_t count, char *buf,
+                         size_t size)
+{
+    uint32_t words[CPU_SETSIZE / 32] = { 0 };
+    int top = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        words[cpus[i] / 32] |= 1U << (cpus[i] % 32);
+        top = cpus[i] / 32 > top ? cpus[i] / 32 : top;
+    }
+
+    size_t offset = 0;
+    for (int i = top; i >= 0 && offset < size; i--) {
+        offset += snprintf(buf + offset, size - offset, "%s%08x",
+                           i == top ? "" : ",", words[i]);
+    }
+}
+
+int affinity_align_interface(char const *ifname, enum affinity_role role)
+{
+    char mask[CPU_SETSIZE / 32 * 9 + 1] = { 0 };
+    char path[512];
+
+    if (!_affinity.enabled) {
+        return 0;
+    }
+
+    size_t count = role == AFFINITY_TUNTAP ? 1 : _affinity.count;
+    _format_mask(_affinity.cpus, count, mask, sizeof(mask));
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", ifname);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        log_error("no queues for %s! (%d / %s)", ifname, errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    struct dirent *entry = NULL;
+    while ((entry = readdir(dir)) != NULL) {
+        char const *file = !strncmp(entry->d_name, "rx-", 3)   ? "rps_cpus"
+                           : !strncmp(entry->d_name, "tx-", 3) ? "xps_cpus"
+                                                                : NULL;
+        if (!file) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/class/net/%s/queues/%s/%s", ifname,
+                 entry->d_name, file);
+        if (_write_file(path, mask) < 0) {
+            log_error("failed to write %s! (%d / %s)", path, errno,
+                      strerror(errno));
+        }
+    }
+    closedir(dir);
+
+    log_info("affinity: %s queues steered to cpu mask %s", ifname, mask);
+
+    return 0;
+}
+
+int affinity_align_irqs(char const *ifname)
+{
+    char line[1024];
+    char path[64];
+    char cpu[16];
+    int moved = 0;
+
+    if (!_affinity.enabled || !ifname) {
+        return 0;
+    }
+
+    FILE *fp = fopen("/proc/interrupts", "r");
+    if (!fp) {
+        log_error("failed to open interrupts! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    size_t name_size = strlen(ifname);
+    while (fgets(line, sizeof(line), fp)) {
+        char *name = strstr(line, ifname);
+        if (!name || (name[name_size] != '-' && name[name_size] != '\n')) {
+            continue;
+        }
+
+        int irq = atoi(line);
+        if (irq <= 0) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irq);
+        snprintf(cpu, sizeof(cpu), "%d",
+                 _affinity.cpus[moved % _affinity.count]);
+        if (_write_file(path, cpu) < 0) {
+            log_error("failed to move irq %d to cpu %s! (%d / %s)", irq, cpu,
+                      errno, strerror(errno));
+            continue;
+        }
+        moved++;
+    }
+    fclose(fp);
+
+    log_info("affinity: %d %s irqs spread over data path cpus", moved,
+             ifname);
+
+    return moved;
+}
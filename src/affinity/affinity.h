@@ -0,0 +1,60 @@
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include <pthread.h>
+
+#define AFFINITY_MAX_CPUS 256
+
+/* socks5 client threads relay from heap buffers, small stack is enough */
+#define AFFINITY_CLIENT_STACK_SIZE (128 * 1024)
+
+enum affinity_role
+{
+    AFFINITY_TUNTAP = 0,
+    AFFINITY_SOCKS5_ACCEPT = 1,
+    AFFINITY_SOCKS5_CLIENT = 2,
+    AFFINITY_SOCKS5_UDP = 3,
+    AFFINITY_TUNTAP_READER = 4,
+    AFFINITY_TUNTAP_WRITER = 5,
+    AFFINITY_TUNTAP_CONNECTOR = 6,
+    AFFINITY_ROLE_COUNT = 7,
+};
+
+/**
+ * @brief initialize thread placement
+ * @param cpu_list data path cores, e.g. "2,3,8-11", NULL disables pinning
+ * @return 0 on success, -errno on failure
+ */
+int affinity_init(char const *cpu_list);
+
+/**
+ * @brief create thread pinned to next core of its role, thread memory
+ *        policy prefers the numa node of that core, client threads get
+ *        AFFINITY_CLIENT_STACK_SIZE stack
+ * @param thread thread handle
+ * @param role thread role
+ * @param fn thread function
+ * @param arg thread function argument
+ * @return 0 on success, error number on failure (same as pthread_create)
+ */
+int affinity_thread_create(pthread_t *thread, enum affinity_role role,
+                           void *(*fn)(void *), void *arg);
+
+/**
+ * @brief steer interface rx / tx queue processing (rps / xps) to cores of
+ *        role, used to keep tuntap queue work next to its worker
+ * @param ifname interface name
+ * @param role thread role
+ * @return 0 on success, -errno on failure
+ */
+int affinity_align_interface(char const *ifname, enum affinity_role role);
+
+/**
+ * @brief spread nic queue irqs over data path cores, queue n irq goes to
+ *        core n so rss lines up with workers
+ * @param ifname nic name as shown in /proc/interrupts
+ * @return number of irqs moved, -1 on failure
+ */
+int affinity_align_irqs(char const *ifname);
+
+#endif /* __AFFINITY_H__ */
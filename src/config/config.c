@@ -0,0 +1,403 @@
+#include "config.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+#include "log.h"
+#include "stats.h"
+
+#define CONFIG_LINE_SIZE 1024
+
+static struct
+{
+    struct config *current;
+    /* generation of current, readable without entering an epoch */
+    uint64_t generation;
+    /* writers are serialized, readers never take it */
+    pthread_mutex_t lock;
+    config_apply_fn subscribers[CONFIG_MAX_SUBSCRIBERS];
+    size_t subscriber_count;
+    uint64_t changes;
+    uint64_t rejected;
+} _config = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int _copy(char *dst, size_t size, char const *src)
+{
+    if (strlen(src) >= size) {
+        errno = -ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(dst, src);
+
+    return 0;
+}
+
+static int _set_proxy(struct config *cfg, char const *value)
+{
+    char ip[CONFIG_ADDR_SIZE] = { 0 };
+    struct in_addr addr;
+    char const *colon = strchr(value, ':');
+    char *end = NULL;
+
+    if (!colon || colon == value || (size_t)(colon - value) >= sizeof(ip)) {
+        errno = -EINVAL;
+        return -1;
+    }
+    memcpy(ip, value, colon - value);
+
+    unsigned long port = strtoul(colon + 1, &end, 10);
+    if (inet_pton(AF_INET, ip, &addr) != 1 || end == colon + 1 || *end
+        || !port || port > UINT16_MAX) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    strcpy(cfg->proxy_ip, ip);
+    cfg->proxy_port = port;
+
+    return 0;
+}
+
+static int _set_tun_addr(struct config *cfg, char const *value)
+{
+    char ip[CONFIG_ADDR_SIZE] = { 0 };
+    struct in_addr addr;
+    char const *slash = strchr(value, '/');
+    char *end = NULL;
+
+    if (!slash || slash == value || (size_t)(slash - value) >= sizeof(ip)) {
+        errno = -EINVAL;
+        return -1;
+    }
+    memcpy(ip, value, slash - value);
+
+    unsigned long prefix = strtoul(slash + 1, &end, 10);
+    if (inet_pton(AF_INET, ip, &addr) != 1 || end == slash + 1 || *end
+        || !prefix || prefix > 30) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    struct in_addr netmask = { .s_addr = htonl(~0U << (32 - prefix)) };
+    strcpy(cfg->tun_addr, ip);
+    inet_ntop(AF_INET, &netmask, cfg->tun_netmask, sizeof(cfg->tun_netmask));
+
+    return 0;
+}
+
+static int _set_steer(struct config *cfg, char const *value)
+{
+    char list[CONFIG_LINE_SIZE];
+    char *save = NULL;
+
+    if (_copy(list, sizeof(list), value) < 0) {
+        return -1;
+    }
+
+    cfg->steer_count = 0;
+    cfg->steer_custom = true;
+    for (char *spec = strtok_r(list, ",", &save); spec;
+         spec = strtok_r(NULL, ",", &save)) {
+        if (config_steer_add(cfg, spec) < 0) {
+            return -1;
+        }
+    }
+
+    if (!cfg->steer_count) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void _config_report()
+{
+    epoch_enter();
+    struct config const *cfg = config_get();
+    log_info("config: generation %llu, proxy %s:%u, tun %s/%s, auth %s, "
+             "%zu steering rules, changes %llu, rejected %llu",
+             (unsigned long long)cfg->generation, cfg->proxy_ip,
+             cfg->proxy_port, cfg->tun_addr, cfg->tun_netmask,
+             cfg->user[0] ? "user / password" : "none", cfg->steer_count,
+             (unsigned long long)__atomic_load_n(&_config.changes,
+                                                 __ATOMIC_RELAXED),
+             (unsigned long long)__atomic_load_n(&_config.rejected,
+                                                 __ATOMIC_RELAXED));
+    epoch_leave();
+}
+
+void config_defaults(struct config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    strcpy(cfg->proxy_ip, "127.0.0.1");
+    cfg->proxy_port = 1080;
+    strcpy(cfg->tun_addr, "10.0.0.1");
+    strcpy(cfg->tun_netmask, "255.255.255.0");
+    cfg->steer[0] = (struct config_steer_rule){ .proto = IPPROTO_UDP,
+                                                .first = 0,
+                                                .last = UINT16_MAX };
+    cfg->steer_count = 1;
+}
+
+int config_set(struct config *cfg, char const *key, char const *value)
+{
+    if (!key || !value) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    if (!strcmp(key, "proxy")) {
+        return _set_proxy(cfg, value);
+    }
+    if (!strcmp(key, "tun-addr")) {
+        return _set_tun_addr(cfg, value);
+    }
+    if (!strcmp(key, "user")) {
+        return _copy(cfg->user, sizeof(cfg->user), value);
+    }
+    if (!strcmp(key, "password")) {
+        return _copy(cfg->password, sizeof(cfg->password), value);
+    }
+    if (!strcmp(key, "steer")) {
+        return _set_steer(cfg, value);
+    }
+
+    errno = -ENOENT;
+    return -1;
+}
+
+int config_steer_add(struct config *cfg, char const *spec)
+{
+    struct config_steer_rule rule = { .last = UINT16_MAX };
+    char *end = NULL;
+
+    if (!spec) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    if (!strcmp(spec, "all")) {
+        rule.proto = 0;
+    }
+    else if (!strncmp(spec, "udp", 3) && (!spec[3] || spec[3] == ':')) {
+        rule.proto = IPPROTO_UDP;
+        if (spec[3]) {
+            unsigned long first = strtoul(spec + 4, &end, 10);
+            unsigned long last = *end == '-' ? strtoul(end + 1, &end, 10)
+                                             : first;
+            if (end == spec + 4 || *end || !first || last < first
+                || last > UINT16_MAX) {
+                errno = -EINVAL;
+                return -1;
+            }
+            rule.first = first;
+            rule.last = last;
+        }
+    }
+    else {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    if (!cfg->steer_custom) {
+        cfg->steer_count = 0;
+        cfg->steer_custom = true;
+    }
+    if (cfg->steer_count == CONFIG_MAX_STEER) {
+        errno = -ENOSPC;
+        return -1;
+    }
+
+    cfg->steer[cfg->steer_count++] = rule;
+
+    return 0;
+}
+
+bool config_steer_match(struct config const *cfg, uint8_t proto,
+                        uint16_t dport)
+{
+    for (size_t i = 0; i < cfg->steer_count; i++) {
+        struct config_steer_rule const *rule = &cfg->steer[i];
+
+        if (!rule->proto
+            || (rule->proto == proto && dport >= rule->first
+                && dport <= rule->last)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int config_load(struct config *cfg, char const *path)
+{
+    char line[CONFIG_LINE_SIZE];
+    size_t number = 0;
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        log_error("config %s unreadable! (%d / %s)", path, errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        char *save = NULL;
+        number++;
+
+        line[strcspn(line, "#\r\n")] = 0;
+        char *key = strtok_r(line, " \t", &save);
+        char *value = strtok_r(NULL, " \t", &save);
+        if (!key) {
+            continue;
+        }
+
+        if (config_set(cfg, key, value ? value : "") < 0) {
+            log_error("config %s:%zu invalid %s! (%d / %s)", path, number, key,
+                      errno, strerror(errno));
+            fclose(file);
+            return -1;
+        }
+    }
+
+    fclose(file);
+
+    return 0;
+}
+
+size_t config_format(struct config const *cfg, char *buf, size_t size)
+{
+    size_t len = 0;
+
+#define CONFIG_APPEND(...)                                                     \
+    if (len < size) {                                                          \
+        len += snprintf(buf + len, size - len, __VA_ARGS__);                   \
+    }
+
+    CONFIG_APPEND("proxy %s:%u\n", cfg->proxy_ip, cfg->proxy_port);
+    struct in_addr netmask = { 0 };
+    inet_pton(AF_INET, cfg->tun_netmask, &netmask);
+    CONFIG_APPEND("tun-addr %s/%d\n", cfg->tun_addr,
+                  __builtin_popcount(netmask.s_addr));
+    if (cfg->user[0]) {
+        /* password stays out of dumps */
+        CONFIG_APPEND("user %s\n", cfg->user);
+    }
+    CONFIG_APPEND("steer ");
+    for (size_t i = 0; i < cfg->steer_count; i++) {
+        struct config_steer_rule const *rule = &cfg->steer[i];
+        char const *sep = i + 1 < cfg->steer_count ? "," : "\n";
+
+        if (!rule->proto) {
+            CONFIG_APPEND("all%s", sep);
+        }
+        else if (!rule->first && rule->last == UINT16_MAX) {
+            CONFIG_APPEND("udp%s", sep);
+        }
+        else if (rule->first == rule->last) {
+            CONFIG_APPEND("udp:%u%s", rule->first, sep);
+        }
+        else {
+            CONFIG_APPEND("udp:%u-%u%s", rule->first, rule->last, sep);
+        }
+    }
+
+#undef CONFIG_APPEND
+
+    return len < size ? len : size - 1;
+}
+
+int config_init(struct config const *cfg)
+{
+    struct config *first = malloc(sizeof(*first));
+    if (!first) {
+        return -1;
+    }
+
+    *first = *cfg;
+    first->generation = 1;
+    __atomic_store_n(&_config.current, first, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&_config.generation, 1, __ATOMIC_RELEASE);
+
+    stats_register(_config_report);
+
+    return 0;
+}
+
+struct config const *config_get()
+{
+    return __atomic_load_n(&_config.current, __ATOMIC_ACQUIRE);
+}
+
+uint64_t config_generation()
+{
+    return __atomic_load_n(&_config.generation, __ATOMIC_ACQUIRE);
+}
+
+void config_copy(struct config *cfg)
+{
+    epoch_enter();
+    *cfg = *config_get();
+    epoch_leave();
+}
+
+int config_publish(struct config const *cfg)
+{
+    struct config *next = malloc(sizeof(*next));
+    if (!next) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&_config.lock);
+    struct config *old = _config.current;
+    *next = *cfg;
+    next->generation = old->generation + 1;
+
+    for (size_t i = 0; i < _config.subscriber_count; i++) {
+        if (_config.subscribers[i](old, next) < 0) {
+            _config.rejected++;
+            pthread_mutex_unlock(&_config.lock);
+            free(next);
+            return -1;
+        }
+    }
+
+    __atomic_store_n(&_config.current, next, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&_config.generation, next->generation, __ATOMIC_RELEASE);
+    _config.changes++;
+
+    uint64_t generation = next->generation;
+
+    /* readers still holding old snapshot finish their section first */
+    epoch_synchronize();
+    free(old);
+    pthread_mutex_unlock(&_config.lock);
+
+    log_info("config generation %llu published",
+             (unsigned long long)generation);
+
+    return 0;
+}
+
+int config_subscribe(config_apply_fn fn)
+{
+    pthread_mutex_lock(&_config.lock);
+    if (_config.subscriber_count == CONFIG_MAX_SUBSCRIBERS) {
+        pthread_mutex_unlock(&_config.lock);
+        errno = -ENOSPC;
+        return -1;
+    }
+    _config.subscribers[_config.subscriber_count++] = fn;
+    pthread_mutex_unlock(&_config.lock);
+
+    return 0;
+}
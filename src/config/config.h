@@ -0,0 +1,151 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONFIG_MAX_STEER       16
+#define CONFIG_MAX_SUBSCRIBERS 8
+#define CONFIG_ADDR_SIZE       16
+#define CONFIG_CRED_SIZE       256
+
+/*
+ * Settings that can change while running. The current settings are one
+ * immutable snapshot, readers dereference it inside epoch_enter() /
+ * epoch_leave() without taking a lock. A change builds a new snapshot,
+ * lets subscribers apply side effects (routes, rules) and swaps the
+ * pointer, the old snapshot is freed once every reader has moved on.
+ */
+
+/* proto 0 matches every protocol */
+struct config_steer_rule
+{
+    uint8_t proto;
+    uint16_t first;
+    uint16_t last;
+};
+
+struct config
+{
+    uint64_t generation;
+    /* tuntap upstream */
+    char proxy_ip[CONFIG_ADDR_SIZE];
+    uint16_t proxy_port;
+    /* tuntap interface */
+    char tun_addr[CONFIG_ADDR_SIZE];
+    char tun_netmask[CONFIG_ADDR_SIZE];
+    /* socks5 user / password, required by listener and sent upstream when
+     * user is set */
+    char user[CONFIG_CRED_SIZE];
+    char password[CONFIG_CRED_SIZE];
+    /* traffic routed into tuntap */
+    struct config_steer_rule steer[CONFIG_MAX_STEER];
+    size_t steer_count;
+    bool steer_custom;
+};
+
+/**
+ * @brief called with old and new snapshot before new one is published
+ * @return 0 to go on, -1 rejects change (earlier subscribers keep theirs)
+ */
+typedef int (*config_apply_fn)(struct config const *old,
+                               struct config const *next);
+
+/**
+ * @brief fill settings with built in defaults (10.0.0.1/24, udp steered,
+ *        no authentication)
+ * @param cfg settings
+ */
+void config_defaults(struct config *cfg);
+
+/**
+ * @brief change one setting
+ * @param cfg settings
+ * @param key "proxy" (ip:port), "tun-addr" (ip/prefix), "user",
+ *        "password" or "steer" (comma separated rules, see
+ *        config_steer_add)
+ * @param value new value
+ * @return 0 on success, -errno on failure
+ */
+int config_set(struct config *cfg, char const *key, char const *value);
+
+/**
+ * @brief add steering rule, first one replaces default rule
+ * @param cfg settings
+ * @param spec "udp", "udp:<port>", "udp:<first>-<last>" or "all"
+ * @return 0 on success, -errno on failure
+ */
+int config_steer_add(struct config *cfg, char const *spec);
+
+/**
+ * @brief check protocol / destination port against steering rules
+ * @param cfg settings
+ * @param proto ip protocol
+ * @param dport destination port (host order), 0 if protocol has none
+ * @return true if packet belongs in tuntap
+ */
+bool config_steer_match(struct config const *cfg, uint8_t proto,
+                        uint16_t dport);
+
+/**
+ * @brief apply "key value" lines of file, '#' starts a comment
+ * @param cfg settings
+ * @param path config file
+ * @return 0 on success, -1 on failure (line is logged)
+ */
+int config_load(struct config *cfg, char const *path);
+
+/**
+ * @brief write settings as "key value" lines config_load reads back,
+ *        password is left out
+ * @param cfg settings
+ * @param buf destination
+ * @param size destination size
+ * @return number of bytes written (truncated to size - 1)
+ */
+size_t config_format(struct config const *cfg, char *buf, size_t size);
+
+/**
+ * @brief publish first snapshot
+ * @param cfg settings
+ * @return 0 on success, -errno on failure
+ */
+int config_init(struct config const *cfg);
+
+/**
+ * @brief get current snapshot
+ * @note only valid between epoch_enter() and epoch_leave()
+ * @return settings
+ */
+struct config const *config_get();
+
+/**
+ * @brief get generation of current snapshot without entering an epoch,
+ *        loops compare it to skip snapshots they already followed
+ * @return generation, 0 before config_init
+ */
+uint64_t config_generation();
+
+/**
+ * @brief copy current snapshot, e.g. as base for a change
+ * @param cfg destination
+ */
+void config_copy(struct config *cfg);
+
+/**
+ * @brief apply subscribers and swap in new snapshot, returns after old one
+ *        is freed
+ * @param cfg new settings
+ * @return 0 on success, -1 if a subscriber rejected it
+ */
+int config_publish(struct config const *cfg);
+
+/**
+ * @brief get called on every published change
+ * @param fn subscriber
+ * @return 0 on success, -errno on failure
+ */
+int config_subscribe(config_apply_fn fn);
+
+#endif /* __CONFIG_H__ */
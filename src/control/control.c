@@ -0,0 +1,237 @@
+#include "control.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+
+#define CONTROL_LINE_SIZE  1024
+#define CONTROL_REPLY_SIZE 4096
+
+static struct
+{
+    int fd;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char file[CONTROL_LINE_SIZE];
+    struct config base;
+    pthread_t worker;
+    /* copy, change and publish of config run as one step */
+    pthread_mutex_t lock;
+} _control = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int _reply(int conn, char const *text)
+{
+    size_t len = strlen(text);
+
+    while (len) {
+        ssize_t sent = send(conn, text, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        text += sent;
+        len -= sent;
+    }
+
+    return 0;
+}
+
+static int _reply_error(int conn, char const *what)
+{
+    /* what is at most a whole line */
+    char reply[CONTROL_REPLY_SIZE];
+    /* config errors carry -errno */
+    int err = errno < 0 ? -errno : errno;
+
+    snprintf(reply, sizeof(reply), "error %s: %s\n", what, strerror(err));
+    return _reply(conn, reply);
+}
+
+static int _command(int conn, char *line)
+{
+    char reply[CONTROL_REPLY_SIZE];
+    struct config next;
+    char *save = NULL;
+    char *cmd = strtok_r(line, " \t", &save);
+
+    if (!cmd) {
+        return 0;
+    }
+
+    if (!strcmp(cmd, "get")) {
+        config_copy(&next);
+        size_t len = config_format(&next, reply, sizeof(reply));
+        snprintf(reply + len, sizeof(reply) - len, "ok\n");
+        return _reply(conn, reply);
+    }
+
+    if (!strcmp(cmd, "set")) {
+        char *key = strtok_r(NULL, " \t", &save);
+        char *value = strtok_r(NULL, " \t", &save);
+
+        pthread_mutex_lock(&_control.lock);
+        config_copy(&next);
+        if (config_set(&next, key, value) < 0) {
+            pthread_mutex_unlock(&_control.lock);
+            return _reply_error(conn, key ? key : "set");
+        }
+        if (config_publish(&next) < 0) {
+            pthread_mutex_unlock(&_control.lock);
+            return _reply_error(conn, "apply");
+        }
+        pthread_mutex_unlock(&_control.lock);
+        log_info("control set %s", key);
+        return _reply(conn, "ok\n");
+    }
+
+    if (!strcmp(cmd, "reload")) {
+        if (!_control.file[0]) {
+            errno = -ENOENT;
+            return _reply_error(conn, "no config file");
+        }
+
+        pthread_mutex_lock(&_control.lock);
+        next = _control.base;
+        if (config_load(&next, _control.file) < 0) {
+            pthread_mutex_unlock(&_control.lock);
+            return _reply_error(conn, _control.file);
+        }
+        if (config_publish(&next) < 0) {
+            pthread_mutex_unlock(&_control.lock);
+            return _reply_error(conn, "apply");
+        }
+        pthread_mutex_unlock(&_control.lock);
+        log_info("control reloaded %s", _control.file);
+        return _reply(conn, "ok\n");
+    }
+
+    errno = -EINVAL;
+    return _reply_error(conn, cmd);
+}
+
+static void _serve(int conn)
+{
+    char buf[CONTROL_LINE_SIZE];
+    size_t len = 0;
+
+    while (1) {
+        ssize_t size = recv(conn, buf + len, sizeof(buf) - 1 - len, 0);
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            return;
+        }
+        len += size;
+        buf[len] = 0;
+
+        char *line = buf;
+        char *end = NULL;
+        while ((end = strchr(line, '\n'))) {
+            *end = 0;
+            if (end > line && end[-1] == '\r') {
+                end[-1] = 0;
+            }
+            if (_command(conn, line) < 0) {
+                return;
+            }
+            line = end + 1;
+        }
+
+        len -= line - buf;
+        memmove(buf, line, len);
+        if (len == sizeof(buf) - 1) {
+            errno = -E2BIG;
+            _reply_error(conn, "line");
+            return;
+        }
+    }
+}
+
+static void *_control_thread(void *arg)
+{
+    while (1) {
+        int conn = accept(_control.fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("control accept failed! (%d / %s)", errno,
+                      strerror(errno));
+            break;
+        }
+
+        _serve(conn);
+        close(conn);
+    }
+
+    return NULL;
+}
+
+int control_init(char const *path, char const *file, struct config const *base)
+{
+    struct sockaddr_un addr = { 0 };
+
+    if (!path || strlen(path) >= sizeof(addr.sun_path)
+        || (file && strlen(file) >= sizeof(_control.file))) {
+        errno = -EINVAL;
+        log_error("control socket path invalid! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("control socket failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(fd, 1) < 0) {
+        log_error("control listen on %s failed! (%d / %s)", path, errno,
+                  strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    _control.fd = fd;
+    strcpy(_control.path, path);
+    if (file) {
+        strcpy(_control.file, file);
+    }
+    _control.base = *base;
+
+    if (pthread_create(&_control.worker, NULL, &_control_thread, NULL) != 0) {
+        control_deinit();
+        return -1;
+    }
+    pthread_detach(_control.worker);
+
+    log_info("control socket %s ready", path);
+
+    return 0;
+}
+
+void control_deinit()
+{
+    if (_control.fd < 0) {
+        return;
+    }
+
+    close(_control.fd);
+    unlink(_control.path);
+    _control.fd = -1;
+}
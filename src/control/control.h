@@ -0,0 +1,32 @@
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+#define CONTROL_DEFAULT_PATH "/run/tunproxy.ctl"
+
+struct config;
+
+/*
+ * Line based control socket for live configuration changes, one client
+ * at a time:
+ *   get                  current settings, one "key value" per line
+ *   set <key> <value>    change one setting
+ *   reload               apply config file again on top of startup settings
+ * every command is answered with "ok" or "error <reason>" as last line.
+ */
+
+/**
+ * @brief listen for control commands
+ * @param path unix socket path
+ * @param file config file reload reads, NULL if none
+ * @param base settings before config file was applied, reload starts from
+ *        them
+ * @return 0 on success, -errno on failure
+ */
+int control_init(char const *path, char const *file, struct config const *base);
+
+/**
+ * @brief stop listening for control commands
+ */
+void control_deinit();
+
+#endif /* __CONTROL_H__ */
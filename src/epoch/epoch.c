@@ -0,0 +1,111 @@
+#include "epoch.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#define EPOCH_CACHE_LINE 64
+#define EPOCH_POLL_US    100
+
+/* 0 while reader is outside of a section */
+struct epoch_slot
+{
+    uint64_t epoch;
+    bool used;
+} __attribute__((aligned(EPOCH_CACHE_LINE)));
+
+static struct
+{
+    uint64_t epoch;
+    struct epoch_slot slots[EPOCH_MAX_READERS];
+    /* readers that found every slot taken */
+    uint64_t overflow __attribute__((aligned(EPOCH_CACHE_LINE)));
+    pthread_key_t key;
+    pthread_once_t once;
+} _epoch = {
+    .epoch = 1,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+static __thread struct epoch_slot *_slot;
+static __thread bool _slot_claimed;
+
+static void _release(void *arg)
+{
+    struct epoch_slot *slot = arg;
+
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->used, false, __ATOMIC_RELEASE);
+}
+
+static void _key_init()
+{
+    pthread_key_create(&_epoch.key, _release);
+}
+
+static void _claim()
+{
+    _slot_claimed = true;
+    pthread_once(&_epoch.once, _key_init);
+
+    for (size_t i = 0; i < EPOCH_MAX_READERS; i++) {
+        bool expected = false;
+        if (__atomic_compare_exchange_n(&_epoch.slots[i].used, &expected,
+                                        true, false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            _slot = &_epoch.slots[i];
+            pthread_setspecific(_epoch.key, _slot);
+            return;
+        }
+    }
+}
+
+void epoch_enter()
+{
+    if (!_slot_claimed) {
+        _claim();
+    }
+
+    if (!_slot) {
+        __atomic_add_fetch(&_epoch.overflow, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    /* store has to be visible before protected pointer is loaded */
+    __atomic_store_n(&_slot->epoch,
+                     __atomic_load_n(&_epoch.epoch, __ATOMIC_RELAXED),
+                     __ATOMIC_SEQ_CST);
+}
+
+void epoch_leave()
+{
+    if (!_slot) {
+        __atomic_sub_fetch(&_epoch.overflow, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    __atomic_store_n(&_slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+void epoch_synchronize()
+{
+    uint64_t epoch = __atomic_add_fetch(&_epoch.epoch, 1, __ATOMIC_SEQ_CST);
+
+    /* pairs with reader's seq_cst slot store: either reader sees new epoch
+     * (and new pointer) or this scan sees its slot, store-load ordering
+     * needs a full fence off x86 */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (size_t i = 0; i < EPOCH_MAX_READERS; i++) {
+        uint64_t seen = 0;
+        while ((seen = __atomic_load_n(&_epoch.slots[i].epoch,
+                                       __ATOMIC_ACQUIRE))
+               && seen < epoch) {
+            usleep(EPOCH_POLL_US);
+        }
+    }
+
+    /* overflow readers carry no epoch, wait until none is left */
+    while (__atomic_load_n(&_epoch.overflow, __ATOMIC_ACQUIRE)) {
+        usleep(EPOCH_POLL_US);
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include <stdint.h>
+
+/* threads reading at the same time, more share one slower counter */
+#define EPOCH_MAX_READERS 1024
+
+/*
+ * Epoch based reclamation for data read far more often than it changes.
+ * Readers announce the global epoch in their own cache line slot while
+ * they dereference shared pointers and clear it afterwards, no lock and no
+ * shared write. A writer swaps the pointer, advances the epoch and waits
+ * until no reader is still inside an older epoch, after that the old
+ * object can't be reached anymore and is freed.
+ */
+
+/**
+ * @brief start read side section, calling thread takes a reader slot on
+ *        first use and gives it back when it exits
+ * @note sections don't nest and must not block
+ */
+void epoch_enter();
+
+/**
+ * @brief end read side section
+ */
+void epoch_leave();
+
+/**
+ * @brief wait until every read side section started before the call has
+ *        ended, writers only
+ */
+void epoch_synchronize();
+
+#endif /* __EPOCH_H__ */
@@ -0,0 +1,452 @@
+#include "fq.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "stats.h"
+#include "util.h"
+
+/* packets dropped from fattest flow at most per overlimit enqueue */
+#define FQ_DROP_BATCH 64
+
+struct fq_packet
+{
+    struct fq_packet *next;
+    uint64_t enqueued_us;
+    /* opaque metadata travelling with packet, e.g. trace timestamp */
+    uint64_t stamp;
+    size_t size;
+    uint8_t data[];
+};
+
+struct fq_flow
+{
+    struct fq_packet *head;
+    struct fq_packet *tail;
+    struct fq_flow *next;
+    bool listed;
+    int32_t deficit;
+    size_t backlog;
+    /* codel state (rfc 8289) */
+    bool dropping;
+    uint32_t count;
+    uint32_t last_count;
+    uint64_t first_above_us;
+    uint64_t drop_next_us;
+};
+
+struct fq_list
+{
+    struct fq_flow *head;
+    struct fq_flow *tail;
+};
+
+static struct
+{
+    struct fq_flow *flows;
+    size_t flow_count;
+    struct fq_list new_flows;
+    struct fq_list old_flows;
+    uint32_t quantum;
+    size_t packet_limit;
+    size_t memory_limit;
+    uint32_t target_us;
+    uint32_t interval_us;
+    uint32_t perturbation;
+    size_t active;
+    fq_gate_fn gate;
+    struct fq_stats stats;
+} _fq;
+
+static void _list_push(struct fq_list *list, struct fq_flow *flow)
+{
+    flow->next = NULL;
+    if (list->tail) {
+        list->tail->next = flow;
+    }
+    else {
+        list->head = flow;
+    }
+    list->tail = flow;
+}
+
+static struct fq_flow *_list_pop(struct fq_list *list)
+{
+    struct fq_flow *flow = list->head;
+
+    list->head = flow->next;
+    if (!list->head) {
+        list->tail = NULL;
+    }
+    flow->next = NULL;
+
+    return flow;
+}
+
+static uint32_t _mix(uint32_t h, uint32_t v)
+{
+    h ^= v * 2654435761u;
+    return (h << 13 | h >> 19) * 5 + 0xe6546b64;
+}
+
+/* 5-tuple hash, ports are only looked at for unfragmented tcp / udp */
+static uint32_t _hash(uint8_t const *buf, size_t size)
+{
+    uint32_t h = _fq.perturbation;
+    uint8_t proto = 0;
+    size_t offset = 0;
+    uint32_t words[8];
+
+    if (size >= sizeof(struct iphdr) && buf[0] >> 4 == 4) {
+        struct iphdr const *ip = (struct iphdr const *)buf;
+        proto = ip->protocol;
+        offset = ip->ihl * 4;
+        h = _mix(h, ip->saddr);
+        h = _mix(h, ip->daddr);
+        if (ip->frag_off & htons(IP_MF | IP_OFFMASK)) {
+            proto = 0;
+        }
+    }
+    else if (size >= sizeof(struct ip6_hdr) && buf[0] >> 4 == 6) {
+        struct ip6_hdr const *ip6 = (struct ip6_hdr const *)buf;
+        proto = ip6->ip6_nxt;
+        offset = sizeof(*ip6);
+        memcpy(words, &ip6->ip6_src, sizeof(words));
+        for (size_t i = 0; i < ARRAY_SIZE(words); i++) {
+            h = _mix(h, words[i]);
+        }
+    }
+
+    h = _mix(h, proto);
+    if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) && offset + 4 <= size) {
+        uint32_t ports;
+        memcpy(&ports, buf + offset, sizeof(ports));
+        h = _mix(h, ports);
+    }
+
+    return h ^ (h >> 16);
+}
+
+static struct fq_packet *_pop(struct fq_flow *flow)
+{
+    struct fq_packet *packet = flow->head;
+
+    if (!packet) {
+        return NULL;
+    }
+
+    flow->head = packet->next;
+    if (!flow->head) {
+        flow->tail = NULL;
+    }
+    flow->backlog -= packet->size;
+    _fq.stats.backlog_bytes -= packet->size;
+    _fq.stats.backlog_packets--;
+
+    return packet;
+}
+
+static void _drop(struct fq_packet *packet, uint64_t *counter)
+{
+    (*counter)++;
+    free(packet);
+}
+
+/* interval / sqrt(count), fixed point so libm isn't needed */
+static uint64_t _control_law(uint64_t t, uint32_t count)
+{
+    uint64_t x = (uint64_t)count << 16;
+    uint64_t root = 0;
+
+    for (uint64_t bit = 1ull << 46; bit; bit >>= 2) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else {
+            root >>= 1;
+        }
+    }
+
+    /* root is sqrt(count) * 256 */
+    return t + ((uint64_t)_fq.interval_us << 8) / (root ? root : 1);
+}
+
+static struct fq_packet *_codel_pop(struct fq_flow *flow, uint64_t now_us,
+                                    bool *ok_to_drop)
+{
+    struct fq_packet *packet = _pop(flow);
+
+    *ok_to_drop = false;
+
+    if (!packet) {
+        flow->first_above_us = 0;
+        return NULL;
+    }
+
+    /* a queue holding less than one quantum can't be a standing queue */
+    if (now_us - packet->enqueued_us < _fq.target_us
+        || flow->backlog <= _fq.quantum) {
+        flow->first_above_us = 0;
+    }
+    else if (!flow->first_above_us) {
+        flow->first_above_us = now_us + _fq.interval_us;
+    }
+    else if (now_us >= flow->first_above_us) {
+        *ok_to_drop = true;
+    }
+
+    return packet;
+}
+
+static struct fq_packet *_codel_dequeue(struct fq_flow *flow, uint64_t now_us)
+{
+    bool ok_to_drop = false;
+    struct fq_packet *packet = _codel_pop(flow, now_us, &ok_to_drop);
+
+    if (!packet) {
+        flow->dropping = false;
+        return NULL;
+    }
+
+    if (flow->dropping) {
+        if (!ok_to_drop) {
+            flow->dropping = false;
+        }
+        while (flow->dropping && now_us >= flow->drop_next_us) {
+            _drop(packet, &_fq.stats.codel_drops);
+            flow->count++;
+            packet = _codel_pop(flow, now_us, &ok_to_drop);
+            if (!packet || !ok_to_drop) {
+                flow->dropping = false;
+            }
+            else {
+                flow->drop_next_us = _control_law(flow->drop_next_us,
+                                                  flow->count);
+            }
+        }
+    }
+    else if (ok_to_drop) {
+        _drop(packet, &_fq.stats.codel_drops);
+        packet = _codel_pop(flow, now_us, &ok_to_drop);
+        flow->dropping = true;
+
+        /* resume near previous drop rate if queue came back quickly */
+        uint32_t delta = flow->count - flow->last_count;
+        flow->count = delta > 1
+                              && now_us - flow->drop_next_us
+                                     < 16ull * _fq.interval_us
+                          ? delta
+                          : 1;
+        flow->drop_next_us = _control_law(now_us, flow->count);
+        flow->last_count = flow->count;
+    }
+
+    return packet;
+}
+
+/* overlimit, shed half of the biggest queue (bounded) from its head */
+static void _drop_fattest()
+{
+    struct fq_flow *fattest = &_fq.flows[0];
+
+    for (size_t i = 1; i < _fq.flow_count; i++) {
+        if (_fq.flows[i].backlog > fattest->backlog) {
+            fattest = &_fq.flows[i];
+        }
+    }
+
+    size_t threshold = fattest->backlog / 2;
+    for (size_t i = 0; i < FQ_DROP_BATCH && fattest->backlog > threshold;
+         i++) {
+        _drop(_pop(fattest), &_fq.stats.overlimit_drops);
+    }
+}
+
+static void _fq_report()
+{
+    log_info("fq: backlog %zu packets / %zu bytes, enqueued %lu, dequeued "
+             "%lu, codel drops %lu, overlimit drops %lu, new flows %lu, "
+             "gated %lu",
+             _fq.stats.backlog_packets, _fq.stats.backlog_bytes,
+             _fq.stats.enqueued, _fq.stats.dequeued, _fq.stats.codel_drops,
+             _fq.stats.overlimit_drops, _fq.stats.new_flows,
+             _fq.stats.gated);
+}
+
+int fq_init(uint32_t quantum, size_t packet_limit, size_t memory_limit,
+            uint32_t target_us, uint32_t interval_us)
+{
+    if (!quantum || !packet_limit || !memory_limit || !target_us
+        || interval_us < target_us) {
+        errno = -EINVAL;
+        log_error("fq limits invalid! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    fq_deinit();
+
+    _fq.flows = calloc(FQ_DEFAULT_FLOWS, sizeof(*_fq.flows));
+    if (!_fq.flows) {
+        errno = -ENOMEM;
+        return -1;
+    }
+
+    _fq.flow_count = FQ_DEFAULT_FLOWS;
+    _fq.quantum = quantum;
+    _fq.packet_limit = packet_limit;
+    _fq.memory_limit = memory_limit;
+    _fq.target_us = target_us;
+    _fq.interval_us = interval_us;
+    _fq.perturbation = (uint32_t)util_now_us() ^ ((uint32_t)getpid() << 16);
+
+    stats_register(_fq_report);
+
+    return 0;
+}
+
+void fq_deinit()
+{
+    for (size_t i = 0; i < _fq.flow_count; i++) {
+        struct fq_packet *packet = NULL;
+        while ((packet = _pop(&_fq.flows[i]))) {
+            free(packet);
+        }
+    }
+
+    free(_fq.flows);
+    _fq.flows = NULL;
+    _fq.flow_count = 0;
+    _fq.active = 0;
+    _fq.new_flows = (struct fq_list){ 0 };
+    _fq.old_flows = (struct fq_list){ 0 };
+}
+
+int fq_enqueue(uint8_t const *buf, size_t size, uint64_t now_us,
+               uint64_t stamp)
+{
+    struct fq_packet *packet = malloc(sizeof(*packet) + size);
+
+    if (!packet) {
+        _fq.stats.overlimit_drops++;
+        errno = -ENOMEM;
+        return -1;
+    }
+
+    packet->next = NULL;
+    packet->enqueued_us = now_us;
+    packet->stamp = stamp;
+    packet->size = size;
+    memcpy(packet->data, buf, size);
+
+    struct fq_flow *flow = &_fq.flows[_hash(buf, size) % _fq.flow_count];
+    if (flow->tail) {
+        flow->tail->next = packet;
+    }
+    else {
+        flow->head = packet;
+    }
+    flow->tail = packet;
+    flow->backlog += size;
+    _fq.stats.backlog_bytes += size;
+    _fq.stats.backlog_packets++;
+    _fq.stats.enqueued++;
+
+    if (!flow->listed) {
+        flow->listed = true;
+        _fq.active++;
+        flow->deficit = _fq.quantum;
+        _list_push(&_fq.new_flows, flow);
+        _fq.stats.new_flows++;
+    }
+
+    while (_fq.stats.backlog_packets > _fq.packet_limit
+           || _fq.stats.backlog_bytes > _fq.memory_limit) {
+        _drop_fattest();
+    }
+
+    return 0;
+}
+
+size_t fq_dequeue(uint8_t *buf, size_t buf_size, uint64_t now_us,
+                  uint64_t *stamp)
+{
+    size_t gated = 0;
+
+    while (1) {
+        struct fq_list *list = _fq.new_flows.head ? &_fq.new_flows
+                                                  : &_fq.old_flows;
+        struct fq_flow *flow = list->head;
+
+        if (!flow) {
+            return 0;
+        }
+
+        if (flow->deficit <= 0) {
+            flow->deficit += _fq.quantum;
+            _list_push(&_fq.old_flows, _list_pop(list));
+            continue;
+        }
+
+        /* every listed flow waits on gate, nothing can leave now */
+        if (_fq.gate && flow->head
+            && !_fq.gate(flow->head->data, flow->head->size)) {
+            _list_push(&_fq.old_flows, _list_pop(list));
+            _fq.stats.gated++;
+            if (++gated >= _fq.active) {
+                return 0;
+            }
+            continue;
+        }
+
+        struct fq_packet *packet = _codel_dequeue(flow, now_us);
+        if (!packet) {
+            /* emptied new flow takes one turn on old list so it can't
+             * jump ahead again right away */
+            _list_pop(list);
+            if (list == &_fq.new_flows && _fq.old_flows.head) {
+                _list_push(&_fq.old_flows, flow);
+            }
+            else {
+                flow->listed = false;
+                _fq.active--;
+            }
+            continue;
+        }
+
+        flow->deficit -= packet->size;
+
+        if (packet->size > buf_size) {
+            _drop(packet, &_fq.stats.overlimit_drops);
+            continue;
+        }
+
+        size_t size = packet->size;
+        memcpy(buf, packet->data, size);
+        *stamp = packet->stamp;
+        free(packet);
+        _fq.stats.dequeued++;
+
+        return size;
+    }
+}
+
+void fq_set_gate(fq_gate_fn gate)
+{
+    _fq.gate = gate;
+}
+
+bool fq_empty()
+{
+    return !_fq.stats.backlog_packets;
+}
+
+void fq_get_stats(struct fq_stats *stats)
+{
+    *stats = _fq.stats;
+}
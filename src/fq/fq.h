@@ -0,0 +1,100 @@
+#ifndef __FQ_H__
+#define __FQ_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FQ_DEFAULT_FLOWS        1024
+#define FQ_DEFAULT_PACKET_LIMIT 10240
+#define FQ_DEFAULT_MEMORY_LIMIT (8 * 1024 * 1024)
+#define FQ_DEFAULT_TARGET_US    5000
+#define FQ_DEFAULT_INTERVAL_US  100000
+
+/*
+ * Fair queueing stage between tuntap ingress and upstream send path, in the
+ * spirit of fq_codel (rfc 8290). Packets are hashed by 5-tuple into flow
+ * queues served by deficit round robin, new flows are served before bulk
+ * ones and every queue runs CoDel on packet sojourn time.
+ */
+
+struct fq_stats
+{
+    uint64_t enqueued;
+    uint64_t dequeued;
+    uint64_t codel_drops;
+    uint64_t overlimit_drops;
+    uint64_t new_flows;
+    uint64_t gated;
+    size_t backlog_packets;
+    size_t backlog_bytes;
+};
+
+/**
+ * @brief callback deciding if head packet of a flow may leave now
+ * @param buf packet buffer
+ * @param size packet size
+ * @return true if packet may be dequeued, false if its flow has to wait
+ */
+typedef bool (*fq_gate_fn)(uint8_t const *buf, size_t size);
+
+/**
+ * @brief initialize fair queueing stage
+ * @note queue state is not thread safe, use it from one thread only
+ * @param quantum bytes a flow may send per round, usually link mtu
+ * @param packet_limit max queued packets for all flows
+ * @param memory_limit max queued bytes for all flows
+ * @param target_us acceptable standing queue delay
+ * @param interval_us period delay has to stay above target before dropping
+ * @return 0 on success, -1 on failure
+ */
+int fq_init(uint32_t quantum, size_t packet_limit, size_t memory_limit,
+            uint32_t target_us, uint32_t interval_us);
+
+/**
+ * @brief drop all queued packets and release queue memory
+ */
+void fq_deinit();
+
+/**
+ * @brief queue ip packet, when over limit packets of fattest flow are dropped
+ * @param buf packet buffer
+ * @param size packet size
+ * @param now_us monotonic time
+ * @param stamp metadata handed back with packet on dequeue
+ * @return 0 on success, -1 if packet couldn't be queued
+ */
+int fq_enqueue(uint8_t const *buf, size_t size, uint64_t now_us,
+               uint64_t stamp);
+
+/**
+ * @brief get next packet picked by scheduler
+ * @param buf buffer receiving packet
+ * @param buf_size buffer capacity
+ * @param now_us monotonic time
+ * @param stamp receives metadata packet was queued with
+ * @return packet size, 0 if every queue is empty or waits on gate
+ */
+size_t fq_dequeue(uint8_t *buf, size_t buf_size, uint64_t now_us,
+                  uint64_t *stamp);
+
+/**
+ * @brief set gate consulted before a flow is served, waiting flows keep
+ *        their packets and deficit and are skipped until gate opens
+ * @param gate gate callback, NULL serves every flow
+ */
+void fq_set_gate(fq_gate_fn gate);
+
+/**
+ * @brief check if any packet is queued
+ * @return true if nothing is queued
+ */
+bool fq_empty();
+
+/**
+ * @brief get copy of queue counters
+ * @param stats output statistics
+ */
+void fq_get_stats(struct fq_stats *stats);
+
+#endif /* __FQ_H__ */
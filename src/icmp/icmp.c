@@ -0,0 +1,203 @@
+#include "icmp.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <string.h>
+
+#include "iov.h"
+#include "log.h"
+#include "packet_parser.h"
+#include "stats.h"
+#include "util.h"
+
+#define ICMP_TTL 64
+
+static struct
+{
+    uint64_t window_ms;
+    uint32_t sent;
+    uint64_t echo;
+    uint64_t unreachable;
+    uint64_t frag_needed;
+    uint64_t limited;
+} _icmp;
+
+/* fixed one second window, shared by every thread generating messages */
+static bool _allow()
+{
+    uint64_t now_ms = util_now_ms();
+    uint64_t window_ms = __atomic_load_n(&_icmp.window_ms, __ATOMIC_RELAXED);
+
+    if (now_ms - window_ms >= 1000
+        && __atomic_compare_exchange_n(&_icmp.window_ms, &window_ms, now_ms,
+                                       false, __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED)) {
+        __atomic_store_n(&_icmp.sent, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_add_fetch(&_icmp.sent, 1, __ATOMIC_RELAXED)
+        > ICMP_RATE_LIMIT) {
+        __atomic_add_fetch(&_icmp.limited, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    return true;
+}
+
+static bool _unicast(uint32_t addr)
+{
+    uint32_t host = ntohl(addr);
+
+    return host && !IN_MULTICAST(host) && host != INADDR_BROADCAST;
+}
+
+/* rfc 1122 3.2.2, errors never answer errors or non first fragments */
+static bool _may_answer(struct iphdr const *ip, size_t size)
+{
+    size_t ihl = ip->ihl * 4;
+
+    if (size < sizeof(*ip) || ip->version != 4 || ihl < sizeof(*ip)
+        || ihl > size || ntohs(ip->frag_off) & IP_OFFMASK
+        || !_unicast(ip->saddr) || !_unicast(ip->daddr)) {
+        return false;
+    }
+
+    if (ip->protocol == IPPROTO_ICMP) {
+        struct icmphdr const *icmp = (struct icmphdr const *)((uint8_t *)ip
+                                                              + ihl);
+        return size >= ihl + sizeof(*icmp)
+               && (icmp->type == ICMP_ECHO || icmp->type == ICMP_TIMESTAMP);
+    }
+
+    return true;
+}
+
+static void _ip_header(struct iphdr *ip, uint32_t saddr, uint32_t daddr,
+                       size_t total)
+{
+    memset(ip, 0, sizeof(*ip));
+    ip->version = 4;
+    ip->ihl = sizeof(*ip) / 4;
+    ip->tot_len = htons(total);
+    ip->ttl = ICMP_TTL;
+    ip->protocol = IPPROTO_ICMP;
+    ip->saddr = saddr;
+    ip->daddr = daddr;
+    ip->check = ip_checksum(ip, sizeof(*ip));
+}
+
+static void _icmp_report()
+{
+    log_info("icmp: echo replies %llu, unreachable %llu, frag needed %llu, "
+             "rate limited %llu",
+             (unsigned long long)__atomic_load_n(&_icmp.echo,
+                                                 __ATOMIC_RELAXED),
+             (unsigned long long)__atomic_load_n(&_icmp.unreachable,
+                                                 __ATOMIC_RELAXED),
+             (unsigned long long)__atomic_load_n(&_icmp.frag_needed,
+                                                 __ATOMIC_RELAXED),
+             (unsigned long long)__atomic_load_n(&_icmp.limited,
+                                                 __ATOMIC_RELAXED));
+}
+
+int icmp_init()
+{
+    stats_register(_icmp_report);
+
+    return 0;
+}
+
+bool icmp_unreachable(struct iov_msg *msg, uint32_t saddr, uint8_t code,
+                      uint16_t mtu, uint8_t const *packet, size_t size)
+{
+    struct iphdr const *orig = (struct iphdr const *)packet;
+
+    if (!_may_answer(orig, size) || !_allow()) {
+        return false;
+    }
+
+    size_t quote = orig->ihl * 4 + 8;
+    if (quote > size) {
+        quote = size;
+    }
+
+    size_t icmp_size = sizeof(struct icmphdr) + quote;
+    iov_msg_init(msg);
+    struct iphdr *ip = iov_msg_header(msg, sizeof(*ip) + icmp_size);
+    struct icmphdr *icmp = (struct icmphdr *)(ip + 1);
+
+    memset(icmp, 0, sizeof(*icmp));
+    icmp->type = ICMP_DEST_UNREACH;
+    icmp->code = code;
+    icmp->un.frag.mtu = htons(mtu);
+    memcpy(icmp + 1, packet, quote);
+    icmp->checksum = ip_checksum(icmp, icmp_size);
+
+    _ip_header(ip, saddr, orig->saddr, sizeof(*ip) + icmp_size);
+
+    __atomic_add_fetch(code == ICMP_FRAG_NEEDED ? &_icmp.frag_needed
+                                                : &_icmp.unreachable,
+                       1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+bool icmp_echo_reply(struct iov_msg *msg, uint32_t gateway, uint8_t *packet,
+                     size_t size)
+{
+    struct iphdr *ip = (struct iphdr *)packet;
+    size_t ihl = ip->ihl * 4;
+
+    if (size < sizeof(*ip) || ip->version != 4 || ip->protocol != IPPROTO_ICMP
+        || ip->daddr != gateway || ihl < sizeof(*ip)
+        || size < ihl + sizeof(struct icmphdr) || ntohs(ip->tot_len) != size
+        || ntohs(ip->frag_off) & (IP_MF | IP_OFFMASK)) {
+        return false;
+    }
+
+    struct icmphdr *icmp = (struct icmphdr *)(packet + ihl);
+    if (icmp->type != ICMP_ECHO || !_unicast(ip->saddr)) {
+        return false;
+    }
+
+    /* dropped requests look like loss, same as a rate limiting router */
+    iov_msg_init(msg);
+    if (!_allow()) {
+        return true;
+    }
+
+    /* identifier, sequence and data are echoed as they are */
+    icmp->type = ICMP_ECHOREPLY;
+    icmp->checksum = 0;
+    icmp->checksum = ip_checksum(icmp, size - ihl);
+
+    ip->daddr = ip->saddr;
+    ip->saddr = gateway;
+    ip->ttl = ICMP_TTL;
+    ip->check = 0;
+    ip->check = ip_checksum(ip, ihl);
+
+    iov_msg_append(msg, packet, size);
+
+    __atomic_add_fetch(&_icmp.echo, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+uint32_t icmp_gateway(char const *addr, char const *netmask)
+{
+    struct in_addr local = { 0 };
+    struct in_addr mask = { 0 };
+
+    if (inet_pton(AF_INET, addr, &local) != 1
+        || inet_pton(AF_INET, netmask, &mask) != 1) {
+        return 0;
+    }
+
+    uint32_t network = ntohl(local.s_addr & mask.s_addr);
+    uint32_t gateway = network + 1 == ntohl(local.s_addr) ? network + 2
+                                                          : network + 1;
+
+    return htonl(gateway);
+}
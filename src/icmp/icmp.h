@@ -0,0 +1,63 @@
+#ifndef __ICMP_H__
+#define __ICMP_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* generated messages per second, more are dropped (rfc 1812 4.3.2.8) */
+#define ICMP_RATE_LIMIT 1000
+
+struct iov_msg;
+
+/*
+ * ICMP messages generated on the tuntap path instead of letting packets
+ * vanish. Errors quote the ip header and first 8 bytes of the offending
+ * packet, so the sender's kernel finds the socket and fails it right away
+ * (ECONNREFUSED, EHOSTUNREACH, lower path mtu) instead of the application
+ * waiting out its timeout. No error is sent about an icmp error, a later
+ * fragment or a non unicast packet (rfc 1122 3.2.2).
+ */
+
+/**
+ * @brief initialize rate limit and stats
+ * @return 0 on success, -errno on failure
+ */
+int icmp_init();
+
+/**
+ * @brief build destination unreachable message about packet
+ * @param msg message to fill, built entirely in its scratch area
+ * @param saddr reporting address (network order)
+ * @param code ICMP_NET_UNREACH, ICMP_PORT_UNREACH, ICMP_FRAG_NEEDED, ...
+ * @param mtu next hop mtu for ICMP_FRAG_NEEDED, 0 otherwise
+ * @param packet offending ipv4 packet, only its header and 8 more bytes
+ *        are read
+ * @param size packet size
+ * @return true if message was built, false if none may be sent
+ */
+bool icmp_unreachable(struct iov_msg *msg, uint32_t saddr, uint8_t code,
+                      uint16_t mtu, uint8_t const *packet, size_t size);
+
+/**
+ * @brief turn echo request addressed to gateway into its reply in place
+ * @param msg message to fill, references packet
+ * @param gateway answered address (network order)
+ * @param packet ipv4 packet, modified
+ * @param size packet size
+ * @return true if packet was an echo request to gateway, msg stays empty
+ *         if rate limit dropped it
+ */
+bool icmp_echo_reply(struct iov_msg *msg, uint32_t gateway, uint8_t *packet,
+                     size_t size);
+
+/**
+ * @brief get gateway address of tuntap subnet, first host address that
+ *        isn't tuntap's own
+ * @param addr tuntap address
+ * @param netmask tuntap netmask
+ * @return gateway (network order), 0 if addresses are invalid
+ */
+uint32_t icmp_gateway(char const *addr, char const *netmask);
+
+#endif /* __ICMP_H__ */
@@ -0,0 +1,87 @@
+#include "iov.h"
+#include <errno.h>
+#include <string.h>
+
+void iov_msg_init(struct iov_msg *m)
+{
+    m->count = 0;
+    m->size = 0;
+    m->scratch_used = 0;
+}
+
+void *iov_msg_header(struct iov_msg *m, size_t size)
+{
+    if (m->scratch_used + size > sizeof(m->scratch)) {
+        errno = -ENOBUFS;
+        return NULL;
+    }
+
+    void *header = m->scratch + m->scratch_used;
+    if (iov_msg_append(m, header, size) < 0) {
+        return NULL;
+    }
+    m->scratch_used += size;
+
+    return header;
+}
+
+int iov_msg_append(struct iov_msg *m, void const *buf, size_t size)
+{
+    if (m->count == IOV_MAX_SEGMENTS) {
+        errno = -ENOBUFS;
+        return -1;
+    }
+
+    if (!size) {
+        return 0;
+    }
+
+    m->iov[m->count].iov_base = (void *)buf;
+    m->iov[m->count].iov_len = size;
+    m->count++;
+    m->size += size;
+
+    return 0;
+}
+
+ssize_t iov_msg_flatten(struct iov_msg const *m, uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+
+    if (m->size > size) {
+        errno = -EMSGSIZE;
+        return -1;
+    }
+
+    for (size_t i = 0; i < m->count; i++) {
+        memcpy(buf + done, m->iov[i].iov_base, m->iov[i].iov_len);
+        done += m->iov[i].iov_len;
+    }
+
+    return done;
+}
+
+ssize_t iov_msg_write(int fd, struct iov_msg const *m)
+{
+    ssize_t bytes = 0;
+
+    do {
+        bytes = writev(fd, m->iov, m->count);
+    } while (bytes < 0 && errno == EINTR);
+
+    return bytes;
+}
+
+void iov_advance(struct msghdr *msg, size_t bytes)
+{
+    while (msg->msg_iovlen && bytes >= msg->msg_iov->iov_len) {
+        bytes -= msg->msg_iov->iov_len;
+        msg->msg_iov++;
+        msg->msg_iovlen--;
+    }
+
+    if (msg->msg_iovlen) {
+        msg->msg_iov->iov_base = (uint8_t *)msg->msg_iov->iov_base + bytes;
+        msg->msg_iov->iov_len -= bytes;
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef __IOV_H__
+#define __IOV_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define IOV_MAX_SEGMENTS 8
+#define IOV_SCRATCH_SIZE 128
+
+/*
+ * Scatter-gather message. Protocol headers are built in a small scratch
+ * area that travels with the message, payloads are referenced where they
+ * already are, and the whole message leaves with one writev / sendmsg
+ * instead of a copy into a staging buffer or a write per part.
+ */
+struct iov_msg
+{
+    struct iovec iov[IOV_MAX_SEGMENTS];
+    size_t count;
+    size_t size;
+    size_t scratch_used;
+    uint8_t scratch[IOV_SCRATCH_SIZE];
+};
+
+/**
+ * @brief initialize empty message
+ * @param m message
+ */
+void iov_msg_init(struct iov_msg *m);
+
+/**
+ * @brief append header segment built in message scratch area
+ * @param m message
+ * @param size header size
+ * @return header to fill in, NULL if scratch or segments ran out
+ */
+void *iov_msg_header(struct iov_msg *m, size_t size);
+
+/**
+ * @brief append segment referencing caller buffer, buffer has to stay
+ *        valid until message is written
+ * @param m message
+ * @param buf segment data
+ * @param size segment size
+ * @return 0 on success, -1 if segments ran out
+ */
+int iov_msg_append(struct iov_msg *m, void const *buf, size_t size);
+
+/**
+ * @brief copy message into one buffer for consumers that need it flat
+ * @param m message
+ * @param buf destination
+ * @param size destination size
+ * @return bytes copied, -1 if message doesn't fit
+ */
+ssize_t iov_msg_flatten(struct iov_msg const *m, uint8_t *buf, size_t size);
+
+/**
+ * @brief write message with one writev, meant for datagram like fds
+ *        (tuntap, udp) where a write is never partial
+ * @param fd destination
+ * @param m message
+ * @return bytes written, -1 on failure
+ */
+ssize_t iov_msg_write(int fd, struct iov_msg const *m);
+
+/**
+ * @brief skip bytes a partial sendmsg / writev already wrote
+ * @param msg message header, iov pointer and lengths are updated in place
+ * @param bytes bytes written
+ */
+void iov_advance(struct msghdr *msg, size_t bytes);
+
+#endif /* __IOV_H__ */
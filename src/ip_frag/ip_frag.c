@@ -0,0 +1,692 @@
+#include "ip_frag.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "iov.h"
+#include "log.h"
+#include "packet_parser.h"
+#include "util.h"
+
+#define IP_FRAG_MAX_CONTEXTS  64
+#define IP_FRAG_MAX_RANGES    64
+#define IP_FRAG_MAX_HEADER    256
+#define IP_FRAG_MAX_DATAGRAM  65535
+#define IP_FRAG_BUFFER_STEP   2048
+#define IPV6_FRAG_HEADER_SIZE 8
+
+struct ip_frag_range
+{
+    uint32_t start;
+    uint32_t end;
+};
+
+struct ip_frag_context
+{
+    bool used;
+    uint8_t version;
+    uint8_t protocol;
+    uint32_t id;
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint64_t created_ms;
+    uint8_t header[IP_FRAG_MAX_HEADER];
+    size_t header_size;
+    size_t next_header_offset;
+    uint8_t *payload;
+    size_t payload_cap;
+    uint32_t total_size;
+    uint32_t received;
+    struct ip_frag_range ranges[IP_FRAG_MAX_RANGES];
+    size_t range_count;
+};
+
+/* parsed view of one incoming fragment */
+struct ip_frag_info
+{
+    uint8_t version;
+    uint8_t protocol;
+    uint32_t id;
+    uint8_t const *src;
+    uint8_t const *dst;
+    size_t addr_size;
+    size_t header_size;
+    size_t next_header_offset;
+    uint8_t const *payload;
+    uint32_t offset;
+    uint32_t size;
+    bool more;
+};
+
+static struct
+{
+    struct ip_frag_context contexts[IP_FRAG_MAX_CONTEXTS];
+    size_t flow_limit;
+    size_t total_limit;
+    size_t used;
+    uint32_t timeout_ms;
+    uint32_t ipv6_id;
+    struct ip_frag_stats stats;
+    uint8_t out[IP_FRAG_MAX_DATAGRAM + 1];
+} _frag = {
+    .flow_limit = IP_FRAG_DEFAULT_FLOW_LIMIT,
+    .total_limit = IP_FRAG_DEFAULT_TOTAL_LIMIT,
+    .timeout_ms = IP_FRAG_DEFAULT_TIMEOUT_MS,
+};
+
+static inline bool _is_ipv6_ext_header(uint8_t nh)
+{
+    return nh == IPPROTO_HOPOPTS || nh == IPPROTO_ROUTING
+           || nh == IPPROTO_DSTOPTS;
+}
+
+static void _context_release(struct ip_frag_context *ctx)
+{
+    _frag.used -= ctx->payload_cap;
+    free(ctx->payload);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+static void _context_drop(struct ip_frag_context *ctx)
+{
+    _frag.stats.dropped++;
+    _context_release(ctx);
+}
+
+static void _expire(uint64_t now)
+{
+    for (size_t i = 0; i < IP_FRAG_MAX_CONTEXTS; i++) {
+        struct ip_frag_context *ctx = &_frag.contexts[i];
+        if (ctx->used && now - ctx->created_ms >= _frag.timeout_ms) {
+            _frag.stats.timeouts++;
+            _context_release(ctx);
+        }
+    }
+}
+
+static struct ip_frag_context *_oldest(struct ip_frag_context const *skip)
+{
+    struct ip_frag_context *oldest = NULL;
+    for (size_t i = 0; i < IP_FRAG_MAX_CONTEXTS; i++) {
+        struct ip_frag_context *ctx = &_frag.contexts[i];
+        if (!ctx->used || ctx == skip) {
+            continue;
+        }
+        if (!oldest || ctx->created_ms < oldest->created_ms) {
+            oldest = ctx;
+        }
+    }
+    return oldest;
+}
+
+static bool _is_same_flow(struct ip_frag_context const *ctx,
+                          struct ip_frag_info const *info)
+{
+    return ctx->used && ctx->version == info->version
+           && ctx->protocol == info->protocol
+           && !memcmp(ctx->src, info->src, info->addr_size)
+           && !memcmp(ctx->dst, info->dst, info->addr_size);
+}
+
+static size_t _flow_usage(struct ip_frag_info const *info)
+{
+    size_t usage = 0;
+    for (size_t i = 0; i < IP_FRAG_MAX_CONTEXTS; i++) {
+        if (_is_same_flow(&_frag.contexts[i], info)) {
+            usage += _frag.contexts[i].payload_cap;
+        }
+    }
+    return usage;
+}
+
+static struct ip_frag_context *_lookup(struct ip_frag_info const *info,
+                                       uint64_t now)
+{
+    struct ip_frag_context *free_ctx = NULL;
+
+    for (size_t i = 0; i < IP_FRAG_MAX_CONTEXTS; i++) {
+        struct ip_frag_context *ctx = &_frag.contexts[i];
+        if (!ctx->used) {
+            free_ctx = free_ctx ? free_ctx : ctx;
+            continue;
+        }
+        if (_is_same_flow(ctx, info) && ctx->id == info->id) {
+            return ctx;
+        }
+    }
+
+    if (!free_ctx) {
+        free_ctx = _oldest(NULL);
+        _frag.stats.evictions++;
+        _context_release(free_ctx);
+    }
+
+    free_ctx->used = true;
+    free_ctx->version = info->version;
+    free_ctx->protocol = info->protocol;
+    free_ctx->id = info->id;
+    free_ctx->created_ms = now;
+    memcpy(free_ctx->src, info->src, info->addr_size);
+    memcpy(free_ctx->dst, info->dst, info->addr_size);
+
+    return free_ctx;
+}
+
+static int _reserve(struct ip_frag_context *ctx,
+                    struct ip_frag_info const *info, size_t size)
+{
+    if (size <= ctx->payload_cap) {
+        return 0;
+    }
+
+    size_t cap = (size + IP_FRAG_BUFFER_STEP - 1) & ~(IP_FRAG_BUFFER_STEP - 1);
+    size_t grow = cap - ctx->payload_cap;
+
+    if (_flow_usage(info) + grow > _frag.flow_limit) {
+        return -1;
+    }
+
+    while (_frag.used + grow > _frag.total_limit) {
+        struct ip_frag_context *victim = _oldest(ctx);
+        if (!victim) {
+            return -1;
+        }
+        _frag.stats.evictions++;
+        _context_release(victim);
+    }
+
+    uint8_t *payload = realloc(ctx->payload, cap);
+    if (!payload) {
+        return -1;
+    }
+
+    ctx->payload = payload;
+    _frag.used += grow;
+    ctx->payload_cap = cap;
+
+    return 0;
+}
+
+static int _parse_ipv4(uint8_t const *buf, size_t size,
+                       struct ip_frag_info *info)
+{
+    struct iphdr const *iph = (struct iphdr const *)buf;
+
+    if (size < sizeof(*iph)) {
+        return -1;
+    }
+
+    size_t header_size = iph->ihl * 4;
+    size_t total_size = ntohs(iph->tot_len);
+
+    if (header_size < sizeof(*iph) || total_size < header_size
+        || total_size > size) {
+        return -1;
+    }
+
+    uint16_t frag_off = ntohs(iph->frag_off);
+
+    info->version = 4;
+    info->protocol = iph->protocol;
+    info->id = ntohs(iph->id);
+    info->src = (uint8_t const *)&iph->saddr;
+    info->dst = (uint8_t const *)&iph->daddr;
+    info->addr_size = sizeof(iph->saddr);
+    info->header_size = header_size;
+    info->payload = buf + header_size;
+    info->offset = (frag_off & IP_OFFMASK) * 8;
+    info->size = total_size - header_size;
+    info->more = frag_off & IP_MF;
+
+    return 0;
+}
+
+static int _parse_ipv6(uint8_t const *buf, size_t size,
+                       struct ip_frag_info *info)
+{
+    struct ip6_hdr const *ip6h = (struct ip6_hdr const *)buf;
+
+    if (size < sizeof(*ip6h)
+        || sizeof(*ip6h) + ntohs(ip6h->ip6_plen) > size) {
+        return -1;
+    }
+
+    size = sizeof(*ip6h) + ntohs(ip6h->ip6_plen);
+
+    uint8_t nh = ip6h->ip6_nxt;
+    size_t nh_offset = offsetof(struct ip6_hdr, ip6_nxt);
+    size_t offset = sizeof(*ip6h);
+
+    while (_is_ipv6_ext_header(nh)) {
+        if (offset + 2 > size) {
+            return -1;
+        }
+        nh_offset = offset;
+        nh = buf[offset];
+        offset += (buf[offset + 1] + 1) * 8;
+    }
+
+    info->version = 6;
+    info->src = (uint8_t const *)&ip6h->ip6_src;
+    info->dst = (uint8_t const *)&ip6h->ip6_dst;
+    info->addr_size = sizeof(ip6h->ip6_src);
+
+    if (nh != IPPROTO_FRAGMENT) {
+        info->protocol = nh;
+        info->offset = 0;
+        info->more = false;
+        return 0;
+    }
+
+    if (offset + IPV6_FRAG_HEADER_SIZE > size) {
+        return -1;
+    }
+
+    struct ip6_frag const *fh = (struct ip6_frag const *)(buf + offset);
+    uint16_t offlg = ntohs(fh->ip6f_offlg);
+
+    info->protocol = fh->ip6f_nxt;
+    info->id = ntohl(fh->ip6f_ident);
+    info->header_size = offset;
+    info->next_header_offset = nh_offset;
+    info->payload = buf + offset + IPV6_FRAG_HEADER_SIZE;
+    info->offset = offlg & ~7;
+    info->size = size - offset - IPV6_FRAG_HEADER_SIZE;
+    info->more = offlg & 1;
+
+    return 0;
+}
+
+/* RFC 6946: atomic fragments are processed in isolation */
+static int _strip_ipv6_frag_header(uint8_t *buf, struct ip_frag_info *info)
+{
+    struct ip6_hdr *ip6h = (struct ip6_hdr *)buf;
+    size_t tail = info->size;
+
+    buf[info->next_header_offset] = info->protocol;
+    memmove(buf + info->header_size, info->payload, tail);
+    ip6h->ip6_plen = htons(info->header_size - sizeof(*ip6h) + tail);
+
+    return info->header_size + tail;
+}
+
+static int _build_datagram(struct ip_frag_context *ctx, uint8_t *buf,
+                           size_t buf_size)
+{
+    size_t size = ctx->header_size + ctx->total_size;
+
+    if (size > buf_size || size > IP_FRAG_MAX_DATAGRAM + sizeof(struct ip6_hdr)
+        || (ctx->version == 4 && size > IP_FRAG_MAX_DATAGRAM)) {
+        return -1;
+    }
+
+    memcpy(buf, ctx->header, ctx->header_size);
+    memcpy(buf + ctx->header_size, ctx->payload, ctx->total_size);
+
+    if (ctx->version == 4) {
+        struct iphdr *iph = (struct iphdr *)buf;
+        iph->tot_len = htons(size);
+        iph->frag_off = 0;
+        iph->check = 0;
+        iph->check = ip_checksum(iph, ctx->header_size);
+    }
+    else {
+        struct ip6_hdr *ip6h = (struct ip6_hdr *)buf;
+        buf[ctx->next_header_offset] = ctx->protocol;
+        ip6h->ip6_plen = htons(size - sizeof(*ip6h));
+    }
+
+    return size;
+}
+
+static int _insert(struct ip_frag_context *ctx,
+                   struct ip_frag_info const *info, uint8_t const *buf)
+{
+    uint32_t start = info->offset;
+    uint32_t end = info->offset + info->size;
+
+    if (info->more && (info->size == 0 || info->size % 8)) {
+        return -1;
+    }
+
+    if (!info->more) {
+        if (ctx->total_size && ctx->total_size != end) {
+            return -1;
+        }
+        for (size_t i = 0; i < ctx->range_count; i++) {
+            if (ctx->ranges[i].end > end) {
+                return -1;
+            }
+        }
+        ctx->total_size = end;
+    }
+    else if (ctx->total_size && end > ctx->total_size) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < ctx->range_count; i++) {
+        struct ip_frag_range const *range = &ctx->ranges[i];
+        if (range->start == start && range->end == end) {
+            return 0;
+        }
+        /* overlapping fragments are never benign, drop whole datagram */
+        if (start < range->end && end > range->start) {
+            _frag.stats.overlaps++;
+            return -1;
+        }
+    }
+
+    if (ctx->range_count == IP_FRAG_MAX_RANGES
+        || _reserve(ctx, info, end) < 0) {
+        return -1;
+    }
+
+    if (start == 0) {
+        if (info->header_size > sizeof(ctx->header)) {
+            return -1;
+        }
+        memcpy(ctx->header, buf, info->header_size);
+        ctx->header_size = info->header_size;
+        ctx->next_header_offset = info->next_header_offset;
+    }
+
+    memcpy(ctx->payload + start, info->payload, info->size);
+    ctx->ranges[ctx->range_count].start = start;
+    ctx->ranges[ctx->range_count].end = end;
+    ctx->range_count++;
+    ctx->received += info->size;
+
+    return 0;
+}
+
+int ip_frag_init(size_t flow_limit, size_t total_limit, uint32_t timeout_ms)
+{
+    if (!flow_limit || !total_limit || !timeout_ms) {
+        errno = -EINVAL;
+        log_error("ip frag limits invalid! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    ip_frag_deinit();
+
+    _frag.flow_limit = flow_limit;
+    _frag.total_limit = total_limit;
+    _frag.timeout_ms = timeout_ms;
+    _frag.ipv6_id = (uint32_t)util_now_ms() ^ ((uint32_t)getpid() << 16);
+
+    return 0;
+}
+
+void ip_frag_deinit()
+{
+    for (size_t i = 0; i < IP_FRAG_MAX_CONTEXTS; i++) {
+        if (_frag.contexts[i].used) {
+            _context_release(&_frag.contexts[i]);
+        }
+    }
+}
+
+int ip_frag_reassemble(uint8_t *buf, size_t size, size_t buf_size)
+{
+    struct ip_frag_info info = { 0 };
+
+    if (!buf || !size) {
+        return 0;
+    }
+
+    int ret = is_packet_ipv4(buf) ? _parse_ipv4(buf, size, &info)
+              : is_packet_ipv6(buf) ? _parse_ipv6(buf, size, &info)
+                                    : -1;
+    if (ret < 0) {
+        return size;
+    }
+
+    if (info.offset == 0 && !info.more) {
+        if (info.version == 6 && info.header_size) {
+            return _strip_ipv6_frag_header(buf, &info);
+        }
+        return size;
+    }
+
+    uint64_t now = util_now_ms();
+    _frag.stats.fragments++;
+    _expire(now);
+
+    struct ip_frag_context *ctx = _lookup(&info, now);
+    if (_insert(ctx, &info, buf) < 0) {
+        _context_drop(ctx);
+        return 0;
+    }
+
+    if (!ctx->total_size || !ctx->header_size
+        || ctx->received != ctx->total_size) {
+        return 0;
+    }
+
+    ret = _build_datagram(ctx, buf, buf_size);
+    if (ret < 0) {
+        _context_drop(ctx);
+        return 0;
+    }
+
+    _frag.stats.reassembled++;
+    _context_release(ctx);
+
+    return ret;
+}
+
+static int _fragment_ipv4(uint8_t const *buf, size_t size, size_t mtu,
+                          ip_frag_output_fn output, void *arg)
+{
+    struct iphdr const *iph = (struct iphdr const *)buf;
+    size_t header_size = iph->ihl * 4;
+    uint16_t frag_off = ntohs(iph->frag_off);
+
+    if (size < sizeof(*iph) || header_size < sizeof(*iph)
+        || header_size > size) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    if (frag_off & IP_DF) {
+        errno = -EMSGSIZE;
+        return -1;
+    }
+
+    /* only options with copied flag are repeated in later fragments */
+    uint8_t tail_header[60] = { 0 };
+    size_t tail_header_size = sizeof(*iph);
+    memcpy(tail_header, buf, sizeof(*iph));
+    for (size_t i = sizeof(*iph); i < header_size;) {
+        uint8_t type = buf[i];
+        if (type == IPOPT_EOL) {
+            break;
+        }
+        if (type == IPOPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= header_size || buf[i + 1] < 2
+            || i + buf[i + 1] > header_size) {
+            break;
+        }
+        if (IPOPT_COPIED(type)) {
+            memcpy(tail_header + tail_header_size, buf + i, buf[i + 1]);
+            tail_header_size += buf[i + 1];
+        }
+        i += buf[i + 1];
+    }
+    tail_header_size = (tail_header_size + 3) & ~3;
+
+    uint8_t const *payload = buf + header_size;
+    size_t payload_size = size - header_size;
+    size_t base = (frag_off & IP_OFFMASK) * 8;
+    int count = 0;
+
+    for (size_t offset = 0; offset < payload_size; count++) {
+        uint8_t const *header = count ? tail_header : buf;
+        size_t hsize = count ? tail_header_size : header_size;
+        struct iov_msg msg;
+
+        if (mtu < hsize + 8) {
+            errno = -EMSGSIZE;
+            return -1;
+        }
+
+        size_t chunk = (mtu - hsize) & ~7;
+        bool last = offset + chunk >= payload_size;
+        if (last) {
+            chunk = payload_size - offset;
+        }
+
+        /* only header is written, chunk is sent from packet */
+        iov_msg_init(&msg);
+        struct iphdr *fh = iov_msg_header(&msg, hsize);
+        iov_msg_append(&msg, payload + offset, chunk);
+        memcpy(fh, header, hsize);
+        fh->ihl = hsize / 4;
+        fh->tot_len = htons(hsize + chunk);
+        fh->frag_off = htons(((base + offset) / 8)
+                             | ((!last || (frag_off & IP_MF)) ? IP_MF : 0));
+        fh->check = 0;
+        fh->check = ip_checksum(fh, hsize);
+
+        if (output(&msg, arg) < 0) {
+            return -1;
+        }
+
+        offset += chunk;
+    }
+
+    _frag.stats.fragmented++;
+
+    return count;
+}
+
+static int _fragment_ipv6(uint8_t const *buf, size_t size, size_t mtu,
+                          ip_frag_output_fn output, void *arg)
+{
+    struct ip6_hdr const *ip6h = (struct ip6_hdr const *)buf;
+
+    if (size < sizeof(*ip6h)) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    /* unfragmentable part ends after last hop-by-hop / routing header */
+    uint8_t nh = ip6h->ip6_nxt;
+    size_t nh_offset = offsetof(struct ip6_hdr, ip6_nxt);
+    size_t offset = sizeof(*ip6h);
+    size_t unfrag_size = offset;
+    size_t unfrag_nh_offset = nh_offset;
+
+    while (_is_ipv6_ext_header(nh)) {
+        if (offset + 2 > size) {
+            errno = -EINVAL;
+            return -1;
+        }
+        uint8_t type = nh;
+        nh_offset = offset;
+        nh = buf[offset];
+        offset += (buf[offset + 1] + 1) * 8;
+        if (type != IPPROTO_DSTOPTS) {
+            unfrag_size = offset;
+            unfrag_nh_offset = nh_offset;
+        }
+    }
+
+    if (nh == IPPROTO_FRAGMENT || unfrag_size > size) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    if (mtu < unfrag_size + IPV6_FRAG_HEADER_SIZE + 8) {
+        errno = -EMSGSIZE;
+        return -1;
+    }
+
+    uint8_t const *payload = buf + unfrag_size;
+    size_t payload_size = size - unfrag_size;
+    size_t chunk_max = (mtu - unfrag_size - IPV6_FRAG_HEADER_SIZE) & ~7;
+    uint32_t id = htonl(++_frag.ipv6_id);
+    uint8_t next = buf[unfrag_nh_offset];
+    int count = 0;
+
+    for (size_t off = 0; off < payload_size; count++) {
+        size_t chunk = chunk_max;
+        bool last = off + chunk >= payload_size;
+        if (last) {
+            chunk = payload_size - off;
+        }
+
+        struct ip6_hdr *out = (struct ip6_hdr *)_frag.out;
+        struct ip6_frag *fh = (struct ip6_frag *)(_frag.out + unfrag_size);
+        struct iov_msg msg;
+
+        memcpy(_frag.out, buf, unfrag_size);
+        _frag.out[unfrag_nh_offset] = IPPROTO_FRAGMENT;
+        fh->ip6f_nxt = next;
+        fh->ip6f_reserved = 0;
+        fh->ip6f_offlg = htons(off | (last ? 0 : 1));
+        fh->ip6f_ident = id;
+
+        size_t out_size = unfrag_size + IPV6_FRAG_HEADER_SIZE + chunk;
+        out->ip6_plen = htons(out_size - sizeof(*out));
+
+        /* extension headers can outgrow message scratch, they are built in
+         * module buffer instead, chunk is sent from packet */
+        iov_msg_init(&msg);
+        iov_msg_append(&msg, _frag.out, unfrag_size + IPV6_FRAG_HEADER_SIZE);
+        iov_msg_append(&msg, payload + off, chunk);
+
+        if (output(&msg, arg) < 0) {
+            return -1;
+        }
+
+        off += chunk;
+    }
+
+    _frag.stats.fragmented++;
+
+    return count;
+}
+
+int ip_frag_fragment(uint8_t const *buf, size_t size, size_t mtu,
+                     ip_frag_output_fn output, void *arg)
+{
+    if (!buf || !size || !output) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    if (size <= mtu) {
+        struct iov_msg msg;
+        iov_msg_init(&msg);
+        iov_msg_append(&msg, buf, size);
+        return output(&msg, arg) < 0 ? -1 : 1;
+    }
+
+    if (is_packet_ipv4(buf)) {
+        return _fragment_ipv4(buf, size, mtu, output, arg);
+    }
+
+    if (is_packet_ipv6(buf)) {
+        return _fragment_ipv6(buf, size, mtu, output, arg);
+    }
+
+    errno = -EINVAL;
+    return -1;
+}
+
+void ip_frag_get_stats(struct ip_frag_stats *stats)
+{
+    if (stats) {
+        *stats = _frag.stats;
+    }
+}
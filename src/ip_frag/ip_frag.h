@@ -0,0 +1,76 @@
+#ifndef __IP_FRAG_H__
+#define __IP_FRAG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IP_FRAG_DEFAULT_FLOW_LIMIT  (256 * 1024)
+#define IP_FRAG_DEFAULT_TOTAL_LIMIT (4 * 1024 * 1024)
+#define IP_FRAG_DEFAULT_TIMEOUT_MS  15000
+
+struct ip_frag_stats
+{
+    uint64_t fragments;
+    uint64_t reassembled;
+    uint64_t timeouts;
+    uint64_t overlaps;
+    uint64_t evictions;
+    uint64_t dropped;
+    uint64_t fragmented;
+};
+
+struct iov_msg;
+
+/**
+ * @brief callback receiving every fragment produced by ip_frag_fragment
+ * @param msg fragment, header in scratch area and payload in packet
+ *        buffer, valid until callback returns
+ * @param arg user argument
+ * @return 0 on success, -1 on failure
+ */
+typedef int (*ip_frag_output_fn)(struct iov_msg const *msg, void *arg);
+
+/**
+ * @brief initialize ip fragment reassembly stage
+ * @note reassembly state is not thread safe, use it from one thread only
+ * @param flow_limit max buffered bytes per src / dst / protocol flow
+ * @param total_limit max buffered bytes for all flows
+ * @param timeout_ms time to wait for missing fragments
+ * @return 0 on success, -1 on failure
+ */
+int ip_frag_init(size_t flow_limit, size_t total_limit, uint32_t timeout_ms);
+
+/**
+ * @brief drop all pending datagrams and release reassembly memory
+ */
+void ip_frag_deinit();
+
+/**
+ * @brief feed ipv4 / ipv6 packet into reassembly stage
+ * @param buf packet buffer, receives reassembled datagram when complete
+ * @param size packet size
+ * @param buf_size buffer capacity
+ * @return size of complete datagram in buf, 0 if datagram is held or dropped
+ */
+int ip_frag_reassemble(uint8_t *buf, size_t size, size_t buf_size);
+
+/**
+ * @brief split ipv4 / ipv6 packet into fragments not larger than mtu
+ * @param buf packet buffer
+ * @param size packet size
+ * @param mtu link mtu
+ * @param output fragment callback, called once if packet already fits
+ * @param arg user argument passed to output
+ * @note may run on another thread than ip_frag_reassemble
+ * @return number of fragments on success, -1 on failure (-EMSGSIZE if DF set)
+ */
+int ip_frag_fragment(uint8_t const *buf, size_t size, size_t mtu,
+                     ip_frag_output_fn output, void *arg);
+
+/**
+ * @brief get reassembly / fragmentation counters
+ * @param stats destination for counters
+ */
+void ip_frag_get_stats(struct ip_frag_stats *stats);
+
+#endif /* __IP_FRAG_H__ */
@@ -1,17 +1,35 @@
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "config.h"
+#include "control.h"
 #include "log.h"
+#include "membudget.h"
+#include "mux.h"
 #include "packet_parser.h"
+#include "shaper.h"
 #include "signal_handler.h"
+#include "sockbuf.h"
 #include "socks5.h"
+#include "srcpool.h"
+#include "stats.h"
+#include "tls.h"
+#include "trace.h"
 #include "tuntap.h"
+#include "upgrade.h"
 #include "util.h"
 
 static void exit_handler(int data)
 {
+    control_deinit();
+    upgrade_deinit();
     tuntap_deinit();
     socks5_deinit();
     printf("\r\n");
@@ -29,21 +47,207 @@ static const struct signal_handler _signal_table[] = {
     // clang-format on
 };
 
+static const struct option _options[] = {
+    // clang-format off
+    { "mtu"            , required_argument, NULL, 'm' },
+    { "upgrade"        , no_argument      , NULL, 'u' },
+    { "upgrade-socket" , required_argument, NULL, 's' },
+    { "busy-poll"      , no_argument      , NULL, 'b' },
+    { "busy-poll-idle" , required_argument, NULL, 'i' },
+    { "stats-interval" , required_argument, NULL, 't' },
+    { "cpus"           , required_argument, NULL, 'c' },
+    { "irq-affinity"   , required_argument, NULL, 'q' },
+    { "mem-budget"     , required_argument, NULL, 'M' },
+    { "pipelined"      , no_argument      , NULL, 'p' },
+    { "mux-connections", required_argument, NULL, 'n' },
+    { "mux-delay"      , required_argument, NULL, 'd' },
+    { "shape"          , required_argument, NULL, 'r' },
+    { "tls"            , required_argument, NULL, 'T' },
+    { "tls-ca"         , required_argument, NULL, 'C' },
+    { "tls-name"       , required_argument, NULL, 'N' },
+    { "steer"          , required_argument, NULL, 'S' },
+    { "stages"         , no_argument      , NULL, 'g' },
+    { "source"         , required_argument, NULL, 'B' },
+    { "config"         , required_argument, NULL, 'f' },
+    { "control-socket" , required_argument, NULL, 'k' },
+    { "buffer-cap"     , required_argument, NULL, 'a' },
+    { "trace"          , required_argument, NULL, 'l' },
+    { "upstream"       , required_argument, NULL, 'U' },
+    { NULL             , 0                , NULL, 0   },
+    // clang-format on
+};
+
 static void _usage()
 {
     fprintf(stderr, "tunproxy usage\r\n"
                     "Run tunproxy as root and provide proxy_ip and proxy_port!\r\n"
-                    "./tunproxy proxy_ip proxy_port\r\n"
-                    "./tunproxy proxy_ip:proxy_port\r\n");
+                    "./tunproxy [options] proxy_ip proxy_port\r\n"
+                    "./tunproxy [options] proxy_ip:proxy_port\r\n"
+                    "options:\r\n"
+                    "  -m, --mtu <bytes>             tuntap mtu (default 1500, 1280 up to 65535)\r\n"
+                    "  -u, --upgrade                 take over sockets of running tunproxy\r\n"
+                    "  -s, --upgrade-socket <path>   upgrade unix socket (default " UPGRADE_DEFAULT_PATH ")\r\n"
+                    "  -b, --busy-poll               spin on tuntap / upstream for low latency\r\n"
+                    "  -i, --busy-poll-idle <us>     block after idle period (default 200)\r\n"
+                    "  -t, --stats-interval <sec>    log stats periodically, SIGUSR1 logs on demand\r\n"
+                    "  -c, --cpus <list>             pin workers to cores, e.g. 2,3,8-11\r\n"
+                    "  -q, --irq-affinity <nic>      spread nic irqs over --cpus cores\r\n"
+                    "  -M, --mem-budget <MB>         socks5 relay memory budget (default 1024, 0 no limit)\r\n"
+                    "  -p, --pipelined               one segment socks5 handshake with tcp fast open\r\n"
+                    "  -n, --mux-connections <n>     connections per upstream udp flows are spread over (default 1,\r\n"
+                    "                                max 16 over all upstreams)\r\n"
+                    "  -d, --mux-delay <us>          max time a mux frame waits to be coalesced (default 1000)\r\n"
+                    "  -r, --shape <match>=<rate>    rate limit class, match is all, client:<cidr>, user:<name> or dst:<cidr>,\r\n"
+                    "                                rate in bytes/s, optional \",<burst>\", repeat for more classes\r\n"
+                    "  -T, --tls <ip:port>           reach proxy over tls through this endpoint, kernel tls when available\r\n"
+                    "  -C, --tls-ca <file>           pem bundle endpoint certificate is verified with (default system store)\r\n"
+                    "  -N, --tls-name <name>         name expected in endpoint certificate (default endpoint ip)\r\n"
+                    "  -S, --steer <rule>            traffic routed into tuntap, udp, udp:<port>, udp:<first>-<last> or all,\r\n"
+                    "                                repeat for more rules (default udp)\r\n"
+                    "  -g, --stages                  tuntap reader and writer on own threads, joined by lock-free rings\r\n"
+                    "  -B, --source <ip>[:<ports>]   source address for outbound connections, optional port range\r\n"
+                    "                                <first>-<last>, repeat to spread connections over more addresses\r\n"
+                    "  -f, --config <file>           \"key value\" lines applied over options, reread on reload\r\n"
+                    "  -k, --control-socket <path>   live configuration unix socket (default " CONTROL_DEFAULT_PATH ")\r\n"
+                    "  -a, --buffer-cap <MB>         socket buffers sized from bandwidth-delay product within cap\r\n"
+                    "                                (default 64, 0 keeps kernel sizing)\r\n"
+                    "  -l, --trace <n>               per stage latency of one in n tuntap packets (default 1024, 0 off)\r\n"
+                    "  -U, --upstream <ip:port>      backup upstream proxy, new flows pick the faster healthy one,\r\n"
+                    "                                repeat for more (max 3)\r\n");
 }
 
 int main(int argc, char *argv[])
 {
     char *ip = "127.0.0.1";
     uint16_t port = 1080;
+    long mtu = 0;
+    bool upgrade = false;
+    char const *upgrade_path = UPGRADE_DEFAULT_PATH;
+    int taken_over = 0;
+    bool busy_poll = false;
+    bool stages = false;
+    long busy_poll_idle = TUNTAP_DEFAULT_BUSY_POLL_IDLE_US;
+    long stats_interval = 0;
+    char const *cpus = NULL;
+    char const *irq_ifname = NULL;
+    long mem_budget = MEMBUDGET_DEFAULT_LIMIT >> 20;
+    long buffer_cap = SOCKBUF_DEFAULT_CAP >> 20;
+    long trace_sample = TRACE_DEFAULT_SAMPLE;
+    long mux_connections = TUNTAP_DEFAULT_MUX_CONNECTIONS;
+    long mux_delay = MUX_DEFAULT_DELAY_US;
+    char *tls_endpoint = NULL;
+    char const *tls_ca = NULL;
+    char const *tls_name = NULL;
+    char const *config_path = NULL;
+    char const *control_path = CONTROL_DEFAULT_PATH;
+    struct config cfg;
+    struct config base;
+    sigset_t stats_set;
+    int opt = 0;
+
+    config_defaults(&cfg);
+
+    while ((opt = getopt_long(argc, argv, "m:us:bi:t:c:q:M:pn:d:r:T:C:N:S:gB:f:k:a:l:U:", _options, NULL))
+           != -1) {
+        switch (opt) {
+            case 'm':
+                mtu = strtol(optarg, NULL, 10);
+                break;
+            case 'u':
+                upgrade = true;
+                break;
+            case 's':
+                upgrade_path = optarg;
+                break;
+            case 'b':
+                busy_poll = true;
+                break;
+            case 'i':
+                busy_poll_idle = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                stats_interval = strtol(optarg, NULL, 10);
+                break;
+            case 'c':
+                cpus = optarg;
+                break;
+            case 'q':
+                irq_ifname = optarg;
+                break;
+            case 'M':
+                mem_budget = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                socks5_set_pipelined(true);
+                break;
+            case 'n':
+                mux_connections = strtol(optarg, NULL, 10);
+                break;
+            case 'd':
+                mux_delay = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                if (shaper_add_class(optarg) < 0) {
+                    fprintf(stderr, "Invalid shaping class %s!\r\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'T':
+                tls_endpoint = optarg;
+                break;
+            case 'C':
+                tls_ca = optarg;
+                break;
+            case 'N':
+                tls_name = optarg;
+                break;
+            case 'S':
+                if (config_steer_add(&cfg, optarg) < 0) {
+                    fprintf(stderr, "Invalid steering rule %s!\r\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'g':
+                stages = true;
+                break;
+            case 'B':
+                if (srcpool_add(optarg) < 0) {
+                    fprintf(stderr, "Invalid source address %s!\r\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'f':
+                config_path = optarg;
+                break;
+            case 'k':
+                control_path = optarg;
+                break;
+            case 'a':
+                buffer_cap = strtol(optarg, NULL, 10);
+                break;
+            case 'l':
+                trace_sample = strtol(optarg, NULL, 10);
+                break;
+            case 'U': {
+                char *upstream_port = strchr(optarg, ':');
+                if (upstream_port) {
+                    *upstream_port++ = 0;
+                }
+                if (!upstream_port || !is_ip_v4_valid(optarg)
+                    || tuntap_add_upstream(optarg, atoi(upstream_port)) < 0) {
+                    fprintf(stderr, "Invalid upstream %s!\r\n", optarg);
+                    return -1;
+                }
+                break;
+            }
+            default:
+                _usage();
+                return -1;
+        }
+    }
 
-    ++argv;
-    --argc;
+    argv += optind;
+    argc -= optind;
 
     if (argc > 0) {
         if (strstr(*argv, ":") != NULL) {
@@ -71,30 +275,150 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    snprintf(cfg.proxy_ip, sizeof(cfg.proxy_ip), "%s", ip);
+    cfg.proxy_port = port;
+    /* reload starts over from options, file applies on top */
+    base = cfg;
+
+    /* stats requests are taken by main loop, blocked before any thread
+     * starts so every thread inherits the mask */
+    sigemptyset(&stats_set);
+    sigaddset(&stats_set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &stats_set, NULL) != 0) {
+        fprintf(stderr, "Failed to block stats signal!\r\n");
+        return -1;
+    }
+
     if (log_init() != 0) {
         fprintf(stderr, "Failed to logging system! (%d / %s)\r\n", errno,
                 strerror(errno));
         return -1;
     }
 
+    if (config_path && config_load(&cfg, config_path) < 0) {
+        log_error("Invalid config file %s!", config_path);
+        return -1;
+    }
+
+    log_info("config init");
+    if (config_init(&cfg) < 0) {
+        log_error("Failed to initialize config! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
     log_info("getuid");
     if (getuid() != 0) {
         log_error("Not a root!");
         return errno;
     }
 
-    log_info("socks5 init");
-    if (socks5_init(ip, port) < 0) {
-        log_error("Failed to initialize socks5! (%d / %s)", errno,
+    if (busy_poll_idle <= 0 || busy_poll_idle > UINT32_MAX
+        || tuntap_set_busy_poll(busy_poll, busy_poll_idle) < 0) {
+        log_error("Invalid busy poll idle period %ld!", busy_poll_idle);
+        return -1;
+    }
+
+    if (tuntap_set_stages(stages) < 0) {
+        log_error("Failed to set up tuntap stages!");
+        return -1;
+    }
+
+    if (mux_delay < 0 || mux_delay > UINT32_MAX || mux_connections <= 0
+        || tuntap_set_mux(mux_connections, mux_delay) < 0) {
+        log_error("Invalid mux connections %ld / delay %ld!", mux_connections,
+                  mux_delay);
+        return -1;
+    }
+    socks5_set_mux_delay(mux_delay);
+
+    if (tls_endpoint) {
+        char *tls_port = strchr(tls_endpoint, ':');
+        if (tls_port) {
+            *tls_port++ = 0;
+        }
+        log_info("tls init");
+        if (!tls_port || !is_ip_v4_valid(tls_endpoint)
+            || tls_client_init(tls_ca, tls_name ? tls_name : tls_endpoint) < 0
+            || tuntap_set_tls(tls_endpoint, atoi(tls_port)) < 0) {
+            log_error("Invalid tls endpoint %s!", tls_endpoint);
+            return -1;
+        }
+    }
+
+    log_info("affinity init");
+    if (affinity_init(cpus) < 0) {
+        log_error("Invalid cpu list %s!", cpus);
+        return -1;
+    }
+
+    if (irq_ifname && affinity_align_irqs(irq_ifname) < 0) {
+        log_warn("Failed to align %s irqs", irq_ifname);
+    }
+
+    if (mem_budget < 0 || membudget_init((size_t)mem_budget << 20) < 0) {
+        log_error("Invalid memory budget %ld!", mem_budget);
+        return -1;
+    }
+
+    if (buffer_cap < 0 || sockbuf_init((size_t)buffer_cap << 20) < 0) {
+        log_error("Invalid socket buffer cap %ld!", buffer_cap);
+        return -1;
+    }
+
+    if (trace_sample < 0 || trace_sample > UINT32_MAX
+        || trace_init(trace_sample) < 0) {
+        log_error("Invalid trace sampling %ld!", trace_sample);
+        return -1;
+    }
+
+    log_info("shaper init");
+    if (shaper_init() < 0) {
+        log_error("Failed to initialize shaper! (%d / %s)", errno,
                   strerror(errno));
-        return errno;
+        return -1;
     }
 
-    log_info("tuntap init");
-    if (tuntap_init(ip, port) < 0) {
-        log_error("Failed to initialize tuntap device! (%d / %s)", errno,
+    log_info("srcpool init");
+    if (srcpool_init() < 0) {
+        log_error("Failed to initialize source pool! (%d / %s)", errno,
                   strerror(errno));
-        return errno;
+        return -1;
+    }
+
+    if (upgrade) {
+        log_info("upgrade takeover");
+        taken_over = upgrade_takeover(upgrade_path, cfg.proxy_ip,
+                                      cfg.proxy_port);
+        if (taken_over < 0) {
+            log_error("Failed to take over running tunproxy! (%d / %s)", errno,
+                      strerror(errno));
+            return errno;
+        }
+    }
+
+    if (!taken_over) {
+        log_info("socks5 init");
+        if (socks5_init(ip, port) < 0) {
+            log_error("Failed to initialize socks5! (%d / %s)", errno,
+                      strerror(errno));
+            return errno;
+        }
+    }
+
+    if (mtu && (mtu < TUNTAP_MIN_MTU || mtu > UINT16_MAX
+                || tuntap_set_mtu(mtu) < 0)) {
+        log_error("Invalid mtu %ld!", mtu);
+        return -1;
+    }
+
+    if (!taken_over) {
+        log_info("tuntap init");
+        if (tuntap_init(cfg.proxy_ip, cfg.proxy_port) < 0) {
+            log_error("Failed to initialize tuntap device! (%d / %s)", errno,
+                      strerror(errno));
+            return errno;
+        }
     }
 
     log_info("signal handler init");
@@ -104,8 +428,28 @@ int main(int argc, char *argv[])
         return errno;
     }
 
-    while (1)
-        ;
+    log_info("upgrade init");
+    if (upgrade_init(upgrade_path) < 0) {
+        log_warn("Upgrade socket unavailable, restart will drop sessions");
+    }
+
+    log_info("control init");
+    if (control_init(control_path, config_path, &base) < 0) {
+        log_warn("Control socket unavailable, configuration is fixed");
+    }
+
+    while (1) {
+        struct timespec interval = { .tv_sec = stats_interval };
+        int ret = stats_interval > 0
+                      ? sigtimedwait(&stats_set, NULL, &interval)
+                      : sigwaitinfo(&stats_set, NULL);
+
+        /* timeout is the periodic report */
+        if (ret < 0 && errno != EAGAIN) {
+            continue;
+        }
+        stats_report();
+    }
 
     return 0;
 }
@@ -0,0 +1,78 @@
+#include "membudget.h"
+#include <stdint.h>
+
+#include "log.h"
+#include "stats.h"
+
+static struct
+{
+    size_t limit;
+    size_t used;
+    size_t peak;
+    uint64_t refused;
+} _budget = { .limit = SIZE_MAX };
+
+static void _update_peak(size_t used)
+{
+    size_t peak = __atomic_load_n(&_budget.peak, __ATOMIC_RELAXED);
+    while (used > peak
+           && !__atomic_compare_exchange_n(&_budget.peak, &peak, used, true,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED)) {
+    }
+}
+
+static void _membudget_report()
+{
+    size_t limit = _budget.limit;
+
+    log_info("membudget: used %zu KB, peak %zu KB, limit %zu KB, "
+             "refused %lu",
+             __atomic_load_n(&_budget.used, __ATOMIC_RELAXED) >> 10,
+             __atomic_load_n(&_budget.peak, __ATOMIC_RELAXED) >> 10,
+             limit >> 10,
+             __atomic_load_n(&_budget.refused, __ATOMIC_RELAXED));
+}
+
+int membudget_init(size_t limit)
+{
+    _budget.limit = limit ? limit : SIZE_MAX;
+    stats_register(_membudget_report);
+
+    return 0;
+}
+
+bool membudget_acquire(size_t size)
+{
+    size_t used = __atomic_load_n(&_budget.used, __ATOMIC_RELAXED);
+
+    do {
+        if (size > _budget.limit || used > _budget.limit - size) {
+            __atomic_add_fetch(&_budget.refused, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&_budget.used, &used, used + size,
+                                          true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    _update_peak(used + size);
+
+    return true;
+}
+
+void membudget_charge(size_t size)
+{
+    _update_peak(__atomic_add_fetch(&_budget.used, size, __ATOMIC_RELAXED));
+}
+
+void membudget_release(size_t size)
+{
+    __atomic_sub_fetch(&_budget.used, size, __ATOMIC_RELAXED);
+}
+
+bool membudget_fits(size_t size)
+{
+    size_t used = __atomic_load_n(&_budget.used, __ATOMIC_RELAXED);
+
+    return size <= _budget.limit && used <= _budget.limit - size;
+}
@@ -0,0 +1,49 @@
+#ifndef __MEMBUDGET_H__
+#define __MEMBUDGET_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MEMBUDGET_DEFAULT_LIMIT ((size_t)1024 << 20)
+
+/*
+ * Process wide byte budget shared by all relay sessions. Callers reserve
+ * before allocating and stop reading (instead of dropping data) while a
+ * reservation is refused.
+ */
+
+/**
+ * @brief initialize memory budget
+ * @param limit max reserved bytes, 0 for no limit
+ * @return 0 on success, -errno on failure
+ */
+int membudget_init(size_t limit);
+
+/**
+ * @brief reserve bytes if they fit in budget
+ * @param size bytes to reserve
+ * @return true if reserved, false if budget is exhausted
+ */
+bool membudget_acquire(size_t size);
+
+/**
+ * @brief reserve bytes even past limit, for state which can't be refused
+ *        (e.g. sessions adopted on upgrade)
+ * @param size bytes to reserve
+ */
+void membudget_charge(size_t size);
+
+/**
+ * @brief return reserved bytes
+ * @param size bytes to return
+ */
+void membudget_release(size_t size);
+
+/**
+ * @brief check if reservation would currently fit
+ * @param size bytes
+ * @return true if size fits in remaining budget
+ */
+bool membudget_fits(size_t size);
+
+#endif /* __MEMBUDGET_H__ */
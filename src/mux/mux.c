@@ -0,0 +1,666 @@
+#include "mux.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "membudget.h"
+#include "netlink.h"
+#include "quiesce.h"
+#include "timer_wheel.h"
+#include "tls.h"
+#include "util.h"
+
+#define MUX_SERVER_BUCKETS   1024
+#define MUX_SERVER_MAX_FLOWS 4096
+#define MUX_SERVER_BATCH     32
+#define MUX_SERVER_TICK_MS   100
+
+struct mux_server;
+
+struct mux_flow
+{
+    uint32_t id;
+    int fd;
+    uint64_t active_ms;
+    struct mux_server *server;
+    struct timer_wheel_timer idle;
+    struct mux_flow *next;
+};
+
+struct mux_server
+{
+    int fd;
+    int epoll_fd;
+    size_t flows;
+    bool dead;
+    /* upgrade asked to park, frame being read is finished first */
+    bool draining;
+    uint64_t active_ms;
+    struct timer_wheel timers;
+    struct timer_wheel_timer keepalive;
+    struct mux_flow *buckets[MUX_SERVER_BUCKETS];
+    struct mux_flow *closed;
+    struct mux_reader reader;
+    struct mux_writer writer;
+};
+
+static void _encode_header(uint8_t *buf, uint32_t flow, uint8_t type,
+                           uint8_t proto, uint16_t length)
+{
+    flow = htonl(flow);
+    length = htons(length);
+    memcpy(buf, &flow, sizeof(flow));
+    buf[4] = type;
+    buf[5] = proto;
+    memcpy(buf + 6, &length, sizeof(length));
+}
+
+void mux_writer_init(struct mux_writer *w, int fd, uint32_t delay_us)
+{
+    w->fd = fd;
+    w->delay_us = delay_us;
+    w->first_us = 0;
+    w->size = 0;
+    w->frames = 0;
+    w->writes = 0;
+    w->blocked = false;
+}
+
+int mux_flush(struct mux_writer *w)
+{
+    size_t sent = 0;
+
+    while (sent < w->size) {
+        ssize_t bytes = tls_send(w->fd, w->buf + sent, w->size - sent,
+                                 MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            break;
+        }
+        sent += bytes;
+    }
+
+    if (sent < w->size) {
+        int err = errno;
+        /* unsent rest moves to front, new frames queue up behind it */
+        memmove(w->buf, w->buf + sent, w->size - sent);
+        w->size -= sent;
+        w->blocked = err == EAGAIN;
+        errno = err;
+        return -1;
+    }
+
+    if (w->size) {
+        w->writes++;
+    }
+    w->size = 0;
+    w->blocked = false;
+
+    return 0;
+}
+
+/* buffer holds a full frame past the coalescing limit, it fits unless
+ * socket left more than that unsent */
+uint8_t *mux_write_reserve(struct mux_writer *w)
+{
+    if (w->size > MUX_COALESCE_BYTES) {
+        return NULL;
+    }
+
+    return w->buf + w->size + MUX_HEADER_SIZE;
+}
+
+int mux_write_commit(struct mux_writer *w, uint32_t flow, uint8_t type,
+                     uint8_t proto, size_t size)
+{
+    if (size > MUX_MAX_PAYLOAD) {
+        errno = -EMSGSIZE;
+        return -1;
+    }
+
+    if (!w->size) {
+        w->first_us = util_now_us();
+    }
+
+    _encode_header(w->buf + w->size, flow, type, proto, size);
+    w->size += MUX_HEADER_SIZE + size;
+    w->frames++;
+
+    /* frame is queued either way, a full socket only delays it */
+    if (w->size >= MUX_COALESCE_BYTES && mux_flush(w) < 0 && !w->blocked) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int mux_write(struct mux_writer *w, uint32_t flow, uint8_t type,
+              uint8_t proto, void const *payload, size_t size)
+{
+    uint8_t *room = mux_write_reserve(w);
+
+    if (size > MUX_MAX_PAYLOAD) {
+        errno = -EMSGSIZE;
+        return -1;
+    }
+
+    if (!room) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (size) {
+        memcpy(room, payload, size);
+    }
+
+    return mux_write_commit(w, flow, type, proto, size);
+}
+
+int mux_flush_due(struct mux_writer *w, uint64_t now_us)
+{
+    if (!w->size || w->blocked || now_us - w->first_us < w->delay_us) {
+        return 0;
+    }
+
+    return mux_flush(w);
+}
+
+int mux_writer_timeout_ms(struct mux_writer const *w, uint64_t now_us)
+{
+    if (!w->size || w->blocked) {
+        return -1;
+    }
+
+    uint64_t deadline_us = w->first_us + w->delay_us;
+    if (deadline_us <= now_us) {
+        return 0;
+    }
+
+    return (deadline_us - now_us + 999) / 1000;
+}
+
+void mux_reader_init(struct mux_reader *r, int fd)
+{
+    r->fd = fd;
+    r->head = 0;
+    r->tail = 0;
+    r->rx_ns = 0;
+}
+
+static ssize_t _reader_fill(struct mux_reader *r, size_t max)
+{
+    union
+    {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(struct timespec))];
+    } control;
+
+    if (r->head) {
+        memmove(r->buf, r->buf + r->head, r->tail - r->head);
+        r->tail -= r->head;
+        r->head = 0;
+    }
+
+    struct iovec iov = {
+        .iov_base = r->buf + r->tail,
+        .iov_len = sizeof(r->buf) - r->tail,
+    };
+    if (iov.iov_len > max) {
+        iov.iov_len = max;
+    }
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t bytes = tls_recvmsg(r->fd, &mh, MSG_DONTWAIT);
+    if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (bytes <= 0) {
+        return bytes;
+    }
+
+    r->tail += bytes;
+    r->rx_ns = 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg;
+         cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET
+            && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            r->rx_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+    }
+
+    return bytes;
+}
+
+ssize_t mux_read(struct mux_reader *r)
+{
+    return _reader_fill(r, sizeof(r->buf));
+}
+
+/* bytes still missing from frame at reader head, 0 on frame boundary */
+static size_t _frame_missing(struct mux_reader const *r)
+{
+    size_t available = r->tail - r->head;
+    uint16_t length = 0;
+
+    if (!available) {
+        return 0;
+    }
+    if (available < MUX_HEADER_SIZE) {
+        return MUX_HEADER_SIZE - available;
+    }
+
+    memcpy(&length, r->buf + r->head + 6, sizeof(length));
+    return MUX_HEADER_SIZE + ntohs(length) - available;
+}
+
+int mux_next(struct mux_reader *r, struct mux_header *header,
+             uint8_t **payload)
+{
+    uint8_t const *buf = r->buf + r->head;
+    size_t available = r->tail - r->head;
+    uint32_t flow = 0;
+    uint16_t length = 0;
+
+    if (available < MUX_HEADER_SIZE) {
+        return 0;
+    }
+
+    memcpy(&length, buf + 6, sizeof(length));
+    length = ntohs(length);
+    if (available < MUX_HEADER_SIZE + length) {
+        return 0;
+    }
+
+    memcpy(&flow, buf, sizeof(flow));
+    header->flow = ntohl(flow);
+    header->type = buf[4];
+    header->proto = buf[5];
+    header->length = length;
+    *payload = r->buf + r->head + MUX_HEADER_SIZE;
+    r->head += MUX_HEADER_SIZE + length;
+
+    return 1;
+}
+
+/* server side */
+static struct mux_flow **_flow_link(struct mux_server *s, uint32_t id)
+{
+    struct mux_flow **link = &s->buckets[id % MUX_SERVER_BUCKETS];
+
+    while (*link && (*link)->id != id) {
+        link = &(*link)->next;
+    }
+
+    return link;
+}
+
+/* freed after event batch, pending events may still point at flow */
+static void _flow_close(struct mux_server *s, uint32_t id)
+{
+    struct mux_flow **link = _flow_link(s, id);
+    struct mux_flow *flow = *link;
+
+    if (!flow) {
+        return;
+    }
+
+    *link = flow->next;
+    timer_wheel_cancel(&s->timers, &flow->idle);
+    close(flow->fd);
+    flow->fd = -1;
+    flow->next = s->closed;
+    s->closed = flow;
+    s->flows--;
+}
+
+/* tuntap side answers sender with this icmp unreachable code */
+static void _flow_error(struct mux_server *s, uint32_t id, uint8_t code,
+                        uint16_t mtu)
+{
+    uint8_t payload[MUX_ERROR_SIZE] = { code, 0 };
+
+    mtu = htons(mtu);
+    memcpy(payload + 2, &mtu, sizeof(mtu));
+    mux_write(&s->writer, id, MUX_ERROR, IPPROTO_UDP, payload,
+              sizeof(payload));
+}
+
+/* errors remote side reported to flow socket, transient ones aren't passed
+ * on */
+static void _flow_failed(struct mux_server *s, struct mux_flow *flow, int err)
+{
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+
+    switch (err) {
+        case ECONNREFUSED:
+            _flow_error(s, flow->id, ICMP_PORT_UNREACH, 0);
+            break;
+        case ENETUNREACH:
+            _flow_error(s, flow->id, ICMP_NET_UNREACH, 0);
+            break;
+        case EHOSTUNREACH:
+            _flow_error(s, flow->id, ICMP_HOST_UNREACH, 0);
+            break;
+        case EMSGSIZE:
+            /* route cached the lower path mtu the remote router reported */
+            if (getsockopt(flow->fd, IPPROTO_IP, IP_MTU, &mtu, &len) == 0) {
+                _flow_error(s, flow->id, ICMP_FRAG_NEEDED, mtu);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* timer isn't moved per datagram, it's pushed back here if still active */
+static void _flow_idle(struct timer_wheel_timer *timer, void *arg)
+{
+    struct mux_flow *flow = arg;
+    struct mux_server *s = flow->server;
+    uint64_t idle_ms = flow->active_ms + MUX_FLOW_IDLE_MS;
+
+    if (idle_ms > util_now_ms()) {
+        timer_wheel_arm(&s->timers, timer, idle_ms);
+        return;
+    }
+
+    mux_write(&s->writer, flow->id, MUX_CLOSE, IPPROTO_UDP, NULL, 0);
+    _flow_close(s, flow->id);
+}
+
+static void _flow_open(struct mux_server *s, struct mux_header const *header,
+                       uint8_t const *payload)
+{
+    struct sockaddr_in remote = { .sin_family = AF_INET };
+
+    _flow_close(s, header->flow);
+
+    if (header->proto != IPPROTO_UDP || header->length != MUX_OPEN_SIZE
+        || s->flows == MUX_SERVER_MAX_FLOWS) {
+        _flow_error(s, header->flow, ICMP_PKT_FILTERED, 0);
+        mux_write(&s->writer, header->flow, MUX_CLOSE, header->proto, NULL,
+                  0);
+        return;
+    }
+
+    memcpy(&remote.sin_addr, payload, 4);
+    memcpy(&remote.sin_port, payload + 4, 2);
+
+    struct mux_flow *flow = calloc(1, sizeof(*flow));
+    if (!flow) {
+        mux_write(&s->writer, header->flow, MUX_CLOSE, header->proto, NULL,
+                  0);
+        return;
+    }
+
+    flow->id = header->flow;
+    flow->active_ms = util_now_ms();
+    flow->server = s;
+    timer_wheel_timer_init(&flow->idle, _flow_idle, flow);
+    flow->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = flow };
+    if (flow->fd < 0 || netlink_mark_socket(flow->fd) < 0
+        || connect(flow->fd, (struct sockaddr *)&remote, sizeof(remote)) < 0
+        || epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, flow->fd, &event) < 0) {
+        int err = errno;
+        log_error("mux flow %u open failed! (%d / %s)", header->flow, err,
+                  strerror(err));
+        _flow_error(s, header->flow,
+                    err == ENETUNREACH                ? ICMP_NET_UNREACH
+                    : err == EACCES || err == EPERM ? ICMP_PKT_FILTERED
+                                                    : ICMP_HOST_UNREACH,
+                    0);
+        if (flow->fd >= 0) {
+            close(flow->fd);
+        }
+        free(flow);
+        mux_write(&s->writer, header->flow, MUX_CLOSE, header->proto, NULL,
+                  0);
+        return;
+    }
+
+    struct mux_flow **link = &s->buckets[flow->id % MUX_SERVER_BUCKETS];
+    flow->next = *link;
+    *link = flow;
+    s->flows++;
+    timer_wheel_arm(&s->timers, &flow->idle,
+                    flow->active_ms + MUX_FLOW_IDLE_MS);
+}
+
+/* client sends keepalives while idle, silence means it is gone */
+static void _client_idle(struct timer_wheel_timer *timer, void *arg)
+{
+    struct mux_server *s = arg;
+    uint64_t idle_ms = s->active_ms + MUX_KEEPALIVE_TIMEOUT_MS;
+
+    if (idle_ms > util_now_ms()) {
+        timer_wheel_arm(&s->timers, timer, idle_ms);
+        return;
+    }
+
+    log_warn("mux client silent for %u ms", MUX_KEEPALIVE_TIMEOUT_MS);
+    s->dead = true;
+}
+
+static int _from_client(struct mux_server *s, uint64_t now_ms)
+{
+    struct mux_header header;
+    uint8_t *payload = NULL;
+    ssize_t bytes = 0;
+
+    if (!s->draining) {
+        bytes = mux_read(&s->reader);
+    }
+    else if (_frame_missing(&s->reader)) {
+        /* nothing past current frame is read, rest goes to next process */
+        bytes = _reader_fill(&s->reader, _frame_missing(&s->reader));
+    }
+    else {
+        return 0;
+    }
+    if (bytes == 0 || (bytes < 0 && errno != EAGAIN)) {
+        return -1;
+    }
+    s->active_ms = now_ms;
+
+    while (mux_next(&s->reader, &header, &payload)) {
+        switch (header.type) {
+            case MUX_KEEPALIVE:
+                mux_write(&s->writer, 0, MUX_KEEPALIVE, 0, NULL, 0);
+                break;
+            case MUX_OPEN:
+                _flow_open(s, &header, payload);
+                break;
+            case MUX_DATA: {
+                struct mux_flow *flow = *_flow_link(s, header.flow);
+                if (!flow) {
+                    /* client's view is stale, let it open flow again */
+                    mux_write(&s->writer, header.flow, MUX_CLOSE,
+                              header.proto, NULL, 0);
+                    break;
+                }
+                flow->active_ms = now_ms;
+                if (send(flow->fd, payload, header.length, MSG_DONTWAIT) < 0) {
+                    _flow_failed(s, flow, errno);
+                }
+                break;
+            }
+            case MUX_CLOSE:
+                _flow_close(s, header.flow);
+                break;
+            default:
+                log_error("mux unknown frame type %u", header.type);
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int _from_remote(struct mux_server *s, struct mux_flow *flow,
+                        uint64_t now_ms)
+{
+    /* datagrams land right behind their frame header, nothing is copied */
+    for (int i = 0; i < MUX_SERVER_BATCH; i++) {
+        uint8_t *room = mux_write_reserve(&s->writer);
+        if (!room) {
+            break;
+        }
+        ssize_t bytes = recv(flow->fd, room, MUX_MAX_PAYLOAD, MSG_DONTWAIT);
+        if (bytes < 0) {
+            /* icmp error remote side got for flow surfaces here once */
+            _flow_failed(s, flow, errno);
+            break;
+        }
+        flow->active_ms = now_ms;
+        if (mux_write_commit(&s->writer, flow->id, MUX_DATA, IPPROTO_UDP,
+                             bytes)
+            < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void _free_closed(struct mux_server *s)
+{
+    while (s->closed) {
+        struct mux_flow *flow = s->closed;
+        s->closed = flow->next;
+        free(flow);
+    }
+}
+
+int mux_serve(int fd, uint32_t delay_us, struct quiesce *q)
+{
+    struct epoll_event events[MUX_SERVER_BATCH];
+    int ret = 0;
+
+    if (!membudget_acquire(sizeof(struct mux_server))) {
+        errno = -ENOMEM;
+        return -1;
+    }
+
+    struct mux_server *s = calloc(1, sizeof(*s));
+    if (!s) {
+        membudget_release(sizeof(struct mux_server));
+        return -1;
+    }
+
+    s->fd = fd;
+    s->active_ms = util_now_ms();
+    timer_wheel_init(&s->timers, MUX_SERVER_TICK_MS, s->active_ms);
+    timer_wheel_timer_init(&s->keepalive, _client_idle, s);
+    timer_wheel_arm(&s->timers, &s->keepalive,
+                    s->active_ms + MUX_KEEPALIVE_TIMEOUT_MS);
+    mux_reader_init(&s->reader, fd);
+    mux_writer_init(&s->writer, fd, delay_us);
+
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    /* server itself stands for quiesce wake up, flows can't be it */
+    struct epoll_event wake = { .events = EPOLLIN, .data.ptr = s };
+    if (s->epoll_fd < 0
+        || epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0
+        || epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, quiesce_fd(q), &wake) < 0) {
+        log_error("mux epoll failed! (%d / %s)", errno, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    while (1) {
+        uint64_t now_us = util_now_us();
+        int timeout = timer_wheel_timeout_ms(&s->timers, now_us / 1000);
+        int flush_ms = mux_writer_timeout_ms(&s->writer, now_us);
+        if (flush_ms >= 0 && (timeout < 0 || flush_ms < timeout)) {
+            timeout = flush_ms;
+        }
+
+        int count = epoll_wait(s->epoll_fd, events, ARRAY_SIZE(events),
+                               timeout);
+        if (count < 0 && errno != EINTR) {
+            ret = -1;
+            break;
+        }
+
+        uint64_t now_ms = util_now_ms();
+        for (int i = 0; i < count && ret == 0; i++) {
+            struct mux_flow *flow = events[i].data.ptr;
+            if (events[i].data.ptr == s) {
+                /* wake up stays readable until resume, mute it meanwhile */
+                s->draining = true;
+                wake.events = 0;
+                epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, quiesce_fd(q), &wake);
+            }
+            else if (!flow) {
+                if (_from_client(s, now_ms) < 0) {
+                    goto out;
+                }
+            }
+            else if (flow->fd >= 0) {
+                ret = _from_remote(s, flow, now_ms);
+            }
+        }
+
+        timer_wheel_advance(&s->timers, util_now_ms());
+        _free_closed(s);
+
+        if (ret < 0 || s->dead || mux_flush_due(&s->writer, util_now_us()) < 0) {
+            ret = -1;
+            break;
+        }
+
+        if (s->draining && !_frame_missing(&s->reader)) {
+            /* park on frame boundary with nothing queued towards client */
+            if (mux_flush(&s->writer) < 0) {
+                ret = -1;
+                break;
+            }
+            quiesce_park(q);
+            s->draining = false;
+            wake.events = EPOLLIN;
+            epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, quiesce_fd(q), &wake);
+        }
+    }
+
+out:
+    for (size_t i = 0; i < MUX_SERVER_BUCKETS; i++) {
+        while (s->buckets[i]) {
+            _flow_close(s, s->buckets[i]->id);
+        }
+    }
+    _free_closed(s);
+    if (s->epoll_fd >= 0) {
+        close(s->epoll_fd);
+    }
+    log_info("mux connection closed, %lu frames in %lu writes",
+             s->writer.frames, s->writer.writes);
+    free(s);
+    membudget_release(sizeof(struct mux_server));
+
+    return ret;
+}
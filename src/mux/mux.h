@@ -0,0 +1,182 @@
+#ifndef __MUX_H__
+#define __MUX_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct quiesce;
+
+#define MUX_HEADER_SIZE      8
+#define MUX_MAX_PAYLOAD      UINT16_MAX
+#define MUX_COALESCE_BYTES   (16 * 1024)
+#define MUX_DEFAULT_DELAY_US 1000
+#define MUX_FLOW_IDLE_MS     60000
+/* idle connections exchange keepalives, silence for 3 of them is fatal */
+#define MUX_KEEPALIVE_MS         15000
+#define MUX_KEEPALIVE_TIMEOUT_MS (3 * MUX_KEEPALIVE_MS)
+/* OPEN payload: ipv4 address (4) + port (2), network order */
+#define MUX_OPEN_SIZE        6
+/* ERROR payload: icmp unreachable code (1), reserved (1), next hop mtu (2) */
+#define MUX_ERROR_SIZE       4
+
+/*
+ * Framed transport carrying many flows over one upstream tcp connection.
+ * Every frame starts with flow id (4), type (1), protocol (1) and payload
+ * length (2), all in network order. Frames are coalesced into one write
+ * until MUX_COALESCE_BYTES are queued or the oldest frame waited delay_us.
+ * On a non-blocking connection whatever socket doesn't take stays queued,
+ * writer is blocked until a flush after POLLOUT gets it out.
+ */
+
+enum mux_type
+{
+    MUX_OPEN = 1,
+    MUX_DATA = 2,
+    MUX_CLOSE = 3,
+    /* flow 0, no payload, server echoes it back */
+    MUX_KEEPALIVE = 4,
+    /* server only, flow failed or remote reported an icmp error, flow
+     * stays open unless CLOSE follows */
+    MUX_ERROR = 5,
+};
+
+struct mux_header
+{
+    uint32_t flow;
+    uint8_t type;
+    uint8_t proto;
+    uint16_t length;
+};
+
+struct mux_writer
+{
+    int fd;
+    uint32_t delay_us;
+    uint64_t first_us;
+    size_t size;
+    uint64_t frames;
+    uint64_t writes;
+    /* socket took only part of last flush, rest waits for it to drain */
+    bool blocked;
+    uint8_t buf[MUX_COALESCE_BYTES + MUX_HEADER_SIZE + MUX_MAX_PAYLOAD];
+};
+
+struct mux_reader
+{
+    int fd;
+    size_t head;
+    size_t tail;
+    uint64_t rx_ns;
+    uint8_t buf[2 * (MUX_HEADER_SIZE + MUX_MAX_PAYLOAD)];
+};
+
+/**
+ * @brief initialize frame writer
+ * @param w writer
+ * @param fd connection
+ * @param delay_us max time a frame waits for more frames, 0 writes them at
+ *        end of every event loop pass
+ */
+void mux_writer_init(struct mux_writer *w, int fd, uint32_t delay_us);
+
+/**
+ * @brief queue frame, writes queued frames once coalescing limit is hit
+ * @param w writer
+ * @param flow flow id
+ * @param type frame type
+ * @param proto flow protocol (IPPROTO_UDP / IPPROTO_TCP)
+ * @param payload frame payload
+ * @param size payload size, up to MUX_MAX_PAYLOAD
+ * @return 0 on success, -1 on failure (errno EAGAIN if blocked writer has
+ *         no room)
+ */
+int mux_write(struct mux_writer *w, uint32_t flow, uint8_t type,
+              uint8_t proto, void const *payload, size_t size);
+
+/**
+ * @brief get room for payload of next frame, so it can be received straight
+ *        into writer buffer
+ * @param w writer
+ * @return MUX_MAX_PAYLOAD bytes, valid until next call on writer, NULL if
+ *         blocked writer has no room
+ */
+uint8_t *mux_write_reserve(struct mux_writer *w);
+
+/**
+ * @brief queue frame whose payload was placed by mux_write_reserve
+ * @param w writer
+ * @param flow flow id
+ * @param type frame type
+ * @param proto flow protocol (IPPROTO_UDP / IPPROTO_TCP)
+ * @param size payload size, up to MUX_MAX_PAYLOAD
+ * @return 0 on success, also when a full socket delays frame, -1 on failure
+ */
+int mux_write_commit(struct mux_writer *w, uint32_t flow, uint8_t type,
+                     uint8_t proto, size_t size);
+
+/**
+ * @brief write every queued frame
+ * @param w writer
+ * @return 0 on success, -1 on failure (errno EAGAIN if socket left part
+ *         queued, writer is blocked then)
+ */
+int mux_flush(struct mux_writer *w);
+
+/**
+ * @brief write queued frames if oldest one reached its deadline, blocked
+ *        writer waits for mux_flush instead
+ * @param w writer
+ * @param now_us monotonic time
+ * @return 0 on success, -1 on failure
+ */
+int mux_flush_due(struct mux_writer *w, uint64_t now_us);
+
+/**
+ * @brief get time left until queued frames have to be written
+ * @param w writer
+ * @param now_us monotonic time
+ * @return milliseconds (rounded up), -1 if nothing is queued or writer is
+ *         blocked
+ */
+int mux_writer_timeout_ms(struct mux_writer const *w, uint64_t now_us);
+
+/**
+ * @brief initialize frame reader
+ * @param r reader
+ * @param fd connection
+ */
+void mux_reader_init(struct mux_reader *r, int fd);
+
+/**
+ * @brief read available bytes from connection
+ * @param r reader, rx_ns receives kernel timestamp if enabled on socket
+ * @return bytes read, 0 on close, -1 on failure
+ */
+ssize_t mux_read(struct mux_reader *r);
+
+/**
+ * @brief get next complete frame, payload points into reader buffer and
+ *        stays valid until next mux_read
+ * @param r reader
+ * @param header frame header
+ * @param payload frame payload
+ * @return 1 if frame was returned, 0 if more bytes are needed
+ */
+int mux_next(struct mux_reader *r, struct mux_header *header,
+             uint8_t **payload);
+
+/**
+ * @brief serve multiplexed connection, opens udp socket per flow and
+ *        relays until connection closes. Parks on frame boundary when
+ *        barrier is suspended, flows are not handed over and client opens
+ *        them again once next process answers with CLOSE.
+ * @param fd client connection after socks5 handshake
+ * @param delay_us coalescing delay for frames towards client
+ * @param q barrier caller registered connection with
+ * @return 0 when client closed, -1 on failure
+ */
+int mux_serve(int fd, uint32_t delay_us, struct quiesce *q);
+
+#endif /* __MUX_H__ */
@@ -0,0 +1,858 @@
+#include "mux_client.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "icmp.h"
+#include "iov.h"
+#include "log.h"
+#include "mux.h"
+#include "packet_parser.h"
+#include "probe.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "tls.h"
+#include "trace.h"
+#include "upstream.h"
+#include "util.h"
+
+#define MUX_CLIENT_HASH_SIZE (MUX_CLIENT_MAX_FLOWS * 2)
+#define MUX_CLIENT_NONE      UINT32_MAX
+#define MUX_CLIENT_TICK_MS   100
+#define MUX_CLIENT_TTL       64
+/* health probes with several upstream servers, a probe unanswered for
+ * longer than timeout (or 4 rtt) takes connection out of flow choice */
+#define MUX_CLIENT_PROBE_MS         100
+#define MUX_CLIENT_PROBE_TIMEOUT_MS 300
+
+/* reasons reported by flow_expire probe */
+enum mux_client_expiry
+{
+    MUX_CLIENT_EXPIRY_IDLE,
+    MUX_CLIENT_EXPIRY_CLOSED,
+    MUX_CLIENT_EXPIRY_RESET,
+};
+
+struct mux_client_flow
+{
+    bool used;
+    uint16_t gen;
+    size_t conn;
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+    uint64_t active_ms;
+    struct timer_wheel_timer idle;
+    uint32_t next;
+    /* sampled packet waiting for its reply, stamps of tuntap read and
+     * upstream write (0 until written) */
+    uint64_t trace_read;
+    uint64_t trace_written;
+};
+
+struct mux_client_connection
+{
+    int fd;
+    size_t index;
+    uint64_t active_ms;
+    uint64_t keepalive_writes;
+    struct timer_wheel_timer keepalive;
+    /* send time of outstanding probe, 0 if none */
+    uint64_t probe_us;
+    /* probe missed its deadline, no new flows until it's answered */
+    bool suspect;
+    struct mux_reader reader;
+    struct mux_writer writer;
+    /* sampled frame queued, leaves with first write after writes */
+    struct
+    {
+        bool pending;
+        uint32_t flow;
+        uint64_t queued;
+        uint64_t writes;
+    } trace;
+};
+
+static struct
+{
+    /* connection i belongs to server i / per_server */
+    size_t count;
+    size_t servers;
+    size_t per_server;
+    uint32_t delay_us;
+    uint32_t probe_ms;
+    /* bit masks of servers with a connection ready for new flows and with
+     * one connected at all */
+    uint32_t ready;
+    uint32_t connected;
+    struct mux_client_connection *conns[MUX_CLIENT_MAX_CONNECTIONS];
+    struct mux_client_flow *flows;
+    uint32_t *heads;
+    uint32_t free_head;
+    struct timer_wheel timers;
+    uint16_t ip_id;
+    struct
+    {
+        uint64_t opened;
+        uint64_t expired;
+        uint64_t reset;
+        uint64_t dead;
+        uint64_t missed;
+        uint64_t frames_in;
+        uint64_t dropped;
+        uint64_t errors;
+    } stats;
+} _client;
+
+static uint32_t _hash(uint32_t saddr, uint32_t daddr, uint16_t sport,
+                      uint16_t dport)
+{
+    uint32_t h = saddr * 2654435761u;
+    h ^= daddr * 2246822519u;
+    h ^= ((uint32_t)sport << 16 | dport) * 3266489917u;
+    return (h ^ (h >> 15)) & (MUX_CLIENT_HASH_SIZE - 1);
+}
+
+static uint32_t _flow_id(uint32_t slot)
+{
+    return (uint32_t)_client.flows[slot].gen << 16 | slot;
+}
+
+static struct mux_client_flow *_flow_by_id(uint32_t id)
+{
+    uint32_t slot = id & 0xffff;
+
+    if (slot >= MUX_CLIENT_MAX_FLOWS) {
+        return NULL;
+    }
+
+    struct mux_client_flow *flow = &_client.flows[slot];
+    return flow->used && flow->gen == id >> 16 ? flow : NULL;
+}
+
+static uint32_t *_flow_link(uint32_t saddr, uint32_t daddr, uint16_t sport,
+                            uint16_t dport)
+{
+    uint32_t *link = &_client.heads[_hash(saddr, daddr, sport, dport)];
+
+    while (*link != MUX_CLIENT_NONE) {
+        struct mux_client_flow const *f = &_client.flows[*link];
+        if (f->saddr == saddr && f->daddr == daddr && f->sport == sport
+            && f->dport == dport) {
+            break;
+        }
+        link = &_client.flows[*link].next;
+    }
+
+    return link;
+}
+
+static void _flow_free(uint32_t slot)
+{
+    struct mux_client_flow *flow = &_client.flows[slot];
+    uint32_t *link = _flow_link(flow->saddr, flow->daddr, flow->sport,
+                                flow->dport);
+
+    if (*link == slot) {
+        *link = flow->next;
+    }
+
+    timer_wheel_cancel(&_client.timers, &flow->idle);
+    flow->used = false;
+    flow->gen++;
+    flow->next = _client.free_head;
+    _client.free_head = slot;
+}
+
+static size_t _server(size_t index)
+{
+    return index / _client.per_server;
+}
+
+static bool _conn_ready(struct mux_client_connection const *conn)
+{
+    return conn->fd >= 0 && !conn->suspect;
+}
+
+static void _update_ready()
+{
+    _client.ready = 0;
+    _client.connected = 0;
+
+    for (size_t i = 0; i < _client.count; i++) {
+        struct mux_client_connection const *conn = _client.conns[i];
+        if (conn->fd >= 0) {
+            _client.connected |= 1u << _server(i);
+        }
+        if (_conn_ready(conn)) {
+            _client.ready |= 1u << _server(i);
+        }
+    }
+}
+
+/*
+ * server is chosen by health, connection within it by flow hash, flow
+ * stays on both until connection goes. Suspect servers still beat dropping
+ * the flow.
+ */
+static size_t _pick(uint32_t hash)
+{
+    int server = upstream_pick(_client.ready ? _client.ready
+                                             : _client.connected);
+    size_t fallback = SIZE_MAX;
+
+    if (server < 0) {
+        return SIZE_MAX;
+    }
+
+    for (size_t i = 0; i < _client.per_server; i++) {
+        size_t index = server * _client.per_server
+                       + (hash + i) % _client.per_server;
+        struct mux_client_connection const *conn = _client.conns[index];
+
+        /* a full connection only takes flows nothing else could */
+        if (_conn_ready(conn) && !conn->writer.blocked) {
+            return index;
+        }
+        if (conn->fd >= 0 && fallback == SIZE_MAX) {
+            fallback = index;
+        }
+    }
+
+    return fallback;
+}
+
+/* flows open again on next packet, wherever choice puts them then */
+static void _reset_flows(size_t index)
+{
+    for (uint32_t i = 0; i < MUX_CLIENT_MAX_FLOWS; i++) {
+        if (_client.flows[i].used && _client.flows[i].conn == index) {
+            PROBE2(flow_expire, _flow_id(i), MUX_CLIENT_EXPIRY_RESET);
+            _flow_free(i);
+            _client.stats.reset++;
+        }
+    }
+}
+
+/* flows of connection move as soon as any connection can take them */
+static void _suspect(struct mux_client_connection *conn)
+{
+    log_warn("mux connection %zu missed probe", conn->index);
+    conn->suspect = true;
+    _client.stats.missed++;
+    upstream_error(_server(conn->index));
+    _update_ready();
+
+    if (_client.ready) {
+        _reset_flows(conn->index);
+    }
+}
+
+static void _probe_answered(struct mux_client_connection *conn)
+{
+    if (!conn->probe_us) {
+        return;
+    }
+
+    upstream_rtt(_server(conn->index), util_now_us() - conn->probe_us);
+    conn->probe_us = 0;
+
+    if (conn->suspect) {
+        log_info("mux connection %zu answers probes again", conn->index);
+        conn->suspect = false;
+        _update_ready();
+    }
+}
+
+/* sampled frame left with the first write after it was queued */
+static void _trace_written(size_t index)
+{
+    struct mux_client_connection *conn = _client.conns[index];
+
+    if (!conn->trace.pending || conn->writer.writes == conn->trace.writes) {
+        return;
+    }
+    conn->trace.pending = false;
+
+    uint64_t now = trace_now();
+    trace_record(TRACE_WRITE, index, conn->trace.queued, now);
+
+    struct mux_client_flow *flow = _flow_by_id(conn->trace.flow);
+    if (flow) {
+        flow->trace_written = now;
+    }
+}
+
+/* stamp is taken before sampled frame is queued, a write it triggers
+ * right away counts as leaving with it */
+static void _trace_queued(uint32_t slot, uint64_t stamp)
+{
+    struct mux_client_flow *flow = &_client.flows[slot];
+    struct mux_client_connection *conn = _client.conns[flow->conn];
+    uint64_t now = trace_now();
+
+    trace_record(TRACE_QUEUE, flow->conn, stamp, now);
+
+    /* one sampled frame per connection at a time */
+    if (conn->trace.pending) {
+        return;
+    }
+
+    flow->trace_read = stamp;
+    flow->trace_written = 0;
+    conn->trace.pending = true;
+    conn->trace.flow = _flow_id(slot);
+    conn->trace.queued = now;
+    conn->trace.writes = conn->writer.writes;
+}
+
+/* first reply after sampled frame was written closes its trace */
+static void _trace_reply(struct mux_client_flow *flow, uint64_t read,
+                         uint64_t delivered)
+{
+    trace_record(TRACE_PROXY, flow->conn, flow->trace_written, read);
+    trace_record(TRACE_DELIVER, flow->conn, read, delivered);
+    trace_record(TRACE_TOTAL, flow->conn, flow->trace_read, delivered);
+    flow->trace_read = 0;
+    flow->trace_written = 0;
+}
+
+/* timer isn't moved per packet, it's pushed back here if still active */
+static void _flow_idle(struct timer_wheel_timer *timer, void *arg)
+{
+    struct mux_client_flow *flow = arg;
+    uint32_t slot = flow - _client.flows;
+    uint64_t idle_ms = flow->active_ms + MUX_FLOW_IDLE_MS;
+
+    if (idle_ms > util_now_ms()) {
+        timer_wheel_arm(&_client.timers, timer, idle_ms);
+        return;
+    }
+
+    struct mux_client_connection *conn = _client.conns[flow->conn];
+    if (conn->fd >= 0) {
+        mux_write(&conn->writer, _flow_id(slot), MUX_CLOSE, IPPROTO_UDP, NULL,
+                  0);
+    }
+    PROBE2(flow_expire, _flow_id(slot), MUX_CLIENT_EXPIRY_IDLE);
+    _flow_free(slot);
+    _client.stats.expired++;
+}
+
+/*
+ * probes measure rtt and keep connection alive, with a single server only
+ * idle connections are probed. Server that stays silent is dropped.
+ */
+static void _keepalive(struct timer_wheel_timer *timer, void *arg)
+{
+    struct mux_client_connection *conn = arg;
+    uint64_t now_us = util_now_us();
+    uint64_t now_ms = now_us / 1000;
+
+    if (now_ms - conn->active_ms >= MUX_KEEPALIVE_TIMEOUT_MS) {
+        /* owner sees connection close and reconnects */
+        log_warn("mux server silent for %u ms", MUX_KEEPALIVE_TIMEOUT_MS);
+        shutdown(conn->fd, SHUT_RDWR);
+        _client.stats.dead++;
+        return;
+    }
+
+    if (conn->probe_us) {
+        uint64_t timeout_us = 4ULL * upstream_rtt_us(_server(conn->index));
+        if (timeout_us < MUX_CLIENT_PROBE_TIMEOUT_MS * 1000ULL) {
+            timeout_us = MUX_CLIENT_PROBE_TIMEOUT_MS * 1000ULL;
+        }
+        if (!conn->suspect && now_us - conn->probe_us >= timeout_us) {
+            _suspect(conn);
+        }
+    }
+    else if (_client.servers > 1
+             || conn->writer.writes == conn->keepalive_writes) {
+        mux_write(&conn->writer, 0, MUX_KEEPALIVE, 0, NULL, 0);
+        mux_flush(&conn->writer);
+        conn->probe_us = now_us;
+    }
+    conn->keepalive_writes = conn->writer.writes;
+
+    timer_wheel_arm(&_client.timers, timer, now_ms + _client.probe_ms);
+}
+
+static void _mux_client_report()
+{
+    uint64_t frames = 0;
+    uint64_t writes = 0;
+    size_t active = 0;
+
+    for (size_t i = 0; i < _client.count; i++) {
+        frames += _client.conns[i]->writer.frames;
+        writes += _client.conns[i]->writer.writes;
+    }
+    for (size_t i = 0; i < MUX_CLIENT_MAX_FLOWS; i++) {
+        active += _client.flows[i].used;
+    }
+
+    log_info("mux: %zu connections to %zu servers (%lu dead, %lu missed "
+             "probes), flows %zu active (%lu opened, %lu expired, %lu reset), "
+             "frames out %lu in %lu writes, in %lu, dropped %lu, errors %lu",
+             _client.count, _client.servers, _client.stats.dead,
+             _client.stats.missed, active, _client.stats.opened,
+             _client.stats.expired, _client.stats.reset, frames, writes,
+             _client.stats.frames_in, _client.stats.dropped,
+             _client.stats.errors);
+}
+
+int mux_client_init(size_t servers, size_t count, uint32_t delay_us)
+{
+    if (!servers || servers > UPSTREAM_MAX_SERVERS || !count
+        || servers * count > MUX_CLIENT_MAX_CONNECTIONS) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    _client.count = servers * count;
+    _client.servers = servers;
+    _client.per_server = count;
+    _client.delay_us = delay_us;
+    _client.probe_ms = servers > 1 ? MUX_CLIENT_PROBE_MS : MUX_KEEPALIVE_MS;
+    timer_wheel_init(&_client.timers, MUX_CLIENT_TICK_MS, util_now_ms());
+    _client.flows = calloc(MUX_CLIENT_MAX_FLOWS, sizeof(*_client.flows));
+    _client.heads = malloc(MUX_CLIENT_HASH_SIZE * sizeof(*_client.heads));
+    if (!_client.flows || !_client.heads) {
+        mux_client_deinit();
+        errno = -ENOMEM;
+        return -1;
+    }
+
+    for (size_t i = 0; i < _client.count; i++) {
+        _client.conns[i] = malloc(sizeof(*_client.conns[i]));
+        if (!_client.conns[i]) {
+            mux_client_deinit();
+            errno = -ENOMEM;
+            return -1;
+        }
+        _client.conns[i]->fd = -1;
+        _client.conns[i]->index = i;
+        timer_wheel_timer_init(&_client.conns[i]->keepalive, _keepalive,
+                               _client.conns[i]);
+    }
+
+    memset(_client.heads, 0xff, MUX_CLIENT_HASH_SIZE * sizeof(*_client.heads));
+    for (uint32_t i = 0; i < MUX_CLIENT_MAX_FLOWS; i++) {
+        _client.flows[i].next = i + 1 < MUX_CLIENT_MAX_FLOWS
+                                    ? i + 1
+                                    : MUX_CLIENT_NONE;
+        timer_wheel_timer_init(&_client.flows[i].idle, _flow_idle,
+                               &_client.flows[i]);
+    }
+    _client.free_head = 0;
+
+    stats_register(_mux_client_report);
+
+    return 0;
+}
+
+void mux_client_deinit()
+{
+    for (size_t i = 0; i < MUX_CLIENT_MAX_CONNECTIONS; i++) {
+        free(_client.conns[i]);
+        _client.conns[i] = NULL;
+    }
+
+    free(_client.flows);
+    free(_client.heads);
+    _client.flows = NULL;
+    _client.heads = NULL;
+    _client.count = 0;
+    _client.ready = 0;
+    _client.connected = 0;
+}
+
+void mux_client_set_connection(size_t index, int fd)
+{
+    struct mux_client_connection *conn = _client.conns[index];
+
+    _reset_flows(index);
+
+    conn->fd = fd;
+    conn->active_ms = util_now_ms();
+    mux_reader_init(&conn->reader, fd);
+    mux_writer_init(&conn->writer, fd, _client.delay_us);
+    conn->keepalive_writes = 0;
+    conn->probe_us = 0;
+    conn->suspect = false;
+    conn->trace.pending = false;
+
+    if (fd >= 0) {
+        timer_wheel_arm(&_client.timers, &conn->keepalive,
+                        conn->active_ms + _client.probe_ms);
+    }
+    else {
+        timer_wheel_cancel(&_client.timers, &conn->keepalive);
+    }
+    _update_ready();
+}
+
+int mux_client_send(uint8_t const *buf, size_t size, uint64_t stamp)
+{
+    struct iphdr const *ip = (struct iphdr const *)buf;
+    size_t ihl = ip->ihl * 4;
+
+    if (size < sizeof(*ip) || ip->version != 4 || ip->protocol != IPPROTO_UDP
+        || size < ihl + sizeof(struct udphdr)) {
+        _client.stats.dropped++;
+        errno = -EPROTONOSUPPORT;
+        return -1;
+    }
+
+    struct udphdr const *udp = (struct udphdr const *)(buf + ihl);
+    size_t length = ntohs(udp->len);
+    if (length < sizeof(*udp) || ihl + length > size) {
+        _client.stats.dropped++;
+        errno = -EINVAL;
+        return -1;
+    }
+
+    uint32_t *link = _flow_link(ip->saddr, ip->daddr, udp->source, udp->dest);
+    uint32_t slot = *link;
+
+    if (slot == MUX_CLIENT_NONE) {
+        size_t index = _pick(_hash(ip->saddr, ip->daddr, udp->source,
+                                   udp->dest));
+        if (index == SIZE_MAX) {
+            _client.stats.dropped++;
+            errno = -ENOTCONN;
+            return -1;
+        }
+
+        slot = _client.free_head;
+        if (slot == MUX_CLIENT_NONE) {
+            _client.stats.dropped++;
+            errno = -ENOSPC;
+            return -1;
+        }
+
+        struct mux_client_flow *flow = &_client.flows[slot];
+        _client.free_head = flow->next;
+        flow->used = true;
+        flow->saddr = ip->saddr;
+        flow->daddr = ip->daddr;
+        flow->sport = udp->source;
+        flow->dport = udp->dest;
+        flow->conn = index;
+        flow->next = *link;
+        *link = slot;
+        flow->trace_read = 0;
+        flow->trace_written = 0;
+        flow->active_ms = util_now_ms();
+        timer_wheel_arm(&_client.timers, &flow->idle,
+                        flow->active_ms + MUX_FLOW_IDLE_MS);
+
+        uint8_t open[MUX_OPEN_SIZE];
+        memcpy(open, &flow->daddr, 4);
+        memcpy(open + 4, &flow->dport, 2);
+
+        struct mux_client_connection *conn = _client.conns[flow->conn];
+        if (mux_write(&conn->writer, _flow_id(slot), MUX_OPEN, IPPROTO_UDP,
+                      open, sizeof(open))
+            < 0) {
+            _flow_free(slot);
+            _client.stats.dropped++;
+            errno = conn->writer.blocked ? -ENOBUFS : -ENOTCONN;
+            return -1;
+        }
+        _client.stats.opened++;
+        PROBE6(flow_create, _flow_id(slot), flow->saddr, flow->daddr,
+               ntohs(flow->sport), ntohs(flow->dport), flow->conn);
+    }
+
+    struct mux_client_flow *flow = &_client.flows[slot];
+    struct mux_client_connection *conn = _client.conns[flow->conn];
+
+    flow->active_ms = util_now_ms();
+
+    if (stamp && conn->fd >= 0) {
+        _trace_queued(slot, stamp);
+    }
+
+    if (conn->fd < 0
+        || mux_write(&conn->writer, _flow_id(slot), MUX_DATA, IPPROTO_UDP,
+                     buf + ihl + sizeof(*udp), length - sizeof(*udp))
+               < 0) {
+        _client.stats.dropped++;
+        /* connection that is only full doesn't make flow unreachable */
+        errno = conn->fd >= 0 && conn->writer.blocked ? -ENOBUFS : -ENOTCONN;
+        return -1;
+    }
+    _trace_written(flow->conn);
+    PROBE2(flow_send, _flow_id(slot), length - sizeof(*udp));
+
+    return 0;
+}
+
+bool mux_client_writable(uint8_t const *buf, size_t size)
+{
+    struct iphdr const *ip = (struct iphdr const *)buf;
+    size_t ihl = ip->ihl * 4;
+
+    if (size < sizeof(*ip) || ip->version != 4 || ip->protocol != IPPROTO_UDP
+        || size < ihl + sizeof(struct udphdr)) {
+        return true;
+    }
+
+    struct udphdr const *udp = (struct udphdr const *)(buf + ihl);
+    uint32_t slot = *_flow_link(ip->saddr, ip->daddr, udp->source, udp->dest);
+    if (slot == MUX_CLIENT_NONE) {
+        return true;
+    }
+
+    return !mux_client_blocked(_client.flows[slot].conn);
+}
+
+/* reply travels back from flow destination to flow source, payload stays
+ * in frame reader buffer */
+static void _build_packet(struct iov_msg *msg,
+                          struct mux_client_flow const *flow,
+                          uint8_t const *payload, size_t size)
+{
+    struct iphdr *ip = NULL;
+    struct udphdr *udp = NULL;
+    size_t total = sizeof(*ip) + sizeof(*udp) + size;
+
+    iov_msg_init(msg);
+    ip = iov_msg_header(msg, sizeof(*ip) + sizeof(*udp));
+    udp = (struct udphdr *)(ip + 1);
+    iov_msg_append(msg, payload, size);
+
+    memset(ip, 0, sizeof(*ip));
+    ip->version = 4;
+    ip->ihl = sizeof(*ip) / 4;
+    ip->tot_len = htons(total);
+    ip->id = htons(_client.ip_id++);
+    ip->ttl = MUX_CLIENT_TTL;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr = flow->daddr;
+    ip->daddr = flow->saddr;
+    ip->check = ip_checksum(ip, sizeof(*ip));
+
+    /* zero udp checksum is valid over ipv4 */
+    udp->source = flow->dport;
+    udp->dest = flow->sport;
+    udp->len = htons(sizeof(*udp) + size);
+    udp->check = 0;
+}
+
+/* server only reports flow, packet icmp quotes is rebuilt from it */
+static bool _build_error(struct iov_msg *msg,
+                         struct mux_client_flow const *flow,
+                         uint8_t const *payload, size_t size)
+{
+    uint8_t quote[sizeof(struct iphdr) + sizeof(struct udphdr)] = { 0 };
+    struct iphdr *ip = (struct iphdr *)quote;
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+    uint16_t mtu = 0;
+
+    if (size < MUX_ERROR_SIZE) {
+        return false;
+    }
+    memcpy(&mtu, payload + 2, sizeof(mtu));
+
+    ip->version = 4;
+    ip->ihl = sizeof(*ip) / 4;
+    ip->tot_len = htons(sizeof(quote));
+    ip->ttl = MUX_CLIENT_TTL;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr = flow->saddr;
+    ip->daddr = flow->daddr;
+    ip->check = ip_checksum(ip, sizeof(*ip));
+    udp->source = flow->sport;
+    udp->dest = flow->dport;
+    udp->len = htons(sizeof(*udp));
+
+    return icmp_unreachable(msg, flow->daddr, payload[0], ntohs(mtu), quote,
+                            sizeof(quote));
+}
+
+static int _process(struct mux_client_connection *conn,
+                    mux_client_deliver_fn deliver, void *arg)
+{
+    struct mux_header header;
+    uint8_t *payload = NULL;
+    int delivered = 0;
+
+    while (mux_next(&conn->reader, &header, &payload)) {
+        _client.stats.frames_in++;
+
+        if (header.type == MUX_KEEPALIVE) {
+            _probe_answered(conn);
+            continue;
+        }
+
+        struct mux_client_flow *flow = _flow_by_id(header.flow);
+        if (!flow) {
+            continue;
+        }
+
+        switch (header.type) {
+            case MUX_DATA: {
+                struct iov_msg msg;
+                uint64_t read = flow->trace_written ? trace_now() : 0;
+                PROBE2(flow_reply, header.flow, header.length);
+                _build_packet(&msg, flow, payload, header.length);
+                flow->active_ms = util_now_ms();
+                if (deliver(&msg, arg) == 0) {
+                    delivered++;
+                }
+                if (read) {
+                    _trace_reply(flow, read, trace_now());
+                }
+                break;
+            }
+            case MUX_ERROR: {
+                struct iov_msg msg;
+                _client.stats.errors++;
+                if (_build_error(&msg, flow, payload, header.length)) {
+                    deliver(&msg, arg);
+                }
+                break;
+            }
+            case MUX_CLOSE:
+                PROBE2(flow_expire, header.flow, MUX_CLIENT_EXPIRY_CLOSED);
+                _flow_free(header.flow & 0xffff);
+                break;
+            default:
+                break;
+        }
+    }
+
+    return delivered;
+}
+
+int mux_client_receive(size_t index, mux_client_deliver_fn deliver,
+                       void *arg, uint64_t *rx_ns)
+{
+    struct mux_client_connection *conn = _client.conns[index];
+    int delivered = 0;
+
+    /* records decrypted in userspace may hold more than one read took */
+    do {
+        ssize_t bytes = mux_read(&conn->reader);
+        *rx_ns = conn->reader.rx_ns;
+
+        if (bytes == 0 || (bytes < 0 && errno != EAGAIN)) {
+            return -1;
+        }
+        conn->active_ms = util_now_ms();
+
+        delivered += _process(conn, deliver, arg);
+    } while (tls_pending(conn->fd));
+
+    return delivered;
+}
+
+/* queued frames leave before connection is handed over or replaced */
+static int _flush_wait(struct mux_client_connection *conn,
+                       uint64_t deadline_ms)
+{
+    while (mux_flush(&conn->writer) < 0) {
+        uint64_t now_ms = util_now_ms();
+        struct pollfd pfd = { .fd = conn->fd, .events = POLLOUT };
+
+        if (!conn->writer.blocked || now_ms >= deadline_ms
+            || poll(&pfd, 1, deadline_ms - now_ms) <= 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int mux_client_drain(mux_client_deliver_fn deliver, void *arg,
+                     int timeout_ms)
+{
+    uint64_t deadline_ms = util_now_ms() + timeout_ms;
+
+    for (size_t i = 0; i < _client.count; i++) {
+        struct mux_client_connection *conn = _client.conns[i];
+
+        if (conn->fd < 0 || _flush_wait(conn, deadline_ms) < 0) {
+            continue;
+        }
+
+        while (conn->reader.head != conn->reader.tail) {
+            uint64_t now_ms = util_now_ms();
+            struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+
+            if (!tls_pending(conn->fd)
+                && (now_ms >= deadline_ms
+                    || poll(&pfd, 1, deadline_ms - now_ms) <= 0)) {
+                return -1;
+            }
+
+            ssize_t bytes = mux_read(&conn->reader);
+            if (bytes == 0 || (bytes < 0 && errno != EAGAIN)) {
+                return -1;
+            }
+            _process(conn, deliver, arg);
+        }
+    }
+
+    return 0;
+}
+
+int mux_client_timeout_ms(uint64_t now_us)
+{
+    int timeout = timer_wheel_timeout_ms(&_client.timers, now_us / 1000);
+
+    for (size_t i = 0; i < _client.count; i++) {
+        int wait_ms = mux_writer_timeout_ms(&_client.conns[i]->writer, now_us);
+        if (wait_ms >= 0 && (timeout < 0 || wait_ms < timeout)) {
+            timeout = wait_ms;
+        }
+    }
+
+    return timeout;
+}
+
+int mux_client_tick(uint64_t now_us)
+{
+    int ret = 0;
+
+    timer_wheel_advance(&_client.timers, now_us / 1000);
+
+    for (size_t i = 0; i < _client.count; i++) {
+        struct mux_client_connection *conn = _client.conns[i];
+        if (conn->fd >= 0 && mux_flush_due(&conn->writer, now_us) < 0
+            && !conn->writer.blocked) {
+            ret = -1;
+        }
+        _trace_written(i);
+    }
+
+    return ret;
+}
+
+bool mux_client_blocked(size_t index)
+{
+    struct mux_client_connection const *conn = _client.conns[index];
+
+    return conn->fd >= 0 && conn->writer.blocked;
+}
+
+int mux_client_flush(size_t index)
+{
+    struct mux_client_connection *conn = _client.conns[index];
+
+    if (conn->fd < 0 || mux_flush(&conn->writer) == 0) {
+        _trace_written(index);
+        return 0;
+    }
+
+    return conn->writer.blocked ? 0 : -1;
+}
@@ -0,0 +1,130 @@
+#ifndef __MUX_CLIENT_H__
+#define __MUX_CLIENT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MUX_CLIENT_MAX_CONNECTIONS 16
+#define MUX_CLIENT_MAX_FLOWS       4096
+
+struct iov_msg;
+
+/*
+ * tuntap side of multiplexed transport. UDP packets read from tuntap are
+ * mapped to flows by their 4-tuple, flows are spread over a few upstream
+ * connections and replies are turned back into ipv4 / udp packets, errors
+ * server reports for a flow into icmp unreachable messages. With several
+ * upstream servers a new flow picks its server by health (see upstream.h)
+ * and keeps it, every connection is probed for rtt and one whose probe
+ * goes unanswered hands its flows to the others.
+ */
+
+/**
+ * @brief callback receiving every ip packet rebuilt from a reply frame
+ * @param msg packet, headers in scratch area and payload in frame reader
+ *        buffer, valid until callback returns
+ * @param arg user argument
+ * @return 0 on success, -1 on failure
+ */
+typedef int (*mux_client_deliver_fn)(struct iov_msg const *msg, void *arg);
+
+/**
+ * @brief initialize flow table and connection state
+ * @param servers number of upstream servers
+ * @param count number of connections per server, connection index divided
+ *        by count is its server
+ * @param delay_us coalescing delay for frames towards server
+ * @return 0 on success, -errno on failure
+ */
+int mux_client_init(size_t servers, size_t count, uint32_t delay_us);
+
+/**
+ * @brief release flow table and connection state
+ */
+void mux_client_deinit();
+
+/**
+ * @brief attach (or replace after reconnect) upstream connection, flows of
+ *        replaced connection are forgotten and open again on next packet
+ * @param index connection index
+ * @param fd connection after socks5 mux handshake, -1 while disconnected
+ */
+void mux_client_set_connection(size_t index, int fd);
+
+/**
+ * @brief send ipv4 / udp packet read from tuntap
+ * @param buf packet buffer
+ * @param size packet size
+ * @param stamp trace timestamp of tuntap read, 0 if packet isn't traced
+ * @return 0 on success, -1 if packet isn't udp (-EPROTONOSUPPORT), no
+ *         connection could take it (-ENOTCONN), its connection is blocked
+ *         and full (-ENOBUFS) or flow table is full
+ */
+int mux_client_send(uint8_t const *buf, size_t size, uint64_t stamp);
+
+/**
+ * @brief check if packet could be queued on its flow's connection now, so
+ *        packets of a blocked connection wait in fair queue while other
+ *        flows go on
+ * @param buf packet buffer
+ * @param size packet size
+ * @return false if packet's flow sits on a blocked connection, true
+ *         otherwise, also for new flows and packets send would reject
+ */
+bool mux_client_writable(uint8_t const *buf, size_t size);
+
+/**
+ * @brief read reply frames from connection
+ * @param index connection index
+ * @param deliver packet callback
+ * @param arg callback argument
+ * @param rx_ns kernel receive timestamp of read, 0 if unknown
+ * @return number of delivered packets, -1 if connection closed
+ */
+int mux_client_receive(size_t index, mux_client_deliver_fn deliver,
+                       void *arg, uint64_t *rx_ns);
+
+/**
+ * @brief read until no connection holds part of a frame, so connections
+ *        can be handed over on a frame boundary
+ * @param deliver packet callback
+ * @param arg callback argument
+ * @param timeout_ms max time to wait for rest of frame
+ * @return 0 on success, -1 on timeout or failure
+ */
+int mux_client_drain(mux_client_deliver_fn deliver, void *arg,
+                     int timeout_ms);
+
+/**
+ * @brief get time until next coalescing deadline or timer
+ * @param now_us monotonic time
+ * @return milliseconds, -1 if nothing is pending
+ */
+int mux_client_timeout_ms(uint64_t now_us);
+
+/**
+ * @brief write frames whose deadline passed, expire idle flows and send
+ *        probes, silent connections are shut down
+ * @param now_us monotonic time
+ * @return 0 on success, -1 if a connection failed
+ */
+int mux_client_tick(uint64_t now_us);
+
+/**
+ * @brief check if connection left frames queued because socket was full
+ * @param index connection index
+ * @return true if connection waits for POLLOUT
+ */
+bool mux_client_blocked(size_t index);
+
+/**
+ * @brief write frames left queued, call once blocked connection polls
+ *        writable
+ * @param index connection index
+ * @return 0 on success, also if socket is still full, -1 if connection
+ *         failed
+ */
+int mux_client_flush(size_t index);
+
+#endif /* __MUX_CLIENT_H__ */
@@ -0,0 +1,491 @@
+#include "netlink.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/fib_rules.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+
+#define NETLINK_BATCH_SIZE 4096
+
+struct netlink_batch
+{
+    uint8_t buf[NETLINK_BATCH_SIZE];
+    size_t size;
+    uint32_t seq;
+    int count;
+};
+
+struct netlink_request
+{
+    unsigned int ifindex;
+    struct in_addr addr;
+    uint8_t prefix;
+    uint16_t mtu;
+};
+
+static struct nlmsghdr *_msg_begin(struct netlink_batch *batch, uint16_t type,
+                                   uint16_t flags, void const *body,
+                                   size_t body_size)
+{
+    size_t size = NLMSG_LENGTH(body_size);
+    if (batch->size + NLMSG_ALIGN(size) > sizeof(batch->buf)) {
+        return NULL;
+    }
+
+    struct nlmsghdr *nlh = (struct nlmsghdr *)(batch->buf + batch->size);
+    memset(nlh, 0, NLMSG_ALIGN(size));
+    nlh->nlmsg_len = size;
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nlh->nlmsg_seq = ++batch->seq;
+    memcpy(NLMSG_DATA(nlh), body, body_size);
+
+    return nlh;
+}
+
+static int _msg_attr(struct netlink_batch *batch, struct nlmsghdr *nlh,
+                     uint16_t type, void const *data, size_t size)
+{
+    if (!nlh) {
+        return -1;
+    }
+
+    size_t offset = NLMSG_ALIGN(nlh->nlmsg_len);
+    if ((uint8_t *)nlh - batch->buf + offset + RTA_SPACE(size)
+        > sizeof(batch->buf)) {
+        return -1;
+    }
+
+    struct rtattr *rta = (struct rtattr *)((uint8_t *)nlh + offset);
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(size);
+    memcpy(RTA_DATA(rta), data, size);
+    nlh->nlmsg_len = offset + RTA_ALIGN(rta->rta_len);
+
+    return 0;
+}
+
+static int _msg_attr_u32(struct netlink_batch *batch, struct nlmsghdr *nlh,
+                         uint16_t type, uint32_t value)
+{
+    return _msg_attr(batch, nlh, type, &value, sizeof(value));
+}
+
+static int _msg_end(struct netlink_batch *batch, struct nlmsghdr *nlh)
+{
+    if (!nlh) {
+        return -1;
+    }
+
+    batch->size += NLMSG_ALIGN(nlh->nlmsg_len);
+    batch->count++;
+
+    return 0;
+}
+
+static bool _is_missing(int err)
+{
+    return err == ENOENT || err == ESRCH || err == ENODEV
+           || err == EADDRNOTAVAIL;
+}
+
+static int _commit(struct netlink_batch *batch, bool ignore_missing)
+{
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        log_error("netlink socket failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+    if (sendto(fd, batch->buf, batch->size, 0, (struct sockaddr *)&kernel,
+               sizeof(kernel))
+        < 0) {
+        log_error("netlink send failed! (%d / %s)", errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    int acks = 0;
+    int err = 0;
+    uint8_t reply[NETLINK_BATCH_SIZE];
+
+    while (acks < batch->count) {
+        ssize_t size = recv(fd, reply, sizeof(reply), 0);
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            log_error("netlink recv failed! (%d / %s)", errno,
+                      strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        struct nlmsghdr *nlh = (struct nlmsghdr *)reply;
+        for (; NLMSG_OK(nlh, size); nlh = NLMSG_NEXT(nlh, size)) {
+            if (nlh->nlmsg_type != NLMSG_ERROR) {
+                continue;
+            }
+            struct nlmsgerr *nle = NLMSG_DATA(nlh);
+            acks++;
+            if (nle->error == 0
+                || (ignore_missing && _is_missing(-nle->error))) {
+                continue;
+            }
+            log_error("netlink request %u failed! (%d / %s)", nlh->nlmsg_seq,
+                      -nle->error, strerror(-nle->error));
+            err = err ? err : -nle->error;
+        }
+    }
+
+    close(fd);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _add_link(struct netlink_batch *batch,
+                     struct netlink_request const *req, bool up)
+{
+    struct ifinfomsg ifi = {
+        .ifi_family = AF_UNSPEC,
+        .ifi_index = req->ifindex,
+        .ifi_flags = up ? IFF_UP : 0,
+        .ifi_change = IFF_UP,
+    };
+
+    struct nlmsghdr *nlh = _msg_begin(batch, RTM_NEWLINK, 0, &ifi,
+                                      sizeof(ifi));
+    if (req->mtu && _msg_attr_u32(batch, nlh, IFLA_MTU, req->mtu) < 0) {
+        return -1;
+    }
+
+    return _msg_end(batch, nlh);
+}
+
+static int _add_addr(struct netlink_batch *batch,
+                     struct netlink_request const *req, uint16_t type)
+{
+    struct ifaddrmsg ifa = {
+        .ifa_family = AF_INET,
+        .ifa_prefixlen = req->prefix,
+        .ifa_scope = RT_SCOPE_UNIVERSE,
+        .ifa_index = req->ifindex,
+    };
+
+    uint16_t flags = type == RTM_NEWADDR ? NLM_F_CREATE | NLM_F_REPLACE : 0;
+    struct nlmsghdr *nlh = _msg_begin(batch, type, flags, &ifa, sizeof(ifa));
+    if (_msg_attr(batch, nlh, IFA_LOCAL, &req->addr, sizeof(req->addr)) < 0
+        || _msg_attr(batch, nlh, IFA_ADDRESS, &req->addr, sizeof(req->addr))
+               < 0) {
+        return -1;
+    }
+
+    return _msg_end(batch, nlh);
+}
+
+static int _add_route(struct netlink_batch *batch,
+                      struct netlink_request const *req, uint16_t type)
+{
+    struct rtmsg rtm = {
+        .rtm_family = AF_INET,
+        .rtm_table = RT_TABLE_UNSPEC,
+        .rtm_protocol = RTPROT_BOOT,
+        .rtm_scope = RT_SCOPE_LINK,
+        .rtm_type = RTN_UNICAST,
+    };
+
+    uint16_t flags = type == RTM_NEWROUTE ? NLM_F_CREATE | NLM_F_REPLACE : 0;
+    struct nlmsghdr *nlh = _msg_begin(batch, type, flags, &rtm, sizeof(rtm));
+    if (_msg_attr_u32(batch, nlh, RTA_TABLE, NETLINK_ROUTE_TABLE) < 0
+        || _msg_attr_u32(batch, nlh, RTA_OIF, req->ifindex) < 0) {
+        return -1;
+    }
+
+    return _msg_end(batch, nlh);
+}
+
+/* one rule per steering rule, matching protocol / destination ports go to
+ * the tuntap table, the rest never leaves kernel fast path */
+static int _add_steer(struct netlink_batch *batch,
+                      struct netlink_tun_config const *config)
+{
+    uint16_t flags = NLM_F_CREATE | NLM_F_EXCL;
+    struct fib_rule_hdr frh = {
+        .family = AF_INET,
+        .action = FR_ACT_TO_TBL,
+    };
+    struct nlmsghdr *nlh = NULL;
+
+    for (size_t i = 0; i < config->steer_count; i++) {
+        struct config_steer_rule const *rule = &config->steer[i];
+        struct fib_rule_port_range range = { rule->first, rule->last };
+
+        nlh = _msg_begin(batch, RTM_NEWRULE, flags, &frh, sizeof(frh));
+        if (_msg_attr_u32(batch, nlh, FRA_PRIORITY,
+                          NETLINK_RULE_PRIORITY + 2 + i)
+                < 0
+            || _msg_attr_u32(batch, nlh, FRA_TABLE, NETLINK_ROUTE_TABLE) < 0
+            || (rule->proto
+                && _msg_attr(batch, nlh, FRA_IP_PROTO, &rule->proto,
+                             sizeof(rule->proto))
+                       < 0)
+            || ((rule->first || rule->last != UINT16_MAX)
+                && _msg_attr(batch, nlh, FRA_DPORT_RANGE, &range,
+                             sizeof(range))
+                       < 0)
+            || _msg_end(batch, nlh) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * rule 1: lookup main but ignore its default route, keeps local subnets
+ * rule 2: sockets carrying our fwmark resolve in main table
+ * rule 3+: steering rules
+ */
+static int _add_rules(struct netlink_batch *batch,
+                      struct netlink_tun_config const *config)
+{
+    uint16_t flags = NLM_F_CREATE | NLM_F_EXCL;
+    struct fib_rule_hdr frh = {
+        .family = AF_INET,
+        .action = FR_ACT_TO_TBL,
+    };
+
+    struct nlmsghdr *nlh = _msg_begin(batch, RTM_NEWRULE, flags, &frh,
+                                      sizeof(frh));
+    if (_msg_attr_u32(batch, nlh, FRA_PRIORITY, NETLINK_RULE_PRIORITY) < 0
+        || _msg_attr_u32(batch, nlh, FRA_TABLE, RT_TABLE_MAIN) < 0
+        || _msg_attr_u32(batch, nlh, FRA_SUPPRESS_PREFIXLEN, 0) < 0
+        || _msg_end(batch, nlh) < 0) {
+        return -1;
+    }
+
+    nlh = _msg_begin(batch, RTM_NEWRULE, flags, &frh, sizeof(frh));
+    if (_msg_attr_u32(batch, nlh, FRA_PRIORITY, NETLINK_RULE_PRIORITY + 1) < 0
+        || _msg_attr_u32(batch, nlh, FRA_FWMARK, NETLINK_FWMARK) < 0
+        || _msg_attr_u32(batch, nlh, FRA_FWMASK, NETLINK_FWMARK) < 0
+        || _msg_attr_u32(batch, nlh, FRA_TABLE, RT_TABLE_MAIN) < 0
+        || _msg_end(batch, nlh) < 0) {
+        return -1;
+    }
+
+    return _add_steer(batch, config);
+}
+
+/* by priority only, also removes rules of instances steering differently,
+ * first 2 leaves the two base rules alone */
+static int _del_rules(struct netlink_batch *batch, uint32_t first)
+{
+    struct fib_rule_hdr frh = { .family = AF_INET };
+
+    for (uint32_t i = first; i < 2 + CONFIG_MAX_STEER; i++) {
+        struct nlmsghdr *nlh = _msg_begin(batch, RTM_DELRULE, 0, &frh,
+                                          sizeof(frh));
+        if (_msg_attr_u32(batch, nlh, FRA_PRIORITY, NETLINK_RULE_PRIORITY + i)
+                < 0
+            || _msg_end(batch, nlh) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int _request_init(struct netlink_tun_config const *config,
+                         struct netlink_request *req)
+{
+    struct in_addr netmask = { 0 };
+
+    if (!config || !config->ifname || !config->addr || !config->netmask
+        || inet_pton(AF_INET, config->addr, &req->addr) != 1
+        || inet_pton(AF_INET, config->netmask, &netmask) != 1) {
+        errno = -EINVAL;
+        log_error("netlink config invalid! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    req->ifindex = if_nametoindex(config->ifname);
+    if (!req->ifindex) {
+        log_error("netlink no interface %s! (%d / %s)", config->ifname, errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    req->prefix = __builtin_popcount(netmask.s_addr);
+    req->mtu = config->mtu;
+
+    return 0;
+}
+
+static int _teardown(struct netlink_request const *req)
+{
+    struct netlink_batch batch = { 0 };
+
+    if (_del_rules(&batch, 0) < 0
+        || _add_route(&batch, req, RTM_DELROUTE) < 0
+        || _add_addr(&batch, req, RTM_DELADDR) < 0
+        || _add_link(&batch, req, false) < 0) {
+        errno = -ENOBUFS;
+        log_error("netlink teardown batch overflow! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    return _commit(&batch, true);
+}
+
+int netlink_tun_setup(struct netlink_tun_config const *config)
+{
+    struct netlink_request req = { 0 };
+    struct netlink_batch batch = { 0 };
+
+    if (_request_init(config, &req) < 0) {
+        return -1;
+    }
+
+    /* stale rules from a crashed instance would be duplicated */
+    _teardown(&req);
+
+    if (_add_link(&batch, &req, true) < 0
+        || _add_addr(&batch, &req, RTM_NEWADDR) < 0
+        || _add_route(&batch, &req, RTM_NEWROUTE) < 0
+        || _add_rules(&batch, config) < 0) {
+        errno = -ENOBUFS;
+        log_error("netlink setup batch overflow! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    if (_commit(&batch, false) < 0) {
+        int err = errno;
+        _teardown(&req);
+        errno = err;
+        return -1;
+    }
+
+    log_info("%s up: %s/%u, mtu %u, table %u, fwmark 0x%x", config->ifname,
+             config->addr, req.prefix, req.mtu, NETLINK_ROUTE_TABLE,
+             NETLINK_FWMARK);
+    for (size_t i = 0; i < config->steer_count; i++) {
+        struct config_steer_rule const *rule = &config->steer[i];
+        log_info("steering %s ports %u-%u into %s",
+                 rule->proto ? "udp" : "all", rule->first, rule->last,
+                 config->ifname);
+    }
+
+    return 0;
+}
+
+int netlink_tun_teardown(struct netlink_tun_config const *config)
+{
+    struct netlink_request req = { 0 };
+
+    if (_request_init(config, &req) < 0) {
+        return -1;
+    }
+
+    return _teardown(&req);
+}
+
+int netlink_set_mtu(char const *ifname, uint16_t mtu)
+{
+    struct netlink_batch batch = { 0 };
+    struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC };
+
+    ifi.ifi_index = if_nametoindex(ifname);
+    if (!ifi.ifi_index) {
+        log_error("netlink no interface %s! (%d / %s)", ifname, errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    struct nlmsghdr *nlh = _msg_begin(&batch, RTM_NEWLINK, 0, &ifi,
+                                      sizeof(ifi));
+    if (_msg_attr_u32(&batch, nlh, IFLA_MTU, mtu) < 0
+        || _msg_end(&batch, nlh) < 0) {
+        return -1;
+    }
+
+    return _commit(&batch, false);
+}
+
+int netlink_steer_apply(struct netlink_tun_config const *config)
+{
+    struct netlink_batch batch = { 0 };
+
+    /* one batch, packets see old rules or new ones for microseconds only */
+    if (_del_rules(&batch, 2) < 0 || _add_steer(&batch, config) < 0) {
+        errno = -ENOBUFS;
+        log_error("netlink steer batch overflow! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    /* missing rules of a shorter list are fine */
+    if (_commit(&batch, true) < 0) {
+        return -1;
+    }
+
+    log_info("%s steering %zu rules", config->ifname, config->steer_count);
+
+    return 0;
+}
+
+int netlink_tun_set_addr(struct netlink_tun_config const *old,
+                         struct netlink_tun_config const *next)
+{
+    struct netlink_request old_req = { 0 };
+    struct netlink_request next_req = { 0 };
+    struct netlink_batch batch = { 0 };
+
+    if (_request_init(old, &old_req) < 0 || _request_init(next, &next_req) < 0) {
+        return -1;
+    }
+
+    /* default route is bound to interface, not to its address */
+    if (_add_addr(&batch, &old_req, RTM_DELADDR) < 0
+        || _add_addr(&batch, &next_req, RTM_NEWADDR) < 0) {
+        errno = -ENOBUFS;
+        return -1;
+    }
+
+    if (_commit(&batch, true) < 0) {
+        return -1;
+    }
+
+    log_info("%s address %s/%u", next->ifname, next->addr, next_req.prefix);
+
+    return 0;
+}
+
+int netlink_mark_socket(int fd)
+{
+    uint32_t mark = NETLINK_FWMARK;
+    if (setsockopt(fd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) < 0) {
+        log_error("failed to set socket mark! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+    return 0;
+}
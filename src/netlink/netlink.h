@@ -0,0 +1,74 @@
+#ifndef __NETLINK_H__
+#define __NETLINK_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NETLINK_FWMARK        0x1080
+#define NETLINK_ROUTE_TABLE   1080
+#define NETLINK_RULE_PRIORITY 10800
+
+struct config_steer_rule;
+
+struct netlink_tun_config
+{
+    char const *ifname;
+    char const *addr;
+    char const *netmask;
+    uint16_t mtu;
+    /* protocol / destination ports routed into tuntap, rest keeps using
+     * main table */
+    struct config_steer_rule const *steer;
+    size_t steer_count;
+};
+
+/**
+ * @brief bring interface up, set address, mtu, default route in own table
+ *        and policy rules in one rtnetlink batch, sockets marked with
+ *        NETLINK_FWMARK keep using the main table
+ * @param config interface configuration
+ * @return 0 on success, -errno on failure (partial setup is rolled back)
+ */
+int netlink_tun_setup(struct netlink_tun_config const *config);
+
+/**
+ * @brief remove policy rules, route and address and bring interface down
+ *        in one rtnetlink batch, missing entries are ignored
+ * @param config interface configuration used for setup
+ * @return 0 on success, -errno on failure
+ */
+int netlink_tun_teardown(struct netlink_tun_config const *config);
+
+/**
+ * @brief change interface mtu
+ * @param ifname interface name
+ * @param mtu interface mtu
+ * @return 0 on success, -errno on failure
+ */
+int netlink_set_mtu(char const *ifname, uint16_t mtu);
+
+/**
+ * @brief replace steering rules of running interface in one batch
+ * @param config interface configuration with new steering rules
+ * @return 0 on success, -errno on failure
+ */
+int netlink_steer_apply(struct netlink_tun_config const *config);
+
+/**
+ * @brief move interface to another address in one batch
+ * @param old current interface configuration
+ * @param next interface configuration with new address / netmask
+ * @return 0 on success, -errno on failure
+ */
+int netlink_tun_set_addr(struct netlink_tun_config const *old,
+                         struct netlink_tun_config const *next);
+
+/**
+ * @brief mark socket so its traffic bypasses the tuntap route table
+ * @param fd socket file descriptor
+ * @return 0 on success, -errno on failure
+ */
+int netlink_mark_socket(int fd);
+
+#endif /* __NETLINK_H__ */
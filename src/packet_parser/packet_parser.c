@@ -60,6 +60,26 @@ bool is_packet_ipv6(uint8_t const *buf)
     return (iph != NULL && iph->version == 6);
 }
 
+uint16_t ip_checksum(void const *buf, size_t size)
+{
+    uint8_t const *data = buf;
+    uint32_t sum = 0;
+
+    for (; size > 1; size -= 2, data += 2) {
+        sum += (uint32_t)(data[0] << 8 | data[1]);
+    }
+
+    if (size) {
+        sum += (uint32_t)(data[0] << 8);
+    }
+
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return htons((uint16_t)~sum);
+}
+
 void print_ip_header(uint8_t const *buf, int size)
 {
     struct iphdr *iph = (struct iphdr *)buf;
@@ -2,6 +2,7 @@
 #define __PACKET_PARSER_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -46,6 +47,14 @@ bool is_packet_ipv4(uint8_t const *buf);
  */
 bool is_packet_ipv6(uint8_t const *buf);
 
+/**
+ * @brief calculate internet checksum (rfc 1071)
+ * @param buf data buffer
+ * @param size data buffer size
+ * @return checksum in network byte order
+ */
+uint16_t ip_checksum(void const *buf, size_t size);
+
 /**
  * @brief print packet ip header
  * @param buf packet buf
@@ -0,0 +1,74 @@
+#include "pktpool.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "ring.h"
+
+int pktpool_init(struct pktpool *p, uint32_t count, size_t buf_size)
+{
+    memset(p, 0, sizeof(*p));
+
+    p->free = calloc(1, sizeof(*p->free));
+    p->lengths = calloc(count, sizeof(*p->lengths));
+    p->stamps = calloc(count, sizeof(*p->stamps));
+    if (!p->free || !p->lengths || !p->stamps
+        || ring_init(p->free, count) < 0) {
+        log_error("pktpool init failed! (%d / %s)", errno, strerror(errno));
+        pktpool_deinit(p);
+        return -1;
+    }
+
+    /* anonymous mapping, untouched tails of large buffers cost nothing */
+    p->data = mmap(NULL, (size_t)count * buf_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p->data == MAP_FAILED) {
+        p->data = NULL;
+        log_error("pktpool mmap failed! (%d / %s)", errno, strerror(errno));
+        pktpool_deinit(p);
+        return -1;
+    }
+    p->buf_size = buf_size;
+    p->count = count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        ring_push(p->free, &i, 1);
+    }
+    ring_clear(p->free);
+
+    return 0;
+}
+
+void pktpool_deinit(struct pktpool *p)
+{
+    if (p->data) {
+        munmap(p->data, (size_t)p->count * p->buf_size);
+    }
+    if (p->free) {
+        ring_deinit(p->free);
+    }
+    free(p->free);
+    free(p->lengths);
+    free(p->stamps);
+    memset(p, 0, sizeof(*p));
+}
+
+uint32_t pktpool_get(struct pktpool *p)
+{
+    uint32_t handle = PKTPOOL_INVALID;
+
+    return ring_pop(p->free, &handle, 1) ? handle : PKTPOOL_INVALID;
+}
+
+void pktpool_put(struct pktpool *p, uint32_t const *handles, size_t count)
+{
+    /* ring holds every handle, it can't overflow */
+    ring_push(p->free, handles, count);
+}
+
+int pktpool_fd(struct pktpool const *p)
+{
+    return ring_fd(p->free);
+}
@@ -0,0 +1,78 @@
+#ifndef __PKTPOOL_H__
+#define __PKTPOOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fixed pool of packet buffers handed between pipeline stages by 32 bit
+ * handle. Free handles circulate through a ring, so one stage takes them
+ * and exactly one other stage gives them back without locks. Buffers are
+ * allocated once and only pages actually written are touched.
+ */
+
+#define PKTPOOL_INVALID UINT32_MAX
+
+struct ring;
+
+struct pktpool
+{
+    uint8_t *data;
+    uint32_t *lengths;
+    /* per buffer metadata set by producing stage, e.g. trace timestamp */
+    uint64_t *stamps;
+    size_t buf_size;
+    uint32_t count;
+    struct ring *free;
+};
+
+/**
+ * @brief allocate pool with every buffer free
+ * @param p pool
+ * @param count number of buffers, power of two
+ * @param buf_size size of one buffer
+ * @return 0 on success, -1 on failure
+ */
+int pktpool_init(struct pktpool *p, uint32_t count, size_t buf_size);
+
+/**
+ * @brief release pool memory
+ * @param p pool
+ */
+void pktpool_deinit(struct pktpool *p);
+
+/**
+ * @brief take free buffer, taking stage only
+ * @param p pool
+ * @return handle, PKTPOOL_INVALID if every buffer is in use
+ */
+uint32_t pktpool_get(struct pktpool *p);
+
+/**
+ * @brief return buffers, returning stage only
+ * @param p pool
+ * @param handles buffers
+ * @param count number of buffers
+ */
+void pktpool_put(struct pktpool *p, uint32_t const *handles, size_t count);
+
+/**
+ * @brief get eventfd that becomes readable when buffers come back to an
+ *        exhausted pool
+ * @param p pool
+ * @return file descriptor
+ */
+int pktpool_fd(struct pktpool const *p);
+
+/**
+ * @brief get buffer of handle
+ * @param p pool
+ * @param handle buffer handle
+ * @return buffer of buf_size bytes
+ */
+static inline uint8_t *pktpool_data(struct pktpool const *p, uint32_t handle)
+{
+    return p->data + (size_t)handle * p->buf_size;
+}
+
+#endif /* __PKTPOOL_H__ */
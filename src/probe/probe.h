@@ -0,0 +1,97 @@
+#ifndef __PROBE_H__
+#define __PROBE_H__
+
+#include <stdint.h>
+
+#define PROBE_PROVIDER "tunproxy"
+
+/*
+ * USDT probes for tracing a running tunproxy with bpftrace, perf or bcc.
+ * Probes are described by .note.stapsdt elf notes in the same format
+ * systemtap's <sys/sdt.h> writes, so no extra header or library is needed.
+ * A probe site is a single nop and a note naming where its arguments live
+ * (register, stack slot or constant); until a tracer attaches nothing but
+ * the nop runs. Arguments are 64 bit signed integers, pointers included.
+ * Builds with -DTUNPROXY_NO_PROBES, or for anything but x86_64 elf, leave
+ * probes out entirely.
+ */
+
+#if !defined(TUNPROXY_NO_PROBES) && defined(__ELF__) && defined(__x86_64__)
+
+    #define PROBE_ARG(x) ((int64_t)(uintptr_t)(x))
+
+    /* base section lets tools correct addresses of prelinked binaries */
+    #define _PROBE_NOTE(name, args)                                          \
+        "990: nop\n"                                                         \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n"                        \
+        ".balign 4\n"                                                        \
+        ".4byte 992f-991f, 994f-993f, 3\n"                                   \
+        "991: .asciz \"stapsdt\"\n"                                          \
+        "992: .balign 4\n"                                                   \
+        "993: .8byte 990b\n"                                                 \
+        ".8byte _.stapsdt.base\n"                                            \
+        ".8byte 0\n"                                                         \
+        ".asciz \"" PROBE_PROVIDER "\"\n"                                    \
+        ".asciz \"" name "\"\n"                                              \
+        ".asciz \"" args "\"\n"                                              \
+        "994: .balign 4\n"                                                   \
+        ".popsection\n"                                                      \
+        ".ifndef _.stapsdt.base\n"                                           \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,"      \
+        "comdat\n"                                                           \
+        ".weak _.stapsdt.base\n"                                             \
+        ".hidden _.stapsdt.base\n"                                           \
+        "_.stapsdt.base: .space 1\n"                                         \
+        ".size _.stapsdt.base, 1\n"                                          \
+        ".popsection\n"                                                      \
+        ".endif\n"
+
+    #define PROBE0(name) __asm__ __volatile__(_PROBE_NOTE(#name, ""))
+    #define PROBE1(name, v0)                                                 \
+        __asm__ __volatile__(_PROBE_NOTE(#name, "-8@%[a0]")                 \
+                             :                                               \
+                             : [a0] "nor"(PROBE_ARG(v0)))
+    #define PROBE2(name, v0, v1)                                             \
+        __asm__ __volatile__(_PROBE_NOTE(#name, "-8@%[a0] -8@%[a1]")        \
+                             :                                               \
+                             : [a0] "nor"(PROBE_ARG(v0)),                    \
+                               [a1] "nor"(PROBE_ARG(v1)))
+    #define PROBE3(name, v0, v1, v2)                                         \
+        __asm__ __volatile__(                                                \
+            _PROBE_NOTE(#name, "-8@%[a0] -8@%[a1] -8@%[a2]")                 \
+            :                                                                \
+            : [a0] "nor"(PROBE_ARG(v0)), [a1] "nor"(PROBE_ARG(v1)),          \
+              [a2] "nor"(PROBE_ARG(v2)))
+    #define PROBE4(name, v0, v1, v2, v3)                                     \
+        __asm__ __volatile__(                                                \
+            _PROBE_NOTE(#name, "-8@%[a0] -8@%[a1] -8@%[a2] -8@%[a3]")        \
+            :                                                                \
+            : [a0] "nor"(PROBE_ARG(v0)), [a1] "nor"(PROBE_ARG(v1)),          \
+              [a2] "nor"(PROBE_ARG(v2)), [a3] "nor"(PROBE_ARG(v3)))
+    #define PROBE6(name, v0, v1, v2, v3, v4, v5)                             \
+        __asm__ __volatile__(                                                \
+            _PROBE_NOTE(#name, "-8@%[a0] -8@%[a1] -8@%[a2] -8@%[a3] "        \
+                               "-8@%[a4] -8@%[a5]")                          \
+            :                                                                \
+            : [a0] "nor"(PROBE_ARG(v0)), [a1] "nor"(PROBE_ARG(v1)),          \
+              [a2] "nor"(PROBE_ARG(v2)), [a3] "nor"(PROBE_ARG(v3)),          \
+              [a4] "nor"(PROBE_ARG(v4)), [a5] "nor"(PROBE_ARG(v5)))
+
+#else
+
+    #define PROBE0(name)             do { } while (0)
+    #define PROBE1(name, v0)         do { (void)(v0); } while (0)
+    #define PROBE2(name, v0, v1)     do { (void)(v0); (void)(v1); } while (0)
+    #define PROBE3(name, v0, v1, v2) \
+        do { (void)(v0); (void)(v1); (void)(v2); } while (0)
+    #define PROBE4(name, v0, v1, v2, v3) \
+        do { (void)(v0); (void)(v1); (void)(v2); (void)(v3); } while (0)
+    #define PROBE6(name, v0, v1, v2, v3, v4, v5)                            \
+        do {                                                                \
+            (void)(v0); (void)(v1); (void)(v2); (void)(v3); (void)(v4);     \
+            (void)(v5);                                                     \
+        } while (0)
+
+#endif
+
+#endif /* __PROBE_H__ */
@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include "quiesce.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+int quiesce_init(struct quiesce *q)
+{
+    memset(q, 0, sizeof(*q));
+
+    if (pipe2(q->wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+        log_error("quiesce pipe failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+
+    return 0;
+}
+
+void quiesce_enter(struct quiesce *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->active++;
+    pthread_mutex_unlock(&q->lock);
+}
+
+void quiesce_leave(struct quiesce *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->active--;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int quiesce_fd(struct quiesce const *q)
+{
+    return q->wake[0];
+}
+
+void quiesce_park(struct quiesce *q)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->suspended) {
+        q->parked++;
+        pthread_cond_broadcast(&q->cond);
+        while (q->suspended) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        q->parked--;
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+int quiesce_suspend(struct quiesce *q, int timeout_ms)
+{
+    struct timespec deadline = { 0 };
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->suspended = true;
+    if (write(q->wake[1], "q", 1) < 0 && errno != EAGAIN) {
+        log_error("quiesce wake failed! (%d / %s)", errno, strerror(errno));
+    }
+
+    int err = 0;
+    while (q->parked < q->active && err != ETIMEDOUT) {
+        err = pthread_cond_timedwait(&q->cond, &q->lock, &deadline);
+    }
+    bool is_parked = q->parked >= q->active;
+    pthread_mutex_unlock(&q->lock);
+
+    if (!is_parked) {
+        log_error("quiesce timeout, %d of %d loops parked", q->parked,
+                  q->active);
+        quiesce_resume(q);
+        return -1;
+    }
+
+    return 0;
+}
+
+void quiesce_resume(struct quiesce *q)
+{
+    char drain[16];
+
+    pthread_mutex_lock(&q->lock);
+    while (read(q->wake[0], drain, sizeof(drain)) > 0)
+        ;
+    q->suspended = false;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,68 @@
+#ifndef __QUIESCE_H__
+#define __QUIESCE_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/*
+ * Lets a controller stop a group of event loop threads at a point where
+ * they hold no buffered data. Every loop adds quiesce_fd() to its select
+ * set and calls quiesce_park() when it becomes readable.
+ */
+struct quiesce
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int wake[2];
+    bool suspended;
+    int active;
+    int parked;
+};
+
+/**
+ * @brief initialize quiesce barrier
+ * @param q barrier
+ * @return 0 on success, -errno on failure
+ */
+int quiesce_init(struct quiesce *q);
+
+/**
+ * @brief register calling loop as barrier participant
+ * @param q barrier
+ */
+void quiesce_enter(struct quiesce *q);
+
+/**
+ * @brief unregister calling loop
+ * @param q barrier
+ */
+void quiesce_leave(struct quiesce *q);
+
+/**
+ * @brief get file descriptor which becomes readable on suspend
+ * @param q barrier
+ * @return file descriptor
+ */
+int quiesce_fd(struct quiesce const *q);
+
+/**
+ * @brief block calling loop while barrier is suspended
+ * @param q barrier
+ */
+void quiesce_park(struct quiesce *q);
+
+/**
+ * @brief wait until every participant is parked
+ * @param q barrier
+ * @param timeout_ms max time to wait
+ * @return 0 on success, -1 on timeout (barrier is resumed)
+ */
+int quiesce_suspend(struct quiesce *q, int timeout_ms);
+
+/**
+ * @brief release parked participants
+ * @param q barrier
+ */
+void quiesce_resume(struct quiesce *q);
+
+#endif /* __QUIESCE_H__ */
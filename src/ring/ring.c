@@ -0,0 +1,118 @@
+#include "ring.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "log.h"
+
+int ring_init(struct ring *r, uint32_t size)
+{
+    memset(r, 0, sizeof(*r));
+    r->event_fd = -1;
+
+    if (!size || (size & (size - 1))) {
+        errno = -EINVAL;
+        log_error("ring size %u not a power of two! (%d / %s)", size, errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    r->slots = calloc(size, sizeof(*r->slots));
+    r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!r->slots || r->event_fd < 0) {
+        log_error("ring init failed! (%d / %s)", errno, strerror(errno));
+        ring_deinit(r);
+        return -1;
+    }
+    r->mask = size - 1;
+
+    return 0;
+}
+
+void ring_deinit(struct ring *r)
+{
+    if (r->event_fd >= 0) {
+        close(r->event_fd);
+    }
+    free(r->slots);
+    r->slots = NULL;
+    r->event_fd = -1;
+}
+
+size_t ring_push(struct ring *r, uint32_t const *items, size_t count)
+{
+    uint32_t tail = r->tail;
+    uint32_t room = r->mask + 1 - (tail - r->head_cache);
+
+    if (room < count) {
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        room = r->mask + 1 - (tail - r->head_cache);
+    }
+
+    if (count > room) {
+        count = room;
+        r->full++;
+    }
+
+    if (!count) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        r->slots[(tail + i) & r->mask] = items[i];
+    }
+
+    /* pairs with consumer storing head and then looking at tail, one of
+     * both sides sees the other's update */
+    __atomic_store_n(&r->tail, tail + count, __ATOMIC_SEQ_CST);
+    r->head_cache = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+
+    if (r->head_cache == tail) {
+        uint64_t one = 1;
+        if (write(r->event_fd, &one, sizeof(one)) == sizeof(one)) {
+            r->wakeups++;
+        }
+    }
+
+    return count;
+}
+
+size_t ring_pop(struct ring *r, uint32_t *items, size_t max)
+{
+    uint32_t head = r->head;
+    uint32_t avail = r->tail_cache - head;
+
+    if (avail < max) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+        avail = r->tail_cache - head;
+    }
+
+    if (avail > max) {
+        avail = max;
+    }
+
+    for (size_t i = 0; i < avail; i++) {
+        items[i] = r->slots[(head + i) & r->mask];
+    }
+
+    if (avail) {
+        __atomic_store_n(&r->head, head + avail, __ATOMIC_SEQ_CST);
+    }
+
+    return avail;
+}
+
+int ring_fd(struct ring const *r)
+{
+    return r->event_fd;
+}
+
+void ring_clear(struct ring *r)
+{
+    uint64_t count = 0;
+
+    while (read(r->event_fd, &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+}
@@ -0,0 +1,81 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded lock-free single producer / single consumer ring of 32 bit
+ * handles. Producer and consumer indices live on their own cache lines and
+ * each side caches the other one's index, so a batch costs one shared load
+ * at most. The producer writes the ring eventfd only when its push finds
+ * the ring empty, a consumer draining the ring after reading the eventfd
+ * therefore never misses a wakeup and a busy ring never makes a syscall.
+ */
+
+#define RING_CACHE_LINE 64
+
+struct ring
+{
+    uint32_t *slots;
+    uint32_t mask;
+    int event_fd;
+    uint64_t wakeups;
+
+    /* producer side */
+    uint32_t tail __attribute__((aligned(RING_CACHE_LINE)));
+    uint32_t head_cache;
+    uint64_t full;
+
+    /* consumer side */
+    uint32_t head __attribute__((aligned(RING_CACHE_LINE)));
+    uint32_t tail_cache;
+};
+
+/**
+ * @brief initialize empty ring
+ * @param r ring
+ * @param size number of slots, power of two
+ * @return 0 on success, -1 on failure
+ */
+int ring_init(struct ring *r, uint32_t size);
+
+/**
+ * @brief release ring slots and eventfd
+ * @param r ring
+ */
+void ring_deinit(struct ring *r);
+
+/**
+ * @brief push handles, producer thread only
+ * @param r ring
+ * @param items handles
+ * @param count number of handles
+ * @return number of handles pushed, less than count when ring is full
+ */
+size_t ring_push(struct ring *r, uint32_t const *items, size_t count);
+
+/**
+ * @brief pop up to max handles, consumer thread only
+ * @param r ring
+ * @param items destination
+ * @param max destination size
+ * @return number of handles popped, 0 if ring is empty
+ */
+size_t ring_pop(struct ring *r, uint32_t *items, size_t max);
+
+/**
+ * @brief get eventfd consumer polls while ring is empty
+ * @param r ring
+ * @return file descriptor
+ */
+int ring_fd(struct ring const *r);
+
+/**
+ * @brief consume pending wakeup, call before draining ring
+ * @param r ring
+ */
+void ring_clear(struct ring *r);
+
+#endif /* __RING_H__ */
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include "shaper.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "log.h"
+#include "stats.h"
+#include "util.h"
+
+#define SHAPER_NAME_SIZE   64
+#define SHAPER_CACHE_LINE  64
+/* default burst is this many ms of rate, but not below one max read */
+#define SHAPER_BURST_MS    100
+#define SHAPER_BURST_MIN   (64 * 1024)
+
+enum shaper_match_type
+{
+    SHAPER_MATCH_ALL,
+    SHAPER_MATCH_CLIENT,
+    SHAPER_MATCH_USER,
+    SHAPER_MATCH_DST,
+};
+
+/* one per cpu, only writers are threads on that cpu and the tick */
+struct shaper_bucket
+{
+    int64_t tokens;
+    uint64_t demand;
+    uint64_t bytes;
+    uint64_t waits;
+} __attribute__((aligned(SHAPER_CACHE_LINE)));
+
+struct shaper_class
+{
+    char name[SHAPER_NAME_SIZE];
+    enum shaper_match_type type;
+    uint32_t net;
+    uint32_t mask;
+    char user[SHAPER_NAME_SIZE];
+    uint64_t rate;
+    uint64_t burst;
+    struct shaper_class *parent;
+    struct shaper_bucket *buckets;
+};
+
+static struct
+{
+    struct shaper_class classes[SHAPER_MAX_CLASSES];
+    size_t count;
+    struct shaper_class *all;
+    size_t cpus;
+    bool running;
+    pthread_t tick;
+} _shaper;
+
+static uint64_t _parse_size(char const *str, char **end)
+{
+    uint64_t value = strtoull(str, end, 10);
+
+    switch (**end) {
+        case 'k':
+        case 'K':
+            value *= 1000;
+            (*end)++;
+            break;
+        case 'm':
+        case 'M':
+            value *= 1000 * 1000;
+            (*end)++;
+            break;
+        case 'g':
+        case 'G':
+            value *= 1000 * 1000 * 1000;
+            (*end)++;
+            break;
+        default:
+            break;
+    }
+
+    return value;
+}
+
+static int _parse_cidr(char const *str, uint32_t *net, uint32_t *mask)
+{
+    char addr[INET_ADDRSTRLEN] = { 0 };
+    char const *slash = strchr(str, '/');
+    size_t len = slash ? (size_t)(slash - str) : strlen(str);
+    long prefix = slash ? strtol(slash + 1, NULL, 10) : 32;
+    struct in_addr in;
+
+    if (len >= sizeof(addr) || prefix < 0 || prefix > 32) {
+        return -1;
+    }
+    memcpy(addr, str, len);
+    if (inet_pton(AF_INET, addr, &in) != 1) {
+        return -1;
+    }
+
+    *mask = prefix ? htonl(~0u << (32 - prefix)) : 0;
+    *net = in.s_addr & *mask;
+
+    return 0;
+}
+
+int shaper_add_class(char const *spec)
+{
+    char match[SHAPER_NAME_SIZE] = { 0 };
+    char const *eq = spec ? strrchr(spec, '=') : NULL;
+    char *end = NULL;
+
+    if (_shaper.running || _shaper.count == SHAPER_MAX_CLASSES || !eq
+        || (size_t)(eq - spec) >= sizeof(match)) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    struct shaper_class *cls = &_shaper.classes[_shaper.count];
+    memset(cls, 0, sizeof(*cls));
+    memcpy(match, spec, eq - spec);
+
+    cls->rate = _parse_size(eq + 1, &end);
+    cls->burst = cls->rate * SHAPER_BURST_MS / 1000;
+    if (*end == ',') {
+        cls->burst = _parse_size(end + 1, &end);
+    }
+    else if (cls->burst < SHAPER_BURST_MIN) {
+        cls->burst = SHAPER_BURST_MIN;
+    }
+    if (*end || !cls->rate || !cls->burst) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    if (!strcmp(match, "all")) {
+        if (_shaper.all) {
+            errno = -EEXIST;
+            return -1;
+        }
+        cls->type = SHAPER_MATCH_ALL;
+    }
+    else if (!strncmp(match, "client:", 7)) {
+        cls->type = SHAPER_MATCH_CLIENT;
+        if (_parse_cidr(match + 7, &cls->net, &cls->mask) < 0) {
+            errno = -EINVAL;
+            return -1;
+        }
+    }
+    else if (!strncmp(match, "dst:", 4)) {
+        cls->type = SHAPER_MATCH_DST;
+        if (_parse_cidr(match + 4, &cls->net, &cls->mask) < 0) {
+            errno = -EINVAL;
+            return -1;
+        }
+    }
+    else if (!strncmp(match, "user:", 5) && match[5]) {
+        cls->type = SHAPER_MATCH_USER;
+        snprintf(cls->user, sizeof(cls->user), "%s", match + 5);
+    }
+    else {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    snprintf(cls->name, sizeof(cls->name), "%s", match);
+    if (cls->type == SHAPER_MATCH_ALL) {
+        _shaper.all = cls;
+    }
+    _shaper.count++;
+
+    return 0;
+}
+
+static struct shaper_bucket *_local(struct shaper_class *cls)
+{
+    int cpu = sched_getcpu();
+
+    return &cls->buckets[cpu < 0 ? 0 : (size_t)cpu % _shaper.cpus];
+}
+
+/* collect every cpu's tokens, add refill and hand them out by demand */
+static void _rebalance(struct shaper_class *cls, uint64_t elapsed_us)
+{
+    int64_t pool = 0;
+    uint64_t demand[AFFINITY_MAX_CPUS];
+    uint64_t total = 0;
+
+    for (size_t i = 0; i < _shaper.cpus; i++) {
+        pool += __atomic_exchange_n(&cls->buckets[i].tokens, 0,
+                                    __ATOMIC_RELAXED);
+        demand[i] = __atomic_exchange_n(&cls->buckets[i].demand, 0,
+                                        __ATOMIC_RELAXED);
+        total += demand[i];
+    }
+
+    pool += cls->rate * elapsed_us / 1000000;
+    if (pool > (int64_t)cls->burst) {
+        pool = cls->burst;
+    }
+
+    /* debt stays with the cpu that made it */
+    if (pool <= 0) {
+        size_t busiest = 0;
+        for (size_t i = 1; i < _shaper.cpus; i++) {
+            busiest = demand[i] > demand[busiest] ? i : busiest;
+        }
+        __atomic_add_fetch(&cls->buckets[busiest].tokens, pool,
+                           __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* idle cpus keep a small share so new flows don't wait a whole tick */
+    uint64_t floor = total / (8 * _shaper.cpus) + 1;
+    uint64_t weights = total + floor * _shaper.cpus;
+
+    for (size_t i = 0; i < _shaper.cpus; i++) {
+        int64_t share = (__int128)pool * (demand[i] + floor) / weights;
+        __atomic_add_fetch(&cls->buckets[i].tokens, share, __ATOMIC_RELAXED);
+    }
+}
+
+static void *_tick_thread(void *arg)
+{
+    struct timespec period = { 0, SHAPER_TICK_MS * 1000000L };
+    uint64_t last_us = util_now_us();
+
+    while (__atomic_load_n(&_shaper.running, __ATOMIC_RELAXED)) {
+        nanosleep(&period, NULL);
+
+        uint64_t now_us = util_now_us();
+        for (size_t i = 0; i < _shaper.count; i++) {
+            _rebalance(&_shaper.classes[i], now_us - last_us);
+        }
+        last_us = now_us;
+    }
+
+    return NULL;
+}
+
+static void _shaper_report()
+{
+    for (size_t i = 0; i < _shaper.count; i++) {
+        struct shaper_class const *cls = &_shaper.classes[i];
+        uint64_t bytes = 0;
+        uint64_t waits = 0;
+        int64_t tokens = 0;
+
+        for (size_t c = 0; c < _shaper.cpus; c++) {
+            bytes += __atomic_load_n(&cls->buckets[c].bytes, __ATOMIC_RELAXED);
+            waits += __atomic_load_n(&cls->buckets[c].waits, __ATOMIC_RELAXED);
+            tokens += __atomic_load_n(&cls->buckets[c].tokens,
+                                      __ATOMIC_RELAXED);
+        }
+
+        log_info("shaper %s: rate %lu B/s, burst %lu B, bytes %lu, waits "
+                 "%lu, tokens %ld",
+                 cls->name, cls->rate, cls->burst, bytes, waits, tokens);
+    }
+}
+
+int shaper_init()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+    if (!_shaper.count) {
+        return 0;
+    }
+
+    _shaper.cpus = cpus <= 0 ? 1
+                   : cpus > AFFINITY_MAX_CPUS ? AFFINITY_MAX_CPUS
+                                              : (size_t)cpus;
+
+    for (size_t i = 0; i < _shaper.count; i++) {
+        struct shaper_class *cls = &_shaper.classes[i];
+
+        cls->buckets = aligned_alloc(SHAPER_CACHE_LINE,
+                                     _shaper.cpus * sizeof(*cls->buckets));
+        if (!cls->buckets) {
+            shaper_deinit();
+            errno = -ENOMEM;
+            return -1;
+        }
+        memset(cls->buckets, 0, _shaper.cpus * sizeof(*cls->buckets));
+        for (size_t c = 0; c < _shaper.cpus; c++) {
+            cls->buckets[c].tokens = cls->burst / _shaper.cpus;
+        }
+
+        cls->parent = cls == _shaper.all ? NULL : _shaper.all;
+        log_info("shaper class %s: %lu B/s, burst %lu B", cls->name,
+                 cls->rate, cls->burst);
+    }
+
+    _shaper.running = true;
+    if (pthread_create(&_shaper.tick, NULL, _tick_thread, NULL) != 0) {
+        _shaper.running = false;
+        shaper_deinit();
+        errno = -EAGAIN;
+        return -1;
+    }
+
+    stats_register(_shaper_report);
+
+    return 0;
+}
+
+void shaper_deinit()
+{
+    if (__atomic_exchange_n(&_shaper.running, false, __ATOMIC_RELAXED)) {
+        pthread_join(_shaper.tick, NULL);
+    }
+
+    for (size_t i = 0; i < _shaper.count; i++) {
+        free(_shaper.classes[i].buckets);
+        _shaper.classes[i].buckets = NULL;
+    }
+}
+
+struct shaper_class *shaper_match(uint32_t client_ip, char const *user,
+                                  uint32_t dst_ip)
+{
+    for (size_t i = 0; i < _shaper.count; i++) {
+        struct shaper_class *cls = &_shaper.classes[i];
+
+        switch (cls->type) {
+            case SHAPER_MATCH_CLIENT:
+                if (client_ip && (client_ip & cls->mask) == cls->net) {
+                    return cls;
+                }
+                break;
+            case SHAPER_MATCH_DST:
+                if (dst_ip && (dst_ip & cls->mask) == cls->net) {
+                    return cls;
+                }
+                break;
+            case SHAPER_MATCH_USER:
+                if (user && !strcmp(user, cls->user)) {
+                    return cls;
+                }
+                break;
+            case SHAPER_MATCH_ALL:
+            default:
+                break;
+        }
+    }
+
+    return _shaper.all;
+}
+
+int shaper_wait_ms(struct shaper_class *cls, uint64_t bytes)
+{
+    for (; cls; cls = cls->parent) {
+        struct shaper_bucket *bucket = _local(cls);
+
+        if (__atomic_load_n(&bucket->tokens, __ATOMIC_RELAXED) <= 0) {
+            /* demand is what next rebalance hands tokens out by, in
+             * bytes like consumed ones */
+            __atomic_add_fetch(&bucket->demand, bytes, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&bucket->waits, 1, __ATOMIC_RELAXED);
+            return SHAPER_TICK_MS;
+        }
+    }
+
+    return 0;
+}
+
+void shaper_consume(struct shaper_class *cls, uint64_t bytes)
+{
+    for (; cls; cls = cls->parent) {
+        struct shaper_bucket *bucket = _local(cls);
+
+        __atomic_sub_fetch(&bucket->tokens, (int64_t)bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&bucket->demand, bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&bucket->bytes, bytes, __ATOMIC_RELAXED);
+    }
+}
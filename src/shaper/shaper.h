@@ -0,0 +1,68 @@
+#ifndef __SHAPER_H__
+#define __SHAPER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SHAPER_MAX_CLASSES 32
+#define SHAPER_TICK_MS     10
+
+/*
+ * Token bucket shaping of relayed bytes. Classes match client address,
+ * authenticated user or destination address, the optional "all" class is
+ * parent of every other class so both limits apply. Every class keeps one
+ * bucket per cpu, consumers only touch bucket of cpu they run on and a
+ * background tick refills buckets and rebalances tokens by recent demand.
+ */
+
+struct shaper_class;
+
+/**
+ * @brief add traffic class, must be called before shaper_init
+ * @param spec "<match>=<rate>[,<burst>]", match is "all", "client:<cidr>",
+ *        "user:<name>" or "dst:<cidr>", rate in bytes per second and burst
+ *        in bytes both accept k / m / g suffix
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int shaper_add_class(char const *spec);
+
+/**
+ * @brief start refill tick if any class is configured
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int shaper_init();
+
+/**
+ * @brief stop refill tick and release classes
+ */
+void shaper_deinit();
+
+/**
+ * @brief find class of traffic, first added class that matches wins
+ * @param client_ip client ipv4 address (network order), 0 if unknown
+ * @param user authenticated user, NULL if none
+ * @param dst_ip destination ipv4 address (network order), 0 if unknown
+ * @return matching class, "all" class if nothing else matches, NULL if
+ *         traffic isn't shaped
+ */
+struct shaper_class *shaper_match(uint32_t client_ip, char const *user,
+                                  uint32_t dst_ip);
+
+/**
+ * @brief get time until class may send again, a wait counts as demand
+ *        for bytes like shaper_consume does
+ * @param cls traffic class, NULL never waits
+ * @param bytes bytes caller wants to send
+ * @return 0 if tokens are available, milliseconds to wait otherwise
+ */
+int shaper_wait_ms(struct shaper_class *cls, uint64_t bytes);
+
+/**
+ * @brief charge bytes to class and its parent, buckets may go into debt
+ *        which is paid back by later refills
+ * @param cls traffic class, NULL is ignored
+ * @param bytes relayed bytes
+ */
+void shaper_consume(struct shaper_class *cls, uint64_t bytes);
+
+#endif /* __SHAPER_H__ */
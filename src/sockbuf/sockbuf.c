@@ -0,0 +1,262 @@
+#include "sockbuf.h"
+#include <errno.h>
+#include <linux/if_tun.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "stats.h"
+
+static struct
+{
+    size_t cap;
+    size_t used;
+    size_t peak;
+    uint64_t sockets;
+    uint64_t resizes;
+    uint64_t capped;
+    size_t sndbuf_max;
+    size_t rcvbuf_max;
+    size_t tun_sndbuf;
+} _sockbuf;
+
+static void _update_max(size_t *max, size_t value)
+{
+    size_t seen = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > seen
+           && !__atomic_compare_exchange_n(max, &seen, value, true,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED)) {
+    }
+}
+
+static bool _charge(size_t old, size_t next)
+{
+    if (next <= old) {
+        __atomic_sub_fetch(&_sockbuf.used, old - next, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    size_t delta = next - old;
+    size_t used = __atomic_load_n(&_sockbuf.used, __ATOMIC_RELAXED);
+    do {
+        if (delta > _sockbuf.cap || used > _sockbuf.cap - delta) {
+            __atomic_add_fetch(&_sockbuf.capped, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&_sockbuf.used, &used, used + delta,
+                                          true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    _update_max(&_sockbuf.peak, used + delta);
+
+    return true;
+}
+
+/* twice the bdp, power of two between SOCKBUF_MIN and SOCKBUF_MAX */
+static size_t _target(uint64_t rate, uint32_t rtt_us)
+{
+    uint64_t bdp = rate * rtt_us / 1000000;
+    size_t size = SOCKBUF_MIN;
+
+    while (size < 2 * bdp && size < SOCKBUF_MAX) {
+        size <<= 1;
+    }
+
+    return size;
+}
+
+/* grow right away, shrink only once target is two steps below */
+static size_t _next(size_t current, size_t target)
+{
+    if (!current || target > current || target * 4 <= current) {
+        return target;
+    }
+
+    return current;
+}
+
+static int _set(int fd, int force, int opt, size_t size)
+{
+    int value = size;
+
+    /* root isn't bound by net.core.[rw]mem_max */
+    if (setsockopt(fd, SOL_SOCKET, force, &value, sizeof(value)) == 0) {
+        return 0;
+    }
+
+    return setsockopt(fd, SOL_SOCKET, opt, &value, sizeof(value));
+}
+
+static void _sockbuf_report()
+{
+    if (!_sockbuf.cap) {
+        log_info("sockbuf: auto-tuning off");
+        return;
+    }
+
+    log_info("sockbuf: %llu sockets, used %zu KB, peak %zu KB, cap %zu KB, "
+             "resizes %llu, capped %llu, largest sndbuf %zu KB, "
+             "rcvbuf %zu KB, tuntap sndbuf %zu KB",
+             (unsigned long long)__atomic_load_n(&_sockbuf.sockets,
+                                                 __ATOMIC_RELAXED),
+             __atomic_load_n(&_sockbuf.used, __ATOMIC_RELAXED) >> 10,
+             __atomic_load_n(&_sockbuf.peak, __ATOMIC_RELAXED) >> 10,
+             _sockbuf.cap >> 10,
+             (unsigned long long)__atomic_load_n(&_sockbuf.resizes,
+                                                 __ATOMIC_RELAXED),
+             (unsigned long long)__atomic_load_n(&_sockbuf.capped,
+                                                 __ATOMIC_RELAXED),
+             __atomic_load_n(&_sockbuf.sndbuf_max, __ATOMIC_RELAXED) >> 10,
+             __atomic_load_n(&_sockbuf.rcvbuf_max, __ATOMIC_RELAXED) >> 10,
+             __atomic_load_n(&_sockbuf.tun_sndbuf, __ATOMIC_RELAXED) >> 10);
+}
+
+int sockbuf_init(size_t cap)
+{
+    _sockbuf.cap = cap;
+    stats_register(_sockbuf_report);
+
+    return 0;
+}
+
+bool sockbuf_enabled()
+{
+    return _sockbuf.cap != 0;
+}
+
+void sockbuf_attach(struct sockbuf *sb, int fd, uint32_t lowat_min)
+{
+    memset(sb, 0, sizeof(*sb));
+    sb->fd = fd;
+    sb->lowat_min = lowat_min;
+    sb->lowat = lowat_min;
+
+    if (_sockbuf.cap) {
+        __atomic_add_fetch(&_sockbuf.sockets, 1, __ATOMIC_RELAXED);
+    }
+}
+
+bool sockbuf_tune(struct sockbuf *sb, uint64_t now_ms)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (!_sockbuf.cap || sb->fd < 0
+        || now_ms - sb->sampled_ms < SOCKBUF_SAMPLE_MS) {
+        return false;
+    }
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(sb->fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        /* not tcp, tried again next period */
+        sb->sampled_ms = now_ms;
+        return false;
+    }
+
+    uint64_t elapsed_ms = now_ms - sb->sampled_ms;
+    uint64_t acked = info.tcpi_bytes_acked - sb->acked;
+    uint64_t received = info.tcpi_bytes_received - sb->received;
+    bool first = !sb->sampled_ms;
+
+    sb->sampled_ms = now_ms;
+    sb->acked = info.tcpi_bytes_acked;
+    sb->received = info.tcpi_bytes_received;
+    sb->rtt_us = info.tcpi_rtt;
+    sb->rate = info.tcpi_delivery_rate;
+
+    /* idle direction keeps its size, there is nothing to measure */
+    if (first || (!acked && !received)) {
+        return false;
+    }
+
+    /* bursts of an app limited sender don't raise the rate, queueing in our
+     * own buffer doesn't raise the rtt */
+    uint64_t snd_rate = acked * 1000 / elapsed_ms;
+    if (info.tcpi_delivery_rate < snd_rate) {
+        snd_rate = info.tcpi_delivery_rate;
+    }
+    uint32_t snd_rtt = info.tcpi_min_rtt ? info.tcpi_min_rtt : info.tcpi_rtt;
+    size_t sndbuf = acked ? _next(sb->sndbuf, _target(snd_rate, snd_rtt))
+                          : sb->sndbuf;
+    uint32_t rcv_rtt = info.tcpi_rcv_rtt ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+    size_t rcvbuf = received ? _next(sb->rcvbuf,
+                                     _target(received * 1000 / elapsed_ms,
+                                             rcv_rtt))
+                             : sb->rcvbuf;
+
+    if (sndbuf == sb->sndbuf && rcvbuf == sb->rcvbuf) {
+        return false;
+    }
+
+    /* kernel doubles requested sizes for its bookkeeping */
+    size_t charge = 2 * (sndbuf + rcvbuf);
+    if (!_charge(sb->charged, charge)) {
+        return false;
+    }
+
+    if ((sndbuf != sb->sndbuf
+         && _set(sb->fd, SO_SNDBUFFORCE, SO_SNDBUF, sndbuf) < 0)
+        || (rcvbuf != sb->rcvbuf
+            && _set(sb->fd, SO_RCVBUFFORCE, SO_RCVBUF, rcvbuf) < 0)) {
+        log_error("sockbuf resize failed! (%d / %s)", errno, strerror(errno));
+        _charge(charge, sb->charged);
+        return false;
+    }
+
+    sb->charged = charge;
+    sb->sndbuf = sndbuf;
+    sb->rcvbuf = rcvbuf;
+    __atomic_add_fetch(&_sockbuf.resizes, 1, __ATOMIC_RELAXED);
+    _update_max(&_sockbuf.sndbuf_max, sndbuf);
+    _update_max(&_sockbuf.rcvbuf_max, rcvbuf);
+
+    /* unsent bytes cover a quarter of the send bdp, enough to keep cwnd fed
+     * until the loop comes back, rest of the backlog stays with caller */
+    if (sb->lowat_min && sndbuf) {
+        uint32_t lowat = sndbuf / 8;
+        if (lowat < sb->lowat_min) {
+            lowat = sb->lowat_min;
+        }
+        if (lowat != sb->lowat
+            && setsockopt(sb->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+                          sizeof(lowat))
+                   == 0) {
+            sb->lowat = lowat;
+        }
+    }
+
+    return true;
+}
+
+void sockbuf_detach(struct sockbuf *sb)
+{
+    if (sb->fd < 0) {
+        return;
+    }
+
+    if (_sockbuf.cap) {
+        _charge(sb->charged, 0);
+        __atomic_sub_fetch(&_sockbuf.sockets, 1, __ATOMIC_RELAXED);
+    }
+    memset(sb, 0, sizeof(*sb));
+    sb->fd = -1;
+}
+
+int sockbuf_set_tun(int fd, size_t size)
+{
+    int value = size < SOCKBUF_TUN_MIN ? SOCKBUF_TUN_MIN : size;
+
+    if (ioctl(fd, TUNSETSNDBUF, &value) < 0) {
+        log_error("tuntap sndbuf resize failed! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    __atomic_store_n(&_sockbuf.tun_sndbuf, (size_t)value, __ATOMIC_RELAXED);
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef __SOCKBUF_H__
+#define __SOCKBUF_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SOCKBUF_DEFAULT_CAP ((size_t)64 << 20)
+/* buffers never go below kernel defaults or above this */
+#define SOCKBUF_MIN       ((size_t)64 << 10)
+#define SOCKBUF_MAX       ((size_t)16 << 20)
+#define SOCKBUF_SAMPLE_MS 250
+/* tuntap send buffer floor, writes beyond it would fail with EAGAIN */
+#define SOCKBUF_TUN_MIN ((size_t)1 << 20)
+
+/*
+ * Socket buffers sized from the measured bandwidth-delay product. Every
+ * tuned tcp socket is sampled with TCP_INFO at most once per
+ * SOCKBUF_SAMPLE_MS while it carries data: send side bdp is delivery rate
+ * (at most bytes acked per second) times min rtt, receive side bdp is bytes
+ * received per second times receiver rtt estimate. Buffers are set to
+ * twice the bdp (rounded up to a power of two, so small changes don't
+ * resize), which leaves room for the rate to grow until the path, not the
+ * window, limits it. Bytes handed to the kernel are charged to one process
+ * wide cap, a socket that doesn't fit keeps its current size.
+ */
+
+struct sockbuf
+{
+    int fd;
+    uint64_t sampled_ms;
+    uint64_t acked;
+    uint64_t received;
+    /* chosen sizes, 0 while kernel default is used */
+    size_t sndbuf;
+    size_t rcvbuf;
+    size_t charged;
+    uint32_t lowat_min;
+    uint32_t lowat;
+    uint32_t rtt_us;
+    uint64_t rate;
+};
+
+/**
+ * @brief initialize auto-tuning
+ * @param cap max bytes of tuned socket buffers, 0 disables tuning
+ * @return 0 on success, -errno on failure
+ */
+int sockbuf_init(size_t cap);
+
+/**
+ * @brief check if auto-tuning is enabled
+ * @return true if sockets are tuned
+ */
+bool sockbuf_enabled();
+
+/**
+ * @brief start tuning connected tcp socket
+ * @param sb tuning state
+ * @param fd socket
+ * @param lowat_min TCP_NOTSENT_LOWAT floor, lowat follows send bdp above
+ *        it, 0 leaves lowat alone
+ */
+void sockbuf_attach(struct sockbuf *sb, int fd, uint32_t lowat_min);
+
+/**
+ * @brief sample socket and resize its buffers, cheap between samples
+ * @param sb tuning state
+ * @param now_ms monotonic time in ms
+ * @return true if a buffer was resized
+ */
+bool sockbuf_tune(struct sockbuf *sb, uint64_t now_ms);
+
+/**
+ * @brief stop tuning socket and return its bytes to cap, socket itself is
+ *        left open
+ * @param sb tuning state
+ */
+void sockbuf_detach(struct sockbuf *sb);
+
+/**
+ * @brief size tuntap send buffer, bounds bytes written to tuntap which
+ *        kernel still holds
+ * @param fd tuntap fd
+ * @param size bytes, rounded up to SOCKBUF_TUN_MIN
+ * @return 0 on success, -errno on failure
+ */
+int sockbuf_set_tun(int fd, size_t size);
+
+#endif /* __SOCKBUF_H__ */
@@ -13,14 +13,53 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 
+#include "affinity.h"
+#include "config.h"
+#include "epoch.h"
+#include "iov.h"
 #include "log.h"
+#include "membudget.h"
+#include "mux.h"
+#include "netlink.h"
 #include "packet_parser.h"
+#include "probe.h"
+#include "quiesce.h"
+#include "shaper.h"
+#include "sockbuf.h"
+#include "srcpool.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "tls.h"
+#include "udp_relay.h"
+#include "util.h"
 
 #define BUFSIZE     65536
 #define MAX_CLIENTS 25
 
+#define SOCKS5_BUFFER_MIN      4096
+#define SOCKS5_BUFFER_MAX      BUFSIZE
+#define SOCKS5_BUFFER_IDLE_MS  1000
+#define SOCKS5_BUDGET_RETRY_MS 10
+/* every session thread reserves its stack up front */
+#define SOCKS5_SESSION_COST    AFFINITY_CLIENT_STACK_SIZE
+#define SOCKS5_FASTOPEN_QUEUE  256
+#define SOCKS5_HANDSHAKE_MS    10000
+#define SOCKS5_CONNECT_MS      10000
+#define SOCKS5_DEADLINE_TICK_MS 100
+/* user / password request is the longest message, 513 bytes */
+#define SOCKS5_HANDSHAKE_SIZE  1024
+/* method, auth and request replies */
+#define SOCKS5_HANDSHAKE_REPLY_SIZE (2 + 2 + 4 + 1 + UINT8_MAX + 2)
+/* client greeting with user / password sub-negotiation behind it */
+#define SOCKS5_GREETING_SIZE (3 + 3 + 2 * UINT8_MAX)
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
 enum version
 {
     RESERVED = 0x00,
@@ -46,7 +85,9 @@ enum command
 {
     CONNECT = 0x01,
     BIND = 0x02,
-    UDPASSOCIATE = 0x03
+    UDPASSOCIATE = 0x03,
+    /* private, connection carries mux frames after reply */
+    MUX = 0x80,
 };
 
 enum type
@@ -74,27 +115,137 @@ struct socks5_device
     const char *ip;
     uint16_t port;
     enum version ver;
-    enum authentication_method method;
-    const char *username;
-    const char *password;
+};
+
+/* relay direction, pending data is [head, tail) */
+struct socks5_buffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t head;
+    size_t tail;
+    uint64_t active_ms;
+};
+
+/* blocking step of a client thread, socket is shut down once it's late */
+struct socks5_deadline
+{
+    struct timer_wheel_timer timer;
+    int fd;
+    uint64_t *expired;
+};
+
+enum socks5_stage
+{
+    SOCKS5_STAGE_GREETING,
+    SOCKS5_STAGE_AUTH,
+    SOCKS5_STAGE_REQUEST,
+    SOCKS5_STAGE_DONE,
+};
+
+/* server side handshake, parsed from in[head, tail), replies wait in out */
+struct socks5_handshake
+{
+    enum socks5_stage stage;
+    uint8_t in[SOCKS5_HANDSHAKE_SIZE];
+    size_t head;
+    size_t tail;
+    uint8_t out[SOCKS5_HANDSHAKE_REPLY_SIZE];
+    size_t out_len;
+    enum command command;
+    enum type type;
+    char addr[UINT8_MAX + 1];
+    uint8_t addr_size;
+    uint16_t port;
+    char user[UINT8_MAX + 1];
+};
+
+struct socks5_session_node
+{
+    struct socks5_session session;
+    struct socks5_session_node *prev;
+    struct socks5_session_node *next;
 };
 
 static pthread_t _main_thread_worker;
+static struct quiesce _quiesce;
+
+static pthread_mutex_t _sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct socks5_session_node *_sessions;
+static size_t _session_count;
 
 static struct socks5_device _device = {
     .fd = -1,
     .ip = "127.0.0.1",
     .port = 1080,
     .ver = VERSION5,
-    .method = NOAUTH,
-    .username = NULL,
-    .password = NULL,
 };
 
+/* deadlines are armed by client threads and run by accept thread */
+static pthread_mutex_t _deadlines_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timer_wheel _deadlines;
+static struct
+{
+    uint64_t handshake;
+    uint64_t connect;
+} _expired;
+static struct
+{
+    uint64_t done;
+    uint64_t failed;
+    uint64_t reads;
+} _handshakes;
+
+static bool _pipelined = false;
+static uint32_t _mux_delay_us = MUX_DEFAULT_DELAY_US;
+
 static volatile bool stop_main_thread = false;
 static volatile bool stop_client_thread = false;
 
-static int socks5_connect(enum type type, char const *addr, uint16_t port)
+static void _deadline_expired(struct timer_wheel_timer *timer, void *arg)
+{
+    struct socks5_deadline *d = arg;
+
+    /* blocked read / connect of owner fails right away */
+    shutdown(d->fd, SHUT_RDWR);
+    (*d->expired)++;
+}
+
+static void _deadline_arm(struct socks5_deadline *d, int fd, uint32_t ms,
+                          uint64_t *expired)
+{
+    pthread_mutex_lock(&_deadlines_lock);
+    timer_wheel_timer_init(&d->timer, _deadline_expired, d);
+    d->fd = fd;
+    d->expired = expired;
+    timer_wheel_arm(&_deadlines, &d->timer, util_now_ms() + ms);
+    pthread_mutex_unlock(&_deadlines_lock);
+}
+
+/* after cancel returns, timer can't touch fd anymore */
+static void _deadline_cancel(struct socks5_deadline *d)
+{
+    pthread_mutex_lock(&_deadlines_lock);
+    timer_wheel_cancel(&_deadlines, &d->timer);
+    pthread_mutex_unlock(&_deadlines_lock);
+}
+
+/* blocking connect bounded by SOCKS5_CONNECT_MS */
+static int _connect(int fd, struct sockaddr const *addr, socklen_t size)
+{
+    struct socks5_deadline deadline;
+
+    PROBE2(socks5_connect_start, fd, addr);
+    _deadline_arm(&deadline, fd, SOCKS5_CONNECT_MS, &_expired.connect);
+    int ret = connect(fd, addr, size);
+    _deadline_cancel(&deadline);
+    PROBE3(socks5_connect_done, fd, ret, ret < 0 ? errno : 0);
+
+    return ret;
+}
+
+static int socks5_connect(enum type type, char const *addr, uint16_t port,
+                          struct srcpool_lease *lease)
 {
     int fd = -1;
     struct sockaddr_in remote_sock = { 0 };
@@ -112,11 +263,19 @@ static int socks5_connect(enum type type, char const *addr, uint16_t port)
                 return -1;
             }
 
-            if (connect(fd, (struct sockaddr *)&remote_sock,
-                        sizeof(remote_sock))
+            if (netlink_mark_socket(fd) < 0
+                || srcpool_bind(fd, (struct sockaddr *)&remote_sock, lease)
+                       < 0) {
+                close(fd);
+                return -1;
+            }
+
+            if (_connect(fd, (struct sockaddr *)&remote_sock,
+                         sizeof(remote_sock))
                 < 0) {
                 log_error("socks5 connect sock failed! (%d / %s)", errno,
                           strerror(errno));
+                srcpool_release(lease);
                 close(fd);
                 return -1;
             }
@@ -142,7 +301,12 @@ static int socks5_connect(enum type type, char const *addr, uint16_t port)
                                   errno, strerror(errno));
                         continue;
                     }
-                    err = connect(fd, r->ai_addr, r->ai_addrlen);
+                    if (netlink_mark_socket(fd) < 0
+                        || srcpool_bind(fd, r->ai_addr, lease) < 0) {
+                        close(fd);
+                        continue;
+                    }
+                    err = _connect(fd, r->ai_addr, r->ai_addrlen);
                     if (err == 0) {
                         log_error("socks5 connected to remote! (%d / %s)",
                                   errno, strerror(errno));
@@ -153,6 +317,7 @@ static int socks5_connect(enum type type, char const *addr, uint16_t port)
                         log_error(
                             "socks5 failed to connect to remote! (%d / %s)",
                             errno, strerror(errno));
+                        srcpool_release(lease);
                         close(fd);
                     }
                 }
@@ -171,283 +336,859 @@ static int socks5_connect(enum type type, char const *addr, uint16_t port)
     return fd;
 }
 
-static int socks5_get_version(int fd)
+/* true while message of size bytes isn't complete in buffer */
+static bool _handshake_short(struct socks5_handshake const *h, size_t size)
+{
+    return h->tail - h->head < size;
+}
+
+static void _handshake_reply(struct socks5_handshake *h, uint8_t b0,
+                             uint8_t b1)
+{
+    h->out[h->out_len++] = b0;
+    h->out[h->out_len++] = b1;
+}
+
+static int _handshake_greeting(struct socks5_handshake *h)
+{
+    uint8_t const *msg = h->in + h->head;
+
+    if (_handshake_short(h, 2) || _handshake_short(h, 2 + msg[1])) {
+        return 0;
+    }
+
+    log_info("Version: %x, method: %x", msg[0], msg[1]);
+
+    if (msg[0] != _device.ver) {
+        return -1;
+    }
+
+    epoch_enter();
+    uint8_t method = config_get()->user[0] ? USERPASS : NOAUTH;
+    epoch_leave();
+
+    bool is_supported = memchr(msg + 2, method, msg[1]) != NULL;
+    h->head += 2 + msg[1];
+
+    if (!is_supported) {
+        _handshake_reply(h, VERSION5, NOMETHOD);
+        return -1;
+    }
+
+    log_info("method supported: %u", method);
+    _handshake_reply(h, VERSION5, method);
+    h->stage = method == USERPASS ? SOCKS5_STAGE_AUTH : SOCKS5_STAGE_REQUEST;
+
+    return 1;
+}
+
+static int _handshake_auth(struct socks5_handshake *h)
 {
-    uint8_t init_buf[2] = { 0 };
-    int bytes = read(fd, init_buf, sizeof(init_buf));
-    if (bytes != 2) {
-        log_error("socks5 failed to get initial packet with version (%d / %s)",
-                  errno, strerror(errno));
+    uint8_t const *msg = h->in + h->head;
+    char username[UINT8_MAX + 1] = { 0 };
+    char user_password[UINT8_MAX + 1] = { 0 };
+
+    if (_handshake_short(h, 2) || _handshake_short(h, 2 + msg[1] + 1)
+        || _handshake_short(h, 2 + msg[1] + 1 + msg[2 + msg[1]])) {
+        return 0;
+    }
+
+    /* rfc 1929 subnegotiation, any other version is refused outright */
+    if (msg[0] != AUTH_VERSION) {
+        _handshake_reply(h, AUTH_VERSION, AUTH_FAIL);
         return -1;
     }
 
-    log_info("Version: %x, method: %x", init_buf[0], init_buf[1]);
+    uint8_t username_size = msg[1];
+    uint8_t user_password_size = msg[2 + username_size];
+    memcpy(username, msg + 2, username_size);
+    memcpy(user_password, msg + 3 + username_size, user_password_size);
+    h->head += 3 + username_size + user_password_size;
+
+    epoch_enter();
+    struct config const *cfg = config_get();
+    bool _is_valid = (!strcmp(username, cfg->user)
+                      && !strcmp(user_password, cfg->password));
+    epoch_leave();
 
-    if (init_buf[0] != _device.ver) {
+    _handshake_reply(h, AUTH_VERSION, _is_valid ? AUTH_OK : AUTH_FAIL);
+    if (!_is_valid) {
         return -1;
     }
 
-    return init_buf[1];
+    snprintf(h->user, sizeof(h->user), "%s", username);
+    h->stage = SOCKS5_STAGE_REQUEST;
+
+    return 1;
 }
 
-static int socks5_authentication(int fd, int method_count)
+static int _handshake_request(struct socks5_handshake *h)
 {
-    bool is_supported = false;
-    for (int i = 0; i < method_count; i++) {
-        uint8_t method = 0;
-        read(fd, &method, sizeof(method));
-        if (method == _device.method) {
-            log_info("method supported: %u", method);
-            is_supported = true;
-            break;
-        }
+    uint8_t const *msg = h->in + h->head;
+    size_t addr_off = 4;
+
+    if (_handshake_short(h, 4)) {
+        return 0;
     }
 
-    if (!is_supported) {
-        uint8_t response[2] = { VERSION5, NOMETHOD };
-        write(fd, response, sizeof(response));
+    if (msg[0] != VERSION5) {
         return -1;
     }
 
-    switch (_device.method) {
-        case NOAUTH: {
-            uint8_t response[2] = { VERSION5, NOAUTH };
-            write(fd, response, sizeof(response));
-            return 0;
-        }
-        case USERPASS: {
-            uint8_t response[2] = { VERSION5, USERPASS };
-            write(fd, response, sizeof(response));
+    h->command = msg[1];
+    h->type = msg[3];
+
+    switch (h->type) {
+        case IPV4:
+            h->addr_size = 4;
+            break;
+        case DOMAIN:
+            if (_handshake_short(h, 5)) {
+                return 0;
+            }
+            h->addr_size = msg[4];
+            addr_off = 5;
+            break;
+        default:
+            log_error("Not supported type %u!", h->type);
+            return -1;
+    }
 
-            uint8_t msg;
-            read(fd, &msg, sizeof(msg));
+    if (_handshake_short(h, addr_off + h->addr_size + sizeof(h->port))) {
+        return 0;
+    }
 
-            uint8_t username_size = 0;
-            read(fd, &username_size, sizeof(username_size));
+    if (h->type == IPV4) {
+        inet_ntop(AF_INET, msg + addr_off, h->addr, sizeof(h->addr));
+    }
+    else {
+        memcpy(h->addr, msg + addr_off, h->addr_size);
+        h->addr[h->addr_size] = 0;
+    }
+    /* kept in network order, it's echoed back in reply */
+    memcpy(&h->port, msg + addr_off + h->addr_size, sizeof(h->port));
+    h->head += addr_off + h->addr_size + sizeof(h->port);
+    h->stage = SOCKS5_STAGE_DONE;
+
+    return 1;
+}
 
-            char username[username_size];
-            memset(username, 0, sizeof(username));
+/* consumes every complete message in buffer, 0 if more input is needed */
+static int _handshake_parse(struct socks5_handshake *h)
+{
+    int ret = 1;
 
-            read(fd, &username, username_size);
-            username[username_size] = 0;
+    while (ret > 0 && h->stage != SOCKS5_STAGE_DONE) {
+        switch (h->stage) {
+            case SOCKS5_STAGE_GREETING:
+                ret = _handshake_greeting(h);
+                break;
+            case SOCKS5_STAGE_AUTH:
+                ret = _handshake_auth(h);
+                break;
+            case SOCKS5_STAGE_REQUEST:
+                ret = _handshake_request(h);
+                break;
+            default:
+                ret = -1;
+                break;
+        }
+    }
 
-            uint8_t user_password_size = 0;
-            read(fd, &user_password_size, sizeof(user_password_size));
+    return ret;
+}
 
-            char user_password[user_password_size];
-            memset(user_password, 0, sizeof(user_password));
+static int _handshake_flush(struct socks5_handshake *h, int fd)
+{
+    size_t done = 0;
 
-            read(fd, &user_password, user_password_size);
-            user_password[user_password_size] = 0;
+    while (done < h->out_len) {
+        ssize_t bytes = send(fd, h->out + done, h->out_len - done,
+                             MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            return -1;
+        }
+        done += bytes;
+    }
 
-            bool _is_valid = (!strcmp(username, _device.username)
-                              && !strcmp(user_password, _device.password));
+    h->out_len = 0;
 
-            response[0] = AUTH_VERSION;
-            response[1] = _is_valid ? AUTH_OK : AUTH_FAIL;
-            write(fd, response, sizeof(response));
+    return 0;
+}
 
+/*
+ * Reads whatever client sent and parses as far as it goes, so greeting,
+ * authentication and request cost one recv each when they come one by one
+ * and one recv together when client pipelines them. Replies are held back
+ * until more input is needed, a pipelining client gets all of them with
+ * the request reply in one write. Bytes past the request stay in buffer.
+ */
+static int socks5_handshake(int fd, struct socks5_handshake *h)
+{
+    while (1) {
+        enum socks5_stage stage = h->stage;
+        int ret = _handshake_parse(h);
+        if (h->stage != stage) {
+            PROBE2(socks5_handshake_stage, fd, h->stage);
+        }
+        if (ret < 0) {
+            _handshake_flush(h, fd);
+            __atomic_add_fetch(&_handshakes.failed, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        if (h->stage == SOCKS5_STAGE_DONE) {
+            __atomic_add_fetch(&_handshakes.done, 1, __ATOMIC_RELAXED);
             return 0;
         }
-        case NOMETHOD:
-        default: {
+
+        /* client waits for these before sending next message */
+        if (_handshake_flush(h, fd) < 0) {
+            return -1;
+        }
+
+        if (h->head) {
+            memmove(h->in, h->in + h->head, h->tail - h->head);
+            h->tail -= h->head;
+            h->head = 0;
+        }
+
+        ssize_t bytes = recv(fd, h->in + h->tail, sizeof(h->in) - h->tail, 0);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            log_error("socks5 handshake cut short (%d / %s)", errno,
+                      strerror(errno));
+            __atomic_add_fetch(&_handshakes.failed, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        __atomic_add_fetch(&_handshakes.reads, 1, __ATOMIC_RELAXED);
+        h->tail += bytes;
+    }
+}
+
+/* data client pipelined behind its request goes to remote first */
+static int _handshake_forward(struct socks5_handshake *h, int fd)
+{
+    while (h->head < h->tail) {
+        ssize_t bytes = send(fd, h->in + h->head, h->tail - h->head,
+                             MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
             return -1;
         }
+        h->head += bytes;
     }
 
     return 0;
 }
 
-static int socks5_get_command(int fd, enum type *type)
+/* one write together with replies still held back, so a pipelining client
+ * gets its stacked replies together */
+static int socks5_send_response(int fd, struct socks5_handshake *h,
+                                enum status status)
 {
-    uint8_t data[4] = { 0 };
-    int bytes = read(fd, data, sizeof(data));
-    *type = data[3];
-    return bytes < 0 && bytes != sizeof(data) ? -1 : 0;
+    uint8_t *response = h->out + h->out_len;
+    size_t length = 4;
+
+    response[0] = VERSION5;
+    response[1] = status;
+    response[2] = RESERVED;
+    response[3] = h->type;
+
+    if (h->type == DOMAIN) {
+        response[length++] = h->addr_size;
+        memcpy(response + length, h->addr, h->addr_size);
+        length += h->addr_size;
+    }
+    else {
+        response[3] = IPV4;
+        if (inet_pton(AF_INET, h->addr, response + length) != 1) {
+            memset(response + length, 0, 4);
+        }
+        length += 4;
+    }
+    memcpy(response + length, &h->port, sizeof(h->port));
+    length += sizeof(h->port);
+    h->out_len += length;
+    PROBE2(socks5_reply, fd, status);
+
+    return _handshake_flush(h, fd);
 }
 
-static uint16_t socks5_get_port(int fd)
+static void _session_register(struct socks5_session_node *node)
 {
-    uint16_t port = 0;
-    read(fd, (uint8_t *)&port, sizeof(port));
-    return port;
+    pthread_mutex_lock(&_sessions_lock);
+    node->prev = NULL;
+    node->next = _sessions;
+    if (_sessions) {
+        _sessions->prev = node;
+    }
+    _sessions = node;
+    _session_count++;
+    pthread_mutex_unlock(&_sessions_lock);
+    quiesce_enter(&_quiesce);
 }
 
-static void _dump(uint8_t *buf, size_t size)
+static void _session_unregister(struct socks5_session_node *node)
 {
-    for (int i = 0; i < size; i++) {
-        printf("%u ", buf[i]);
+    quiesce_leave(&_quiesce);
+    pthread_mutex_lock(&_sessions_lock);
+    if (node->prev) {
+        node->prev->next = node->next;
+    }
+    else {
+        _sessions = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
     }
-    printf("\r\n");
+    _session_count--;
+    pthread_mutex_unlock(&_sessions_lock);
+}
+
+static size_t _buffer_next_size(struct socks5_buffer const *b)
+{
+    return b->size ? b->size * 2 : SOCKS5_BUFFER_MIN;
 }
 
-static char *socks5_get_ip(int fd)
+/* bytes next fill could take, after growing if buffer is full */
+static size_t _buffer_room(struct socks5_buffer const *b)
 {
-    uint8_t buf[4] = { 0 };
-    read(fd, buf, sizeof(buf));
-    _dump(buf, sizeof(buf));
-    char *ip = calloc(16, 1);
-    inet_ntop(AF_INET, buf, ip, 16);
-    ip[16] = 0;
-    return ip;
+    size_t used = b->tail - b->head;
+
+    return used < b->size ? b->size - used : _buffer_next_size(b) - used;
 }
 
-static char *socks5_get_domain(int fd, uint8_t *size)
+/* room to read into now or after growing within budget */
+static bool _buffer_can_fill(struct socks5_buffer const *b)
 {
-    uint8_t domain_size = 0;
+    if (b->tail - b->head < b->size) {
+        return true;
+    }
+
+    return b->size < SOCKS5_BUFFER_MAX
+           && membudget_fits(_buffer_next_size(b) - b->size);
+}
+
+static bool _buffer_reserve(struct socks5_buffer *b, uint64_t now)
+{
+    b->active_ms = now;
+
+    if (b->tail - b->head < b->size) {
+        return true;
+    }
+
+    if (b->size == SOCKS5_BUFFER_MAX) {
+        return false;
+    }
+
+    size_t size = _buffer_next_size(b);
+    if (!membudget_acquire(size - b->size)) {
+        return false;
+    }
+
+    uint8_t *data = realloc(b->data, size);
+    if (!data) {
+        membudget_release(size - b->size);
+        return false;
+    }
 
-    read(fd, &domain_size, sizeof(domain_size));
+    b->data = data;
+    b->size = size;
 
-    char *domain = calloc(domain_size, sizeof(char));
+    return true;
+}
 
-    read(fd, domain, domain_size);
+static void _buffer_free(struct socks5_buffer *b)
+{
+    membudget_release(b->size);
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
 
-    domain[domain_size] = 0;
-    *size = domain_size;
+static ssize_t _buffer_fill(struct socks5_buffer *b, int fd)
+{
+    if (b->head && b->tail == b->size) {
+        memmove(b->data, b->data + b->head, b->tail - b->head);
+        b->tail -= b->head;
+        b->head = 0;
+    }
+
+    ssize_t bytes = recv(fd, b->data + b->tail, b->size - b->tail,
+                         MSG_DONTWAIT);
+    if (bytes > 0) {
+        b->tail += bytes;
+    }
 
-    return domain;
+    return bytes;
 }
 
-static int socks5_send_response(int fd, char *ip, size_t size, uint16_t port,
-                                enum type type)
+static int _buffer_flush(struct socks5_buffer *b, int fd)
 {
-    uint8_t response[] = { VERSION5, SUCCESS, RESERVED, type };
-    write(fd, response, sizeof(response));
-    write(fd, ip, size);
-    write(fd, &port, sizeof(port));
+    while (b->head < b->tail) {
+        ssize_t bytes = send(fd, b->data + b->head, b->tail - b->head,
+                             MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (bytes < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        b->head += bytes;
+    }
+
+    b->head = b->tail = 0;
+
     return 0;
 }
 
-static void socks5_pipe(int fd0, int fd1)
+/* shaping class of relayed connection, client is the socks5 peer */
+static struct shaper_class *_session_class(int net_fd, int inet_fd,
+                                           char const *user)
+{
+    struct sockaddr_in client = { 0 };
+    struct sockaddr_in remote = { 0 };
+    socklen_t size = sizeof(client);
+
+    getpeername(net_fd, (struct sockaddr *)&client, &size);
+    size = sizeof(remote);
+    getpeername(inet_fd, (struct sockaddr *)&remote, &size);
+
+    return shaper_match(client.sin_family == AF_INET ? client.sin_addr.s_addr
+                                                     : 0,
+                        user && *user ? user : NULL,
+                        remote.sin_family == AF_INET ? remote.sin_addr.s_addr
+                                                     : 0);
+}
+
+/*
+ * Relays both directions through on-demand buffers charged to the memory
+ * budget. A direction whose buffer is full (or can't grow) stops polling
+ * its source, so tcp flow control slows the sender down instead of data
+ * being dropped.
+ */
+static void socks5_pipe(int fd0, int fd1, struct shaper_class *cls)
+{
+    struct socks5_session_node node = { .session = { fd0, fd1 } };
+    struct socks5_buffer buffers[2] = { 0 };
+    struct sockbuf sockbufs[2];
+    struct pollfd fds[3] = { 0 };
+    int const socks[2] = { fd0, fd1 };
+    bool draining = false;
+    bool eof[2] = { false, false };
+    /* hung up, bytes may still be queued until recv returns 0 */
+    bool hup[2] = { false, false };
+    bool done[2] = { false, false };
+    bool failed = false;
+
+    fds[0].fd = fd0;
+    fds[1].fd = fd1;
+    fds[2].fd = quiesce_fd(&_quiesce);
+    sockbuf_attach(&sockbufs[0], fd0, 0);
+    sockbuf_attach(&sockbufs[1], fd1, 0);
+
+    _session_register(&node);
+    PROBE2(socks5_relay_start, fd0, fd1);
+
+    while (!failed) {
+        uint64_t now = util_now_ms();
+        bool pending = false;
+        int timeout = -1;
+
+        fds[0].events = 0;
+        fds[1].events = 0;
+        fds[2].events = draining ? 0 : POLLIN;
+
+        /* buffers[d] carries fds[d] -> fds[!d] */
+        for (int d = 0; d < 2; d++) {
+            struct socks5_buffer *b = &buffers[d];
+            int wait_ms = -1;
+
+            sockbuf_tune(&sockbufs[d], now);
+
+            if (b->head < b->tail) {
+                fds[!d].events |= POLLOUT;
+                pending = true;
+            }
+            else if (eof[d] && !done[d]) {
+                /* pass half close on once everything is delivered */
+                shutdown(socks[!d], SHUT_WR);
+                done[d] = true;
+            }
+            else if (b->size && now - b->active_ms >= SOCKS5_BUFFER_IDLE_MS) {
+                _buffer_free(b);
+            }
+            else if (b->size) {
+                wait_ms = SOCKS5_BUFFER_IDLE_MS - (now - b->active_ms);
+            }
+
+            if (draining || eof[d]) {
+                /* nothing new is read, idle buffers are freed on park */
+            }
+            else if (_buffer_can_fill(b)) {
+                /* over rate, leave bytes in socket so tcp paces sender */
+                int shaped_ms = shaper_wait_ms(cls, _buffer_room(b));
+                if (shaped_ms) {
+                    wait_ms = shaped_ms;
+                }
+                else {
+                    fds[d].events |= POLLIN;
+                }
+            }
+            else if (b->head == b->tail) {
+                /* nothing to flush, wait for budget */
+                wait_ms = SOCKS5_BUDGET_RETRY_MS;
+            }
+
+            if (wait_ms >= 0 && (timeout < 0 || wait_ms < timeout)) {
+                timeout = wait_ms;
+            }
+        }
+
+        /* hung up socket polls ready at once, it's left out while its
+         * buffer is full and it isn't written to */
+        for (int d = 0; d < 2; d++) {
+            fds[d].fd = hup[d] && !fds[d].events ? -1 : socks[d];
+        }
+
+        if (!pending && ((done[0] && done[1]) || draining)) {
+            if (done[0] && done[1]) {
+                break;
+            }
+            /* park between transfers so the session can be handed over */
+            _buffer_free(&buffers[0]);
+            _buffer_free(&buffers[1]);
+            quiesce_park(&_quiesce);
+            draining = false;
+            continue;
+        }
+
+        int ret = poll(fds, ARRAY_SIZE(fds), timeout);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        if (fds[2].revents & POLLIN) {
+            draining = true;
+        }
+
+        for (int d = 0; d < 2 && !failed; d++) {
+            struct socks5_buffer *b = &buffers[d];
+
+            if (fds[d].revents & (POLLERR | POLLNVAL)) {
+                failed = true;
+            }
+            else if (fds[d].events & POLLIN
+                     && fds[d].revents & (POLLIN | POLLHUP)) {
+                ssize_t bytes = -1;
+                errno = EAGAIN;
+                if (_buffer_reserve(b, now)) {
+                    bytes = _buffer_fill(b, socks[d]);
+                }
+                if (bytes > 0) {
+                    shaper_consume(cls, bytes);
+                    PROBE3(socks5_relay, socks[d], socks[!d], bytes);
+                }
+                if (!bytes) {
+                    eof[d] = true;
+                }
+                else if (bytes < 0 && errno != EAGAIN && errno != EINTR) {
+                    failed = true;
+                }
+            }
+            else if (fds[d].revents & POLLHUP) {
+                hup[d] = true;
+            }
+
+            /* write straight away, most of the time peer can take it */
+            if (!failed && _buffer_flush(b, socks[!d]) < 0) {
+                failed = true;
+            }
+        }
+    }
+
+    _buffer_free(&buffers[0]);
+    _buffer_free(&buffers[1]);
+    sockbuf_detach(&sockbufs[0]);
+    sockbuf_detach(&sockbufs[1]);
+
+    PROBE3(socks5_relay_end, fd0, fd1, failed);
+    _session_unregister(&node);
+}
+
+static void *_session_thread(void *arg)
+{
+    struct socks5_session session = *(struct socks5_session *)arg;
+    free(arg);
+
+    socks5_pipe(session.inet_fd, session.net_fd,
+                _session_class(session.net_fd, session.inet_fd, NULL));
+
+    close(session.inet_fd);
+    close(session.net_fd);
+    membudget_release(SOCKS5_SESSION_COST);
+
+    return NULL;
+}
+
+/* mux connections park between frames so they can be handed over */
+static void _mux_session(int net_fd)
+{
+    struct socks5_session_node node = { .session = { -1, net_fd, true } };
+
+    _session_register(&node);
+    mux_serve(net_fd, _mux_delay_us, &_quiesce);
+    _session_unregister(&node);
+}
+
+static void *_mux_thread(void *fd)
+{
+    int net_fd = *(int *)fd;
+    free(fd);
+
+    _mux_session(net_fd);
+
+    close(net_fd);
+    membudget_release(SOCKS5_SESSION_COST);
+
+    return NULL;
+}
+
+/* idle clients can be handed over until their greeting arrives */
+static int _client_wait(int net_fd)
 {
-    int maxfd = (fd0 > fd1) ? fd0 : fd1;
-    fd_set rd_set = { 0 };
-    size_t nread = 0;
-    uint8_t buffer_r[BUFSIZE] = { 0 };
+    struct socks5_session_node node = { .session = { -1, net_fd } };
+    int wake_fd = quiesce_fd(&_quiesce);
+    int maxfd = (net_fd > wake_fd) ? net_fd : wake_fd;
+    fd_set rd_set;
+    int ret = 0;
+
+    _session_register(&node);
 
     while (1) {
         FD_ZERO(&rd_set);
-        FD_SET(fd0, &rd_set);
-        FD_SET(fd1, &rd_set);
-        int ret = select(maxfd + 1, &rd_set, NULL, NULL, NULL);
+        FD_SET(net_fd, &rd_set);
+        FD_SET(wake_fd, &rd_set);
+        ret = select(maxfd + 1, &rd_set, NULL, NULL, NULL);
 
         if (ret < 0 && errno == EINTR) {
             continue;
         }
 
-        if (FD_ISSET(fd0, &rd_set)) {
-            nread = recv(fd0, buffer_r, BUFSIZE, 0);
-            if (!nread) {
-                break;
-            }
-            send(fd1, (const void *)buffer_r, nread, 0);
+        if (ret < 0) {
+            break;
         }
 
-        if (FD_ISSET(fd1, &rd_set)) {
-            nread = recv(fd1, buffer_r, BUFSIZE, 0);
-            if (!nread) {
-                break;
-            }
-            send(fd0, (const void *)buffer_r, nread, 0);
+        if (FD_ISSET(wake_fd, &rd_set)) {
+            quiesce_park(&_quiesce);
+            continue;
+        }
+
+        if (FD_ISSET(net_fd, &rd_set)) {
+            break;
+        }
+    }
+
+    _session_unregister(&node);
+
+    return ret < 0 ? -1 : 0;
+}
+
+/* association lives until control connection closes or relay expires it */
+static void socks5_udp_associate(int net_fd, uint16_t port)
+{
+    uint8_t reply[10] = { VERSION5, SUCCESS, RESERVED, IPV4 };
+    struct sockaddr_in peer = { 0 };
+    struct sockaddr_in relay = { 0 };
+    socklen_t peer_size = sizeof(peer);
+    uint8_t discard[64];
+    int id = -1;
+
+    if (getpeername(net_fd, (struct sockaddr *)&peer, &peer_size) == 0) {
+        id = udp_relay_open(net_fd, peer.sin_addr.s_addr, port);
+    }
+
+    if (id < 0 || udp_relay_get_address(&relay) < 0) {
+        reply[1] = SERVER_FAIL;
+    }
+    memcpy(reply + 4, &relay.sin_addr, 4);
+    memcpy(reply + 8, &relay.sin_port, 2);
+
+    if (send(net_fd, reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply)
+        || id < 0) {
+        udp_relay_close(id);
+        return;
+    }
+
+    log_info("udp associate %s:%u", inet_ntoa(peer.sin_addr), ntohs(port));
+
+    while (1) {
+        ssize_t bytes = recv(net_fd, discard, sizeof(discard), 0);
+        if (bytes == 0 || (bytes < 0 && errno != EINTR)) {
+            break;
         }
     }
+
+    udp_relay_close(id);
 }
 
 static void *_client_thread(void *fd)
 {
+    int net_fd = *(int *)fd;
+    free(fd);
+
     while (!stop_client_thread) {
-        int net_fd = *(int *)fd;
         int inet_fd = -1;
-        enum type type = 0;
-        char *remote_addr = NULL;
-        uint8_t remote_addr_size = 4;
-        uint16_t port = 0;
-
-        int method_count = socks5_get_version(net_fd);
-        if (method_count < 0) {
-            log_error("Failed to verify version!");
-            exit(-1);
-            // return NULL;
-        }
-
-        if (socks5_authentication(net_fd, method_count) < 0) {
-            log_error("Failed authentification!");
-            exit(-1);
-            // return NULL;
-        }
-        log_info("Authentification success!");
-
-        if (socks5_get_command(net_fd, &type) < 0) {
-            log_error("Failed to get command!");
-            exit(-1);
-            // return NULL;
-        }
-        log_info("Command type %d success!", type);
-
-        switch (type) {
-            case IPV4: {
-                remote_addr = socks5_get_ip(net_fd);
-                port = socks5_get_port(net_fd);
-                log_info("remote ip address: %s : %u", remote_addr, port);
-                inet_fd = socks5_connect(IPV4, remote_addr, ntohs(port));
-                if (inet_fd < 0) {
-                    log_error("failed to connect to socket");
-                    // return NULL;
-                }
-
-                break;
+        struct srcpool_lease lease = { 0 };
+        struct socks5_handshake handshake = { .stage = SOCKS5_STAGE_GREETING };
+        struct socks5_deadline deadline;
+
+        /* half open clients are cut off once handshake takes too long */
+        _deadline_arm(&deadline, net_fd, SOCKS5_HANDSHAKE_MS,
+                      &_expired.handshake);
+
+        if (_client_wait(net_fd) < 0) {
+            log_error("Failed to wait for client!");
+            _deadline_cancel(&deadline);
+            close(net_fd);
+            break;
+        }
+        PROBE1(socks5_handshake_start, net_fd);
+
+        int handshake_ret = socks5_handshake(net_fd, &handshake);
+        PROBE3(socks5_handshake_done, net_fd, handshake_ret,
+               handshake.command);
+        if (handshake_ret < 0) {
+            log_error("Failed socks5 handshake!");
+            _deadline_cancel(&deadline);
+            close(net_fd);
+            break;
+        }
+        _deadline_cancel(&deadline);
+        log_info("Command %d type %d success!", handshake.command,
+                 handshake.type);
+
+        if (handshake.command == MUX) {
+            /* client waits for reply before its first frame */
+            if (handshake.head != handshake.tail) {
+                log_error("mux client sent frames before reply");
             }
-            case DOMAIN: {
-                remote_addr = socks5_get_domain(net_fd, &remote_addr_size);
-                port = socks5_get_port(net_fd);
-                log_info("remote domain address: %s : %u", remote_addr, port);
-                inet_fd = socks5_connect(DOMAIN, remote_addr, ntohs(port));
-                if (inet_fd < 0) {
-                    log_error("failed to connect to socket");
-                    // return NULL;
-                }
-                break;
+            else if (socks5_send_response(net_fd, &handshake, SUCCESS) == 0) {
+                log_info("mux connection started");
+                _mux_session(net_fd);
             }
-            default: {
-                log_error("Not supported type %u!", type);
-                errno = -EINVAL;
-                // return NULL;
+
+            close(net_fd);
+            break;
+        }
+
+        if (handshake.command == UDPASSOCIATE) {
+            /* DST.ADDR is client's own address, only its port is used */
+            if (_handshake_flush(&handshake, net_fd) == 0) {
+                socks5_udp_associate(net_fd, handshake.port);
             }
+
+            close(net_fd);
+            break;
+        }
+
+        log_info("remote %s address: %s : %u",
+                 handshake.type == DOMAIN ? "domain" : "ip", handshake.addr,
+                 ntohs(handshake.port));
+        inet_fd = socks5_connect(handshake.type, handshake.addr,
+                                 ntohs(handshake.port), &lease);
+        if (inet_fd < 0) {
+            log_error("failed to connect to socket");
         }
 
-        if (socks5_send_response(net_fd, remote_addr, remote_addr_size, port,
-                                 type)
+        if (socks5_send_response(net_fd, &handshake,
+                                 inet_fd < 0 ? HOST_UNREACHABLE : SUCCESS)
             < 0) {
             log_error("Failed to send response");
-            // return NULL;
         }
 
-        if (remote_addr) {
-            free(remote_addr);
+        if (inet_fd >= 0 && _handshake_forward(&handshake, inet_fd) == 0) {
+            socks5_pipe(inet_fd, net_fd,
+                        _session_class(net_fd, inet_fd, handshake.user));
         }
 
-        socks5_pipe(inet_fd, net_fd);
-
         close(inet_fd);
+        srcpool_release(&lease);
         close(net_fd);
+        break;
     }
 
+    membudget_release(SOCKS5_SESSION_COST);
+
     return NULL;
 }
 
 static void *_main_thread(void *fd)
 {
     int sock_fd = *(int *)fd;
+    int wake_fd = quiesce_fd(&_quiesce);
+    int maxfd = (sock_fd > wake_fd) ? sock_fd : wake_fd;
+    bool announce = true;
+
+    quiesce_enter(&_quiesce);
+
     while (!stop_main_thread) {
         struct sockaddr_in remote = { 0 };
         socklen_t remotelen = 0;
         pthread_t worker = 0;
+        fd_set rd_set;
+        /* out of budget, leave new connections in listen backlog */
+        bool accepting = membudget_fits(SOCKS5_SESSION_COST);
+
+        /* deadlines are armed by other threads and are further out than
+         * one wheel turn, so waking once per turn is enough */
+        pthread_mutex_lock(&_deadlines_lock);
+        timer_wheel_advance(&_deadlines, util_now_ms());
+        int wait_ms = timer_wheel_timeout_ms(&_deadlines, util_now_ms());
+        pthread_mutex_unlock(&_deadlines_lock);
+        if (wait_ms < 0) {
+            wait_ms = SOCKS5_DEADLINE_TICK_MS * TIMER_WHEEL_SLOTS;
+        }
+        if (!accepting && wait_ms > SOCKS5_BUDGET_RETRY_MS) {
+            wait_ms = SOCKS5_BUDGET_RETRY_MS;
+        }
+        struct timeval timeout = { wait_ms / 1000, (wait_ms % 1000) * 1000 };
+
+        if (accepting && announce) {
+            log_info("waiting for socks5 connections!");
+            announce = false;
+        }
+
+        FD_ZERO(&rd_set);
+        if (accepting) {
+            FD_SET(sock_fd, &rd_set);
+        }
+        FD_SET(wake_fd, &rd_set);
+        if (select(maxfd + 1, &rd_set, NULL, NULL, &timeout) <= 0) {
+            continue;
+        }
+
+        if (FD_ISSET(wake_fd, &rd_set)) {
+            quiesce_park(&_quiesce);
+            continue;
+        }
+
+        if (!membudget_acquire(SOCKS5_SESSION_COST)) {
+            continue;
+        }
 
-        log_info("waiting for socks5 connections!");
         int net_fd = accept(sock_fd, (struct sockaddr *)&remote, &remotelen);
         if (net_fd < 0) {
             log_error("socks5 failed to accept client (%u / %s)", errno,
                       strerror(errno));
+            membudget_release(SOCKS5_SESSION_COST);
+            continue;
         }
 
         int one = 1;
@@ -457,13 +1198,77 @@ static void *_main_thread(void *fd)
         }
 
         log_info("accepted connection");
-        if (pthread_create(&worker, NULL, &_client_thread, &net_fd) != 0) {
-            pthread_detach(worker);
+        announce = true;
+        int *arg = malloc(sizeof(*arg));
+        if (!arg) {
+            membudget_release(SOCKS5_SESSION_COST);
+            close(net_fd);
+            continue;
         }
+        *arg = net_fd;
+        if (affinity_thread_create(&worker, AFFINITY_SOCKS5_CLIENT,
+                                   &_client_thread, arg) != 0) {
+            membudget_release(SOCKS5_SESSION_COST);
+            free(arg);
+            close(net_fd);
+            continue;
+        }
+        pthread_detach(worker);
     }
+
+    quiesce_leave(&_quiesce);
+
     return NULL;
 }
 
+static void _socks5_report()
+{
+    uint64_t done = __atomic_load_n(&_handshakes.done, __ATOMIC_RELAXED);
+    uint64_t failed = __atomic_load_n(&_handshakes.failed, __ATOMIC_RELAXED);
+    uint64_t reads = __atomic_load_n(&_handshakes.reads, __ATOMIC_RELAXED);
+
+    log_info("socks5: handshakes %lu (failed %lu), %.2f reads per handshake",
+             done, failed,
+             done + failed ? (double)reads / (done + failed) : 0.0);
+
+    pthread_mutex_lock(&_deadlines_lock);
+    log_info("socks5: deadlines armed %zu, handshake timeouts %lu, connect "
+             "timeouts %lu",
+             _deadlines.armed, _expired.handshake, _expired.connect);
+    pthread_mutex_unlock(&_deadlines_lock);
+}
+
+static int socks5_start(int sock_fd, char const *server_ip, uint16_t port)
+{
+    _device.fd = sock_fd;
+    _device.ip = server_ip;
+    _device.port = port;
+
+    if (quiesce_init(&_quiesce) < 0) {
+        log_error("socks5 quiesce init failed (%u / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    log_info("Start listening on %s:%u", _device.ip, _device.port);
+
+    timer_wheel_init(&_deadlines, SOCKS5_DEADLINE_TICK_MS, util_now_ms());
+    stats_register(_socks5_report);
+
+    if (udp_relay_init(server_ip) < 0) {
+        log_warn("socks5 udp associate unavailable");
+    }
+
+    if (affinity_thread_create(&_main_thread_worker, AFFINITY_SOCKS5_ACCEPT,
+                               &_main_thread, &_device.fd)
+        != 0) {
+        pthread_detach(_main_thread_worker);
+        return -1;
+    }
+
+    return 0;
+}
+
 int socks5_init(char const *server_ip, uint16_t port)
 {
     int optval = 1;
@@ -485,6 +1290,13 @@ int socks5_init(char const *server_ip, uint16_t port)
         return -1;
     }
 
+    /* accepted sockets inherit mark, replies to remote clients must not be
+     * routed into the tunnel */
+    if (netlink_mark_socket(sock_fd) < 0) {
+        close(sock_fd);
+        return -1;
+    }
+
     struct sockaddr_in local = {
         .sin_family = AF_INET,
         .sin_port = htons(port),
@@ -497,29 +1309,125 @@ int socks5_init(char const *server_ip, uint16_t port)
         return -1;
     }
 
+    /* accept data in SYN from pipelining clients */
+    optval = SOCKS5_FASTOPEN_QUEUE;
+    if (setsockopt(sock_fd, SOL_TCP, TCP_FASTOPEN, &optval, sizeof(optval))
+        < 0) {
+        log_warn("socks5 fast open unavailable (%u / %s)", errno,
+                 strerror(errno));
+    }
+
     if (listen(sock_fd, MAX_CLIENTS) < 0) {
         log_error("socks5 socket listen start failed (%u / %s)", errno,
                   strerror(errno));
         return -1;
     }
 
-    _device.fd = sock_fd;
-    _device.ip = server_ip;
-    _device.port = port;
+    return socks5_start(sock_fd, server_ip, port);
+}
 
-    log_info("Start listening on %s:%u", _device.ip, _device.port);
+int socks5_adopt(int sock_fd, char const *server_ip, uint16_t port)
+{
+    if (sock_fd < 0) {
+        errno = -EINVAL;
+        log_error("socks5 adopted socket invalid (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
 
-    if (pthread_create(&_main_thread_worker, NULL, &_main_thread, &_device.fd)
-        != 0) {
-        pthread_detach(_main_thread_worker);
+    log_info("socks5 adopted listening socket %d", sock_fd);
+
+    return socks5_start(sock_fd, server_ip, port);
+}
+
+int socks5_adopt_session(int net_fd, int inet_fd, bool mux)
+{
+    pthread_t worker = 0;
+
+    /* handed over sessions are kept even past the budget */
+    membudget_charge(SOCKS5_SESSION_COST);
+
+    if (inet_fd < 0) {
+        int *arg = malloc(sizeof(*arg));
+        if (!arg) {
+            membudget_release(SOCKS5_SESSION_COST);
+            return -1;
+        }
+        *arg = net_fd;
+        if (affinity_thread_create(&worker, AFFINITY_SOCKS5_CLIENT,
+                                   mux ? &_mux_thread : &_client_thread, arg)
+            != 0) {
+            membudget_release(SOCKS5_SESSION_COST);
+            free(arg);
+            return -1;
+        }
+        pthread_detach(worker);
+        return 0;
+    }
+
+    struct socks5_session *session = malloc(sizeof(*session));
+    if (!session) {
+        membudget_release(SOCKS5_SESSION_COST);
         return -1;
     }
 
+    session->net_fd = net_fd;
+    session->inet_fd = inet_fd;
+
+    if (affinity_thread_create(&worker, AFFINITY_SOCKS5_CLIENT,
+                               &_session_thread, session) != 0) {
+        log_error("socks5 session thread failed (%u / %s)", errno,
+                  strerror(errno));
+        membudget_release(SOCKS5_SESSION_COST);
+        free(session);
+        return -1;
+    }
+
+    pthread_detach(worker);
+
     return 0;
 }
 
+int socks5_get_listener()
+{
+    return _device.fd;
+}
+
+size_t socks5_get_sessions(struct socks5_session *sessions, size_t max)
+{
+    size_t count = 0;
+
+    pthread_mutex_lock(&_sessions_lock);
+    for (struct socks5_session_node *node = _sessions; node && count < max;
+         node = node->next) {
+        sessions[count++] = node->session;
+    }
+    pthread_mutex_unlock(&_sessions_lock);
+
+    return count;
+}
+
+size_t socks5_get_session_count()
+{
+    pthread_mutex_lock(&_sessions_lock);
+    size_t count = _session_count;
+    pthread_mutex_unlock(&_sessions_lock);
+    return count;
+}
+
+int socks5_suspend(int timeout_ms)
+{
+    return quiesce_suspend(&_quiesce, timeout_ms);
+}
+
+void socks5_resume()
+{
+    quiesce_resume(&_quiesce);
+}
+
 int socks5_deinit()
 {
+    udp_relay_deinit();
     close(_device.fd);
     stop_main_thread = true;
     stop_client_thread = true;
@@ -527,84 +1435,208 @@ int socks5_deinit()
 }
 
 /* client side */
-int socks5_send_connect_request(int fd, const char *ip, uint8_t len,
-                                uint16_t port)
+static size_t _build_request(uint8_t *buf, enum command command,
+                             char const *ip, uint8_t len, uint16_t port)
 {
-    enum type type = DOMAIN;
+    size_t buf_len = 4;
+
+    buf[0] = VERSION5;
+    buf[1] = command;
+    buf[2] = RESERVED;
+
     if (is_ip_v4_valid(ip)) {
-        type = IPV4;
+        buf[3] = IPV4;
+        inet_pton(AF_INET, ip, buf + buf_len);
+        buf_len += 4;
     }
-    else if (is_ip_v6_valid(ip)) {
-        log_error("not supported ip");
-        return -1;
+    else {
+        buf[3] = DOMAIN;
+        buf[buf_len++] = len;
+        memcpy(buf + buf_len, ip, len);
+        buf_len += len;
     }
 
-    switch (type) {
-        case IPV4: {
-            uint8_t buf[1024] = { VERSION5, UDPASSOCIATE, RESERVED, IPV4 };
-            size_t buf_len = 4;
-            uint8_t req_ip[4] = { 0 };
-            inet_pton(AF_INET, ip, req_ip);
-            memcpy(buf + buf_len, req_ip, sizeof(req_ip));
-            buf_len += sizeof(req_ip);
-            memcpy(buf + buf_len, &port, sizeof(port));
-            buf_len += sizeof(port);
-            buf[buf_len] = 0;
-            return write(fd, buf, buf_len);
+    memcpy(buf + buf_len, &port, sizeof(port));
+    buf_len += sizeof(port);
+
+    return buf_len;
+}
+
+static int _read_exact(int fd, uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t bytes = tls_recv(fd, buf + done, size - done, 0);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
         }
-        case DOMAIN: {
-            uint8_t buf[1024] = { VERSION5, UDPASSOCIATE, RESERVED, DOMAIN };
-            size_t buf_len = 4;
-            memcpy(buf + buf_len, &len, sizeof(len));
-            buf_len += sizeof(len);
-            memcpy(buf + buf_len, ip, len);
-            buf_len += len;
-            memcpy(buf + buf_len, &port, sizeof(port));
-            buf_len += sizeof(port);
-            buf[buf_len] = 0;
-            return write(fd, buf, buf_len);
+        if (bytes <= 0) {
+            return -1;
         }
+        done += bytes;
+    }
+
+    return 0;
+}
+
+static int socks5_recv_reply(int fd)
+{
+    uint8_t reply[4 + 1 + UINT8_MAX + sizeof(uint16_t)] = { 0 };
+    size_t addr_len = 0;
+
+    if (_read_exact(fd, reply, 4) < 0) {
+        log_error("socks5 reply missing (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    if (reply[0] != VERSION5 || reply[1] != SUCCESS) {
+        log_error("socks5 request failed, version %u status %u", reply[0],
+                  reply[1]);
+        return -1;
+    }
+
+    switch (reply[3]) {
+        case IPV4:
+            addr_len = 4;
+            break;
+        case DOMAIN:
+            if (_read_exact(fd, reply + 4, 1) < 0) {
+                return -1;
+            }
+            addr_len = reply[4];
+            break;
         default:
+            log_error("socks5 reply address type %u not supported", reply[3]);
             return -1;
     }
-    return -1;
+
+    return _read_exact(fd, reply + 5, addr_len + sizeof(uint16_t));
+}
+
+/* offers the one method config asks for, credentials follow right behind
+ * so authentication costs no extra round trip */
+static size_t _client_greeting(uint8_t *buf)
+{
+    size_t len = 0;
+
+    epoch_enter();
+    struct config const *cfg = config_get();
+    size_t user_len = strlen(cfg->user);
+    size_t password_len = strlen(cfg->password);
+
+    buf[len++] = VERSION5;
+    buf[len++] = 0x01;
+    buf[len++] = user_len ? USERPASS : NOAUTH;
+    if (user_len) {
+        buf[len++] = AUTH_VERSION;
+        buf[len++] = user_len;
+        memcpy(buf + len, cfg->user, user_len);
+        len += user_len;
+        buf[len++] = password_len;
+        memcpy(buf + len, cfg->password, password_len);
+        len += password_len;
+    }
+    epoch_leave();
+
+    return len;
 }
 
 int socks5_send_method(int fd)
 {
-    char buf[3] = { VERSION5, 0x01, NOAUTH };
-    return write(fd, buf, sizeof(buf));
+    uint8_t buf[SOCKS5_GREETING_SIZE];
+    return tls_send(fd, buf, _client_greeting(buf), MSG_NOSIGNAL);
 }
 
 int socks5_recv_method(int fd)
 {
     uint8_t method_buf[2] = { 0 };
 
-    read(fd, method_buf, 2);
+    if (_read_exact(fd, method_buf, sizeof(method_buf)) < 0) {
+        log_error("socks5 method reply missing");
+        return -1;
+    }
 
     if (method_buf[0] != VERSION5) {
         log_error("socks5 version failure");
         return -1;
     }
 
-    if (method_buf[1] != NOAUTH) {
+    if (method_buf[1] != NOAUTH && method_buf[1] != USERPASS) {
         log_error("socks5 authentication method mismatch");
         return -1;
     }
 
+    if (method_buf[1] == USERPASS
+        && (_read_exact(fd, method_buf, sizeof(method_buf)) < 0
+            || method_buf[1] != AUTH_OK)) {
+        log_error("socks5 authentication failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+void socks5_set_pipelined(bool enabled)
+{
+    _pipelined = enabled;
+}
+
+int socks5_client_fastopen(int fd)
+{
+    int one = 1;
+
+    if (!_pipelined) {
+        return 0;
+    }
+
+    /* connect() returns at once, SYN leaves with first write */
+    if (setsockopt(fd, SOL_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) < 0) {
+        log_warn("socks5 fast open connect unavailable (%d / %s)", errno,
+                 strerror(errno));
+        return -1;
+    }
+
     return 0;
 }
 
-int socks5_send_packet(int fd, const char *ip, uint16_t port, uint8_t *buf,
-                       size_t size)
+void socks5_set_mux_delay(uint32_t delay_us)
+{
+    _mux_delay_us = delay_us;
+}
+
+int socks5_client_mux(int fd)
 {
-    struct sockaddr_in dst = { .sin_addr.s_addr =
-                                   ((struct iphdr *)buf)->daddr };
-    char *dest = inet_ntoa(dst.sin_addr);
+    uint8_t request[4 + 1 + UINT8_MAX + sizeof(uint16_t)];
+    size_t request_len = _build_request(request, MUX, "0.0.0.0", 7, 0);
+
+    if (_pipelined) {
+        uint8_t greeting[SOCKS5_GREETING_SIZE];
+        size_t greeting_len = _client_greeting(greeting);
+        struct iovec iov[2] = {
+            { .iov_base = greeting, .iov_len = greeting_len },
+            { .iov_base = request, .iov_len = request_len },
+        };
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = ARRAY_SIZE(iov) };
+        if (tls_sendmsg(fd, &msg, MSG_NOSIGNAL)
+            != (ssize_t)(greeting_len + request_len)) {
+            log_error("socks5 mux request failed (%d / %s)", errno,
+                      strerror(errno));
+            return -1;
+        }
+    }
+    else if (socks5_send_method(fd) < 0 || socks5_recv_method(fd) < 0
+             || tls_send(fd, request, request_len, MSG_NOSIGNAL)
+                    != (ssize_t)request_len) {
+        log_error("socks5 mux request failed (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
 
-    socks5_send_method(fd);
-    socks5_recv_method(fd);
-    socks5_send_connect_request(fd, dest, strlen(dest), port);
+    if ((_pipelined && socks5_recv_method(fd) < 0)
+        || socks5_recv_reply(fd) < 0) {
+        return -1;
+    }
 
-    return write(fd, buf, size);
+    return 0;
 }
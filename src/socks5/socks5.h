@@ -1,9 +1,18 @@
 #ifndef __SOCKS5_H__
 #define __SOCKS5_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
+struct socks5_session
+{
+    int inet_fd;
+    int net_fd;
+    /* mux connection, inet_fd is -1 */
+    bool mux;
+};
+
 /**
  * @brief initialize socks5 proxy socket
  * @param server_ip server ip
@@ -12,6 +21,57 @@
  */
 int socks5_init(char const *server_ip, uint16_t port);
 
+/**
+ * @brief take over listening socket from previous process
+ * @param sock_fd received listening socket
+ * @param server_ip server ip
+ * @param port server port
+ * @return 0 on success, -errno on failure
+ */
+int socks5_adopt(int sock_fd, char const *server_ip, uint16_t port);
+
+/**
+ * @brief continue serving session from previous process
+ * @param net_fd client socket
+ * @param inet_fd remote socket, -1 for idle client before handshake
+ * @param mux net_fd is a mux connection between frames
+ * @return 0 on success, -errno on failure
+ */
+int socks5_adopt_session(int net_fd, int inet_fd, bool mux);
+
+/**
+ * @brief get listening socket
+ * @return file descriptor, -1 if not listening
+ */
+int socks5_get_listener();
+
+/**
+ * @brief get idle, relaying and mux sessions
+ * @param sessions destination array
+ * @param max destination array size
+ * @return number of sessions copied
+ */
+size_t socks5_get_sessions(struct socks5_session *sessions, size_t max);
+
+/**
+ * @brief get number of idle, relaying and mux sessions
+ * @return session count
+ */
+size_t socks5_get_session_count();
+
+/**
+ * @brief park accept loop, relaying sessions between transfers and mux
+ *        sessions between frames
+ * @param timeout_ms max time to wait for loops
+ * @return 0 on success, -1 on timeout
+ */
+int socks5_suspend(int timeout_ms);
+
+/**
+ * @brief restart parked loops
+ */
+void socks5_resume();
+
 /**
  * @brief deinitialize socks5 proxy socket
  * @return 0 on success, -errno on failure
@@ -19,15 +79,32 @@ int socks5_init(char const *server_ip, uint16_t port);
 int socks5_deinit();
 
 /**
- * @brief send packet to destination ip via socks5
- * @param fd socks file descriptor
- * @param ip destination ip
- * @param port destination port
- * @param buf pointer to data buffer
- * @param size data buffer size
- * @return 0 on success, -errno on failure
+ * @brief enable optimistic client handshake, greeting, request and first
+ *        data leave in one segment and stacked replies are checked after
+ * @param enabled true to pipeline, false for one round trip per step
+ */
+void socks5_set_pipelined(bool enabled);
+
+/**
+ * @brief let client socket carry its first write in SYN when pipelining,
+ *        call before connect
+ * @param fd client socket
+ * @return 0 on success or when pipelining is off, -1 if kernel refused
+ */
+int socks5_client_fastopen(int fd);
+
+/**
+ * @brief set coalescing delay of frames mux connections send to clients
+ * @param delay_us max time a frame waits, 0 writes once per loop pass
+ */
+void socks5_set_mux_delay(uint32_t delay_us);
+
+/**
+ * @brief switch connected client socket to multiplexed transport, uses
+ *        pipelined handshake when enabled
+ * @param fd socket connected to socks5 server
+ * @return 0 on success, -1 on failure
  */
-int socks5_send_packet(int fd, const char *ip, uint16_t port, uint8_t *buf,
-                       size_t size);
+int socks5_client_mux(int fd);
 
 #endif /* __SOCKS5_H__ */
@@ -0,0 +1,289 @@
+#include "srcpool.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "stats.h"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+    #define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+/* linux 6.3+, older kernels use net.ipv4.ip_local_port_range */
+#ifndef IP_LOCAL_PORT_RANGE
+    #define IP_LOCAL_PORT_RANGE 51
+#endif
+
+#define SRCPOOL_PORT_RANGE_PATH "/proc/sys/net/ipv4/ip_local_port_range"
+
+struct srcpool_source
+{
+    uint32_t addr;
+    uint16_t first;
+    uint16_t last;
+    uint64_t active;
+    uint64_t connects;
+    uint64_t failed;
+};
+
+/* connections of one destination per source */
+struct srcpool_dest
+{
+    uint32_t addr;
+    uint16_t port;
+    uint32_t total;
+    uint32_t counts[SRCPOOL_MAX_SOURCES];
+    struct srcpool_dest *next;
+};
+
+static struct
+{
+    struct srcpool_source sources[SRCPOOL_MAX_SOURCES];
+    size_t count;
+    bool range_option;
+    pthread_mutex_t lock;
+    struct srcpool_dest *buckets[SRCPOOL_BUCKETS];
+    size_t dests;
+    uint64_t exhausted;
+} _pool = {
+    .range_option = true,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t _bucket(uint32_t addr, uint16_t port)
+{
+    uint32_t h = (addr ^ ((uint32_t)port << 16 | port)) * 0x9e3779b1u;
+    return h % SRCPOOL_BUCKETS;
+}
+
+static struct srcpool_dest **_lookup(uint32_t addr, uint16_t port)
+{
+    struct srcpool_dest **d = &_pool.buckets[_bucket(addr, port)];
+
+    while (*d && ((*d)->addr != addr || (*d)->port != port)) {
+        d = &(*d)->next;
+    }
+
+    return d;
+}
+
+static uint32_t _used(struct srcpool_dest const *dest, size_t source)
+{
+    return dest ? dest->counts[source] : 0;
+}
+
+/* least used source for dest that still has ports, ties go to source with
+ * fewer connections overall */
+static ssize_t _pick(struct srcpool_dest const *dest)
+{
+    ssize_t best = -1;
+
+    for (size_t i = 0; i < _pool.count; i++) {
+        struct srcpool_source const *src = &_pool.sources[i];
+        uint32_t used = _used(dest, i);
+
+        if (used > (uint32_t)(src->last - src->first)) {
+            continue;
+        }
+        if (best < 0 || used < _used(dest, best)
+            || (used == _used(dest, best)
+                && src->active < _pool.sources[best].active)) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+static void _srcpool_report()
+{
+    pthread_mutex_lock(&_pool.lock);
+    log_info("srcpool: %zu sources, %zu destinations, exhausted %llu",
+             _pool.count, _pool.dests, (unsigned long long)_pool.exhausted);
+    for (size_t i = 0; i < _pool.count; i++) {
+        struct srcpool_source const *src = &_pool.sources[i];
+        struct in_addr addr = { .s_addr = src->addr };
+
+        log_info("srcpool: %s ports %u - %u, active %llu, connects %llu, "
+                 "bind failures %llu",
+                 inet_ntoa(addr), src->first, src->last,
+                 (unsigned long long)src->active,
+                 (unsigned long long)src->connects,
+                 (unsigned long long)src->failed);
+    }
+    pthread_mutex_unlock(&_pool.lock);
+}
+
+int srcpool_add(char const *spec)
+{
+    struct srcpool_source src = { 0 };
+    char ip[INET_ADDRSTRLEN] = { 0 };
+    char const *range = spec ? strchr(spec, ':') : NULL;
+    size_t len = range ? (size_t)(range - spec) : (spec ? strlen(spec) : 0);
+    char *end = NULL;
+
+    if (!len || len >= sizeof(ip)) {
+        errno = -EINVAL;
+        return -1;
+    }
+    memcpy(ip, spec, len);
+    if (inet_pton(AF_INET, ip, &src.addr) != 1) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    if (range) {
+        unsigned long first = strtoul(range + 1, &end, 10);
+        unsigned long last = *end == '-' ? strtoul(end + 1, &end, 10) : 0;
+        if (end == range + 1 || *end || !first || last < first
+            || last > UINT16_MAX) {
+            errno = -EINVAL;
+            return -1;
+        }
+        src.first = first;
+        src.last = last;
+    }
+
+    if (_pool.count == SRCPOOL_MAX_SOURCES) {
+        errno = -ENOSPC;
+        return -1;
+    }
+
+    _pool.sources[_pool.count++] = src;
+
+    return 0;
+}
+
+int srcpool_init()
+{
+    unsigned int first = 32768;
+    unsigned int last = 60999;
+
+    if (!_pool.count) {
+        return 0;
+    }
+
+    FILE *file = fopen(SRCPOOL_PORT_RANGE_PATH, "r");
+    if (file) {
+        if (fscanf(file, "%u %u", &first, &last) != 2) {
+            log_warn("srcpool: unreadable %s, assuming %u - %u",
+                     SRCPOOL_PORT_RANGE_PATH, first, last);
+        }
+        fclose(file);
+    }
+
+    for (size_t i = 0; i < _pool.count; i++) {
+        if (!_pool.sources[i].first) {
+            _pool.sources[i].first = first;
+            _pool.sources[i].last = last;
+        }
+    }
+
+    stats_register(_srcpool_report);
+
+    return 0;
+}
+
+int srcpool_bind(int fd, struct sockaddr const *remote,
+                 struct srcpool_lease *lease)
+{
+    struct sockaddr_in const *dst = (struct sockaddr_in const *)remote;
+    struct sockaddr_in local = { .sin_family = AF_INET };
+    int one = 1;
+
+    lease->dest = NULL;
+    if (!_pool.count || remote->sa_family != AF_INET) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&_pool.lock);
+    struct srcpool_dest **slot = _lookup(dst->sin_addr.s_addr, dst->sin_port);
+    ssize_t index = _pick(*slot);
+    if (index < 0) {
+        _pool.exhausted++;
+        pthread_mutex_unlock(&_pool.lock);
+        errno = -EADDRNOTAVAIL;
+        log_error("srcpool: no free source port for %s:%u! (%d / %s)",
+                  inet_ntoa(dst->sin_addr), ntohs(dst->sin_port), errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    if (!*slot) {
+        *slot = calloc(1, sizeof(**slot));
+        if (!*slot) {
+            pthread_mutex_unlock(&_pool.lock);
+            return -1;
+        }
+        (*slot)->addr = dst->sin_addr.s_addr;
+        (*slot)->port = dst->sin_port;
+        _pool.dests++;
+    }
+
+    struct srcpool_source *src = &_pool.sources[index];
+    (*slot)->counts[index]++;
+    (*slot)->total++;
+    src->active++;
+    src->connects++;
+    lease->dest = *slot;
+    lease->source = index;
+    pthread_mutex_unlock(&_pool.lock);
+
+    /* port is picked on connect against full 4-tuple, not on bind */
+    if (setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one))
+        < 0) {
+        log_error("srcpool: bind address no port failed! (%d / %s)", errno,
+                  strerror(errno));
+    }
+
+    uint32_t range = (uint32_t)src->last << 16 | src->first;
+    if (__atomic_load_n(&_pool.range_option, __ATOMIC_RELAXED)
+        && setsockopt(fd, IPPROTO_IP, IP_LOCAL_PORT_RANGE, &range,
+                      sizeof(range))
+               < 0) {
+        /* kernel without per socket range, system range applies */
+        __atomic_store_n(&_pool.range_option, false, __ATOMIC_RELAXED);
+        log_warn("srcpool: per socket port range unsupported (%d / %s)",
+                 errno, strerror(errno));
+    }
+
+    local.sin_addr.s_addr = src->addr;
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        log_error("srcpool: bind to %s failed! (%d / %s)",
+                  inet_ntoa(local.sin_addr), errno, strerror(errno));
+        pthread_mutex_lock(&_pool.lock);
+        src->failed++;
+        pthread_mutex_unlock(&_pool.lock);
+        srcpool_release(lease);
+        return -1;
+    }
+
+    return 0;
+}
+
+void srcpool_release(struct srcpool_lease *lease)
+{
+    struct srcpool_dest *dest = lease->dest;
+
+    if (!dest) {
+        return;
+    }
+
+    pthread_mutex_lock(&_pool.lock);
+    dest->counts[lease->source]--;
+    _pool.sources[lease->source].active--;
+    if (!--dest->total) {
+        struct srcpool_dest **slot = _lookup(dest->addr, dest->port);
+        *slot = dest->next;
+        _pool.dests--;
+        free(dest);
+    }
+    pthread_mutex_unlock(&_pool.lock);
+
+    lease->dest = NULL;
+}
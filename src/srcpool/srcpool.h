@@ -0,0 +1,63 @@
+#ifndef __SRCPOOL_H__
+#define __SRCPOOL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define SRCPOOL_MAX_SOURCES 16
+/* destinations with connections are tracked in this many hash buckets */
+#define SRCPOOL_BUCKETS 4096
+
+/*
+ * Source addresses outbound tcp connections are spread over. One source
+ * address holds a port range worth of connections to every destination
+ * ip / port, sockets are bound with IP_BIND_ADDRESS_NO_PORT so kernel picks
+ * the port on connect against the full 4-tuple instead of reserving it for
+ * every destination on bind. Connections are counted per destination and
+ * source, each new connection takes the least used source with free ports
+ * for its destination, so exhaustion is known before connect is tried.
+ */
+
+struct srcpool_dest;
+
+struct srcpool_lease
+{
+    struct srcpool_dest *dest;
+    size_t source;
+};
+
+/**
+ * @brief add source address, must be called before srcpool_init
+ * @param spec "<ip>" or "<ip>:<first>-<last>" local port range for it
+ *        (default net.ipv4.ip_local_port_range)
+ * @return 0 on success, -errno on failure
+ */
+int srcpool_add(char const *spec);
+
+/**
+ * @brief initialize pool, without sources sockets are left to kernel
+ * @return 0 on success, -errno on failure
+ */
+int srcpool_init();
+
+/**
+ * @brief bind socket to least used source for remote before connect
+ * @param fd unbound tcp socket
+ * @param remote destination address
+ * @param lease filled with taken slot, its dest is NULL if nothing was
+ *        bound (no sources or non ipv4 remote)
+ * @return 0 on success, -1 on failure (-EADDRNOTAVAIL if every source is
+ *         out of ports for remote)
+ */
+int srcpool_bind(int fd, struct sockaddr const *remote,
+                 struct srcpool_lease *lease);
+
+/**
+ * @brief give slot back once its connection is closed or never came up
+ * @param lease slot from srcpool_bind, empty lease is ignored
+ */
+void srcpool_release(struct srcpool_lease *lease);
+
+#endif /* __SRCPOOL_H__ */
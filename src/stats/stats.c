@@ -0,0 +1,119 @@
+#include "stats.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "log.h"
+#include "util.h"
+
+static struct
+{
+    pthread_mutex_t lock;
+    stats_report_fn reporters[STATS_MAX_REPORTERS];
+    size_t count;
+} _stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t _bucket(uint64_t value)
+{
+    if (value < STATS_HISTOGRAM_SUB) {
+        return value;
+    }
+
+    size_t msb = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (msb - 4)) & (STATS_HISTOGRAM_SUB - 1);
+
+    return (msb - 3) * STATS_HISTOGRAM_SUB + sub;
+}
+
+static uint64_t _bucket_value(size_t bucket)
+{
+    if (bucket < STATS_HISTOGRAM_SUB) {
+        return bucket;
+    }
+
+    size_t msb = bucket / STATS_HISTOGRAM_SUB + 3;
+    size_t sub = bucket % STATS_HISTOGRAM_SUB;
+
+    return (uint64_t)(STATS_HISTOGRAM_SUB | sub) << (msb - 4);
+}
+
+int stats_register(stats_report_fn fn)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&_stats.lock);
+    for (size_t i = 0; i < _stats.count; i++) {
+        if (_stats.reporters[i] == fn) {
+            pthread_mutex_unlock(&_stats.lock);
+            return 0;
+        }
+    }
+    if (!fn || _stats.count == ARRAY_SIZE(_stats.reporters)) {
+        errno = -ENOSPC;
+        ret = -1;
+    }
+    else {
+        _stats.reporters[_stats.count++] = fn;
+    }
+    pthread_mutex_unlock(&_stats.lock);
+
+    return ret;
+}
+
+void stats_report()
+{
+    pthread_mutex_lock(&_stats.lock);
+    log_info("---- stats ----");
+    for (size_t i = 0; i < _stats.count; i++) {
+        _stats.reporters[i]();
+    }
+    pthread_mutex_unlock(&_stats.lock);
+}
+
+void stats_histogram_record(struct stats_histogram *h, uint64_t value)
+{
+    h->buckets[_bucket(value)]++;
+    h->count++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void stats_histogram_merge(struct stats_histogram *dst,
+                           struct stats_histogram const *src)
+{
+    if (!src->count) {
+        return;
+    }
+
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t stats_histogram_percentile(struct stats_histogram const *h,
+                                    double percentile)
+{
+    uint64_t count = h->count;
+    if (!count) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)(count * percentile / 100.0 + 0.5);
+    target = target ? target : 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            uint64_t value = _bucket_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
@@ -0,0 +1,60 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_MAX_REPORTERS    16
+#define STATS_HISTOGRAM_SUB    16
+#define STATS_HISTOGRAM_BUCKETS (64 * STATS_HISTOGRAM_SUB)
+
+/**
+ * @brief module callback writing its counters to the log
+ */
+typedef void (*stats_report_fn)(void);
+
+/* log-linear histogram, 16 sub-buckets per power of two (~6% error) */
+struct stats_histogram
+{
+    uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+};
+
+/**
+ * @brief register module stats reporter
+ * @param fn reporter callback
+ * @return 0 on success, -errno on failure
+ */
+int stats_register(stats_report_fn fn);
+
+/**
+ * @brief write stats of every registered module to the log
+ */
+void stats_report();
+
+/**
+ * @brief record value in histogram, single writer only
+ * @param h histogram
+ * @param value recorded value
+ */
+void stats_histogram_record(struct stats_histogram *h, uint64_t value);
+
+/**
+ * @brief add counts of one histogram to another
+ * @param dst histogram receiving counts
+ * @param src histogram added
+ */
+void stats_histogram_merge(struct stats_histogram *dst,
+                           struct stats_histogram const *src);
+
+/**
+ * @brief get value at percentile
+ * @param h histogram
+ * @param percentile percentile in range 0 - 100
+ * @return value at percentile, 0 if histogram is empty
+ */
+uint64_t stats_histogram_percentile(struct stats_histogram const *h,
+                                    double percentile);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,195 @@
+#include "timer_wheel.h"
+#include <string.h>
+
+#define TIMER_WHEEL_MASK  (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static void _link(struct timer_wheel_timer **head, struct timer_wheel_timer *t)
+{
+    t->next = *head;
+    if (t->next) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = head;
+    *head = t;
+}
+
+static void _unlink(struct timer_wheel_timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/* level is picked by distance, slot by deadline bits of that level, a
+ * deadline equal to now only comes from cascade and lands in the slot that
+ * is expired right after it */
+static void _place(struct timer_wheel *w, struct timer_wheel_timer *t)
+{
+    uint64_t delta = t->expires - w->now;
+
+    if (delta >= TIMER_WHEEL_RANGE) {
+        t->expires = w->now + TIMER_WHEEL_RANGE - 1;
+        delta = TIMER_WHEEL_RANGE - 1;
+    }
+
+    size_t level = 0;
+    while (delta >= 1ull << (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    size_t slot = (t->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    _link(&w->slots[level][slot], t);
+}
+
+void timer_wheel_init(struct timer_wheel *w, uint32_t tick_ms,
+                      uint64_t now_ms)
+{
+    memset(w, 0, sizeof(*w));
+    w->tick_ms = tick_ms ? tick_ms : 1;
+    w->now = now_ms / w->tick_ms;
+}
+
+void timer_wheel_timer_init(struct timer_wheel_timer *t, timer_wheel_fn fn,
+                            void *arg)
+{
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void timer_wheel_arm(struct timer_wheel *w, struct timer_wheel_timer *t,
+                     uint64_t expires_ms)
+{
+    if (t->pprev) {
+        _unlink(t);
+    }
+    else {
+        w->armed++;
+    }
+
+    /* current tick is already expired, past deadlines run on next one */
+    t->expires = (expires_ms + w->tick_ms - 1) / w->tick_ms;
+    if (t->expires <= w->now) {
+        t->expires = w->now + 1;
+    }
+    _place(w, t);
+}
+
+void timer_wheel_cancel(struct timer_wheel *w, struct timer_wheel_timer *t)
+{
+    if (!t->pprev) {
+        return;
+    }
+
+    _unlink(t);
+    w->armed--;
+}
+
+bool timer_wheel_armed(struct timer_wheel_timer const *t)
+{
+    return t->pprev != NULL;
+}
+
+/* move timers of one coarse slot down to where they belong now */
+static void _cascade(struct timer_wheel *w, size_t level, size_t slot)
+{
+    struct timer_wheel_timer *list = w->slots[level][slot];
+
+    w->slots[level][slot] = NULL;
+    if (list) {
+        list->pprev = &list;
+    }
+
+    while (list) {
+        struct timer_wheel_timer *t = list;
+        _unlink(t);
+        _place(w, t);
+    }
+}
+
+static size_t _expire(struct timer_wheel *w, size_t slot)
+{
+    struct timer_wheel_timer *list = w->slots[0][slot];
+    size_t expired = 0;
+
+    /* callbacks may arm or cancel any timer, including ones left here */
+    w->slots[0][slot] = NULL;
+    if (list) {
+        list->pprev = &list;
+    }
+
+    while (list) {
+        struct timer_wheel_timer *t = list;
+        _unlink(t);
+
+        if (t->expires > w->now) {
+            _place(w, t);
+            continue;
+        }
+
+        w->armed--;
+        expired++;
+        t->fn(t, t->arg);
+    }
+
+    return expired;
+}
+
+size_t timer_wheel_advance(struct timer_wheel *w, uint64_t now_ms)
+{
+    uint64_t target = now_ms / w->tick_ms;
+    size_t expired = 0;
+
+    while (w->now < target) {
+        if (!w->armed) {
+            w->now = target;
+            break;
+        }
+
+        w->now++;
+
+        for (size_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            uint64_t below = w->now >> (TIMER_WHEEL_BITS * (level - 1));
+            if (below & TIMER_WHEEL_MASK) {
+                break;
+            }
+            _cascade(w, level,
+                     (w->now >> (TIMER_WHEEL_BITS * level))
+                         & TIMER_WHEEL_MASK);
+        }
+
+        expired += _expire(w, w->now & TIMER_WHEEL_MASK);
+    }
+
+    w->expired += expired;
+
+    return expired;
+}
+
+int timer_wheel_timeout_ms(struct timer_wheel const *w, uint64_t now_ms)
+{
+    uint64_t ticks = TIMER_WHEEL_SLOTS;
+
+    if (!w->armed) {
+        return -1;
+    }
+
+    for (uint64_t i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+        uint64_t tick = w->now + i;
+        if (w->slots[0][tick & TIMER_WHEEL_MASK]
+            || !(tick & TIMER_WHEEL_MASK)) {
+            ticks = i;
+            break;
+        }
+    }
+
+    uint64_t deadline_ms = (w->now + ticks) * w->tick_ms;
+
+    return deadline_ms > now_ms ? (int)(deadline_ms - now_ms) : 0;
+}
@@ -0,0 +1,106 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/*
+ * Hashed hierarchical timer wheel (Varghese / Lauck). Level 0 slots are one
+ * tick wide, every next level is TIMER_WHEEL_SLOTS times coarser and gets
+ * cascaded down when the level below wraps. Arm and cancel are O(1), idle
+ * timers cost nothing until their slot comes up. Deadlines past the range
+ * of the top level are clamped to it. One wheel belongs to one event loop,
+ * it isn't thread safe.
+ */
+
+struct timer_wheel_timer;
+
+/**
+ * @brief timer callback, timer is disarmed and may be armed again from it
+ * @param timer expired timer
+ * @param arg user argument
+ */
+typedef void (*timer_wheel_fn)(struct timer_wheel_timer *timer, void *arg);
+
+struct timer_wheel_timer
+{
+    struct timer_wheel_timer *next;
+    struct timer_wheel_timer **pprev;
+    uint64_t expires;
+    timer_wheel_fn fn;
+    void *arg;
+};
+
+struct timer_wheel
+{
+    uint32_t tick_ms;
+    uint64_t now;
+    size_t armed;
+    uint64_t expired;
+    struct timer_wheel_timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+/**
+ * @brief initialize empty wheel
+ * @param w wheel
+ * @param tick_ms timer resolution
+ * @param now_ms monotonic time
+ */
+void timer_wheel_init(struct timer_wheel *w, uint32_t tick_ms,
+                      uint64_t now_ms);
+
+/**
+ * @brief initialize disarmed timer
+ * @param t timer
+ * @param fn expiry callback
+ * @param arg callback argument
+ */
+void timer_wheel_timer_init(struct timer_wheel_timer *t, timer_wheel_fn fn,
+                            void *arg);
+
+/**
+ * @brief arm (or move already armed) timer
+ * @param w wheel
+ * @param t timer
+ * @param expires_ms monotonic deadline, rounded up to next tick
+ */
+void timer_wheel_arm(struct timer_wheel *w, struct timer_wheel_timer *t,
+                     uint64_t expires_ms);
+
+/**
+ * @brief disarm timer, disarmed timer is ignored
+ * @param w wheel
+ * @param t timer
+ */
+void timer_wheel_cancel(struct timer_wheel *w, struct timer_wheel_timer *t);
+
+/**
+ * @brief check if timer is armed
+ * @param t timer
+ * @return true if armed
+ */
+bool timer_wheel_armed(struct timer_wheel_timer const *t);
+
+/**
+ * @brief run callbacks of every timer whose deadline passed
+ * @param w wheel
+ * @param now_ms monotonic time
+ * @return number of expired timers
+ */
+size_t timer_wheel_advance(struct timer_wheel *w, uint64_t now_ms);
+
+/**
+ * @brief get time until wheel has to be advanced, never later than next
+ *        cascade of level 1 so only a few slots are looked at
+ * @param w wheel
+ * @param now_ms monotonic time
+ * @return milliseconds, -1 if no timer is armed
+ */
+int timer_wheel_timeout_ms(struct timer_wheel const *w, uint64_t now_ms);
+
+#endif /* __TIMER_WHEEL_H__ */
@@ -0,0 +1,452 @@
+#include "tls.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "stats.h"
+
+/* iovecs are gathered into one buffer, a full record at most */
+#define TLS_GATHER_SIZE (16 * 1024)
+/* big enough for crypto info of every cipher kernel offloads */
+#define TLS_CRYPTO_INFO_SIZE 128
+
+/* kernel offloads these, list them first so server picks one of them */
+#define TLS_CIPHERS      "ECDHE+AESGCM:ECDHE+CHACHA20"
+#define TLS_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:" \
+                         "TLS_CHACHA20_POLY1305_SHA256"
+
+#ifndef BIO_get_ktls_send
+    #define BIO_get_ktls_send(b) 0
+    #define BIO_get_ktls_recv(b) 0
+#endif
+
+/* socket with at least one direction left in userspace */
+struct tls_session
+{
+    int fd;
+    SSL *ssl;
+    bool ktls_tx;
+    bool ktls_rx;
+};
+
+static struct
+{
+    SSL_CTX *ctx;
+    char name[TLS_NAME_SIZE];
+    bool name_is_address;
+    struct tls_session sessions[TLS_MAX_SESSIONS];
+    struct
+    {
+        uint64_t handshakes;
+        uint64_t failed;
+        uint64_t ktls_tx;
+        uint64_t ktls_rx;
+        uint64_t adopted;
+    } stats;
+} _tls;
+
+/* session is added by thread that connects it and removed by thread owning
+ * it after, others never match its fd */
+static struct tls_session *_find(int fd)
+{
+    if (!_tls.ctx || fd < 0) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < TLS_MAX_SESSIONS; i++) {
+        if (__atomic_load_n(&_tls.sessions[i].fd, __ATOMIC_ACQUIRE) == fd) {
+            return &_tls.sessions[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int _wait(int fd, short events)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static char const *_error_string()
+{
+    unsigned long error = ERR_get_error();
+
+    return error ? ERR_reason_error_string(error) : strerror(errno);
+}
+
+static ssize_t _read(struct tls_session *s, void *buf, size_t size,
+                     bool dontwait)
+{
+    while (1) {
+        size_t bytes = 0;
+
+        ERR_clear_error();
+        int ret = SSL_read_ex(s->ssl, buf, size, &bytes);
+        if (ret > 0) {
+            return bytes;
+        }
+
+        switch (SSL_get_error(s->ssl, ret)) {
+            case SSL_ERROR_WANT_READ:
+                if (dontwait) {
+                    errno = EAGAIN;
+                    return -1;
+                }
+                if (_wait(s->fd, POLLIN) < 0) {
+                    return -1;
+                }
+                break;
+            case SSL_ERROR_WANT_WRITE:
+                if (_wait(s->fd, POLLOUT) < 0) {
+                    return -1;
+                }
+                break;
+            case SSL_ERROR_ZERO_RETURN:
+                return 0;
+            default:
+                log_error("tls read failed! (%s)", _error_string());
+                errno = EPROTO;
+                return -1;
+        }
+    }
+}
+
+/*
+ * record by record like send on a non-blocking socket, stops at the first
+ * record socket can't take. OpenSSL keeps that record and sends it when
+ * caller offers the same bytes again.
+ */
+static ssize_t _write(struct tls_session *s, void const *buf, size_t size)
+{
+    size_t written = 0;
+
+    while (written < size) {
+        size_t bytes = 0;
+
+        ERR_clear_error();
+        int ret = SSL_write_ex(s->ssl, (uint8_t const *)buf + written,
+                               size - written, &bytes);
+        if (ret > 0) {
+            written += bytes;
+            continue;
+        }
+
+        switch (SSL_get_error(s->ssl, ret)) {
+            case SSL_ERROR_WANT_WRITE:
+            case SSL_ERROR_WANT_READ:
+                if (written) {
+                    return written;
+                }
+                errno = EAGAIN;
+                return -1;
+            default:
+                log_error("tls write failed! (%s)", _error_string());
+                errno = EPIPE;
+                return -1;
+        }
+    }
+
+    return written;
+}
+
+static void _tls_report()
+{
+    size_t sessions = 0;
+
+    for (size_t i = 0; i < TLS_MAX_SESSIONS; i++) {
+        sessions += __atomic_load_n(&_tls.sessions[i].fd, __ATOMIC_RELAXED)
+                    >= 0;
+    }
+
+    log_info("tls: handshakes %lu, failed %lu, ktls tx %lu / rx %lu, "
+             "userspace sessions %zu, adopted %lu",
+             _tls.stats.handshakes, _tls.stats.failed, _tls.stats.ktls_tx,
+             _tls.stats.ktls_rx, sessions, _tls.stats.adopted);
+}
+
+int tls_client_init(char const *ca_file, char const *server_name)
+{
+    struct in6_addr address;
+
+    if (!server_name || strlen(server_name) >= sizeof(_tls.name)) {
+        errno = -EINVAL;
+        log_error("tls server name invalid! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) {
+        log_error("tls context failed! (%s)", _error_string());
+        errno = -ENOMEM;
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF
+                                 | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    /* writes return per record, unsent rest is offered again from wherever
+     * caller keeps it */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+                              | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    if (!SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS)
+        || !SSL_CTX_set_ciphersuites(ctx, TLS_CIPHERSUITES)
+        || !(ca_file ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL)
+                     : SSL_CTX_set_default_verify_paths(ctx))) {
+        log_error("tls setup failed! (%s)", _error_string());
+        errno = -EINVAL;
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+
+    snprintf(_tls.name, sizeof(_tls.name), "%s", server_name);
+    _tls.name_is_address = inet_pton(AF_INET, server_name, &address) == 1
+                           || inet_pton(AF_INET6, server_name, &address) == 1;
+
+    for (size_t i = 0; i < TLS_MAX_SESSIONS; i++) {
+        _tls.sessions[i].fd = -1;
+        _tls.sessions[i].ssl = NULL;
+    }
+
+    /* OpenSSL writes with plain write(), a closed peer must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    _tls.ctx = ctx;
+    stats_register(_tls_report);
+
+    return 0;
+}
+
+void tls_deinit()
+{
+    if (!_tls.ctx) {
+        return;
+    }
+
+    for (size_t i = 0; i < TLS_MAX_SESSIONS; i++) {
+        if (_tls.sessions[i].fd >= 0) {
+            tls_close(_tls.sessions[i].fd);
+        }
+    }
+
+    SSL_CTX_free(_tls.ctx);
+    _tls.ctx = NULL;
+}
+
+bool tls_enabled()
+{
+    return _tls.ctx != NULL;
+}
+
+int tls_connect(int fd)
+{
+    struct tls_session *slot = NULL;
+    SSL *ssl = SSL_new(_tls.ctx);
+
+    for (size_t i = 0; i < TLS_MAX_SESSIONS && !slot; i++) {
+        if (__atomic_load_n(&_tls.sessions[i].fd, __ATOMIC_ACQUIRE) < 0) {
+            slot = &_tls.sessions[i];
+        }
+    }
+
+    if (!ssl || !SSL_set_fd(ssl, fd)
+        || !(_tls.name_is_address
+                 ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl),
+                                                 _tls.name)
+                 : SSL_set_tlsext_host_name(ssl, _tls.name)
+                       && SSL_set1_host(ssl, _tls.name))) {
+        log_error("tls session setup failed! (%s)", _error_string());
+        errno = -ENOMEM;
+        goto fail;
+    }
+
+    ERR_clear_error();
+    if (SSL_connect(ssl) != 1) {
+        long verify = SSL_get_verify_result(ssl);
+        log_error("tls handshake with %s failed! (%s)", _tls.name,
+                  verify != X509_V_OK ? X509_verify_cert_error_string(verify)
+                                      : _error_string());
+        errno = -ECONNREFUSED;
+        goto fail;
+    }
+
+    bool tx = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    bool rx = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+
+    _tls.stats.handshakes++;
+    _tls.stats.ktls_tx += tx;
+    _tls.stats.ktls_rx += rx;
+    log_info("tls upstream %s %s, ktls tx %s rx %s", SSL_get_version(ssl),
+             SSL_get_cipher_name(ssl), tx ? "on" : "off", rx ? "on" : "off");
+
+    /* kernel owns record layer in both directions, session isn't needed */
+    if (tx && rx) {
+        SSL_free(ssl);
+        return 0;
+    }
+
+    if (!slot) {
+        errno = -ENOSPC;
+        log_error("tls sessions exhausted! (%d / %s)", errno, strerror(errno));
+        goto fail;
+    }
+
+    /* a read must never block on rest of a record */
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        goto fail;
+    }
+
+    slot->ssl = ssl;
+    slot->ktls_tx = tx;
+    slot->ktls_rx = rx;
+    __atomic_store_n(&slot->fd, fd, __ATOMIC_RELEASE);
+
+    return 0;
+
+fail:
+    _tls.stats.failed++;
+    SSL_free(ssl);
+    return -1;
+}
+
+int tls_adopt(int fd)
+{
+    uint8_t info[TLS_CRYPTO_INFO_SIZE];
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(fd, SOL_TLS, TLS_TX, info, &len) < 0
+        || (len = sizeof(info), getsockopt(fd, SOL_TLS, TLS_RX, info, &len))
+               < 0) {
+        errno = -EPROTONOSUPPORT;
+        log_warn("tls state of adopted upstream stayed in old process");
+        return -1;
+    }
+
+    _tls.stats.adopted++;
+
+    return 0;
+}
+
+void tls_close(int fd)
+{
+    struct tls_session *s = _find(fd);
+
+    if (!s) {
+        return;
+    }
+
+    /* slot is free for next connect once fd is cleared */
+    SSL *ssl = s->ssl;
+    s->ssl = NULL;
+    __atomic_store_n(&s->fd, -1, __ATOMIC_RELEASE);
+    SSL_free(ssl);
+}
+
+bool tls_pending(int fd)
+{
+    struct tls_session *s = _find(fd);
+
+    return s && !s->ktls_rx && SSL_pending(s->ssl) > 0;
+}
+
+ssize_t tls_recv(int fd, void *buf, size_t size, int flags)
+{
+    struct tls_session *s = _find(fd);
+
+    if (!s || s->ktls_rx) {
+        return recv(fd, buf, size, flags);
+    }
+
+    return _read(s, buf, size, flags & MSG_DONTWAIT);
+}
+
+ssize_t tls_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    struct tls_session *s = _find(fd);
+    size_t total = 0;
+
+    if (!s || s->ktls_rx) {
+        return recvmsg(fd, msg, flags);
+    }
+
+    msg->msg_controllen = 0;
+    msg->msg_flags = 0;
+
+    /* later iovecs only take what is already decrypted */
+    for (size_t i = 0; i < msg->msg_iovlen; i++) {
+        if (total && SSL_pending(s->ssl) <= 0) {
+            break;
+        }
+
+        ssize_t bytes = _read(s, msg->msg_iov[i].iov_base,
+                              msg->msg_iov[i].iov_len,
+                              total || (flags & MSG_DONTWAIT));
+        if (bytes <= 0) {
+            return total ? (ssize_t)total : bytes;
+        }
+        total += bytes;
+        if ((size_t)bytes < msg->msg_iov[i].iov_len) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+ssize_t tls_send(int fd, void const *buf, size_t size, int flags)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    return tls_sendmsg(fd, &msg, flags);
+}
+
+ssize_t tls_sendmsg(int fd, struct msghdr const *msg, int flags)
+{
+    struct tls_session *s = _find(fd);
+
+    /* kernel encrypts, short writes and EAGAIN come from socket itself */
+    if (!s || s->ktls_tx) {
+        return sendmsg(fd, msg, flags);
+    }
+
+    if (msg->msg_iovlen == 1) {
+        return _write(s, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+    }
+
+    /* always the same prefix, a retry offers OpenSSL its pending record */
+    uint8_t buf[TLS_GATHER_SIZE];
+    size_t size = 0;
+
+    for (size_t i = 0; i < msg->msg_iovlen && size < sizeof(buf); i++) {
+        size_t chunk = msg->msg_iov[i].iov_len;
+        if (chunk > sizeof(buf) - size) {
+            chunk = sizeof(buf) - size;
+        }
+        memcpy(buf + size, msg->msg_iov[i].iov_base, chunk);
+        size += chunk;
+    }
+
+    return _write(s, buf, size);
+}
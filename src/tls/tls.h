@@ -0,0 +1,117 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define TLS_MAX_SESSIONS 16
+#define TLS_NAME_SIZE    256
+
+/*
+ * TLS client for upstream connections. Handshake runs in OpenSSL, record
+ * layer is handed to kernel (kTLS, TCP_ULP "tls") afterwards. Once both
+ * directions are offloaded the socket is an ordinary fd again, read / write,
+ * splice and sendfile work on it and it survives upgrade handover. When
+ * kernel or cipher can't offload a direction, that direction stays in
+ * OpenSSL and the fd has to go through tls_* I/O calls, which fall back to
+ * plain syscalls for fds without such session.
+ */
+
+/**
+ * @brief enable tls for upstream connections
+ * @param ca_file pem bundle server certificate is verified with, NULL uses
+ *        system store
+ * @param server_name name (or ip address) expected in server certificate,
+ *        also sent as sni when it isn't an address
+ * @return 0 on success, -1 on failure
+ */
+int tls_client_init(char const *ca_file, char const *server_name);
+
+/**
+ * @brief release tls context and every session left
+ */
+void tls_deinit();
+
+/**
+ * @brief check if upstream connections use tls
+ * @return true if tls_client_init succeeded
+ */
+bool tls_enabled();
+
+/**
+ * @brief run handshake on connected socket and offload record layer
+ * @param fd connected tcp socket, switched to non-blocking if a direction
+ *        stays in userspace, writes then return short like on any
+ *        non-blocking socket
+ * @return 0 on success, -1 on failure
+ */
+int tls_connect(int fd);
+
+/**
+ * @brief take over socket from previous process, only fully offloaded
+ *        sockets carry their tls state along
+ * @param fd adopted socket
+ * @return 0 if socket is usable, -1 if it has to be reconnected
+ */
+int tls_adopt(int fd);
+
+/**
+ * @brief forget userspace session of socket, must be called before close
+ * @param fd socket
+ */
+void tls_close(int fd);
+
+/**
+ * @brief check if decrypted bytes wait in userspace, poll won't report them
+ * @param fd socket
+ * @return true if tls_recv returns data without touching socket
+ */
+bool tls_pending(int fd);
+
+/**
+ * @brief recv replacement
+ * @param fd socket
+ * @param buf destination
+ * @param size destination size
+ * @param flags recv flags, only MSG_DONTWAIT is honoured for sessions
+ * @return bytes read, 0 on close, -1 on failure (errno EAGAIN if nothing
+ *         was ready with MSG_DONTWAIT)
+ */
+ssize_t tls_recv(int fd, void *buf, size_t size, int flags);
+
+/**
+ * @brief recvmsg replacement, control messages aren't returned for data
+ *        decrypted in userspace
+ * @param fd socket
+ * @param msg message header
+ * @param flags recvmsg flags
+ * @return bytes read, 0 on close, -1 on failure
+ */
+ssize_t tls_recvmsg(int fd, struct msghdr *msg, int flags);
+
+/**
+ * @brief send replacement, sessions stop at first record socket can't take
+ *        and expect the unsent bytes offered again
+ * @param fd socket
+ * @param buf source
+ * @param size source size
+ * @param flags send flags
+ * @return bytes written, may be short, -1 on failure (errno EAGAIN if
+ *         socket took nothing)
+ */
+ssize_t tls_send(int fd, void const *buf, size_t size, int flags);
+
+/**
+ * @brief sendmsg replacement, sessions gather iovecs into one record and
+ *        write it like tls_send
+ * @param fd socket
+ * @param msg message header
+ * @param flags sendmsg flags
+ * @return bytes written, may be short, -1 on failure (errno EAGAIN if
+ *         socket took nothing)
+ */
+ssize_t tls_sendmsg(int fd, struct msghdr const *msg, int flags);
+
+#endif /* __TLS_H__ */
@@ -0,0 +1,228 @@
+#include "trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+    #include <cpuid.h>
+    #include <x86intrin.h>
+#endif
+
+#include "log.h"
+#include "stats.h"
+#include "util.h"
+
+#define TRACE_CALIBRATE_NS 20000000
+
+struct trace_thread
+{
+    struct stats_histogram hist[TRACE_STAGES][TRACE_MAX_UPSTREAMS];
+};
+
+static struct
+{
+    uint32_t sample;
+    bool tsc;
+    /* nanoseconds per tick, 32.32 fixed point */
+    uint64_t mult;
+    pthread_mutex_t lock;
+    struct trace_thread *threads[TRACE_MAX_THREADS];
+    size_t count;
+    uint64_t unregistered;
+} _trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct trace_thread *_local;
+static __thread bool _local_failed;
+static __thread uint32_t _countdown;
+
+static char const *const _stage_names[TRACE_STAGES] = {
+    [TRACE_QUEUE] = "tuntap read to upstream queue",
+    [TRACE_WRITE] = "upstream queue to write",
+    [TRACE_PROXY] = "upstream write to reply",
+    [TRACE_DELIVER] = "reply to tuntap write",
+    [TRACE_TOTAL] = "end to end",
+};
+
+static uint64_t _monotonic_ns()
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* tsc only counts wall time if it neither stops nor scales with frequency */
+static bool _tsc_invariant()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+    return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)
+           && (edx & (1u << 8));
+#else
+    return false;
+#endif
+}
+
+static uint64_t _ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (_trace.tsc) {
+        return __rdtsc();
+    }
+#endif
+    return _monotonic_ns();
+}
+
+static void _calibrate()
+{
+    _trace.tsc = _tsc_invariant();
+    _trace.mult = 1ULL << 32;
+
+    if (!_trace.tsc) {
+        return;
+    }
+
+    struct timespec wait = { .tv_nsec = TRACE_CALIBRATE_NS };
+    uint64_t ns = _monotonic_ns();
+    uint64_t ticks = _ticks();
+
+    nanosleep(&wait, NULL);
+    ns = _monotonic_ns() - ns;
+    ticks = _ticks() - ticks;
+
+    if (!ticks) {
+        _trace.tsc = false;
+        return;
+    }
+    _trace.mult = (uint64_t)(((unsigned __int128)ns << 32) / ticks);
+}
+
+static struct trace_thread *_thread_histograms()
+{
+    if (_local || _local_failed) {
+        return _local;
+    }
+
+    struct trace_thread *t = calloc(1, sizeof(*t));
+
+    pthread_mutex_lock(&_trace.lock);
+    if (t && _trace.count < ARRAY_SIZE(_trace.threads)) {
+        _trace.threads[_trace.count++] = t;
+        _local = t;
+    }
+    else {
+        _trace.unregistered++;
+        _local_failed = true;
+        free(t);
+    }
+    pthread_mutex_unlock(&_trace.lock);
+
+    return _local;
+}
+
+/* merged on demand, a record racing with the merge lands in next report */
+static void _merge(struct stats_histogram *h, enum trace_stage stage,
+                   size_t upstream)
+{
+    memset(h, 0, sizeof(*h));
+    for (size_t i = 0; i < _trace.count; i++) {
+        struct trace_thread const *t = _trace.threads[i];
+        if (upstream < TRACE_MAX_UPSTREAMS) {
+            stats_histogram_merge(h, &t->hist[stage][upstream]);
+            continue;
+        }
+        for (size_t j = 0; j < TRACE_MAX_UPSTREAMS; j++) {
+            stats_histogram_merge(h, &t->hist[stage][j]);
+        }
+    }
+}
+
+static void _report_line(char const *what, struct stats_histogram const *h)
+{
+    log_info("trace %s: p50 %llu ns, p99 %llu ns, p99.9 %llu ns, "
+             "max %llu ns (%llu samples)",
+             what, (unsigned long long)stats_histogram_percentile(h, 50),
+             (unsigned long long)stats_histogram_percentile(h, 99),
+             (unsigned long long)stats_histogram_percentile(h, 99.9),
+             (unsigned long long)h->max, (unsigned long long)h->count);
+}
+
+static void _trace_report()
+{
+    static struct stats_histogram h;
+    char what[96];
+
+    pthread_mutex_lock(&_trace.lock);
+    log_info("trace: 1 in %u packets, clock %s, %zu threads (%llu not "
+             "registered)",
+             _trace.sample, _trace.tsc ? "tsc" : "monotonic", _trace.count,
+             (unsigned long long)_trace.unregistered);
+
+    for (size_t stage = 0; stage < TRACE_STAGES; stage++) {
+        _merge(&h, stage, TRACE_MAX_UPSTREAMS);
+        _report_line(_stage_names[stage], &h);
+        uint64_t total = h.count;
+
+        /* split only says something once several upstreams carry samples */
+        for (size_t i = 0; i < TRACE_MAX_UPSTREAMS; i++) {
+            _merge(&h, stage, i);
+            if (h.count && h.count < total) {
+                snprintf(what, sizeof(what), "%s, upstream %zu",
+                         _stage_names[stage], i);
+                _report_line(what, &h);
+            }
+        }
+    }
+    pthread_mutex_unlock(&_trace.lock);
+}
+
+int trace_init(uint32_t sample)
+{
+    _trace.sample = sample;
+
+    if (!sample) {
+        return 0;
+    }
+
+    _calibrate();
+    log_info("trace: 1 in %u packets, %s clock, %llu.%03llu ns per tick",
+             sample, _trace.tsc ? "tsc" : "monotonic",
+             (unsigned long long)(_trace.mult >> 32),
+             (unsigned long long)(((_trace.mult & 0xffffffffULL) * 1000)
+                                  >> 32));
+
+    return stats_register(_trace_report);
+}
+
+uint64_t trace_sample()
+{
+    if (!_trace.sample || _countdown--) {
+        return 0;
+    }
+    _countdown = _trace.sample - 1;
+
+    return _ticks();
+}
+
+uint64_t trace_now()
+{
+    return _ticks();
+}
+
+void trace_record(enum trace_stage stage, size_t upstream, uint64_t from,
+                  uint64_t to)
+{
+    if (!from || to < from || upstream >= TRACE_MAX_UPSTREAMS) {
+        return;
+    }
+
+    struct trace_thread *t = _thread_histograms();
+    if (!t) {
+        return;
+    }
+
+    uint64_t ns = (uint64_t)(((unsigned __int128)(to - from) * _trace.mult)
+                             >> 32);
+    stats_histogram_record(&t->hist[stage][upstream], ns);
+}
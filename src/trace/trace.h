@@ -0,0 +1,70 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* one in this many packets read from tuntap is traced, 0 disables */
+#define TRACE_DEFAULT_SAMPLE 1024
+#define TRACE_MAX_THREADS    16
+#define TRACE_MAX_UPSTREAMS  16
+
+/*
+ * Sampled per-packet latency tracing across the tuntap pipeline. A sampled
+ * packet is stamped with the cycle counter (invariant tsc, monotonic clock
+ * where there is none) right after its tuntap read, the stamp travels with
+ * the packet through rings and fair queue, and every stage it passes
+ * records its duration. The reply a flow gets next closes the trace. Each
+ * thread records into its own histograms, they are merged only when stats
+ * are reported.
+ */
+
+enum trace_stage
+{
+    /* tuntap read until frame is queued for upstream: reassembly, rings,
+     * fair queue and shaper */
+    TRACE_QUEUE,
+    /* frame queued until it is written to upstream socket (coalescing) */
+    TRACE_WRITE,
+    /* frame written until first reply of its flow is read from upstream */
+    TRACE_PROXY,
+    /* reply read until it is written to tuntap (handed to writer thread in
+     * staged mode) */
+    TRACE_DELIVER,
+    /* tuntap read until reply is delivered */
+    TRACE_TOTAL,
+    TRACE_STAGES,
+};
+
+/**
+ * @brief initialize tracing and calibrate cycle counter
+ * @param sample trace one in sample packets, 0 disables tracing
+ * @return 0 on success, -errno on failure
+ */
+int trace_init(uint32_t sample);
+
+/**
+ * @brief stamp packet if it is picked for tracing, sampling is counted per
+ *        thread
+ * @return timestamp, 0 if packet isn't traced
+ */
+uint64_t trace_sample();
+
+/**
+ * @brief get timestamp in same unit as trace_sample
+ * @return timestamp
+ */
+uint64_t trace_now();
+
+/**
+ * @brief record stage duration into calling thread's histograms
+ * @param stage pipeline stage
+ * @param upstream upstream connection index
+ * @param from stage start timestamp
+ * @param to stage end timestamp
+ */
+void trace_record(enum trace_stage stage, size_t upstream, uint64_t from,
+                  uint64_t to);
+
+#endif /* __TRACE_H__ */
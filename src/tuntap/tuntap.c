@@ -3,47 +3,196 @@
 #include <fcntl.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
-#include <net/route.h>
 #include <netinet/if_ether.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "config.h"
+#include "epoch.h"
+#include "icmp.h"
+#include "ip_frag.h"
+#include "fq.h"
+#include "iov.h"
 #include "log.h"
+#include "mux.h"
+#include "mux_client.h"
+#include "netlink.h"
 #include "packet_parser.h"
+#include "pktpool.h"
+#include "probe.h"
+#include "quiesce.h"
+#include "ring.h"
+#include "shaper.h"
+#include "sockbuf.h"
 #include "socks5.h"
+#include "stats.h"
+#include "tls.h"
+#include "trace.h"
 #include "tuntap.h"
+#include "upstream.h"
+#include "util.h"
 
 #define BUFSIZE 65536
 
+
+#define TUNTAP_RECONNECT_MS 1000
+/* reconnect pace of a server that keeps failing doubles up to this */
+#define TUNTAP_RECONNECT_MAX_MS 32000
+/* connect and handshake run on connector thread one at a time, each step
+ * gets this long */
+#define TUNTAP_CONNECT_TIMEOUT_MS 500
+/* connector jobs, a reconnect and an upstream move per connection */
+#define TUNTAP_CONNECT_JOBS (2 * MUX_CLIENT_MAX_CONNECTIONS)
+#define TUNTAP_DRAIN_MS     1000
+/* packets pulled from tuntap into fair queue per loop pass */
+#define TUNTAP_INGRESS_BATCH 64
+/* unsent upstream bytes below which upstream counts as writable */
+#define TUNTAP_NOTSENT_LOWAT (2 * MUX_COALESCE_BYTES)
+/* staged mode, packets in flight per direction and handles per ring op */
+#define TUNTAP_RING_SIZE  256
+#define TUNTAP_RING_BATCH 32
+#define TUNTAP_PACKET_MAX \
+    (sizeof(struct iphdr) + sizeof(struct udphdr) + MUX_MAX_PAYLOAD)
+
+/* verdicts reported by classify probe */
+enum tuntap_verdict
+{
+    TUNTAP_STEERED,
+    TUNTAP_UNSTEERED,
+    TUNTAP_ANSWERED,
+    TUNTAP_NOT_IPV4,
+};
+
+/* connection connector thread opens, fd is -1 if it failed */
+struct tuntap_connect
+{
+    char ip[CONFIG_ADDR_SIZE];
+    uint16_t port;
+    bool tls;
+    int fd;
+};
+
+#ifndef SO_PREFER_BUSY_POLL
+    #define SO_PREFER_BUSY_POLL 69
+#endif
+
 struct tuntap_device
 {
     char name[IFNAMSIZ + 1];
-    char const *addr;
-    char const *netmask;
+    /* empty while interface isn't configured */
+    char addr[CONFIG_ADDR_SIZE];
+    char netmask[CONFIG_ADDR_SIZE];
     int fd;
     int flags;
+    uint16_t mtu;
+    struct
+    {
+        bool enabled;
+        uint32_t idle_us;
+    } busy_poll;
+    struct
+    {
+        uint64_t started_ms;
+        uint64_t spins;
+        uint64_t blocking;
+        uint64_t unsteered;
+        struct stats_histogram latency;
+    } stats;
     struct
     {
-        char const *ip;
+        char ip[CONFIG_ADDR_SIZE];
         uint16_t port;
-        int fd;
+        /* config generation upstream address was last checked against */
+        uint64_t generation;
+        /* servers flows fail over to, proxy above is server 0 */
+        struct
+        {
+            char ip[CONFIG_ADDR_SIZE];
+            uint16_t port;
+        } backups[UPSTREAM_MAX_SERVERS - 1];
+        size_t backup_count;
+        /* mux connections, per_server of them for each server in turn,
+         * first one is handed over on upgrade */
+        int fds[MUX_CLIENT_MAX_CONNECTIONS];
+        struct sockbuf bufs[MUX_CLIENT_MAX_CONNECTIONS];
+        size_t count;
+        size_t per_server;
+        uint32_t delay_us;
+        uint64_t reconnect_ms;
+        /* next reconnect per server, pace doubles while it keeps failing */
+        uint64_t retry_ms[UPSTREAM_MAX_SERVERS];
+        uint32_t backoff_ms[UPSTREAM_MAX_SERVERS];
+        /* tls endpoint in front of proxy, replaces proxy address */
+        char const *tls_ip;
+        uint16_t tls_port;
+        /* tuntap send buffer last derived from upstream receive buffers */
+        size_t tun_sndbuf;
     } proxy;
+    /* connects and handshakes leave data path, it hands job handles to
+     * connector thread through one ring and takes them back through the
+     * other. Job i reconnects connection i, job MUX_CLIENT_MAX_CONNECTIONS
+     * + i opens connection i to a moved upstream */
+    struct
+    {
+        struct ring requests;
+        struct ring results;
+        pthread_t thread;
+        struct tuntap_connect jobs[TUNTAP_CONNECT_JOBS];
+        /* server with a reconnect on its way */
+        bool busy[UPSTREAM_MAX_SERVERS];
+        /* connections to moved upstream still on their way */
+        size_t moving;
+        uint64_t move_generation;
+    } connector;
+    /* tuntap reader and writer on own threads, joined to data path by
+     * rings carrying pool handles */
     struct
     {
-        int fd;
-        int flags;
-    } socket;
+        bool enabled;
+        struct pktpool rx_pool;
+        struct pktpool tx_pool;
+        struct ring rx;
+        struct ring tx;
+        uint32_t pending[TUNTAP_RING_SIZE];
+        size_t pending_count;
+        pthread_t reader;
+        pthread_t writer;
+        bool reader_parked;
+        bool path_parked;
+        bool writer_parked;
+        uint64_t pool_waits;
+        uint64_t tx_drops;
+    } stages;
+    /* replies over mtu are gathered here before fragmenting */
+    uint8_t oversize[TUNTAP_PACKET_MAX];
 };
 
-static struct tuntap_device _device = { .flags = IFF_TUN };
+static struct tuntap_device _device = {
+    .fd = -1,
+    .flags = IFF_TUN,
+    .mtu = TUNTAP_DEFAULT_MTU,
+    .busy_poll.idle_us = TUNTAP_DEFAULT_BUSY_POLL_IDLE_US,
+    .proxy.count = TUNTAP_DEFAULT_MUX_CONNECTIONS,
+    .proxy.per_server = TUNTAP_DEFAULT_MUX_CONNECTIONS,
+    .proxy.delay_us = MUX_DEFAULT_DELAY_US,
+};
 
 static pthread_t _main_thread_worker;
+static struct quiesce _quiesce;
 
 #define TUN_DEVICE "/dev/net/tun"
 
@@ -62,7 +211,7 @@ static int tuntap_open()
     }
 
     struct ifreq ifr = { .ifr_flags = IFF_NO_PI | _device.flags };
-    if (_device.name) {
+    if (_device.name[0]) {
         strncpy(ifr.ifr_name, _device.name, IFNAMSIZ);
         ifr.ifr_name[IFNAMSIZ - 1] = 0;
     }
@@ -111,164 +260,470 @@ static int tuntap_close()
     return 0;
 }
 
-static int tuntap_configure(char const *addr, char const *netmask)
+static int tuntap_configure(struct config const *cfg)
 {
-    if (!addr || !netmask) {
-        errno = -EINVAL;
-        log_error("address or netmask invalid! (%d / %s)", errno,
+    struct netlink_tun_config config = {
+        .ifname = _device.name,
+        .addr = cfg->tun_addr,
+        .netmask = cfg->tun_netmask,
+        .mtu = _device.mtu,
+        .steer = cfg->steer,
+        .steer_count = cfg->steer_count,
+    };
+
+    if (netlink_tun_setup(&config) < 0) {
+        log_error("failed to configure %s! (%d / %s)", _device.name, errno,
                   strerror(errno));
         return -1;
     }
 
-    struct ifreq ifr = { 0 };
-    struct sockaddr_in sock_addr = { 0 };
+    strcpy(_device.addr, cfg->tun_addr);
+    strcpy(_device.netmask, cfg->tun_netmask);
+
+    return 0;
+}
 
-    strncpy(ifr.ifr_name, _device.name, IFNAMSIZ);
+static int tuntap_unconfigure()
+{
+    struct netlink_tun_config config = {
+        .ifname = _device.name,
+        .addr = _device.addr,
+        .netmask = _device.netmask,
+    };
 
-    sock_addr.sin_family = AF_INET;
-    sock_addr.sin_addr.s_addr = inet_addr(addr);
-    ifr.ifr_addr = *(struct sockaddr *)&sock_addr;
+    if (!_device.addr[0]) {
+        return 0;
+    }
 
-    if (ioctl(_device.socket.fd, SIOCSIFADDR, (caddr_t)&ifr) < 0) {
-        log_error("failed to set address! (%d / %s)", errno, strerror(errno));
+    if (netlink_tun_teardown(&config) < 0) {
+        log_error("failed to unconfigure %s! (%d / %s)", _device.name, errno,
+                  strerror(errno));
         return -1;
     }
 
-    sock_addr.sin_addr.s_addr = inet_addr(netmask);
-    ifr.ifr_netmask = *(struct sockaddr *)&sock_addr;
+    _device.addr[0] = 0;
+    _device.netmask[0] = 0;
+
+    return 0;
+}
+
+static void _set_timeout(int fd, int timeout_ms)
+{
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int _proxy_connect(char const *ip, uint16_t port, bool tls)
+{
+    struct sockaddr_in remote_sock = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = inet_addr(ip),
+        .sin_port = htons(port),
+    };
 
-    if (ioctl(_device.socket.fd, SIOCSIFNETMASK, (caddr_t)&ifr) < 0) {
-        log_error("failed to set netmask! (%d / %s)", errno, strerror(errno));
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_error("tuntap proxy init failed! (%d / %s)", errno,
+                  strerror(errno));
         return -1;
     }
 
-    struct rtentry route = { 0 };
-    struct sockaddr_in *route_addr = (struct sockaddr_in *)&route.rt_gateway;
+    /* upstream traffic must not be routed back into the tunnel */
+    if (netlink_mark_socket(fd) < 0) {
+        close(fd);
+        return -1;
+    }
 
-    route_addr->sin_family = AF_INET;
-    route_addr->sin_addr.s_addr = inet_addr(addr);
+    socks5_client_fastopen(fd);
+    /* a dead server must not hold up reconnects to the others for long */
+    _set_timeout(fd, TUNTAP_CONNECT_TIMEOUT_MS);
 
-    route_addr = (struct sockaddr_in *)&route.rt_dst;
-    route_addr->sin_family = AF_INET;
-    route_addr->sin_addr.s_addr = INADDR_ANY;
+    if (connect(fd, (struct sockaddr *)&remote_sock, sizeof(remote_sock)) < 0) {
+        log_error("tuntap connect to proxy failed! (%d / %s)", errno,
+                  strerror(errno));
+        close(fd);
+        return -1;
+    }
 
-    route_addr = (struct sockaddr_in *)&route.rt_genmask;
-    route_addr->sin_family = AF_INET;
-    route_addr->sin_addr.s_addr = INADDR_ANY;
+    /* with fast open, client hello is what leaves in the SYN */
+    if (tls && tls_connect(fd) < 0) {
+        close(fd);
+        return -1;
+    }
 
-    route.rt_flags = RTF_UP | RTF_GATEWAY;
-    route.rt_metric = 0;
-    route.rt_dev = _device.name;
+    if (socks5_client_mux(fd) < 0) {
+        log_error("tuntap proxy refused mux! (%d / %s)", errno,
+                  strerror(errno));
+        tls_close(fd);
+        close(fd);
+        return -1;
+    }
+    _set_timeout(fd, 0);
 
-    if (ioctl(_device.socket.fd, SIOCADDRT, &route) < 0) {
-        log_error("failed to set route! (%d / %s)", errno, strerror(errno));
+    /* full socket leaves frames queued in writer instead of stalling data
+     * path, tls did this already */
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        log_error("tuntap proxy nonblock failed! (%d / %s)", errno,
+                  strerror(errno));
+        tls_close(fd);
+        close(fd);
         return -1;
     }
 
-    _device.addr = addr;
-    _device.netmask = netmask;
+    return fd;
+}
 
-    return 0;
+static size_t _servers()
+{
+    return 1 + _device.proxy.backup_count;
+}
+
+static char const *_server_ip(size_t server)
+{
+    return server ? _device.proxy.backups[server - 1].ip : _device.proxy.ip;
+}
+
+static uint16_t _server_port(size_t server)
+{
+    return server ? _device.proxy.backups[server - 1].port
+                  : _device.proxy.port;
+}
+
+/* tls endpoint fronts proxy only, backups are reached directly */
+static bool _server_tls(size_t server)
+{
+    return !server && tls_enabled();
 }
 
-static int tuntap_set_state(bool state)
+/* connection belongs to server index / per_server, failure counts
+ * against that server */
+static int _server_connect(size_t index)
 {
-    int fd = socket(AF_INET, SOCK_DGRAM, PF_UNSPEC);
+    size_t server = index / _device.proxy.per_server;
+    int fd = _proxy_connect(_server_ip(server), _server_port(server),
+                            _server_tls(server));
+
     if (fd < 0) {
-        log_error("failed to create socket! (%d / %s)", errno, strerror(errno));
-        return -1;
+        upstream_error(server);
     }
 
-    struct ifreq ifr = { 0 };
+    return fd;
+}
 
-    strncpy(ifr.ifr_name, _device.name, IFNAMSIZ);
-    ifr.ifr_name[IFNAMSIZ - 1] = 0;
+static void _set_proxy(char const *ip, uint16_t port)
+{
+    snprintf(_device.proxy.ip, sizeof(_device.proxy.ip), "%s",
+             _device.proxy.tls_ip ? _device.proxy.tls_ip : ip);
+    _device.proxy.port = _device.proxy.tls_ip ? _device.proxy.tls_port : port;
+}
 
-    if (ioctl(fd, SIOCGIFFLAGS, &ifr) < 0) {
-        log_error("failed to get flags! (%d / %s)", errno, strerror(errno));
-        return -1;
+static int tuntap_connect_to_proxy(char const *ip, uint16_t port)
+{
+    _set_proxy(ip, port);
+    _device.proxy.fds[0] = _proxy_connect(_device.proxy.ip,
+                                          _device.proxy.port, _server_tls(0));
+
+    return _device.proxy.fds[0] < 0 ? -1 : 0;
+}
+
+static int _tuntap_write(struct iov_msg const *msg, void *arg)
+{
+    int tap_fd = *(int *)arg;
+    ssize_t ret = iov_msg_write(tap_fd, msg);
+
+    PROBE2(tun_write, msg->size, ret);
+
+    return ret < 0 ? -1 : 0;
+}
+
+static void _record_latency(uint64_t rx_ns)
+{
+    struct timespec now = { 0 };
+
+    if (!rx_ns) {
+        return;
     }
 
-    if (state) {
-        ifr.ifr_flags |= (IFF_UP | IFF_RUNNING);
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    if (now_ns > rx_ns) {
+        stats_histogram_record(&_device.stats.latency, now_ns - rx_ns);
     }
-    else {
-        ifr.ifr_flags &= ~(IFF_UP | IFF_RUNNING);
+}
+
+static uint64_t _thread_cpu_ms(pthread_t thread)
+{
+    struct timespec cpu = { 0 };
+    clockid_t clock = 0;
+
+    if (pthread_getcpuclockid(thread, &clock) != 0
+        || clock_gettime(clock, &cpu) != 0) {
+        return 0;
     }
 
-    if (ioctl(fd, SIOCSIFFLAGS, &ifr) < 0) {
-        log_error("failed to set flags! (%d / %s)", errno, strerror(errno));
-        return -1;
+    return (uint64_t)cpu.tv_sec * 1000 + cpu.tv_nsec / 1000000;
+}
+
+static void _tuntap_report()
+{
+    uint64_t wall_ms = util_now_ms() - _device.stats.started_ms;
+    uint64_t cpu_ms = _thread_cpu_ms(_main_thread_worker);
+
+    log_info("tuntap %s: busy poll %s (idle %u us), cpu %.1f%%, "
+             "spins %llu, blocking waits %llu, unsteered %llu",
+             _device.name, _device.busy_poll.enabled ? "on" : "off",
+             _device.busy_poll.idle_us,
+             wall_ms ? 100.0 * cpu_ms / wall_ms : 0.0,
+             (unsigned long long)_device.stats.spins,
+             (unsigned long long)_device.stats.blocking,
+             (unsigned long long)_device.stats.unsteered);
+    log_info("tuntap %s: upstream rx to tuntap latency p50 %llu ns, "
+             "p99 %llu ns, max %llu ns (%llu packets)",
+             _device.name,
+             (unsigned long long)stats_histogram_percentile(
+                 &_device.stats.latency, 50),
+             (unsigned long long)stats_histogram_percentile(
+                 &_device.stats.latency, 99),
+             (unsigned long long)_device.stats.latency.max,
+             (unsigned long long)_device.stats.latency.count);
+
+    for (size_t i = 0; sockbuf_enabled() && i < _device.proxy.count; i++) {
+        struct sockbuf const *sb = &_device.proxy.bufs[i];
+        log_info("tuntap %s: upstream %zu rtt %u us, delivery rate %llu "
+                 "KB/s, sndbuf %zu KB, rcvbuf %zu KB, notsent lowat %u KB",
+                 _device.name, i, sb->rtt_us,
+                 (unsigned long long)sb->rate >> 10, sb->sndbuf >> 10,
+                 sb->rcvbuf >> 10, sb->lowat >> 10);
     }
 
-    _device.socket.fd = fd;
-    _device.socket.flags = ifr.ifr_flags;
+    if (!_device.stages.enabled) {
+        return;
+    }
 
-    return 0;
+    log_info("tuntap %s: stages reader cpu %.1f%%, writer cpu %.1f%%, "
+             "rx ring wakeups %llu, tx ring wakeups %llu, pool waits %llu, "
+             "tx drops %llu",
+             _device.name,
+             wall_ms ? 100.0 * _thread_cpu_ms(_device.stages.reader) / wall_ms
+                     : 0.0,
+             wall_ms ? 100.0 * _thread_cpu_ms(_device.stages.writer) / wall_ms
+                     : 0.0,
+             (unsigned long long)_device.stages.rx.wakeups,
+             (unsigned long long)_device.stages.tx.wakeups,
+             (unsigned long long)_device.stages.pool_waits,
+             (unsigned long long)_device.stages.tx_drops);
 }
 
-static int tuntap_connect_to_proxy(char const *ip, uint16_t port)
+static void _setup_socket(size_t index, int net_fd)
 {
-    struct sockaddr_in remote_sock = {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = inet_addr(ip),
-        .sin_port = htons(port),
-    };
+    int one = 1;
+    int usec = _device.busy_poll.idle_us;
+    int lowat = TUNTAP_NOTSENT_LOWAT;
+
+    /* keep standing queue in fair queue instead of socket send buffer */
+    if (setsockopt(net_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+                   sizeof(lowat))
+        < 0) {
+        log_error("failed to set notsent lowat! (%d / %s)", errno,
+                  strerror(errno));
+    }
+    sockbuf_attach(&_device.proxy.bufs[index], net_fd, lowat);
 
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        log_error("tuntap proxy init failed! (%d / %s)", errno,
+    if (setsockopt(net_fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one))
+        < 0) {
+        log_error("failed to enable rx timestamps! (%d / %s)", errno,
                   strerror(errno));
-        return -1;
     }
 
-    if (connect(fd, (struct sockaddr *)&remote_sock, sizeof(remote_sock)) < 0) {
-        log_error("tuntap connect to proxy failed! (%d / %s)", errno,
+    if (!_device.busy_poll.enabled) {
+        return;
+    }
+
+    if (setsockopt(net_fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0
+        || setsockopt(net_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one,
+                      sizeof(one))
+               < 0) {
+        log_error("failed to enable socket busy poll! (%d / %s)", errno,
                   strerror(errno));
-        close(fd);
+    }
+}
+
+/* headers and payload go out with one writev, only packets over mtu are
+ * gathered into one buffer to be fragmented */
+static int _tuntap_deliver(struct iov_msg const *msg, void *arg)
+{
+    ssize_t size = msg->size;
+    int ret = 0;
+
+    if (size <= _device.mtu) {
+        ret = _tuntap_write(msg, arg);
+    }
+    else {
+        size = iov_msg_flatten(msg, _device.oversize,
+                               sizeof(_device.oversize));
+        ret = size < 0 ? -1
+                       : ip_frag_fragment(_device.oversize, size, _device.mtu,
+                                          _tuntap_write, arg);
+    }
+
+    if (ret < 0) {
+        log_error("failed to write %zu bytes to tuntap! (%d / %s)", msg->size,
+                  errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* staged mode, queued replies go to writer thread in one ring push */
+static void _stage_flush()
+{
+    if (_device.stages.pending_count) {
+        ring_push(&_device.stages.tx, _device.stages.pending,
+                  _device.stages.pending_count);
+        _device.stages.pending_count = 0;
+    }
+}
+
+/* staged mode, replies are gathered into pool buffers for writer thread */
+static int _tuntap_deliver_staged(struct iov_msg const *msg, void *arg)
+{
+    struct pktpool *pool = &_device.stages.tx_pool;
+    uint32_t handle = pktpool_get(pool);
+
+    if (handle == PKTPOOL_INVALID) {
+        _device.stages.tx_drops++;
+        return 0;
+    }
+
+    ssize_t size = iov_msg_flatten(msg, pktpool_data(pool, handle),
+                                   pool->buf_size);
+    if (size < 0) {
+        pktpool_put(pool, &handle, 1);
         return -1;
     }
+    pool->lengths[handle] = size;
 
-    _device.proxy.fd = fd;
-    _device.proxy.ip = ip;
-    _device.proxy.port = port;
+    _device.stages.pending[_device.stages.pending_count++] = handle;
+    if (_device.stages.pending_count == ARRAY_SIZE(_device.stages.pending)) {
+        _stage_flush();
+    }
 
     return 0;
 }
 
-static int read_n(int fd, uint8_t *buf, int n)
+/* writer thread, packets over mtu are fragmented here */
+static size_t _egress_ring(int tap_fd)
 {
-    int left = n;
-    while (left > 0) {
-        int nread = 0;
-        if ((nread = read(fd, buf, left)) == 0) {
-            return 0;
+    struct pktpool *pool = &_device.stages.tx_pool;
+    uint32_t batch[TUNTAP_RING_BATCH];
+    size_t count = 0;
+    size_t total = 0;
+
+    ring_clear(&_device.stages.tx);
+    while ((count = ring_pop(&_device.stages.tx, batch, ARRAY_SIZE(batch)))
+           > 0) {
+        for (size_t i = 0; i < count; i++) {
+            uint8_t const *buf = pktpool_data(pool, batch[i]);
+            size_t size = pool->lengths[batch[i]];
+            int ret = 0;
+            if (size <= _device.mtu) {
+                ret = write(tap_fd, buf, size);
+                PROBE2(tun_write, size, ret);
+            }
+            else {
+                ret = ip_frag_fragment(buf, size, _device.mtu, _tuntap_write,
+                                       &tap_fd);
+            }
+            if (ret < 0) {
+                log_error("failed to write %zu bytes to tuntap! (%d / %s)",
+                          size, errno, strerror(errno));
+            }
         }
-        else {
-            left -= nread;
-            buf += nread;
+        pktpool_put(pool, batch, count);
+        total += count;
+    }
+
+    return total;
+}
+
+static bool _steer_equal(struct config const *a, struct config const *b)
+{
+    if (a->steer_count != b->steer_count) {
+        return false;
+    }
+
+    for (size_t i = 0; i < a->steer_count; i++) {
+        if (a->steer[i].proto != b->steer[i].proto
+            || a->steer[i].first != b->steer[i].first
+            || a->steer[i].last != b->steer[i].last) {
+            return false;
         }
     }
-    return n;
+
+    return true;
 }
 
-static void *_main_thread(void *fd)
+/* runs on thread publishing the change, before data path can see it */
+static int _tuntap_apply(struct config const *old, struct config const *next)
 {
-    int tap_fd = _device.fd;
-    int net_fd = _device.proxy.fd;
-    int maxfd = (tap_fd > net_fd) ? tap_fd : net_fd;
-    uint8_t buffer[BUFSIZE] = { 0 };
-    uint16_t nread = 0;
-    uint16_t plength = 0;
+    struct netlink_tun_config now = {
+        .ifname = _device.name,
+        .addr = old->tun_addr,
+        .netmask = old->tun_netmask,
+        .steer = next->steer,
+        .steer_count = next->steer_count,
+    };
+    struct netlink_tun_config moved = now;
 
-    while (1) {
-        fd_set rd_set;
+    if (!_device.addr[0]) {
+        return 0;
+    }
+
+    if (!_steer_equal(old, next) && netlink_steer_apply(&now) < 0) {
+        return -1;
+    }
+
+    if (strcmp(old->tun_addr, next->tun_addr)
+        || strcmp(old->tun_netmask, next->tun_netmask)) {
+        moved.addr = next->tun_addr;
+        moved.netmask = next->tun_netmask;
+        if (netlink_tun_set_addr(&now, &moved) < 0) {
+            return -1;
+        }
+        strcpy(_device.addr, next->tun_addr);
+        strcpy(_device.netmask, next->tun_netmask);
+    }
+
+    return 0;
+}
+
+/* job slot belongs to connector from push until data path pops result */
+static void _connect_start(uint32_t job, char const *ip, uint16_t port,
+                           bool tls)
+{
+    struct tuntap_connect *c = &_device.connector.jobs[job];
 
-        FD_ZERO(&rd_set);
-        FD_SET(tap_fd, &rd_set);
-        FD_SET(net_fd, &rd_set);
+    snprintf(c->ip, sizeof(c->ip), "%s", ip);
+    c->port = port;
+    c->tls = tls;
+    ring_push(&_device.connector.requests, &job, 1);
+}
+
+/* connects one job after another, a dead server costs its timeouts here
+ * instead of on data path */
+static void *_connector_thread(void *arg)
+{
+    uint32_t job = 0;
+    struct pollfd pfd = { .fd = ring_fd(&_device.connector.requests),
+                          .events = POLLIN };
 
-        int ret = select(maxfd + 1, &rd_set, NULL, NULL, NULL);
+    while (1) {
+        int ret = poll(&pfd, 1, -1);
 
         if (ret < 0 && errno == EINTR) {
             continue;
@@ -278,79 +733,1057 @@ static void *_main_thread(void *fd)
             exit(1);
         }
 
-        if (FD_ISSET(tap_fd, &rd_set)) {
-            nread = read(tap_fd, buffer, BUFSIZE);
-            if (nread == 0) {
-                continue;
-            }
-            if (!is_packet_ipv4(buffer) && !is_packet_udp(buffer)) {
-                continue;
+        ring_clear(&_device.connector.requests);
+        while (ring_pop(&_device.connector.requests, &job, 1)) {
+            struct tuntap_connect *c = &_device.connector.jobs[job];
+            c->fd = _proxy_connect(c->ip, c->port, c->tls);
+            ring_push(&_device.connector.results, &job, 1);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * upstream moved, every connection to server 0 is replaced once new
+ * upstream accepted all of them, flows open again with their next packet
+ */
+static void _follow_upstream(uint64_t now_ms)
+{
+    char ip[CONFIG_ADDR_SIZE];
+    uint16_t port = 0;
+    uint64_t generation = config_generation();
+
+    if (generation == _device.proxy.generation || _device.connector.moving) {
+        return;
+    }
+
+    epoch_enter();
+    strcpy(ip, config_get()->proxy_ip);
+    port = config_get()->proxy_port;
+    epoch_leave();
+
+    /* tls endpoint stays in front of whatever proxy is configured */
+    if (_device.proxy.tls_ip
+        || (!strcmp(ip, _device.proxy.ip) && port == _device.proxy.port)) {
+        _device.proxy.generation = generation;
+        return;
+    }
+
+    /* retried at reconnect pace until new upstream answers */
+    if (now_ms - _device.proxy.reconnect_ms < TUNTAP_RECONNECT_MS) {
+        return;
+    }
+    _device.proxy.reconnect_ms = now_ms;
+
+    for (size_t i = 0; i < _device.proxy.per_server; i++) {
+        _connect_start(MUX_CLIENT_MAX_CONNECTIONS + i, ip, port,
+                       _server_tls(0));
+    }
+    _device.connector.moving = _device.proxy.per_server;
+    _device.connector.move_generation = generation;
+}
+
+/* last connection to moved upstream is back, all of them replace server 0
+ * connections at once or none does */
+static void _moved(struct pollfd *fds, mux_client_deliver_fn deliver,
+                   int *tap_fd)
+{
+    struct tuntap_connect const *next =
+        &_device.connector.jobs[MUX_CLIENT_MAX_CONNECTIONS];
+    char const *ip = next[0].ip;
+    uint16_t port = next[0].port;
+    bool failed = false;
+
+    for (size_t i = 0; i < _device.proxy.per_server; i++) {
+        failed |= next[i].fd < 0;
+    }
+
+    if (failed) {
+        log_warn("tuntap upstream %s:%u unreachable, keeping %s:%u", ip, port,
+                 _device.proxy.ip, _device.proxy.port);
+        for (size_t i = 0; i < _device.proxy.per_server; i++) {
+            if (next[i].fd >= 0) {
+                tls_close(next[i].fd);
+                close(next[i].fd);
             }
+        }
+        return;
+    }
 
-            print_ip_header(buffer, sizeof(buffer));
+    /* frames already on their way are read before connections go */
+    if (mux_client_drain(deliver, tap_fd, TUNTAP_DRAIN_MS) < 0) {
+        log_warn("tuntap mux drain incomplete");
+    }
+    _stage_flush();
 
-            plength = htons(nread);
-            socks5_send_packet(net_fd, _device.proxy.ip, _device.proxy.port,
-                               buffer, nread);
+    for (size_t i = 0; i < _device.proxy.per_server; i++) {
+        if (_device.proxy.fds[i] >= 0) {
+            sockbuf_detach(&_device.proxy.bufs[i]);
+            tls_close(_device.proxy.fds[i]);
+            close(_device.proxy.fds[i]);
         }
+        _setup_socket(i, next[i].fd);
+        _device.proxy.fds[i] = next[i].fd;
+        fds[i].fd = next[i].fd;
+        mux_client_set_connection(i, next[i].fd);
+    }
 
-        if (FD_ISSET(net_fd, &rd_set)) {
-            nread = read_n(net_fd, (uint8_t *)&plength, sizeof(plength));
-            if (nread == 0) {
-                break;
+    log_info("tuntap upstream moved from %s:%u to %s:%u", _device.proxy.ip,
+             _device.proxy.port, ip, port);
+    _set_proxy(ip, port);
+    upstream_set_name(0, ip, port);
+    _device.proxy.generation = _device.connector.move_generation;
+}
+
+/*
+ * lost connections come back at most once per TUNTAP_RECONNECT_MS, a server
+ * that fails again waits twice as long each time. One reconnect per server
+ * is on its way at a time, next one follows once it succeeded.
+ */
+static void _reconnect(uint64_t now_ms)
+{
+    size_t per_server = _device.proxy.per_server;
+
+    for (size_t server = 0; server < _servers(); server++) {
+        if (_device.connector.busy[server]
+            || now_ms < _device.proxy.retry_ms[server]) {
+            continue;
+        }
+
+        for (size_t i = server * per_server; i < (server + 1) * per_server;
+             i++) {
+            if (_device.proxy.fds[i] >= 0) {
+                continue;
             }
 
-            nread = read_n(net_fd, buffer, ntohs(plength));
-            write(tap_fd, buffer, nread);
+            _connect_start(i, _server_ip(server), _server_port(server),
+                           _server_tls(server));
+            _device.connector.busy[server] = true;
+            _device.proxy.retry_ms[server] = now_ms
+                                             + _device.proxy.backoff_ms[server];
+            break;
         }
     }
-
-    return NULL;
 }
 
-int tuntap_init(char const *addr, uint16_t port)
+static void _reconnected(struct pollfd *fds, size_t index, int fd,
+                         uint64_t now_ms)
 {
-    if (tuntap_open() < 0) {
-        log_error("open failed! (%d / %s)", errno, strerror(errno));
-        return errno;
+    size_t server = index / _device.proxy.per_server;
+    uint32_t *backoff_ms = &_device.proxy.backoff_ms[server];
+
+    _device.connector.busy[server] = false;
+
+    if (fd < 0) {
+        upstream_error(server);
+        *backoff_ms = *backoff_ms * 2 < TUNTAP_RECONNECT_MAX_MS
+                          ? *backoff_ms * 2
+                          : TUNTAP_RECONNECT_MAX_MS;
+        _device.proxy.retry_ms[server] = now_ms + *backoff_ms;
+        return;
     }
 
-    if (tuntap_set_state(true) < 0) {
-        log_error("set state failed! (%d / %s)", errno, strerror(errno));
-        return errno;
+    /* upstream move replaced connection meanwhile */
+    if (_device.proxy.fds[index] >= 0) {
+        tls_close(fd);
+        close(fd);
+        return;
     }
 
-    if (tuntap_configure("10.0.0.1", "255.255.255.0") < 0) {
-        log_error("configure failed! (%d / %s)", errno, strerror(errno));
-        return errno;
+    *backoff_ms = TUNTAP_RECONNECT_MS;
+    _device.proxy.retry_ms[server] = now_ms;
+
+    log_info("tuntap mux connection %zu restored", index);
+    _setup_socket(index, fd);
+    _device.proxy.fds[index] = fd;
+    fds[index].fd = fd;
+    mux_client_set_connection(index, fd);
+}
+
+/* connections connector finished are taken over */
+static void _connected(struct pollfd *fds, uint64_t now_ms,
+                       mux_client_deliver_fn deliver, int *tap_fd)
+{
+    uint32_t job = 0;
+
+    ring_clear(&_device.connector.results);
+    while (ring_pop(&_device.connector.results, &job, 1)) {
+        int fd = _device.connector.jobs[job].fd;
+
+        if (job < MUX_CLIENT_MAX_CONNECTIONS) {
+            _reconnected(fds, job, fd, now_ms);
+        }
+        else if (!--_device.connector.moving) {
+            _moved(fds, deliver, tap_fd);
+        }
     }
+}
 
-    if (tuntap_connect_to_proxy(addr, port) < 0) {
-        log_error("failed to connect to proxy! (%d / %s)", errno,
-                  strerror(errno));
-        return errno;
+/*
+ * upstream buffers follow their bdp, tuntap send buffer holds what all
+ * upstream receive buffers can hand over at once (kernel sized ones count
+ * as SOCKBUF_MAX)
+ */
+static void _tune_buffers(uint64_t now_ms)
+{
+    bool resized = false;
+    size_t rcvbuf = 0;
+
+    if (!sockbuf_enabled()) {
+        return;
     }
 
-    if (pthread_create(&_main_thread_worker, NULL, &_main_thread, &_device.fd)
-        != 0) {
-        pthread_detach(_main_thread_worker);
-        return -1;
+    for (size_t i = 0; i < _device.proxy.count; i++) {
+        if (_device.proxy.fds[i] >= 0) {
+            resized |= sockbuf_tune(&_device.proxy.bufs[i], now_ms);
+        }
+        rcvbuf += _device.proxy.bufs[i].rcvbuf ? _device.proxy.bufs[i].rcvbuf
+                                               : SOCKBUF_MAX;
     }
 
-    return 0;
+    if ((resized || !_device.proxy.tun_sndbuf)
+        && _device.proxy.tun_sndbuf != 2 * rcvbuf
+        && sockbuf_set_tun(_device.fd, 2 * rcvbuf) == 0) {
+        _device.proxy.tun_sndbuf = 2 * rcvbuf;
+    }
 }
 
-int tuntap_deinit()
+static bool _disconnected()
 {
-    if (tuntap_set_state(false) < 0) {
-        log_error("set state failed! (%d / %s)", errno, strerror(errno));
-        return -1;
+    for (size_t i = 0; i < _device.proxy.count; i++) {
+        if (_device.proxy.fds[i] < 0) {
+            return true;
+        }
     }
 
-    if (tuntap_close() < 0) {
-        log_error("set state failed! (%d / %s)", errno, strerror(errno));
-        return -1;
+    return false;
+}
+
+static void _disconnect(struct pollfd *fds, size_t index)
+{
+    log_warn("tuntap mux connection %zu lost", index);
+    upstream_error(index / _device.proxy.per_server);
+    sockbuf_detach(&_device.proxy.bufs[index]);
+    tls_close(_device.proxy.fds[index]);
+    close(_device.proxy.fds[index]);
+    _device.proxy.fds[index] = -1;
+    fds[index].fd = -1;
+    mux_client_set_connection(index, -1);
+}
+
+/* policy rules already classified it, this only catches foreign routes */
+static bool _steered(struct config const *cfg, uint8_t const *buf,
+                     size_t size)
+{
+    struct iphdr const *ip = (struct iphdr const *)buf;
+    size_t offset = ip->ihl * 4;
+    uint16_t dport = 0;
+
+    if ((ip->protocol == IPPROTO_UDP || ip->protocol == IPPROTO_TCP)
+        && offset + 4 <= size) {
+        memcpy(&dport, buf + offset + 2, sizeof(dport));
+        dport = ntohs(dport);
+    }
+
+    return config_steer_match(cfg, ip->protocol, dport);
+}
+
+/* gateway answers ping itself, nothing upstream could */
+static bool _answer_echo(struct config const *cfg, int tap_fd, uint8_t *buf,
+                         size_t size)
+{
+    struct iov_msg msg;
+
+    if (((struct iphdr const *)buf)->protocol != IPPROTO_ICMP
+        || !icmp_echo_reply(&msg,
+                            icmp_gateway(cfg->tun_addr, cfg->tun_netmask),
+                            buf, size)) {
+        return false;
+    }
+
+    if (msg.size) {
+        iov_msg_write(tap_fd, &msg);
+    }
+
+    return true;
+}
+
+/* size of steered ipv4 packet read, 0 if it doesn't go upstream, -1 once
+ * tuntap is empty, caller is inside an epoch, stamp is set if packet is
+ * traced */
+static int _read_packet(struct config const *cfg, int tap_fd, uint8_t *buffer,
+                        size_t size, uint64_t *stamp)
+{
+    int nread = read(tap_fd, buffer, size);
+    if (nread <= 0) {
+        return -1;
+    }
+    *stamp = trace_sample();
+    PROBE2(tun_read, buffer, nread);
+
+    /* fragments are held until their datagram is complete */
+    nread = ip_frag_reassemble(buffer, nread, size);
+    if (nread <= 0) {
+        return 0;
+    }
+
+    if (!is_packet_ipv4(buffer)) {
+        PROBE3(classify, buffer, nread, TUNTAP_NOT_IPV4);
+        return 0;
+    }
+
+    if (_answer_echo(cfg, tap_fd, buffer, nread)) {
+        PROBE3(classify, buffer, nread, TUNTAP_ANSWERED);
+        return 0;
+    }
+
+    if (!_steered(cfg, buffer, nread)) {
+        _device.stats.unsteered++;
+        PROBE3(classify, buffer, nread, TUNTAP_UNSTEERED);
+        return 0;
+    }
+    PROBE3(classify, buffer, nread, TUNTAP_STEERED);
+    print_ip_header(buffer, size);
+
+    return nread;
+}
+
+static void _ingress(int tap_fd, uint8_t *buffer, uint64_t now_us)
+{
+    epoch_enter();
+    struct config const *cfg = config_get();
+
+    for (size_t i = 0; i < TUNTAP_INGRESS_BATCH; i++) {
+        uint64_t stamp = 0;
+        int nread = _read_packet(cfg, tap_fd, buffer, BUFSIZE, &stamp);
+        if (nread < 0) {
+            break;
+        }
+        if (nread > 0) {
+            fq_enqueue(buffer, nread, now_us, stamp);
+        }
+    }
+
+    epoch_leave();
+}
+
+/* staged mode, packets the reader thread queued move into fair queue */
+static void _ingress_ring(uint64_t now_us)
+{
+    struct pktpool *pool = &_device.stages.rx_pool;
+    uint32_t batch[TUNTAP_RING_BATCH];
+    size_t count = 0;
+
+    ring_clear(&_device.stages.rx);
+    while ((count = ring_pop(&_device.stages.rx, batch, ARRAY_SIZE(batch)))
+           > 0) {
+        for (size_t i = 0; i < count; i++) {
+            fq_enqueue(pktpool_data(pool, batch[i]), pool->lengths[batch[i]],
+                       now_us, pool->stamps[batch[i]]);
+        }
+        pktpool_put(pool, batch, count);
+    }
+}
+
+/* destinations over their class rate wait in fair queue */
+static bool _shaper_gate(uint8_t const *buf, size_t size)
+{
+    struct iphdr const *ip = (struct iphdr const *)buf;
+    struct shaper_class *cls = shaper_match(ip->saddr, NULL, ip->daddr);
+
+    if (shaper_wait_ms(cls, size)) {
+        return false;
+    }
+
+    shaper_consume(cls, size);
+
+    return true;
+}
+
+/* flow waits in fair queue while its upstream is blocked or its class is
+ * over rate, flows on other connections keep going */
+static bool _egress_gate(uint8_t const *buf, size_t size)
+{
+    return mux_client_writable(buf, size) && _shaper_gate(buf, size);
+}
+
+/* sender learns right away that its packet can't go anywhere, instead of
+ * waiting out its timeout */
+static void _unreachable(uint8_t const *buf, size_t size, int err)
+{
+    struct iphdr const *ip = (struct iphdr const *)buf;
+    struct iov_msg msg;
+    bool built = false;
+
+    if (err == -ENOTCONN) {
+        epoch_enter();
+        uint32_t gateway = icmp_gateway(config_get()->tun_addr,
+                                        config_get()->tun_netmask);
+        epoch_leave();
+        built = icmp_unreachable(&msg, gateway, ICMP_NET_UNREACH, 0, buf,
+                                 size);
+    }
+    else if (err == -EPROTONOSUPPORT && ip->protocol != IPPROTO_UDP) {
+        /* steered tcp fails with ECONNREFUSED instead of retrying SYNs */
+        built = icmp_unreachable(&msg, ip->daddr, ICMP_PROT_UNREACH, 0, buf,
+                                 size);
+    }
+
+    if (built) {
+        iov_msg_write(_device.fd, &msg);
+    }
+}
+
+/* hand at most one coalesced write worth of packets to upstream */
+static size_t _egress(uint8_t *buffer, size_t limit)
+{
+    size_t bytes = 0;
+    size_t size = 0;
+    uint64_t stamp = 0;
+
+    while (bytes < limit
+           && (size = fq_dequeue(buffer, BUFSIZE, util_now_us(), &stamp))
+                  > 0) {
+        if (mux_client_send(buffer, size, stamp) < 0) {
+            _unreachable(buffer, size, errno);
+        }
+        bytes += size;
+    }
+
+    return bytes;
+}
+
+static bool _stage_parked(bool const *flag)
+{
+    return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+}
+
+static void _stage_park(bool *flag)
+{
+    __atomic_store_n(flag, true, __ATOMIC_RELEASE);
+    quiesce_park(&_quiesce);
+    __atomic_store_n(flag, false, __ATOMIC_RELEASE);
+}
+
+/* staged mode, tuntap reads and reassembly run ahead of data path */
+static void *_reader_thread(void *arg)
+{
+    int tap_fd = _device.fd;
+    struct pktpool *pool = &_device.stages.rx_pool;
+    uint32_t batch[TUNTAP_RING_BATCH];
+    uint32_t handle = PKTPOOL_INVALID;
+    size_t count = 0;
+    struct pollfd fds[3] = {
+        { .fd = tap_fd },
+        { .fd = quiesce_fd(&_quiesce), .events = POLLIN },
+        { .fd = pktpool_fd(pool) },
+    };
+
+    quiesce_enter(&_quiesce);
+
+    while (1) {
+        if (handle == PKTPOOL_INVALID) {
+            handle = pktpool_get(pool);
+        }
+
+        /* out of buffers, packets wait in tuntap queue until some return */
+        bool starved = handle == PKTPOOL_INVALID;
+        fds[0].events = starved ? 0 : POLLIN;
+        fds[2].events = starved ? POLLIN : 0;
+        if (starved) {
+            _device.stages.pool_waits++;
+        }
+
+        int ret = poll(fds, ARRAY_SIZE(fds), -1);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0) {
+            exit(1);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            _stage_park(&_device.stages.reader_parked);
+            continue;
+        }
+
+        if (fds[2].revents & POLLIN) {
+            ring_clear(pool->free);
+        }
+
+        epoch_enter();
+        struct config const *cfg = config_get();
+        while (handle != PKTPOOL_INVALID
+               || (handle = pktpool_get(pool)) != PKTPOOL_INVALID) {
+            int nread = _read_packet(cfg, tap_fd, pktpool_data(pool, handle),
+                                     pool->buf_size, &pool->stamps[handle]);
+            if (nread < 0) {
+                break;
+            }
+            if (nread == 0) {
+                continue;
+            }
+
+            pool->lengths[handle] = nread;
+            batch[count++] = handle;
+            handle = PKTPOOL_INVALID;
+
+            if (count == ARRAY_SIZE(batch)) {
+                ring_push(&_device.stages.rx, batch, count);
+                count = 0;
+            }
+        }
+        epoch_leave();
+
+        if (count) {
+            ring_push(&_device.stages.rx, batch, count);
+            count = 0;
+        }
+    }
+
+    quiesce_leave(&_quiesce);
+
+    return NULL;
+}
+
+/* staged mode, replies leave through their own thread */
+static void *_writer_thread(void *arg)
+{
+    int tap_fd = _device.fd;
+    struct pollfd fds[2] = {
+        { .fd = ring_fd(&_device.stages.tx), .events = POLLIN },
+        { .fd = quiesce_fd(&_quiesce), .events = POLLIN },
+    };
+
+    quiesce_enter(&_quiesce);
+
+    while (1) {
+        int ret = poll(fds, ARRAY_SIZE(fds), -1);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0) {
+            exit(1);
+        }
+
+        /* data path drains upstream into ring before it parks */
+        if (fds[1].revents & POLLIN) {
+            uint64_t deadline_ms = util_now_ms() + 2 * TUNTAP_DRAIN_MS;
+            while (!_stage_parked(&_device.stages.path_parked)
+                   && util_now_ms() < deadline_ms) {
+                if (!_egress_ring(tap_fd)) {
+                    usleep(1000);
+                }
+            }
+            _egress_ring(tap_fd);
+            _stage_park(&_device.stages.writer_parked);
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            _egress_ring(tap_fd);
+        }
+    }
+
+    quiesce_leave(&_quiesce);
+
+    return NULL;
+}
+
+static void *_main_thread(void *fd)
+{
+    int tap_fd = _device.fd;
+    uint8_t buffer[BUFSIZE] = { 0 };
+    uint64_t rx_ns = 0;
+    uint64_t idle_since = util_now_us();
+    bool throttled = false;
+    bool staged = _device.stages.enabled;
+    mux_client_deliver_fn deliver = staged ? _tuntap_deliver_staged
+                                           : _tuntap_deliver;
+    struct pollfd fds[3 + MUX_CLIENT_MAX_CONNECTIONS] = {
+        { .fd = staged ? ring_fd(&_device.stages.rx) : tap_fd,
+          .events = POLLIN },
+        { .fd = quiesce_fd(&_quiesce), .events = POLLIN },
+        { .fd = ring_fd(&_device.connector.results), .events = POLLIN },
+    };
+    struct pollfd *net_fds = fds + 3;
+    size_t nfds = 3 + _device.proxy.count;
+
+    for (size_t i = 0; i < _device.proxy.count; i++) {
+        net_fds[i].fd = _device.proxy.fds[i];
+        net_fds[i].events = POLLIN;
+        if (net_fds[i].fd >= 0) {
+            _setup_socket(i, net_fds[i].fd);
+        }
+    }
+    quiesce_enter(&_quiesce);
+
+    while (1) {
+        uint64_t now_us = util_now_us();
+        /* spin while traffic is flowing, block once idle period passed */
+        bool spin = _device.busy_poll.enabled
+                    && now_us - idle_since < _device.busy_poll.idle_us;
+
+        bool backlog = !fq_empty();
+        int timeout = mux_client_timeout_ms(now_us);
+
+        if (!spin) {
+            _device.stats.blocking++;
+        }
+
+        /* backlog that can leave goes right away, one held back by shaper
+         * or a full upstream waits for next refill or POLLOUT */
+        if (backlog && !throttled) {
+            timeout = 0;
+        }
+        else if (backlog && (timeout < 0 || timeout > SHAPER_TICK_MS)) {
+            timeout = SHAPER_TICK_MS;
+        }
+
+        if (_disconnected() && (timeout < 0 || timeout > TUNTAP_RECONNECT_MS)) {
+            timeout = TUNTAP_RECONNECT_MS;
+        }
+
+        /* only a socket that returned EAGAIN is waited on for space */
+        for (size_t i = 0; i < _device.proxy.count; i++) {
+            net_fds[i].events = POLLIN | (mux_client_blocked(i) ? POLLOUT : 0);
+        }
+
+        int ret = poll(fds, nfds, spin ? 0 : timeout);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0) {
+            exit(1);
+        }
+
+        if (ret == 0 && spin) {
+            _device.stats.spins++;
+        }
+
+        if (ret > 0) {
+            idle_since = util_now_us();
+        }
+
+        /* park on a frame boundary with nothing queued */
+        if (fds[1].revents & POLLIN) {
+            /* reader stops first, whatever it queued still goes upstream */
+            if (staged) {
+                uint64_t deadline_ms = util_now_ms() + TUNTAP_DRAIN_MS;
+                while (!_stage_parked(&_device.stages.reader_parked)
+                       && util_now_ms() < deadline_ms) {
+                    usleep(1000);
+                }
+                _ingress_ring(util_now_us());
+            }
+            _egress(buffer, SIZE_MAX);
+            if (mux_client_drain(deliver, &tap_fd, TUNTAP_DRAIN_MS) < 0) {
+                log_warn("tuntap mux drain incomplete");
+            }
+            _stage_flush();
+            _stage_park(&_device.stages.path_parked);
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if (staged) {
+                _ingress_ring(util_now_us());
+            }
+            else {
+                _ingress(tap_fd, buffer, util_now_us());
+            }
+        }
+
+        /* frames socket didn't take go first */
+        for (size_t i = 0; i < _device.proxy.count; i++) {
+            if (net_fds[i].revents & POLLOUT && mux_client_blocked(i)
+                && mux_client_flush(i) < 0) {
+                _disconnect(net_fds, i);
+                net_fds[i].revents = 0;
+            }
+        }
+
+        throttled = !_egress(buffer, MUX_COALESCE_BYTES) && !fq_empty();
+
+        for (size_t i = 0; i < _device.proxy.count; i++) {
+            if (!(net_fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            int delivered = mux_client_receive(i, deliver, &tap_fd, &rx_ns);
+            if (delivered < 0) {
+                _disconnect(net_fds, i);
+            }
+            else if (delivered > 0) {
+                _record_latency(rx_ns);
+            }
+        }
+        _stage_flush();
+
+        now_us = util_now_us();
+        if (fds[2].revents & POLLIN) {
+            _connected(net_fds, now_us / 1000, deliver, &tap_fd);
+        }
+        _follow_upstream(now_us / 1000);
+        _reconnect(now_us / 1000);
+        _tune_buffers(now_us / 1000);
+        mux_client_tick(now_us);
+    }
+
+    quiesce_leave(&_quiesce);
+
+    return NULL;
+}
+
+static int _connector_start()
+{
+    if (ring_init(&_device.connector.requests, TUNTAP_CONNECT_JOBS) < 0
+        || ring_init(&_device.connector.results, TUNTAP_CONNECT_JOBS) < 0) {
+        return -1;
+    }
+
+    if (affinity_thread_create(&_device.connector.thread,
+                               AFFINITY_TUNTAP_CONNECTOR, &_connector_thread,
+                               NULL)
+        != 0) {
+        log_error("connector thread failed! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* reader and writer are up before data path polls their rings */
+static int _stages_start()
+{
+    if (pktpool_init(&_device.stages.rx_pool, TUNTAP_RING_SIZE,
+                     TUNTAP_PACKET_MAX)
+            < 0
+        || pktpool_init(&_device.stages.tx_pool, TUNTAP_RING_SIZE,
+                        TUNTAP_PACKET_MAX)
+               < 0
+        || ring_init(&_device.stages.rx, TUNTAP_RING_SIZE) < 0
+        || ring_init(&_device.stages.tx, TUNTAP_RING_SIZE) < 0) {
+        log_error("stages init failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    if (affinity_thread_create(&_device.stages.reader, AFFINITY_TUNTAP_READER,
+                               &_reader_thread, NULL)
+            != 0
+        || affinity_thread_create(&_device.stages.writer,
+                                  AFFINITY_TUNTAP_WRITER, &_writer_thread,
+                                  NULL)
+               != 0) {
+        log_error("stage threads failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int tuntap_start()
+{
+    if (ip_frag_init(IP_FRAG_DEFAULT_FLOW_LIMIT, IP_FRAG_DEFAULT_TOTAL_LIMIT,
+                     IP_FRAG_DEFAULT_TIMEOUT_MS)
+        < 0) {
+        log_error("ip frag init failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    if (quiesce_init(&_quiesce) < 0) {
+        log_error("quiesce init failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    if (icmp_init() < 0) {
+        log_error("icmp init failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    /* one mtu sized packet per flow and round */
+    if (fq_init(_device.mtu, FQ_DEFAULT_PACKET_LIMIT, FQ_DEFAULT_MEMORY_LIMIT,
+                FQ_DEFAULT_TARGET_US, FQ_DEFAULT_INTERVAL_US)
+        < 0) {
+        log_error("fq init failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+    fq_set_gate(_egress_gate);
+
+    if (upstream_init(_servers()) < 0) {
+        log_error("upstream init failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+    upstream_set_name(0, _device.proxy.ip, _device.proxy.port);
+    for (size_t i = 0; i < _device.proxy.backup_count; i++) {
+        upstream_set_name(i + 1, _device.proxy.backups[i].ip,
+                          _device.proxy.backups[i].port);
+    }
+
+    _device.proxy.count = _servers() * _device.proxy.per_server;
+    if (mux_client_init(_servers(), _device.proxy.per_server,
+                        _device.proxy.delay_us)
+        < 0) {
+        log_error("mux init failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    /* first connection is already up (or adopted), rest are opened here */
+    mux_client_set_connection(0, _device.proxy.fds[0]);
+    for (size_t i = 1; i < _device.proxy.count; i++) {
+        _device.proxy.fds[i] = _server_connect(i);
+        mux_client_set_connection(i, _device.proxy.fds[i]);
+    }
+    for (size_t i = 0; i < _servers(); i++) {
+        _device.proxy.backoff_ms[i] = TUNTAP_RECONNECT_MS;
+    }
+
+    /* tuntap is drained in batches into fair queue */
+    fcntl(_device.fd, F_SETFL, fcntl(_device.fd, F_GETFL) | O_NONBLOCK);
+
+    if (_connector_start() < 0
+        || (_device.stages.enabled && _stages_start() < 0)) {
+        return -1;
+    }
+
+    _device.stats.started_ms = util_now_ms();
+    stats_register(_tuntap_report);
+    config_subscribe(_tuntap_apply);
+
+    affinity_align_interface(_device.name, AFFINITY_TUNTAP);
+
+    if (affinity_thread_create(&_main_thread_worker, AFFINITY_TUNTAP,
+                               &_main_thread, &_device.fd)
+        != 0) {
+        pthread_detach(_main_thread_worker);
+        return -1;
+    }
+
+    return 0;
+}
+
+int tuntap_init(char const *addr, uint16_t port)
+{
+    if (tuntap_open() < 0) {
+        log_error("open failed! (%d / %s)", errno, strerror(errno));
+        return errno;
+    }
+
+    struct config cfg;
+    config_copy(&cfg);
+
+    if (tuntap_configure(&cfg) < 0) {
+        log_error("configure failed! (%d / %s)", errno, strerror(errno));
+        return errno;
+    }
+
+    /* with backups any server will do, main loop retries the rest */
+    if (tuntap_connect_to_proxy(addr, port) < 0) {
+        if (!_device.proxy.backup_count) {
+            log_error("failed to connect to proxy! (%d / %s)", errno,
+                      strerror(errno));
+            return errno;
+        }
+        log_warn("tuntap upstream %s:%u unreachable, starting on backups",
+                 _device.proxy.ip, _device.proxy.port);
+    }
+
+    return tuntap_start();
+}
+
+int tuntap_adopt(struct tuntap_state const *state, char const *addr,
+                 uint16_t port)
+{
+    if (!state || state->fd < 0 || state->proxy_fd < 0) {
+        errno = -EINVAL;
+        log_error("tuntap state invalid! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    strncpy(_device.name, state->name, IFNAMSIZ);
+    _device.name[IFNAMSIZ - 1] = 0;
+    _device.fd = state->fd;
+    _device.mtu = state->mtu;
+    _device.proxy.fds[0] = state->proxy_fd;
+    epoch_enter();
+    strcpy(_device.addr, config_get()->tun_addr);
+    strcpy(_device.netmask, config_get()->tun_netmask);
+    epoch_leave();
+    _set_proxy(addr, port);
+
+    /* userspace tls state can't be handed over, main loop reconnects */
+    if (tls_enabled() && tls_adopt(_device.proxy.fds[0]) < 0) {
+        close(_device.proxy.fds[0]);
+        _device.proxy.fds[0] = -1;
+    }
+
+    log_info("adopted %s (fd %d, proxy fd %d)", _device.name, _device.fd,
+             _device.proxy.fds[0]);
+
+    return tuntap_start();
+}
+
+int tuntap_get_state(struct tuntap_state *state)
+{
+    if (!state || !_is_fd_valid()) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    memset(state, 0, sizeof(*state));
+    strncpy(state->name, _device.name, sizeof(state->name) - 1);
+    state->mtu = _device.mtu;
+    state->fd = _device.fd;
+    state->proxy_fd = _device.proxy.fds[0];
+
+    return 0;
+}
+
+int tuntap_suspend(int timeout_ms)
+{
+    return quiesce_suspend(&_quiesce, timeout_ms);
+}
+
+void tuntap_resume()
+{
+    quiesce_resume(&_quiesce);
+}
+
+int tuntap_deinit()
+{
+    if (tuntap_unconfigure() < 0) {
+        log_error("unconfigure failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    if (tuntap_close() < 0) {
+        log_error("set state failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    ip_frag_deinit();
+    fq_deinit();
+
+    return 0;
+}
+
+int tuntap_set_busy_poll(bool enable, uint32_t idle_us)
+{
+    if (_is_fd_valid()) {
+        errno = -EBUSY;
+        log_error("busy poll must be set before start! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    _device.busy_poll.enabled = enable;
+    _device.busy_poll.idle_us = idle_us;
+
+    return 0;
+}
+
+int tuntap_set_stages(bool enable)
+{
+    if (_is_fd_valid()) {
+        errno = -EBUSY;
+        log_error("stages must be set before start! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
     }
 
+    _device.stages.enabled = enable;
+
     return 0;
 }
+
+int tuntap_set_mux(size_t connections, uint32_t delay_us)
+{
+    if (_is_fd_valid()) {
+        errno = -EBUSY;
+        log_error("mux must be set before start! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    if (!connections
+        || connections * _servers() > MUX_CLIENT_MAX_CONNECTIONS) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    _device.proxy.per_server = connections;
+    _device.proxy.delay_us = delay_us;
+
+    return 0;
+}
+
+int tuntap_add_upstream(char const *ip, uint16_t port)
+{
+    size_t n = _device.proxy.backup_count;
+
+    if (_is_fd_valid()) {
+        errno = -EBUSY;
+        log_error("upstreams must be added before start! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    if (!ip || !port || strlen(ip) >= CONFIG_ADDR_SIZE) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    if (_servers() >= UPSTREAM_MAX_SERVERS
+        || (_servers() + 1) * _device.proxy.per_server
+               > MUX_CLIENT_MAX_CONNECTIONS) {
+        errno = -ENOSPC;
+        return -1;
+    }
+
+    strcpy(_device.proxy.backups[n].ip, ip);
+    _device.proxy.backups[n].port = port;
+    _device.proxy.backup_count++;
+
+    return 0;
+}
+
+int tuntap_set_tls(char const *ip, uint16_t port)
+{
+    if (_is_fd_valid() || !tls_enabled()) {
+        errno = -EBUSY;
+        log_error("tls must be set up before start! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    if (!ip || !port) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    _device.proxy.tls_ip = ip;
+    _device.proxy.tls_port = port;
+
+    return 0;
+}
+
+int tuntap_set_mtu(uint16_t mtu)
+{
+    if (mtu < TUNTAP_MIN_MTU) {
+        errno = -EINVAL;
+        log_error("mtu %u too small! (%d / %s)", mtu, errno, strerror(errno));
+        return -1;
+    }
+
+    _device.mtu = mtu;
+
+    return _is_fd_valid() ? netlink_set_mtu(_device.name, mtu) : 0;
+}
@@ -1,8 +1,26 @@
 #ifndef __TUNTAP_H__
 #define __TUNTAP_H__
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#define TUNTAP_DEFAULT_MTU 1500
+/* device carries ipv6 too, which needs at least 1280 (rfc 8200 5) */
+#define TUNTAP_MIN_MTU     1280
+#define TUNTAP_NAME_SIZE   16
+
+#define TUNTAP_DEFAULT_BUSY_POLL_IDLE_US 200
+#define TUNTAP_DEFAULT_MUX_CONNECTIONS   1
+
+struct tuntap_state
+{
+    char name[TUNTAP_NAME_SIZE];
+    uint16_t mtu;
+    int fd;
+    int proxy_fd;
+};
+
 /**
  * @brief initialize tuntap interface
  * @param addr proxy ip address
@@ -11,10 +29,94 @@
  */
 int tuntap_init(char const *addr, uint16_t port);
 
+/**
+ * @brief take over configured tuntap interface from previous process
+ * @param state interface state with received file descriptors
+ * @param addr proxy ip address
+ * @param port proxy port
+ * @return 0 on success, -errno on failure
+ */
+int tuntap_adopt(struct tuntap_state const *state, char const *addr,
+                 uint16_t port);
+
+/**
+ * @brief get interface state for handover to next process
+ * @param state destination for state
+ * @return 0 on success, -errno on failure
+ */
+int tuntap_get_state(struct tuntap_state *state);
+
+/**
+ * @brief park data path between packets
+ * @param timeout_ms max time to wait for data path
+ * @return 0 on success, -1 on timeout
+ */
+int tuntap_suspend(int timeout_ms);
+
+/**
+ * @brief restart parked data path
+ */
+void tuntap_resume();
+
 /**
  * @brief deinitialize tuntap interface
  * @return 0 on success, -errno on failure
  */
 int tuntap_deinit();
 
+/**
+ * @brief set tuntap interface mtu, oversized replies are fragmented to it
+ * @param mtu interface mtu, 1280 up to 65535 for jumbo frames
+ * @return 0 on success, -1 on failure (errno set)
+ */
+int tuntap_set_mtu(uint16_t mtu);
+
+/**
+ * @brief enable low latency busy poll mode of data path, must be called
+ *        before tuntap_init
+ * @param enable spin on tuntap and upstream socket instead of blocking
+ * @param idle_us idle period after which data path falls back to blocking
+ * @return 0 on success, -errno on failure
+ */
+int tuntap_set_busy_poll(bool enable, uint32_t idle_us);
+
+/**
+ * @brief split data path into tuntap reader, classification / upstream and
+ *        tuntap writer threads joined by lock-free rings, must be called
+ *        before tuntap_init
+ * @param enable run reader and writer on their own threads
+ * @return 0 on success, -errno on failure
+ */
+int tuntap_set_stages(bool enable);
+
+/**
+ * @brief configure multiplexed upstream, must be called before tuntap_init
+ * @param connections number of connections to each upstream server flows
+ *        are spread over
+ * @param delay_us max time a frame waits to be coalesced with others
+ * @return 0 on success, -errno on failure
+ */
+int tuntap_set_mux(size_t connections, uint32_t delay_us);
+
+/**
+ * @brief add backup upstream server, new flows go to the faster healthy
+ *        server and fail over to the others, must be called before
+ *        tuntap_init. Backups are reached without tls, tls endpoint only
+ *        fronts proxy
+ * @param ip server ip address
+ * @param port server port
+ * @return 0 on success, -errno on failure
+ */
+int tuntap_add_upstream(char const *ip, uint16_t port);
+
+/**
+ * @brief reach proxy through tls endpoint (e.g. a terminator in front of
+ *        it), tls_client_init has to succeed first and it must be called
+ *        before tuntap_init
+ * @param ip tls endpoint ip address
+ * @param port tls endpoint port
+ * @return 0 on success, -errno on failure
+ */
+int tuntap_set_tls(char const *ip, uint16_t port);
+
 #endif /* __TUNTAP_H__ */
@@ -0,0 +1,550 @@
+#define _GNU_SOURCE
+#include "udp_relay.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "log.h"
+#include "netlink.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "util.h"
+
+#define UDP_RELAY_HASH_SIZE   (UDP_RELAY_MAX_ASSOCIATIONS * 2)
+#define UDP_RELAY_NONE        UINT32_MAX
+#define UDP_RELAY_CLIENTS     UINT64_MAX
+#define UDP_RELAY_TICK_MS     100
+#define UDP_RELAY_SOCKET_SIZE (4 * 1024 * 1024)
+#define UDP_RELAY_ATYP_IPV4   0x01
+
+struct udp_relay_association
+{
+    bool used;
+    bool expired;
+    uint16_t gen;
+    int fd;
+    int control_fd;
+    struct sockaddr_in client;
+    uint64_t active_ms;
+    struct timer_wheel_timer idle;
+    uint32_t next;
+};
+
+/* datagrams are received behind header room so it can be filled in place */
+struct udp_relay_batch
+{
+    struct mmsghdr msgs[UDP_RELAY_BATCH];
+    struct iovec iov[UDP_RELAY_BATCH];
+    struct sockaddr_in addrs[UDP_RELAY_BATCH];
+    uint8_t data[UDP_RELAY_BATCH]
+                [UDP_RELAY_HEADER_SIZE + UDP_RELAY_DATAGRAM_SIZE];
+};
+
+struct udp_relay_out
+{
+    struct mmsghdr msgs[UDP_RELAY_BATCH];
+    struct iovec iov[UDP_RELAY_BATCH];
+    struct sockaddr_in addrs[UDP_RELAY_BATCH];
+    size_t count;
+};
+
+static struct
+{
+    int fd;
+    int epoll_fd;
+    volatile bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct udp_relay_association *slots;
+    uint32_t *heads;
+    uint32_t free_head;
+    struct timer_wheel timers;
+    struct udp_relay_batch *in;
+    struct udp_relay_out out;
+    struct udp_relay_stats stats;
+} _relay = {
+    .fd = -1,
+    .epoll_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint32_t _hash(uint32_t ip, uint16_t port)
+{
+    return ((ip * 2654435761u) ^ port) & (UDP_RELAY_HASH_SIZE - 1);
+}
+
+static void _hash_insert(uint32_t slot)
+{
+    struct udp_relay_association *a = &_relay.slots[slot];
+    uint32_t bucket = _hash(a->client.sin_addr.s_addr, a->client.sin_port);
+
+    a->next = _relay.heads[bucket];
+    _relay.heads[bucket] = slot;
+}
+
+static void _hash_remove(uint32_t slot)
+{
+    struct udp_relay_association *a = &_relay.slots[slot];
+    uint32_t *link = &_relay.heads[_hash(a->client.sin_addr.s_addr,
+                                         a->client.sin_port)];
+
+    while (*link != UDP_RELAY_NONE && *link != slot) {
+        link = &_relay.slots[*link].next;
+    }
+    if (*link == slot) {
+        *link = a->next;
+    }
+}
+
+static uint32_t _hash_find(uint32_t ip, uint16_t port)
+{
+    uint32_t slot = _relay.heads[_hash(ip, port)];
+
+    while (slot != UDP_RELAY_NONE) {
+        struct udp_relay_association const *a = &_relay.slots[slot];
+        if (a->client.sin_addr.s_addr == ip && a->client.sin_port == port) {
+            break;
+        }
+        slot = a->next;
+    }
+
+    return slot;
+}
+
+/* exact client address, or association still waiting to learn its port */
+static struct udp_relay_association *_lookup(struct sockaddr_in const *from)
+{
+    uint32_t slot = _hash_find(from->sin_addr.s_addr, from->sin_port);
+    if (slot != UDP_RELAY_NONE) {
+        return &_relay.slots[slot];
+    }
+
+    slot = _hash_find(from->sin_addr.s_addr, 0);
+    if (slot == UDP_RELAY_NONE) {
+        return NULL;
+    }
+
+    _hash_remove(slot);
+    _relay.slots[slot].client.sin_port = from->sin_port;
+    _hash_insert(slot);
+
+    return &_relay.slots[slot];
+}
+
+static void _send_batch(int fd, struct udp_relay_out *out)
+{
+    size_t sent = 0;
+
+    while (sent < out->count) {
+        int ret = sendmmsg(fd, out->msgs + sent, out->count - sent,
+                           MSG_DONTWAIT);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        sent += ret;
+        _relay.stats.batches_out++;
+    }
+
+    _relay.stats.datagrams_out += sent;
+    _relay.stats.dropped += out->count - sent;
+    out->count = 0;
+}
+
+static void _queue(struct udp_relay_out *out, void *buf, size_t size,
+                   struct sockaddr_in const *to)
+{
+    size_t i = out->count++;
+
+    out->iov[i].iov_base = buf;
+    out->iov[i].iov_len = size;
+    out->addrs[i] = *to;
+    memset(&out->msgs[i], 0, sizeof(out->msgs[i]));
+    out->msgs[i].msg_hdr.msg_iov = &out->iov[i];
+    out->msgs[i].msg_hdr.msg_iovlen = 1;
+    out->msgs[i].msg_hdr.msg_name = &out->addrs[i];
+    out->msgs[i].msg_hdr.msg_namelen = sizeof(out->addrs[i]);
+}
+
+static int _receive_batch(int fd, size_t offset)
+{
+    struct udp_relay_batch *in = _relay.in;
+
+    for (size_t i = 0; i < UDP_RELAY_BATCH; i++) {
+        in->iov[i].iov_base = in->data[i] + offset;
+        in->iov[i].iov_len = sizeof(in->data[i]) - offset;
+        memset(&in->msgs[i], 0, sizeof(in->msgs[i]));
+        in->msgs[i].msg_hdr.msg_iov = &in->iov[i];
+        in->msgs[i].msg_hdr.msg_iovlen = 1;
+        in->msgs[i].msg_hdr.msg_name = &in->addrs[i];
+        in->msgs[i].msg_hdr.msg_namelen = sizeof(in->addrs[i]);
+    }
+
+    int count = recvmmsg(fd, in->msgs, UDP_RELAY_BATCH, MSG_DONTWAIT, NULL);
+    if (count > 0) {
+        _relay.stats.batches_in++;
+        _relay.stats.datagrams_in += count;
+    }
+
+    return count;
+}
+
+/* client -> remote, consecutive datagrams of one association share a send */
+static void _from_clients(uint64_t now)
+{
+    struct udp_relay_batch *in = _relay.in;
+    struct udp_relay_association *current = NULL;
+    int count = _receive_batch(_relay.fd, 0);
+
+    for (int i = 0; i < count; i++) {
+        uint8_t *header = in->data[i];
+        size_t size = in->msgs[i].msg_len;
+
+        if (in->msgs[i].msg_hdr.msg_flags & MSG_TRUNC
+            || size < UDP_RELAY_HEADER_SIZE || header[2] != 0
+            || header[3] != UDP_RELAY_ATYP_IPV4) {
+            /* fragments and domain destinations aren't relayed */
+            _relay.stats.dropped++;
+            continue;
+        }
+
+        struct udp_relay_association *a = _lookup(&in->addrs[i]);
+        if (!a || a->expired) {
+            _relay.stats.dropped++;
+            continue;
+        }
+
+        if (a != current && current) {
+            _send_batch(current->fd, &_relay.out);
+        }
+        current = a;
+        a->active_ms = now;
+
+        struct sockaddr_in to = { .sin_family = AF_INET };
+        memcpy(&to.sin_addr, header + 4, sizeof(to.sin_addr));
+        memcpy(&to.sin_port, header + 8, sizeof(to.sin_port));
+
+        _queue(&_relay.out, header + UDP_RELAY_HEADER_SIZE,
+               size - UDP_RELAY_HEADER_SIZE, &to);
+    }
+
+    if (current) {
+        _send_batch(current->fd, &_relay.out);
+    }
+}
+
+/* remote -> client, header is written into room left in front of payload */
+static void _from_remote(struct udp_relay_association *a, uint64_t now)
+{
+    struct udp_relay_batch *in = _relay.in;
+    int count = _receive_batch(a->fd, UDP_RELAY_HEADER_SIZE);
+
+    for (int i = 0; i < count; i++) {
+        uint8_t *header = in->data[i];
+
+        if (in->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            _relay.stats.dropped++;
+            continue;
+        }
+
+        memset(header, 0, 3);
+        header[3] = UDP_RELAY_ATYP_IPV4;
+        memcpy(header + 4, &in->addrs[i].sin_addr, 4);
+        memcpy(header + 8, &in->addrs[i].sin_port, 2);
+
+        _queue(&_relay.out, header,
+               UDP_RELAY_HEADER_SIZE + in->msgs[i].msg_len, &a->client);
+    }
+
+    if (count > 0) {
+        a->active_ms = now;
+        _send_batch(_relay.fd, &_relay.out);
+    }
+}
+
+/* timer isn't moved per datagram, it's pushed back here if still active */
+static void _expire(struct timer_wheel_timer *timer, void *arg)
+{
+    struct udp_relay_association *a = arg;
+    uint64_t idle_ms = a->active_ms + UDP_RELAY_IDLE_MS;
+
+    if (idle_ms > util_now_ms()) {
+        timer_wheel_arm(&_relay.timers, timer, idle_ms);
+        return;
+    }
+
+    /* owner sees control connection close and frees association */
+    a->expired = true;
+    shutdown(a->control_fd, SHUT_RDWR);
+    _relay.stats.expired++;
+}
+
+static void *_relay_thread(void *arg)
+{
+    struct epoll_event events[UDP_RELAY_BATCH];
+    int timeout = -1;
+
+    while (!_relay.stop) {
+        int count = epoll_wait(_relay.epoll_fd, events, ARRAY_SIZE(events),
+                               timeout);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            if (!_relay.stop) {
+                log_error("udp relay wait failed! (%d / %s)", errno,
+                          strerror(errno));
+            }
+            break;
+        }
+
+        pthread_mutex_lock(&_relay.lock);
+        uint64_t now = util_now_ms();
+        for (int i = 0; i < count; i++) {
+            uint64_t key = events[i].data.u64;
+            if (key == UDP_RELAY_CLIENTS) {
+                _from_clients(now);
+                continue;
+            }
+
+            /* association may have been closed since event was queued */
+            struct udp_relay_association *a = &_relay.slots[key & 0xffff];
+            if (a->used && a->gen == key >> 16) {
+                _from_remote(a, now);
+            }
+        }
+        timer_wheel_advance(&_relay.timers, util_now_ms());
+        /* associations are armed by other threads, their idle deadline is
+         * further out than one wheel turn so waking once per turn is enough */
+        timeout = timer_wheel_timeout_ms(&_relay.timers, util_now_ms());
+        if (timeout < 0) {
+            timeout = UDP_RELAY_TICK_MS * TIMER_WHEEL_SLOTS;
+        }
+        pthread_mutex_unlock(&_relay.lock);
+    }
+
+    return NULL;
+}
+
+static void _udp_relay_report()
+{
+    struct udp_relay_stats stats;
+    udp_relay_get_stats(&stats);
+
+    log_info("udp relay: associations %lu (expired %lu), datagrams in %lu "
+             "(%lu batches) out %lu (%lu batches), dropped %lu",
+             stats.associations, stats.expired, stats.datagrams_in,
+             stats.batches_in, stats.datagrams_out, stats.batches_out,
+             stats.dropped);
+}
+
+int udp_relay_init(char const *ip)
+{
+    int size = UDP_RELAY_SOCKET_SIZE;
+    struct sockaddr_in local = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = inet_addr(ip),
+    };
+
+    _relay.slots = calloc(UDP_RELAY_MAX_ASSOCIATIONS, sizeof(*_relay.slots));
+    _relay.heads = malloc(UDP_RELAY_HASH_SIZE * sizeof(*_relay.heads));
+    _relay.in = malloc(sizeof(*_relay.in));
+    if (!_relay.slots || !_relay.heads || !_relay.in) {
+        errno = -ENOMEM;
+        goto fail;
+    }
+
+    memset(_relay.heads, 0xff, UDP_RELAY_HASH_SIZE * sizeof(*_relay.heads));
+    for (uint32_t i = 0; i < UDP_RELAY_MAX_ASSOCIATIONS; i++) {
+        _relay.slots[i].fd = -1;
+        _relay.slots[i].next = i + 1 < UDP_RELAY_MAX_ASSOCIATIONS
+                                   ? i + 1
+                                   : UDP_RELAY_NONE;
+    }
+    _relay.free_head = 0;
+
+    _relay.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_relay.fd < 0) {
+        goto fail;
+    }
+
+    setsockopt(_relay.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(_relay.fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    /* datagrams back to clients stay out of the tunnel like socks5 replies */
+    if (netlink_mark_socket(_relay.fd) < 0) {
+        goto fail;
+    }
+
+    if (bind(_relay.fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        goto fail;
+    }
+
+    _relay.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (_relay.epoll_fd < 0) {
+        goto fail;
+    }
+
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u64 = UDP_RELAY_CLIENTS,
+    };
+    if (epoll_ctl(_relay.epoll_fd, EPOLL_CTL_ADD, _relay.fd, &event) < 0) {
+        goto fail;
+    }
+
+    _relay.stop = false;
+    timer_wheel_init(&_relay.timers, UDP_RELAY_TICK_MS, util_now_ms());
+    if (affinity_thread_create(&_relay.thread, AFFINITY_SOCKS5_UDP,
+                               &_relay_thread, NULL)
+        != 0) {
+        goto fail;
+    }
+    pthread_detach(_relay.thread);
+
+    stats_register(_udp_relay_report);
+
+    udp_relay_get_address(&local);
+    log_info("udp relay listening on %s:%u", ip, ntohs(local.sin_port));
+
+    return 0;
+
+fail:
+    log_error("udp relay init failed! (%d / %s)", errno, strerror(errno));
+    udp_relay_deinit();
+    return -1;
+}
+
+void udp_relay_deinit()
+{
+    _relay.stop = true;
+
+    if (_relay.epoll_fd >= 0) {
+        close(_relay.epoll_fd);
+        _relay.epoll_fd = -1;
+    }
+    if (_relay.fd >= 0) {
+        close(_relay.fd);
+        _relay.fd = -1;
+    }
+}
+
+int udp_relay_get_address(struct sockaddr_in *addr)
+{
+    socklen_t size = sizeof(*addr);
+
+    if (_relay.fd < 0) {
+        return -1;
+    }
+
+    return getsockname(_relay.fd, (struct sockaddr *)addr, &size);
+}
+
+int udp_relay_open(int control_fd, uint32_t client_ip, uint16_t client_port)
+{
+    if (_relay.fd < 0) {
+        errno = -ENOTCONN;
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("udp relay socket failed! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    if (netlink_mark_socket(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&_relay.lock);
+
+    uint32_t slot = _relay.free_head;
+    if (slot == UDP_RELAY_NONE) {
+        pthread_mutex_unlock(&_relay.lock);
+        close(fd);
+        errno = -ENOSPC;
+        log_error("udp relay association limit reached! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    struct udp_relay_association *a = &_relay.slots[slot];
+    _relay.free_head = a->next;
+
+    a->used = true;
+    a->expired = false;
+    a->fd = fd;
+    a->control_fd = control_fd;
+    a->active_ms = util_now_ms();
+    timer_wheel_timer_init(&a->idle, _expire, a);
+    timer_wheel_arm(&_relay.timers, &a->idle,
+                    a->active_ms + UDP_RELAY_IDLE_MS);
+    a->client.sin_family = AF_INET;
+    a->client.sin_addr.s_addr = client_ip;
+    a->client.sin_port = client_port;
+    _hash_insert(slot);
+
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u64 = (uint64_t)a->gen << 16 | slot,
+    };
+    int id = (a->gen & 0x7fff) << 16 | slot;
+
+    if (epoll_ctl(_relay.epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        pthread_mutex_unlock(&_relay.lock);
+        log_error("udp relay epoll add failed! (%d / %s)", errno,
+                  strerror(errno));
+        udp_relay_close(id);
+        return -1;
+    }
+
+    _relay.stats.associations++;
+    pthread_mutex_unlock(&_relay.lock);
+
+    return id;
+}
+
+void udp_relay_close(int id)
+{
+    uint32_t slot = id & 0xffff;
+
+    if (id < 0 || slot >= UDP_RELAY_MAX_ASSOCIATIONS) {
+        return;
+    }
+
+    pthread_mutex_lock(&_relay.lock);
+
+    struct udp_relay_association *a = &_relay.slots[slot];
+    if (a->used && (a->gen & 0x7fff) == id >> 16) {
+        _hash_remove(slot);
+        timer_wheel_cancel(&_relay.timers, &a->idle);
+        close(a->fd);
+        a->fd = -1;
+        a->used = false;
+        a->gen++;
+        a->next = _relay.free_head;
+        _relay.free_head = slot;
+        _relay.stats.associations--;
+    }
+
+    pthread_mutex_unlock(&_relay.lock);
+}
+
+void udp_relay_get_stats(struct udp_relay_stats *stats)
+{
+    pthread_mutex_lock(&_relay.lock);
+    *stats = _relay.stats;
+    pthread_mutex_unlock(&_relay.lock);
+}
@@ -0,0 +1,73 @@
+#ifndef __UDP_RELAY_H__
+#define __UDP_RELAY_H__
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#define UDP_RELAY_MAX_ASSOCIATIONS 4096
+#define UDP_RELAY_BATCH            32
+#define UDP_RELAY_DATAGRAM_SIZE    9216
+#define UDP_RELAY_IDLE_MS          60000
+/* rsv(2) frag(1) atyp(1) ipv4(4) port(2) */
+#define UDP_RELAY_HEADER_SIZE      10
+
+struct udp_relay_stats
+{
+    uint64_t datagrams_in;
+    uint64_t datagrams_out;
+    uint64_t batches_in;
+    uint64_t batches_out;
+    uint64_t dropped;
+    uint64_t associations;
+    uint64_t expired;
+};
+
+/*
+ * Server side of socks5 UDP ASSOCIATE. Clients talk to one shared socket
+ * and are told apart by source address, every association has its own
+ * socket towards remote hosts so replies need no lookup. One thread moves
+ * datagrams in recvmmsg / sendmmsg batches, payloads are never copied.
+ */
+
+/**
+ * @brief open shared client socket and start relay thread
+ * @param ip local address of shared socket, port is picked by kernel
+ * @return 0 on success, -errno on failure
+ */
+int udp_relay_init(char const *ip);
+
+/**
+ * @brief stop relay thread and close every socket
+ */
+void udp_relay_deinit();
+
+/**
+ * @brief get address clients send datagrams to (BND.ADDR / BND.PORT)
+ * @param addr destination address
+ * @return 0 on success, -1 if relay isn't running
+ */
+int udp_relay_get_address(struct sockaddr_in *addr);
+
+/**
+ * @brief create association, idle associations get control connection
+ *        shut down so its owner closes them
+ * @param control_fd tcp connection association lives on
+ * @param client_ip client ip, network order
+ * @param client_port client port, network order, 0 if not known yet
+ * @return association id on success, -1 on failure
+ */
+int udp_relay_open(int control_fd, uint32_t client_ip, uint16_t client_port);
+
+/**
+ * @brief close association
+ * @param id association id
+ */
+void udp_relay_close(int id);
+
+/**
+ * @brief get relay counters
+ * @param stats destination
+ */
+void udp_relay_get_stats(struct udp_relay_stats *stats);
+
+#endif /* __UDP_RELAY_H__ */
@@ -0,0 +1,570 @@
+#include "upgrade.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "socks5.h"
+#include "tuntap.h"
+
+#define UPGRADE_MAGIC       0x74707570
+#define UPGRADE_VERSION     1
+#define UPGRADE_MAX_FDS     252
+#define UPGRADE_MAX_PAYLOAD 1024
+
+enum upgrade_message
+{
+    UPGRADE_HELLO = 1,
+    UPGRADE_STATE = 2,
+    UPGRADE_SESSIONS = 3,
+    UPGRADE_ACK = 4,
+};
+
+/* state payload is a list of sections so new state can be appended */
+enum upgrade_section
+{
+    UPGRADE_SECTION_TUNTAP = 1,
+    UPGRADE_SECTION_SOCKS5 = 2,
+};
+
+/* payload byte per session of UPGRADE_SESSIONS */
+enum upgrade_session_kind
+{
+    UPGRADE_SESSION_IDLE = 0,
+    UPGRADE_SESSION_RELAY = 1,
+    UPGRADE_SESSION_MUX = 2,
+};
+
+/* fixed file descriptor order of UPGRADE_STATE */
+enum upgrade_state_fd
+{
+    UPGRADE_FD_TUNTAP = 0,
+    UPGRADE_FD_PROXY = 1,
+    UPGRADE_FD_LISTENER = 2,
+    UPGRADE_FD_COUNT = 3,
+};
+
+struct upgrade_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;
+    uint32_t size;
+};
+
+struct upgrade_section_header
+{
+    uint16_t type;
+    uint16_t size;
+};
+
+struct upgrade_tuntap
+{
+    char name[TUNTAP_NAME_SIZE];
+    uint16_t mtu;
+};
+
+struct upgrade_socks5
+{
+    uint32_t session_count;
+};
+
+struct upgrade_message_buf
+{
+    struct upgrade_header header;
+    uint8_t payload[UPGRADE_MAX_PAYLOAD];
+};
+
+static struct
+{
+    int fd;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    pthread_t worker;
+} _upgrade = { .fd = -1 };
+
+static int _send_msg(int fd, uint16_t type, void const *payload, size_t size,
+                     int const *fds, size_t fd_count)
+{
+    struct upgrade_message_buf msg = {
+        .header = {
+            .magic = UPGRADE_MAGIC,
+            .version = UPGRADE_VERSION,
+            .type = type,
+            .size = size,
+        },
+    };
+    union
+    {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    } control = { 0 };
+
+    if (size > sizeof(msg.payload) || fd_count > UPGRADE_MAX_FDS) {
+        errno = -EMSGSIZE;
+        return -1;
+    }
+
+    if (size) {
+        memcpy(msg.payload, payload, size);
+    }
+
+    struct iovec iov = { .iov_base = &msg,
+                         .iov_len = sizeof(msg.header) + size };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (fd_count) {
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+
+    return sendmsg(fd, &mh, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static int _recv_msg(int fd, struct upgrade_message_buf *msg, int *fds,
+                     size_t *fd_count)
+{
+    union
+    {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    } control = { 0 };
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t size = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+    if (size <= 0) {
+        return size;
+    }
+
+    size_t received = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg;
+         cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (fds && fd_count && received <= *fd_count) {
+            memcpy(fds, CMSG_DATA(cmsg), received * sizeof(int));
+        }
+        else {
+            int *extra = (int *)CMSG_DATA(cmsg);
+            for (size_t i = 0; i < received; i++) {
+                close(extra[i]);
+            }
+            received = 0;
+        }
+    }
+
+    if (fd_count) {
+        *fd_count = received;
+    }
+
+    if ((size_t)size < sizeof(msg->header)
+        || msg->header.magic != UPGRADE_MAGIC
+        || msg->header.version != UPGRADE_VERSION
+        || sizeof(msg->header) + msg->header.size != (size_t)size
+        || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        errno = -EPROTO;
+        return -1;
+    }
+
+    return size;
+}
+
+static void _set_timeout(int fd, int timeout_ms)
+{
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static size_t _put_section(uint8_t *buf, size_t offset, uint16_t type,
+                           void const *data, uint16_t size)
+{
+    struct upgrade_section_header section = { .type = type, .size = size };
+    memcpy(buf + offset, &section, sizeof(section));
+    memcpy(buf + offset + sizeof(section), data, size);
+    return offset + sizeof(section) + size;
+}
+
+static int _send_state(int conn)
+{
+    struct tuntap_state tuntap = { 0 };
+    struct upgrade_tuntap tuntap_section = { 0 };
+    struct upgrade_socks5 socks5_section = { 0 };
+    uint8_t payload[UPGRADE_MAX_PAYLOAD];
+    size_t size = 0;
+
+    if (tuntap_get_state(&tuntap) < 0) {
+        log_error("upgrade tuntap state unavailable! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    size_t session_count = socks5_get_session_count();
+    struct socks5_session *sessions = calloc(session_count + 1,
+                                             sizeof(*sessions));
+    if (!sessions) {
+        return -1;
+    }
+    session_count = socks5_get_sessions(sessions, session_count);
+
+    memcpy(tuntap_section.name, tuntap.name, sizeof(tuntap_section.name));
+    tuntap_section.mtu = tuntap.mtu;
+    socks5_section.session_count = session_count;
+
+    size = _put_section(payload, size, UPGRADE_SECTION_TUNTAP, &tuntap_section,
+                        sizeof(tuntap_section));
+    size = _put_section(payload, size, UPGRADE_SECTION_SOCKS5, &socks5_section,
+                        sizeof(socks5_section));
+
+    int fds[UPGRADE_MAX_FDS] = { 0 };
+    fds[UPGRADE_FD_TUNTAP] = tuntap.fd;
+    fds[UPGRADE_FD_PROXY] = tuntap.proxy_fd;
+    fds[UPGRADE_FD_LISTENER] = socks5_get_listener();
+
+    if (_send_msg(conn, UPGRADE_STATE, payload, size, fds, UPGRADE_FD_COUNT)
+        < 0) {
+        log_error("upgrade send state failed! (%d / %s)", errno,
+                  strerror(errno));
+        free(sessions);
+        return -1;
+    }
+
+    /*
+     * sessions travel chunked by SCM_RIGHTS limit, payload holds one kind
+     * byte per session: relays carry inet / net fd pair, idle clients and
+     * mux connections net fd
+     */
+    for (size_t i = 0; i < session_count;) {
+        size_t fd_count = 0;
+        size = 0;
+        for (; i < session_count && fd_count + 2 <= UPGRADE_MAX_FDS; i++) {
+            bool relay = sessions[i].inet_fd >= 0;
+            payload[size++] = relay             ? UPGRADE_SESSION_RELAY
+                              : sessions[i].mux ? UPGRADE_SESSION_MUX
+                                                : UPGRADE_SESSION_IDLE;
+            if (relay) {
+                fds[fd_count++] = sessions[i].inet_fd;
+            }
+            fds[fd_count++] = sessions[i].net_fd;
+        }
+        if (_send_msg(conn, UPGRADE_SESSIONS, payload, size, fds, fd_count)
+            < 0) {
+            log_error("upgrade send sessions failed! (%d / %s)", errno,
+                      strerror(errno));
+            free(sessions);
+            return -1;
+        }
+    }
+
+    log_info("upgrade sent %s, listener and %zu sessions", tuntap.name,
+             session_count);
+
+    free(sessions);
+    return 0;
+}
+
+static void _handover(int conn)
+{
+    struct upgrade_message_buf msg = { 0 };
+
+    _set_timeout(conn, UPGRADE_TIMEOUT_MS);
+
+    if (_recv_msg(conn, &msg, NULL, NULL) <= 0
+        || msg.header.type != UPGRADE_HELLO) {
+        log_error("upgrade invalid hello! (%d / %s)", errno, strerror(errno));
+        return;
+    }
+
+    log_info("upgrade requested, parking data path");
+
+    if (socks5_suspend(UPGRADE_TIMEOUT_MS) < 0) {
+        return;
+    }
+
+    if (tuntap_suspend(UPGRADE_TIMEOUT_MS) < 0) {
+        socks5_resume();
+        return;
+    }
+
+    if (_send_state(conn) == 0 && _recv_msg(conn, &msg, NULL, NULL) > 0
+        && msg.header.type == UPGRADE_ACK) {
+        log_info("upgrade complete, exiting");
+        /* no deinit, interface and routes now belong to new process */
+        _exit(0);
+    }
+
+    log_error("upgrade aborted, resuming data path");
+    tuntap_resume();
+    socks5_resume();
+}
+
+static void *_upgrade_thread(void *arg)
+{
+    while (1) {
+        int conn = accept(_upgrade.fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("upgrade accept failed! (%d / %s)", errno,
+                      strerror(errno));
+            break;
+        }
+
+        _handover(conn);
+        close(conn);
+    }
+
+    return NULL;
+}
+
+static int _fill_addr(char const *path, struct sockaddr_un *addr)
+{
+    if (!path || strlen(path) >= sizeof(addr->sun_path)) {
+        errno = -EINVAL;
+        log_error("upgrade socket path invalid! (%d / %s)", errno,
+                  strerror(errno));
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+int upgrade_init(char const *path)
+{
+    struct sockaddr_un addr = { 0 };
+
+    if (_fill_addr(path, &addr) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("upgrade socket failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(fd, 1) < 0) {
+        log_error("upgrade listen on %s failed! (%d / %s)", path, errno,
+                  strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    _upgrade.fd = fd;
+    strcpy(_upgrade.path, path);
+
+    if (pthread_create(&_upgrade.worker, NULL, &_upgrade_thread, NULL) != 0) {
+        upgrade_deinit();
+        return -1;
+    }
+    pthread_detach(_upgrade.worker);
+
+    log_info("upgrade socket %s ready", path);
+
+    return 0;
+}
+
+static int _receive(int conn, struct tuntap_state *tuntap, int *listener,
+                    struct socks5_session **sessions, size_t *session_count)
+{
+    struct upgrade_message_buf msg = { 0 };
+    int fds[UPGRADE_MAX_FDS] = { 0 };
+    size_t fd_count = UPGRADE_MAX_FDS;
+
+    if (_recv_msg(conn, &msg, fds, &fd_count) <= 0
+        || msg.header.type != UPGRADE_STATE || fd_count != UPGRADE_FD_COUNT) {
+        log_error("upgrade invalid state! (%d / %s)", errno, strerror(errno));
+        for (size_t i = 0; i < fd_count; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+
+    tuntap->fd = fds[UPGRADE_FD_TUNTAP];
+    tuntap->proxy_fd = fds[UPGRADE_FD_PROXY];
+    *listener = fds[UPGRADE_FD_LISTENER];
+
+    uint32_t expected = 0;
+    for (size_t offset = 0;
+         offset + sizeof(struct upgrade_section_header) <= msg.header.size;) {
+        struct upgrade_section_header section = { 0 };
+        memcpy(&section, msg.payload + offset, sizeof(section));
+        offset += sizeof(section);
+        if (offset + section.size > msg.header.size) {
+            break;
+        }
+
+        if (section.type == UPGRADE_SECTION_TUNTAP
+            && section.size == sizeof(struct upgrade_tuntap)) {
+            struct upgrade_tuntap data = { 0 };
+            memcpy(&data, msg.payload + offset, sizeof(data));
+            memcpy(tuntap->name, data.name, sizeof(tuntap->name));
+            tuntap->name[sizeof(tuntap->name) - 1] = 0;
+            tuntap->mtu = data.mtu;
+        }
+        else if (section.type == UPGRADE_SECTION_SOCKS5
+                 && section.size == sizeof(struct upgrade_socks5)) {
+            struct upgrade_socks5 data = { 0 };
+            memcpy(&data, msg.payload + offset, sizeof(data));
+            expected = data.session_count;
+        }
+        /* unknown sections come from newer versions and are skipped */
+        offset += section.size;
+    }
+
+    *sessions = calloc(expected + 1, sizeof(**sessions));
+    if (!*sessions) {
+        return -1;
+    }
+
+    *session_count = 0;
+    while (*session_count < expected) {
+        fd_count = UPGRADE_MAX_FDS;
+        if (_recv_msg(conn, &msg, fds, &fd_count) <= 0
+            || msg.header.type != UPGRADE_SESSIONS) {
+            log_error("upgrade invalid sessions! (%d / %s)", errno,
+                      strerror(errno));
+            return -1;
+        }
+        size_t fd_index = 0;
+        for (size_t i = 0; i < msg.header.size && *session_count < expected;
+             i++) {
+            struct socks5_session *session = &(*sessions)[*session_count];
+            bool relay = msg.payload[i] == UPGRADE_SESSION_RELAY;
+            size_t needed = relay ? 2 : 1;
+            if (fd_index + needed > fd_count) {
+                break;
+            }
+            session->inet_fd = relay ? fds[fd_index++] : -1;
+            session->net_fd = fds[fd_index++];
+            session->mux = msg.payload[i] == UPGRADE_SESSION_MUX;
+            (*session_count)++;
+        }
+        for (; fd_index < fd_count; fd_index++) {
+            close(fds[fd_index]);
+        }
+    }
+
+    return 0;
+}
+
+int upgrade_takeover(char const *path, char const *addr, uint16_t port)
+{
+    struct sockaddr_un sun = { 0 };
+    struct upgrade_message_buf msg = { 0 };
+    struct tuntap_state tuntap = { .fd = -1, .proxy_fd = -1 };
+    struct socks5_session *sessions = NULL;
+    size_t session_count = 0;
+    int listener = -1;
+
+    if (_fill_addr(path, &sun) < 0) {
+        return -1;
+    }
+
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (conn < 0) {
+        log_error("upgrade socket failed! (%d / %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    if (connect(conn, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        log_info("no running instance on %s, starting fresh", path);
+        close(conn);
+        return 0;
+    }
+
+    _set_timeout(conn, 2 * UPGRADE_TIMEOUT_MS);
+
+    if (_send_msg(conn, UPGRADE_HELLO, NULL, 0, NULL, 0) < 0
+        || _receive(conn, &tuntap, &listener, &sessions, &session_count) < 0) {
+        goto fail;
+    }
+
+    if (_send_msg(conn, UPGRADE_ACK, NULL, 0, NULL, 0) < 0) {
+        goto fail;
+    }
+
+    /* old process exits on ack, wait so only one process reads tuntap */
+    while (recv(conn, &msg, sizeof(msg), 0) > 0)
+        ;
+    close(conn);
+
+    if (socks5_adopt(listener, addr, port) < 0
+        || tuntap_adopt(&tuntap, addr, port) < 0) {
+        free(sessions);
+        return -1;
+    }
+
+    for (size_t i = 0; i < session_count; i++) {
+        if (socks5_adopt_session(sessions[i].net_fd, sessions[i].inet_fd,
+                                 sessions[i].mux)
+            < 0) {
+            close(sessions[i].net_fd);
+            if (sessions[i].inet_fd >= 0) {
+                close(sessions[i].inet_fd);
+            }
+        }
+    }
+
+    log_info("took over %s and %zu sessions", tuntap.name, session_count);
+
+    free(sessions);
+    return 1;
+
+fail:
+    log_error("upgrade takeover failed! (%d / %s)", errno, strerror(errno));
+    close(conn);
+    if (tuntap.fd >= 0) {
+        close(tuntap.fd);
+        close(tuntap.proxy_fd);
+        close(listener);
+    }
+    for (size_t i = 0; sessions && i < session_count; i++) {
+        close(sessions[i].net_fd);
+        if (sessions[i].inet_fd >= 0) {
+            close(sessions[i].inet_fd);
+        }
+    }
+    free(sessions);
+    return -1;
+}
+
+void upgrade_deinit()
+{
+    if (_upgrade.fd < 0) {
+        return;
+    }
+
+    close(_upgrade.fd);
+    unlink(_upgrade.path);
+    _upgrade.fd = -1;
+}
@@ -0,0 +1,32 @@
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include <stdint.h>
+
+#define UPGRADE_DEFAULT_PATH "/run/tunproxy.sock"
+#define UPGRADE_TIMEOUT_MS   5000
+
+/**
+ * @brief listen for a new tunproxy process taking over this one, on
+ *        handover the data path is parked, tuntap / socks5 sockets and
+ *        state are passed with SCM_RIGHTS and this process exits
+ * @param path unix socket path
+ * @return 0 on success, -errno on failure
+ */
+int upgrade_init(char const *path);
+
+/**
+ * @brief take over tuntap and socks5 sockets from a running process
+ * @param path unix socket path of running process
+ * @param addr proxy ip address
+ * @param port proxy port
+ * @return 1 if taken over, 0 if no process is running, -1 on failure
+ */
+int upgrade_takeover(char const *path, char const *addr, uint16_t port);
+
+/**
+ * @brief stop listening for new process
+ */
+void upgrade_deinit();
+
+#endif /* __UPGRADE_H__ */
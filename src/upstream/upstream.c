@@ -0,0 +1,154 @@
+#include "upstream.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+#include "stats.h"
+#include "util.h"
+
+/* "255.255.255.255:65535" */
+#define UPSTREAM_NAME_SIZE 24
+
+struct upstream_server
+{
+    char name[UPSTREAM_NAME_SIZE];
+    /* 0 until first probe is answered */
+    uint32_t srtt_us;
+    uint32_t errors;
+    uint64_t picks;
+    uint64_t failures;
+    uint64_t probes;
+};
+
+static struct
+{
+    size_t count;
+    uint32_t seed;
+    struct upstream_server servers[UPSTREAM_MAX_SERVERS];
+} _upstream;
+
+static uint32_t _random()
+{
+    uint32_t x = _upstream.seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    _upstream.seed = x;
+
+    return x;
+}
+
+/* unmeasured server only wins against another unmeasured one */
+static uint64_t _cost(struct upstream_server const *s)
+{
+    if (!s->srtt_us) {
+        return UINT64_MAX;
+    }
+
+    return (uint64_t)s->srtt_us
+           * (UPSTREAM_ERROR_SCALE + UPSTREAM_ERROR_COST * s->errors);
+}
+
+static void _upstream_report()
+{
+    for (size_t i = 0; i < _upstream.count; i++) {
+        struct upstream_server const *s = &_upstream.servers[i];
+        log_info("upstream %zu %s: rtt %u us, error score %u / %u, picks "
+                 "%llu, failures %llu, probes answered %llu",
+                 i, s->name, s->srtt_us, s->errors, UPSTREAM_ERROR_SCALE,
+                 (unsigned long long)s->picks,
+                 (unsigned long long)s->failures,
+                 (unsigned long long)s->probes);
+    }
+}
+
+int upstream_init(size_t count)
+{
+    if (!count || count > UPSTREAM_MAX_SERVERS) {
+        errno = -EINVAL;
+        return -1;
+    }
+
+    memset(&_upstream, 0, sizeof(_upstream));
+    _upstream.count = count;
+    _upstream.seed = (uint32_t)util_now_us() | 1;
+
+    return stats_register(_upstream_report);
+}
+
+void upstream_set_name(size_t server, char const *ip, uint16_t port)
+{
+    snprintf(_upstream.servers[server].name, UPSTREAM_NAME_SIZE, "%s:%u", ip,
+             port);
+}
+
+void upstream_rtt(size_t server, uint64_t rtt_us)
+{
+    struct upstream_server *s = &_upstream.servers[server];
+    uint32_t sample = rtt_us > UINT32_MAX ? UINT32_MAX : rtt_us;
+
+    /* 0 means unmeasured */
+    sample = sample ? sample : 1;
+    if (!s->srtt_us) {
+        s->srtt_us = sample;
+    }
+    else if (sample > s->srtt_us) {
+        s->srtt_us += (sample - s->srtt_us) >> UPSTREAM_RTT_SHIFT;
+    }
+    else {
+        s->srtt_us -= (s->srtt_us - sample) >> UPSTREAM_RTT_SHIFT;
+    }
+
+    /* rounded up so score reaches 0 again */
+    s->errors -= (s->errors + (1u << UPSTREAM_ERROR_SHIFT) - 1)
+                 >> UPSTREAM_ERROR_SHIFT;
+    s->probes++;
+}
+
+void upstream_error(size_t server)
+{
+    struct upstream_server *s = &_upstream.servers[server];
+
+    uint32_t gap = UPSTREAM_ERROR_SCALE - s->errors;
+
+    s->errors += (gap + (1u << UPSTREAM_ERROR_SHIFT) - 1)
+                 >> UPSTREAM_ERROR_SHIFT;
+    s->failures++;
+}
+
+uint32_t upstream_rtt_us(size_t server)
+{
+    return _upstream.servers[server].srtt_us;
+}
+
+int upstream_pick(uint32_t ready)
+{
+    size_t candidates[UPSTREAM_MAX_SERVERS];
+    size_t n = 0;
+
+    for (size_t i = 0; i < _upstream.count; i++) {
+        if (ready & (1u << i)) {
+            candidates[n++] = i;
+        }
+    }
+
+    if (!n) {
+        return -1;
+    }
+
+    size_t first = _random() % n;
+    size_t a = candidates[first];
+    if (n > 1) {
+        /* second choice is drawn from the others */
+        size_t second = _random() % (n - 1);
+        size_t b = candidates[second >= first ? second + 1 : second];
+        if (_cost(&_upstream.servers[b]) < _cost(&_upstream.servers[a])) {
+            a = b;
+        }
+    }
+    _upstream.servers[a].picks++;
+
+    return a;
+}
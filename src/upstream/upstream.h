@@ -0,0 +1,69 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define UPSTREAM_MAX_SERVERS 4
+/* smoothing of rtt and error score, new sample weighs 1 / 2^shift */
+#define UPSTREAM_RTT_SHIFT   3
+#define UPSTREAM_ERROR_SHIFT 2
+/* error score of a server that only fails, its rtt counts this many times
+ * over */
+#define UPSTREAM_ERROR_SCALE 1024
+#define UPSTREAM_ERROR_COST  8
+
+/*
+ * Health and choice of upstream socks5 servers. Each server keeps an ewma
+ * of its probe rtt and an ewma error score, fed by failed connects, lost
+ * connections and probes left unanswered; every answered probe pulls the
+ * score back down. A new flow picks two servers at random among those
+ * ready and takes the cheaper one (rtt weighted by error score), so load
+ * follows the fastest server without every flow piling onto it. Servers
+ * that were never measured lose against measured ones.
+ */
+
+/**
+ * @brief initialize server table
+ * @param count number of upstream servers
+ * @return 0 on success, -errno on failure
+ */
+int upstream_init(size_t count);
+
+/**
+ * @brief set address server is reported with
+ * @param server server index
+ * @param ip server ip address
+ * @param port server port
+ */
+void upstream_set_name(size_t server, char const *ip, uint16_t port);
+
+/**
+ * @brief record answered probe, lowers error score
+ * @param server server index
+ * @param rtt_us time until probe was answered
+ */
+void upstream_rtt(size_t server, uint64_t rtt_us);
+
+/**
+ * @brief record failed connect, lost connection or unanswered probe
+ * @param server server index
+ */
+void upstream_error(size_t server);
+
+/**
+ * @brief get smoothed probe rtt
+ * @param server server index
+ * @return rtt in microseconds, 0 while server wasn't measured
+ */
+uint32_t upstream_rtt_us(size_t server);
+
+/**
+ * @brief pick server for new flow, best of two random choices
+ * @param ready bit mask of servers able to take flows
+ * @return server index, -1 if no server is ready
+ */
+int upstream_pick(uint32_t ready);
+
+#endif /* __UPSTREAM_H__ */
@@ -0,0 +1,271 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "test.h"
+
+static void test_defaults()
+{
+    struct config cfg;
+
+    config_defaults(&cfg);
+    TEST_CHECK(!strcmp(cfg.proxy_ip, "127.0.0.1") && cfg.proxy_port == 1080);
+    TEST_CHECK(!strcmp(cfg.tun_addr, "10.0.0.1"));
+    TEST_CHECK(!strcmp(cfg.tun_netmask, "255.255.255.0"));
+    TEST_CHECK(!cfg.user[0] && !cfg.password[0]);
+    /* udp is steered, nothing else */
+    TEST_CHECK(config_steer_match(&cfg, IPPROTO_UDP, 53));
+    TEST_CHECK(config_steer_match(&cfg, IPPROTO_UDP, 0));
+    TEST_CHECK(!config_steer_match(&cfg, IPPROTO_TCP, 443));
+}
+
+static void test_proxy()
+{
+    struct config cfg;
+
+    config_defaults(&cfg);
+    TEST_CHECK(config_set(&cfg, "proxy", "192.168.1.10:9050") == 0);
+    TEST_CHECK(!strcmp(cfg.proxy_ip, "192.168.1.10"));
+    TEST_CHECK(cfg.proxy_port == 9050);
+
+    char const *invalid[] = { "192.168.1.10",       ":1080",
+                              "192.168.1.10:",      "192.168.1.10:0",
+                              "192.168.1.10:65536", "192.168.1.10:80x",
+                              "host:1080",          "1.2.3.4.5.6.7.8.9:1" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        TEST_CHECK(config_set(&cfg, "proxy", invalid[i]) == -1
+                   && errno == -EINVAL);
+    }
+    /* failed change leaves setting alone */
+    TEST_CHECK(!strcmp(cfg.proxy_ip, "192.168.1.10"));
+    TEST_CHECK(cfg.proxy_port == 9050);
+}
+
+static void test_tun_addr()
+{
+    struct config cfg;
+
+    config_defaults(&cfg);
+    TEST_CHECK(config_set(&cfg, "tun-addr", "172.16.5.1/16") == 0);
+    TEST_CHECK(!strcmp(cfg.tun_addr, "172.16.5.1"));
+    TEST_CHECK(!strcmp(cfg.tun_netmask, "255.255.0.0"));
+    TEST_CHECK(config_set(&cfg, "tun-addr", "10.9.0.1/30") == 0);
+    TEST_CHECK(!strcmp(cfg.tun_netmask, "255.255.255.252"));
+
+    char const *invalid[] = { "10.0.0.1", "10.0.0.1/0", "10.0.0.1/31",
+                              "10.0.0.1/", "/24", "10.0.0/24" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        TEST_CHECK(config_set(&cfg, "tun-addr", invalid[i]) == -1
+                   && errno == -EINVAL);
+    }
+    TEST_CHECK(!strcmp(cfg.tun_addr, "10.9.0.1"));
+}
+
+static void test_credentials()
+{
+    struct config cfg;
+    char longer[CONFIG_CRED_SIZE + 1];
+
+    config_defaults(&cfg);
+    TEST_CHECK(config_set(&cfg, "user", "alice") == 0);
+    TEST_CHECK(config_set(&cfg, "password", "secret") == 0);
+    TEST_CHECK(!strcmp(cfg.user, "alice") && !strcmp(cfg.password, "secret"));
+
+    memset(longer, 'x', sizeof(longer) - 1);
+    longer[sizeof(longer) - 1] = 0;
+    TEST_CHECK(config_set(&cfg, "user", longer) == -1
+               && errno == -ENAMETOOLONG);
+    longer[CONFIG_CRED_SIZE - 1] = 0;
+    TEST_CHECK(config_set(&cfg, "password", longer) == 0);
+}
+
+static void test_unknown_key()
+{
+    struct config cfg;
+
+    config_defaults(&cfg);
+    TEST_CHECK(config_set(&cfg, "proxi", "127.0.0.1:1080") == -1
+               && errno == -ENOENT);
+    TEST_CHECK(config_set(&cfg, NULL, "x") == -1 && errno == -EINVAL);
+    TEST_CHECK(config_set(&cfg, "user", NULL) == -1 && errno == -EINVAL);
+}
+
+static void test_steer_rules()
+{
+    struct config cfg;
+
+    config_defaults(&cfg);
+    /* first custom rule replaces default */
+    TEST_CHECK(config_steer_add(&cfg, "udp:53") == 0);
+    TEST_CHECK(cfg.steer_count == 1);
+    TEST_CHECK(config_steer_match(&cfg, IPPROTO_UDP, 53));
+    TEST_CHECK(!config_steer_match(&cfg, IPPROTO_UDP, 54));
+
+    TEST_CHECK(config_steer_add(&cfg, "udp:5000-5010") == 0);
+    TEST_CHECK(cfg.steer_count == 2);
+    TEST_CHECK(config_steer_match(&cfg, IPPROTO_UDP, 5000));
+    TEST_CHECK(config_steer_match(&cfg, IPPROTO_UDP, 5010));
+    TEST_CHECK(!config_steer_match(&cfg, IPPROTO_UDP, 5011));
+    TEST_CHECK(!config_steer_match(&cfg, IPPROTO_TCP, 5005));
+
+    TEST_CHECK(config_steer_add(&cfg, "all") == 0);
+    TEST_CHECK(config_steer_match(&cfg, IPPROTO_TCP, 443));
+
+    char const *invalid[] = { "tcp",      "udp:",     "udp:0",  "udp:70000",
+                              "udp:9-8",  "udp:1-",   "udp:1x", "udpx",
+                              "udp:1-2-3" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        TEST_CHECK(config_steer_add(&cfg, invalid[i]) == -1
+                   && errno == -EINVAL);
+    }
+    TEST_CHECK(cfg.steer_count == 3);
+}
+
+static void test_steer_limit()
+{
+    struct config cfg;
+
+    config_defaults(&cfg);
+    for (size_t i = 0; i < CONFIG_MAX_STEER; i++) {
+        TEST_CHECK(config_steer_add(&cfg, "udp") == 0);
+    }
+    TEST_CHECK(config_steer_add(&cfg, "udp") == -1 && errno == -ENOSPC);
+    TEST_CHECK(cfg.steer_count == CONFIG_MAX_STEER);
+}
+
+static void test_steer_key()
+{
+    struct config cfg;
+
+    config_defaults(&cfg);
+    TEST_CHECK(config_set(&cfg, "steer", "udp:53,udp:123") == 0);
+    TEST_CHECK(cfg.steer_count == 2);
+    TEST_CHECK(config_steer_match(&cfg, IPPROTO_UDP, 123));
+    TEST_CHECK(!config_steer_match(&cfg, IPPROTO_UDP, 124));
+
+    /* list replaces rules set before */
+    TEST_CHECK(config_set(&cfg, "steer", "all") == 0);
+    TEST_CHECK(cfg.steer_count == 1);
+    TEST_CHECK(config_set(&cfg, "steer", "") == -1 && errno == -EINVAL);
+    TEST_CHECK(config_set(&cfg, "steer", "udp,bogus") == -1
+               && errno == -EINVAL);
+}
+
+static void test_format_load_round_trip()
+{
+    struct config cfg;
+    struct config loaded;
+    char path[] = "/tmp/config_test.XXXXXX";
+    char text[1024];
+    char again[1024];
+
+    config_defaults(&cfg);
+    config_set(&cfg, "proxy", "10.1.2.3:1081");
+    config_set(&cfg, "tun-addr", "10.8.0.1/20");
+    config_set(&cfg, "user", "bob");
+    config_set(&cfg, "password", "hunter2");
+    config_set(&cfg, "steer", "udp,udp:443,udp:6000-6100,all");
+
+    size_t len = config_format(&cfg, text, sizeof(text));
+    TEST_CHECK(len == strlen(text));
+    TEST_CHECK(!strstr(text, "hunter2"));
+
+    int fd = mkstemp(path);
+    TEST_CHECK(fd >= 0);
+    FILE *file = fdopen(fd, "w");
+    fprintf(file, "# written by config_test\n\n%s", text);
+    fclose(file);
+
+    config_defaults(&loaded);
+    TEST_CHECK(config_load(&loaded, path) == 0);
+    TEST_CHECK(!strcmp(loaded.proxy_ip, cfg.proxy_ip));
+    TEST_CHECK(loaded.proxy_port == cfg.proxy_port);
+    TEST_CHECK(!strcmp(loaded.tun_addr, cfg.tun_addr));
+    TEST_CHECK(!strcmp(loaded.tun_netmask, "255.255.240.0"));
+    TEST_CHECK(!strcmp(loaded.user, "bob"));
+    TEST_CHECK(!loaded.password[0]);
+    TEST_CHECK(loaded.steer_count == 4);
+    TEST_CHECK(!memcmp(loaded.steer, cfg.steer, sizeof(cfg.steer)));
+
+    config_format(&loaded, again, sizeof(again));
+    TEST_CHECK(!strcmp(text, again));
+
+    /* short buffer is truncated, still terminated */
+    TEST_CHECK(config_format(&cfg, text, 8) == 7);
+    TEST_CHECK(strlen(text) == 7);
+
+    unlink(path);
+}
+
+static void test_load_rejects_bad_line()
+{
+    struct config cfg;
+    char path[] = "/tmp/config_test.XXXXXX";
+
+    int fd = mkstemp(path);
+    FILE *file = fdopen(fd, "w");
+    fprintf(file, "proxy 10.0.0.9:1080   # comment\n"
+                  "tun-addr 10.0.0.1/33\n"
+                  "user skipped\n");
+    fclose(file);
+
+    config_defaults(&cfg);
+    TEST_CHECK(config_load(&cfg, path) == -1);
+    /* lines before the bad one are applied, later ones are not */
+    TEST_CHECK(!strcmp(cfg.proxy_ip, "10.0.0.9"));
+    TEST_CHECK(!cfg.user[0]);
+    unlink(path);
+
+    TEST_CHECK(config_load(&cfg, path) == -1);
+}
+
+static int _reject(struct config const *old, struct config const *next)
+{
+    return next->proxy_port == 1 ? -1 : 0;
+}
+
+static void test_publish()
+{
+    struct config cfg;
+
+    config_defaults(&cfg);
+    TEST_CHECK(config_init(&cfg) == 0);
+    TEST_CHECK(config_generation() == 1);
+    TEST_CHECK(config_subscribe(_reject) == 0);
+
+    cfg.proxy_port = 2000;
+    TEST_CHECK(config_publish(&cfg) == 0);
+    TEST_CHECK(config_generation() == 2);
+
+    cfg.proxy_port = 1;
+    TEST_CHECK(config_publish(&cfg) == -1);
+    TEST_CHECK(config_generation() == 2);
+
+    struct config current;
+    config_copy(&current);
+    TEST_CHECK(current.proxy_port == 2000 && current.generation == 2);
+}
+
+int main()
+{
+    log_set_quiet(true);
+
+    TEST_RUN(test_defaults);
+    TEST_RUN(test_proxy);
+    TEST_RUN(test_tun_addr);
+    TEST_RUN(test_credentials);
+    TEST_RUN(test_unknown_key);
+    TEST_RUN(test_steer_rules);
+    TEST_RUN(test_steer_limit);
+    TEST_RUN(test_steer_key);
+    TEST_RUN(test_format_load_round_trip);
+    TEST_RUN(test_load_rejects_bad_line);
+    TEST_RUN(test_publish);
+
+    return TEST_DONE();
+}
@@ -0,0 +1,340 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <string.h>
+
+#include "fq.h"
+#include "log.h"
+#include "test.h"
+
+#define QUANTUM     1000
+#define TARGET_US   5000
+#define INTERVAL_US 100000
+
+static uint8_t _packet[QUANTUM];
+static uint16_t _gated_port;
+/* counters survive fq_init, tests look at what changed since theirs */
+static struct fq_stats _base;
+
+/* udp packet of size bytes, flow told apart by source port */
+static uint8_t const *_udp(uint16_t sport, size_t size)
+{
+    struct iphdr *ip = (struct iphdr *)_packet;
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+
+    memset(_packet, 0, sizeof(_packet));
+    ip->version = 4;
+    ip->ihl = sizeof(*ip) / 4;
+    ip->tot_len = htons(size);
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr = inet_addr("10.0.0.2");
+    ip->daddr = inet_addr("10.1.0.1");
+    udp->source = htons(sport);
+    udp->dest = htons(53);
+    udp->len = htons(size - sizeof(*ip));
+
+    return _packet;
+}
+
+static uint16_t _sport(uint8_t const *buf)
+{
+    struct udphdr const *udp = (struct udphdr const *)(buf
+                                                       + sizeof(struct iphdr));
+    return ntohs(udp->source);
+}
+
+static struct fq_stats _stats()
+{
+    struct fq_stats stats;
+
+    fq_get_stats(&stats);
+
+    return stats;
+}
+
+#define FQ_STAT(field) (_stats().field - _base.field)
+
+static size_t _drain()
+{
+    uint8_t buf[QUANTUM];
+    uint64_t stamp = 0;
+    size_t count = 0;
+
+    while (fq_dequeue(buf, sizeof(buf), 0, &stamp)) {
+        count++;
+    }
+
+    return count;
+}
+
+/* hashed flows share a bucket now and then, port moves on until it gets
+ * one of its own, queue is left empty */
+static uint16_t _second_flow(uint16_t first)
+{
+    for (uint16_t port = first + 1;; port++) {
+        fq_enqueue(_udp(first, QUANTUM), QUANTUM, 0, 0);
+        uint64_t flows = _stats().new_flows;
+        fq_enqueue(_udp(port, QUANTUM), QUANTUM, 0, 0);
+        bool own = _stats().new_flows > flows;
+        _drain();
+        if (own) {
+            return port;
+        }
+    }
+}
+
+static uint16_t _init(size_t packet_limit)
+{
+    TEST_CHECK(fq_init(QUANTUM, packet_limit, 1 << 20, TARGET_US, INTERVAL_US)
+               == 0);
+    fq_set_gate(NULL);
+
+    uint16_t other = _second_flow(1000);
+    _base = _stats();
+
+    return other;
+}
+
+static void test_init_limits()
+{
+    TEST_CHECK(fq_init(0, 1, 1, TARGET_US, INTERVAL_US) == -1
+               && errno == -EINVAL);
+    TEST_CHECK(fq_init(QUANTUM, 1, 1, TARGET_US, TARGET_US - 1) == -1
+               && errno == -EINVAL);
+}
+
+static void test_fifo_within_flow()
+{
+    uint8_t buf[QUANTUM];
+    uint64_t stamp = 0;
+
+    _init(FQ_DEFAULT_PACKET_LIMIT);
+    TEST_CHECK(fq_empty());
+
+    for (uint64_t i = 1; i <= 3; i++) {
+        TEST_CHECK(fq_enqueue(_udp(1000, 100 * i), 100 * i, 0, i) == 0);
+    }
+    TEST_CHECK(!fq_empty());
+
+    for (uint64_t i = 1; i <= 3; i++) {
+        TEST_CHECK(fq_dequeue(buf, sizeof(buf), 0, &stamp) == 100 * i);
+        TEST_CHECK(stamp == i);
+    }
+    TEST_CHECK(fq_dequeue(buf, sizeof(buf), 0, &stamp) == 0);
+    TEST_CHECK(fq_empty());
+}
+
+static void test_drr_alternates_flows()
+{
+    uint8_t buf[QUANTUM];
+    uint64_t stamp = 0;
+    uint16_t last = 0;
+
+    uint16_t other = _init(FQ_DEFAULT_PACKET_LIMIT);
+    for (int i = 0; i < 10; i++) {
+        fq_enqueue(_udp(1000, QUANTUM), QUANTUM, 0, 0);
+    }
+    for (int i = 0; i < 10; i++) {
+        fq_enqueue(_udp(other, QUANTUM), QUANTUM, 0, 0);
+    }
+
+    /* one quantum per flow and round, flows take turns */
+    for (int i = 0; i < 20; i++) {
+        TEST_CHECK(fq_dequeue(buf, sizeof(buf), 0, &stamp) == QUANTUM);
+        TEST_CHECK(_sport(buf) != last);
+        last = _sport(buf);
+    }
+    TEST_CHECK(fq_empty());
+}
+
+static void test_drr_small_packets_share_quantum()
+{
+    uint8_t buf[QUANTUM];
+    uint64_t stamp = 0;
+    size_t small = 0;
+
+    uint16_t other = _init(FQ_DEFAULT_PACKET_LIMIT);
+    for (int i = 0; i < 10; i++) {
+        fq_enqueue(_udp(1000, QUANTUM), QUANTUM, 0, 0);
+    }
+    for (int i = 0; i < 40; i++) {
+        fq_enqueue(_udp(other, QUANTUM / 4), QUANTUM / 4, 0, 0);
+    }
+
+    /* bytes are shared, not packets: four small ones per big one */
+    for (int i = 0; i < 20; i++) {
+        fq_dequeue(buf, sizeof(buf), 0, &stamp);
+        small += _sport(buf) == other;
+    }
+    TEST_CHECK(small >= 15 && small <= 17);
+    _drain();
+}
+
+static void test_new_flow_served_first()
+{
+    uint8_t buf[QUANTUM];
+    uint64_t stamp = 0;
+
+    uint16_t sparse = _init(FQ_DEFAULT_PACKET_LIMIT);
+    for (int i = 0; i < 5; i++) {
+        fq_enqueue(_udp(1000, QUANTUM), QUANTUM, 0, 0);
+    }
+    /* bulk flow moved to old list after its first quantum */
+    fq_dequeue(buf, sizeof(buf), 0, &stamp);
+    fq_dequeue(buf, sizeof(buf), 0, &stamp);
+
+    fq_enqueue(_udp(sparse, QUANTUM), QUANTUM, 0, 0);
+    TEST_CHECK(fq_dequeue(buf, sizeof(buf), 0, &stamp) == QUANTUM);
+    TEST_CHECK(_sport(buf) == sparse);
+    _drain();
+}
+
+static void test_codel_spares_short_queue()
+{
+    uint8_t buf[QUANTUM];
+    uint64_t stamp = 0;
+    uint64_t now_us = 0;
+
+    _init(FQ_DEFAULT_PACKET_LIMIT);
+    /* packets leave within target, however long it goes on */
+    for (int i = 0; i < 1000; i++) {
+        fq_enqueue(_udp(1000, QUANTUM), QUANTUM, now_us, 0);
+        fq_enqueue(_udp(1000, QUANTUM), QUANTUM, now_us, 0);
+        now_us += TARGET_US / 2;
+        fq_dequeue(buf, sizeof(buf), now_us, &stamp);
+        fq_dequeue(buf, sizeof(buf), now_us, &stamp);
+    }
+    TEST_CHECK(FQ_STAT(codel_drops) == 0);
+}
+
+static void test_codel_tolerates_burst()
+{
+    uint8_t buf[QUANTUM];
+    uint64_t stamp = 0;
+    uint64_t now_us = 2 * TARGET_US;
+
+    _init(FQ_DEFAULT_PACKET_LIMIT);
+    for (int i = 0; i < 50; i++) {
+        fq_enqueue(_udp(1000, QUANTUM), QUANTUM, 0, 0);
+    }
+
+    /* above target, but drained within one interval */
+    while (fq_dequeue(buf, sizeof(buf), now_us, &stamp)) {
+        now_us += INTERVAL_US / 100;
+    }
+    TEST_CHECK(FQ_STAT(codel_drops) == 0);
+    TEST_CHECK(FQ_STAT(dequeued) == 50);
+}
+
+static void test_codel_drops_standing_queue()
+{
+    uint8_t buf[QUANTUM];
+    uint64_t stamp = 0;
+    uint64_t now_us = 0;
+    size_t served = 0;
+
+    _init(FQ_DEFAULT_PACKET_LIMIT);
+    /* queue stays above target: one packet arrives per packet served, with
+     * a standing backlog of 50 in front */
+    for (int i = 0; i < 50; i++) {
+        fq_enqueue(_udp(1000, QUANTUM), QUANTUM, now_us, 0);
+    }
+    while (now_us < 4 * INTERVAL_US) {
+        now_us += 1000;
+        fq_enqueue(_udp(1000, QUANTUM), QUANTUM, now_us, 0);
+        served += fq_dequeue(buf, sizeof(buf), now_us, &stamp) > 0;
+    }
+
+    /* nothing before first interval above target, drops after it */
+    TEST_CHECK(FQ_STAT(codel_drops) > 0);
+    TEST_CHECK(FQ_STAT(dequeued) + FQ_STAT(codel_drops)
+                   + FQ_STAT(backlog_packets)
+               == FQ_STAT(enqueued));
+    TEST_CHECK(served == FQ_STAT(dequeued));
+    _drain();
+}
+
+static void test_overlimit_drops_fattest()
+{
+    uint8_t buf[QUANTUM];
+    uint64_t stamp = 0;
+
+    uint16_t fat = _init(8);
+    fq_enqueue(_udp(1000, 100), 100, 0, 0);
+    for (int i = 0; i < 9; i++) {
+        fq_enqueue(_udp(fat, QUANTUM), QUANTUM, 0, 0);
+    }
+
+    TEST_CHECK(FQ_STAT(backlog_packets) <= 8);
+    TEST_CHECK(FQ_STAT(overlimit_drops) > 0);
+
+    /* sparse flow keeps its packet */
+    TEST_CHECK(fq_dequeue(buf, sizeof(buf), 0, &stamp) == 100);
+    TEST_CHECK(_sport(buf) == 1000);
+    _drain();
+}
+
+static void test_oversize_packet_dropped()
+{
+    uint8_t buf[100];
+    uint64_t stamp = 0;
+
+    _init(FQ_DEFAULT_PACKET_LIMIT);
+    fq_enqueue(_udp(1000, QUANTUM), QUANTUM, 0, 0);
+    TEST_CHECK(fq_dequeue(buf, sizeof(buf), 0, &stamp) == 0);
+    TEST_CHECK(FQ_STAT(overlimit_drops) == 1);
+    TEST_CHECK(fq_empty());
+}
+
+static bool _gate(uint8_t const *buf, size_t size)
+{
+    return _sport(buf) != _gated_port;
+}
+
+static void test_gate_holds_flow_back()
+{
+    uint8_t buf[QUANTUM];
+    uint64_t stamp = 0;
+
+    uint16_t other = _init(FQ_DEFAULT_PACKET_LIMIT);
+    fq_enqueue(_udp(1000, QUANTUM), QUANTUM, 0, 0);
+    fq_enqueue(_udp(other, QUANTUM), QUANTUM, 0, 0);
+    fq_set_gate(_gate);
+
+    /* waiting flow keeps its packets while others go on */
+    _gated_port = 1000;
+    TEST_CHECK(fq_dequeue(buf, sizeof(buf), 0, &stamp) == QUANTUM);
+    TEST_CHECK(_sport(buf) == other);
+    TEST_CHECK(fq_dequeue(buf, sizeof(buf), 0, &stamp) == 0);
+    TEST_CHECK(!fq_empty());
+    TEST_CHECK(FQ_STAT(gated) > 0);
+
+    _gated_port = 0;
+    TEST_CHECK(fq_dequeue(buf, sizeof(buf), 0, &stamp) == QUANTUM);
+    TEST_CHECK(_sport(buf) == 1000);
+    TEST_CHECK(fq_empty());
+    fq_set_gate(NULL);
+}
+
+int main()
+{
+    log_set_quiet(true);
+
+    TEST_RUN(test_init_limits);
+    TEST_RUN(test_fifo_within_flow);
+    TEST_RUN(test_drr_alternates_flows);
+    TEST_RUN(test_drr_small_packets_share_quantum);
+    TEST_RUN(test_new_flow_served_first);
+    TEST_RUN(test_codel_spares_short_queue);
+    TEST_RUN(test_codel_tolerates_burst);
+    TEST_RUN(test_codel_drops_standing_queue);
+    TEST_RUN(test_overlimit_drops_fattest);
+    TEST_RUN(test_oversize_packet_dropped);
+    TEST_RUN(test_gate_holds_flow_back);
+
+    fq_deinit();
+
+    return TEST_DONE();
+}
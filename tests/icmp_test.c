@@ -0,0 +1,257 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
+#include <string.h>
+
+#include "icmp.h"
+#include "iov.h"
+#include "log.h"
+#include "packet_parser.h"
+#include "test.h"
+
+#define PACKET_SIZE 200
+
+static uint8_t _packet[PACKET_SIZE];
+
+static struct iphdr *_ipv4(uint8_t protocol, char const *saddr,
+                           char const *daddr)
+{
+    struct iphdr *ip = (struct iphdr *)_packet;
+
+    memset(_packet, 0, sizeof(_packet));
+    for (size_t i = sizeof(*ip); i < sizeof(_packet); i++) {
+        _packet[i] = i;
+    }
+    ip->version = 4;
+    ip->ihl = sizeof(*ip) / 4;
+    ip->tot_len = htons(sizeof(_packet));
+    ip->ttl = 3;
+    ip->protocol = protocol;
+    ip->saddr = inet_addr(saddr);
+    ip->daddr = inet_addr(daddr);
+    ip->check = ip_checksum(ip, sizeof(*ip));
+
+    return ip;
+}
+
+static struct icmphdr *_icmp(struct iphdr *ip, uint8_t type)
+{
+    struct icmphdr *icmp = (struct icmphdr *)(ip + 1);
+
+    icmp->type = type;
+    icmp->code = 0;
+    icmp->un.echo.id = htons(77);
+    icmp->un.echo.sequence = htons(5);
+    icmp->checksum = 0;
+    icmp->checksum = ip_checksum(icmp, sizeof(_packet) - sizeof(*ip));
+
+    return icmp;
+}
+
+static void test_gateway()
+{
+    TEST_CHECK(icmp_gateway("10.0.0.5", "255.255.255.0")
+               == inet_addr("10.0.0.1"));
+    /* first host is tuntap itself */
+    TEST_CHECK(icmp_gateway("10.0.0.1", "255.255.255.0")
+               == inet_addr("10.0.0.2"));
+    TEST_CHECK(icmp_gateway("172.16.9.1", "255.255.0.0")
+               == inet_addr("172.16.0.1"));
+    TEST_CHECK(icmp_gateway("10.0.0", "255.255.255.0") == 0);
+    TEST_CHECK(icmp_gateway("10.0.0.1", "bogus") == 0);
+}
+
+static void test_unreachable_quotes_packet()
+{
+    struct iov_msg msg;
+    uint8_t out[PACKET_SIZE];
+    struct iphdr *orig = _ipv4(IPPROTO_UDP, "10.0.0.2", "8.8.8.8");
+
+    TEST_CHECK(icmp_unreachable(&msg, inet_addr("10.0.0.1"), ICMP_PORT_UNREACH,
+                                0, _packet, sizeof(_packet)));
+
+    ssize_t size = iov_msg_flatten(&msg, out, sizeof(out));
+    struct iphdr *ip = (struct iphdr *)out;
+    struct icmphdr *icmp = (struct icmphdr *)(ip + 1);
+    size_t quote = sizeof(*orig) + 8;
+
+    TEST_CHECK(size == (ssize_t)(sizeof(*ip) + sizeof(*icmp) + quote));
+    TEST_CHECK(ntohs(ip->tot_len) == size);
+    TEST_CHECK(ip->version == 4 && ip->protocol == IPPROTO_ICMP);
+    TEST_CHECK(ip->saddr == inet_addr("10.0.0.1"));
+    TEST_CHECK(ip->daddr == orig->saddr);
+    TEST_CHECK(ip->ttl > 1);
+    /* checksum over correct data comes out 0 */
+    TEST_CHECK(ip_checksum(ip, sizeof(*ip)) == 0);
+    TEST_CHECK(ip_checksum(icmp, size - sizeof(*ip)) == 0);
+
+    TEST_CHECK(icmp->type == ICMP_DEST_UNREACH);
+    TEST_CHECK(icmp->code == ICMP_PORT_UNREACH);
+    TEST_CHECK(icmp->un.frag.mtu == 0);
+    TEST_CHECK(!memcmp(icmp + 1, _packet, quote));
+}
+
+static void test_frag_needed_carries_mtu()
+{
+    struct iov_msg msg;
+    uint8_t out[PACKET_SIZE];
+
+    _ipv4(IPPROTO_UDP, "10.0.0.2", "8.8.8.8");
+    TEST_CHECK(icmp_unreachable(&msg, inet_addr("10.0.0.1"), ICMP_FRAG_NEEDED,
+                                1400, _packet, sizeof(_packet)));
+
+    ssize_t size = iov_msg_flatten(&msg, out, sizeof(out));
+    struct icmphdr *icmp = (struct icmphdr *)(out + sizeof(struct iphdr));
+    TEST_CHECK(icmp->code == ICMP_FRAG_NEEDED);
+    TEST_CHECK(ntohs(icmp->un.frag.mtu) == 1400);
+    TEST_CHECK(ip_checksum(icmp, size - sizeof(struct iphdr)) == 0);
+}
+
+static void test_short_packet_quoted_whole()
+{
+    struct iov_msg msg;
+    uint8_t out[PACKET_SIZE];
+    size_t short_size = sizeof(struct iphdr) + 4;
+
+    _ipv4(IPPROTO_UDP, "10.0.0.2", "8.8.8.8");
+    TEST_CHECK(icmp_unreachable(&msg, inet_addr("10.0.0.1"), ICMP_NET_UNREACH,
+                                0, _packet, short_size));
+    TEST_CHECK(iov_msg_flatten(&msg, out, sizeof(out))
+               == (ssize_t)(sizeof(struct iphdr) + sizeof(struct icmphdr)
+                            + short_size));
+
+    /* not even an ip header */
+    TEST_CHECK(!icmp_unreachable(&msg, inet_addr("10.0.0.1"), ICMP_NET_UNREACH,
+                                 0, _packet, sizeof(struct iphdr) - 1));
+}
+
+static void test_no_error_about_error()
+{
+    struct iov_msg msg;
+    uint32_t saddr = inet_addr("10.0.0.1");
+    struct iphdr *ip = _ipv4(IPPROTO_ICMP, "10.0.0.2", "8.8.8.8");
+
+    _icmp(ip, ICMP_DEST_UNREACH);
+    TEST_CHECK(!icmp_unreachable(&msg, saddr, ICMP_HOST_UNREACH, 0, _packet,
+                                 sizeof(_packet)));
+    _icmp(ip, ICMP_TIME_EXCEEDED);
+    TEST_CHECK(!icmp_unreachable(&msg, saddr, ICMP_HOST_UNREACH, 0, _packet,
+                                 sizeof(_packet)));
+
+    /* queries are answered */
+    _icmp(ip, ICMP_ECHO);
+    TEST_CHECK(icmp_unreachable(&msg, saddr, ICMP_HOST_UNREACH, 0, _packet,
+                                sizeof(_packet)));
+}
+
+static void test_no_error_for_fragment_or_broadcast()
+{
+    struct iov_msg msg;
+    uint32_t saddr = inet_addr("10.0.0.1");
+    struct iphdr *ip = _ipv4(IPPROTO_UDP, "10.0.0.2", "8.8.8.8");
+
+    ip->frag_off = htons(IP_MF | 100);
+    TEST_CHECK(!icmp_unreachable(&msg, saddr, ICMP_PORT_UNREACH, 0, _packet,
+                                 sizeof(_packet)));
+    /* first fragment has the ports, it is answered */
+    ip->frag_off = htons(IP_MF);
+    TEST_CHECK(icmp_unreachable(&msg, saddr, ICMP_PORT_UNREACH, 0, _packet,
+                                sizeof(_packet)));
+
+    char const *pairs[][2] = { { "10.0.0.2", "224.0.0.251" },
+                               { "10.0.0.2", "255.255.255.255" },
+                               { "0.0.0.0", "8.8.8.8" },
+                               { "239.1.1.1", "8.8.8.8" } };
+    for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+        _ipv4(IPPROTO_UDP, pairs[i][0], pairs[i][1]);
+        TEST_CHECK(!icmp_unreachable(&msg, saddr, ICMP_PORT_UNREACH, 0,
+                                     _packet, sizeof(_packet)));
+    }
+}
+
+static void test_echo_reply()
+{
+    struct iov_msg msg;
+    uint8_t out[PACKET_SIZE];
+    uint32_t gateway = inet_addr("10.0.0.1");
+    struct iphdr *ip = _ipv4(IPPROTO_ICMP, "10.0.0.2", "10.0.0.1");
+
+    _icmp(ip, ICMP_ECHO);
+    TEST_CHECK(icmp_echo_reply(&msg, gateway, _packet, sizeof(_packet)));
+    TEST_CHECK(iov_msg_flatten(&msg, out, sizeof(out)) == sizeof(_packet));
+
+    struct iphdr *reply = (struct iphdr *)out;
+    struct icmphdr *icmp = (struct icmphdr *)(reply + 1);
+    TEST_CHECK(reply->saddr == gateway);
+    TEST_CHECK(reply->daddr == inet_addr("10.0.0.2"));
+    TEST_CHECK(icmp->type == ICMP_ECHOREPLY);
+    TEST_CHECK(ntohs(icmp->un.echo.id) == 77);
+    TEST_CHECK(ntohs(icmp->un.echo.sequence) == 5);
+    TEST_CHECK(ip_checksum(reply, sizeof(*reply)) == 0);
+    TEST_CHECK(ip_checksum(icmp, sizeof(out) - sizeof(*reply)) == 0);
+    /* payload is echoed untouched */
+    TEST_CHECK(out[sizeof(out) - 1] == (uint8_t)(sizeof(out) - 1));
+}
+
+static void test_echo_only_for_gateway()
+{
+    struct iov_msg msg;
+    uint32_t gateway = inet_addr("10.0.0.1");
+    struct iphdr *ip = _ipv4(IPPROTO_ICMP, "10.0.0.2", "8.8.8.8");
+
+    _icmp(ip, ICMP_ECHO);
+    TEST_CHECK(!icmp_echo_reply(&msg, gateway, _packet, sizeof(_packet)));
+
+    ip = _ipv4(IPPROTO_ICMP, "10.0.0.2", "10.0.0.1");
+    _icmp(ip, ICMP_ECHOREPLY);
+    TEST_CHECK(!icmp_echo_reply(&msg, gateway, _packet, sizeof(_packet)));
+
+    ip = _ipv4(IPPROTO_UDP, "10.0.0.2", "10.0.0.1");
+    TEST_CHECK(!icmp_echo_reply(&msg, gateway, _packet, sizeof(_packet)));
+
+    /* fragmented requests are not reassembled */
+    ip = _ipv4(IPPROTO_ICMP, "10.0.0.2", "10.0.0.1");
+    _icmp(ip, ICMP_ECHO);
+    ip->frag_off = htons(IP_MF);
+    TEST_CHECK(!icmp_echo_reply(&msg, gateway, _packet, sizeof(_packet)));
+
+    /* length has to match ip header */
+    ip->frag_off = 0;
+    TEST_CHECK(!icmp_echo_reply(&msg, gateway, _packet, sizeof(_packet) - 1));
+}
+
+static void test_rate_limit()
+{
+    struct iov_msg msg;
+    uint32_t saddr = inet_addr("10.0.0.1");
+    size_t sent = 0;
+
+    _ipv4(IPPROTO_UDP, "10.0.0.2", "8.8.8.8");
+    for (int i = 0; i < 2 * ICMP_RATE_LIMIT; i++) {
+        sent += icmp_unreachable(&msg, saddr, ICMP_PORT_UNREACH, 0, _packet,
+                                 sizeof(_packet));
+    }
+
+    /* earlier tests already used part of this second */
+    TEST_CHECK(sent > 0 && sent <= ICMP_RATE_LIMIT);
+}
+
+int main()
+{
+    log_set_quiet(true);
+    icmp_init();
+
+    TEST_RUN(test_gateway);
+    TEST_RUN(test_unreachable_quotes_packet);
+    TEST_RUN(test_frag_needed_carries_mtu);
+    TEST_RUN(test_short_packet_quoted_whole);
+    TEST_RUN(test_no_error_about_error);
+    TEST_RUN(test_no_error_for_fragment_or_broadcast);
+    TEST_RUN(test_echo_reply);
+    TEST_RUN(test_echo_only_for_gateway);
+    TEST_RUN(test_rate_limit);
+
+    return TEST_DONE();
+}
@@ -0,0 +1,401 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "iov.h"
+#include "ip_frag.h"
+#include "log.h"
+#include "packet_parser.h"
+#include "test.h"
+
+#define MAX_FRAGMENTS 16
+#define BUF_SIZE      4096
+
+/* fragments ip_frag_fragment produced, flattened */
+static struct
+{
+    uint8_t data[MAX_FRAGMENTS][BUF_SIZE];
+    size_t size[MAX_FRAGMENTS];
+    size_t count;
+} _out;
+
+/* counters survive ip_frag_init, tests look at what changed since theirs */
+static struct ip_frag_stats _base;
+
+static struct ip_frag_stats _stats()
+{
+    struct ip_frag_stats stats;
+
+    ip_frag_get_stats(&stats);
+
+    return stats;
+}
+
+#define FRAG_STAT(field) (_stats().field - _base.field)
+
+static int _collect(struct iov_msg const *msg, void *arg)
+{
+    if (_out.count == MAX_FRAGMENTS) {
+        return -1;
+    }
+
+    ssize_t size = iov_msg_flatten(msg, _out.data[_out.count], BUF_SIZE);
+    if (size < 0) {
+        return -1;
+    }
+    _out.size[_out.count++] = size;
+
+    return 0;
+}
+
+static void _init(size_t flow_limit, size_t total_limit, uint32_t timeout_ms)
+{
+    TEST_CHECK(ip_frag_init(flow_limit, total_limit, timeout_ms) == 0);
+    _out.count = 0;
+    _base = _stats();
+}
+
+/* ipv4 udp datagram with size bytes in total, payload bytes count up */
+static size_t _ipv4(uint8_t *buf, char const *saddr, uint16_t id, size_t size)
+{
+    struct iphdr *ip = (struct iphdr *)buf;
+
+    memset(buf, 0, sizeof(*ip));
+    for (size_t i = sizeof(*ip); i < size; i++) {
+        buf[i] = i * 7;
+    }
+    ip->version = 4;
+    ip->ihl = sizeof(*ip) / 4;
+    ip->tot_len = htons(size);
+    ip->id = htons(id);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr = inet_addr(saddr);
+    ip->daddr = inet_addr("10.1.0.1");
+    ip->check = ip_checksum(ip, sizeof(*ip));
+
+    return size;
+}
+
+/* hand made fragment, payload covers [offset, offset + size) of the
+ * datagram payload */
+static size_t _frag4(uint8_t *buf, char const *saddr, uint16_t id,
+                     size_t offset, size_t size, bool more)
+{
+    struct iphdr *ip = (struct iphdr *)buf;
+
+    _ipv4(buf, saddr, id, sizeof(*ip) + size);
+    for (size_t i = 0; i < size; i++) {
+        buf[sizeof(*ip) + i] = offset + i;
+    }
+    ip->frag_off = htons(offset / 8 | (more ? IP_MF : 0));
+    ip->check = 0;
+    ip->check = ip_checksum(ip, sizeof(*ip));
+
+    return sizeof(*ip) + size;
+}
+
+static int _feed(uint8_t *buf, size_t size)
+{
+    return ip_frag_reassemble(buf, size, BUF_SIZE);
+}
+
+/* ipv6 udp datagram behind a hop-by-hop header */
+static size_t _ipv6(uint8_t *buf, size_t size)
+{
+    struct ip6_hdr *ip6 = (struct ip6_hdr *)buf;
+    uint8_t *hbh = buf + sizeof(*ip6);
+
+    memset(buf, 0, sizeof(*ip6) + 8);
+    for (size_t i = sizeof(*ip6) + 8; i < size; i++) {
+        buf[i] = i * 3;
+    }
+    ip6->ip6_flow = htonl(6 << 28);
+    ip6->ip6_plen = htons(size - sizeof(*ip6));
+    ip6->ip6_nxt = IPPROTO_HOPOPTS;
+    ip6->ip6_hlim = 64;
+    inet_pton(AF_INET6, "fd00::2", &ip6->ip6_src);
+    inet_pton(AF_INET6, "fd00:1::1", &ip6->ip6_dst);
+    /* next header udp, PadN filling the rest */
+    hbh[0] = IPPROTO_UDP;
+    hbh[1] = 0;
+    hbh[2] = 1;
+    hbh[3] = 4;
+
+    return size;
+}
+
+static void test_init_limits()
+{
+    TEST_CHECK(ip_frag_init(0, 1, 1) == -1 && errno == -EINVAL);
+    TEST_CHECK(ip_frag_init(1, 0, 1) == -1 && errno == -EINVAL);
+    TEST_CHECK(ip_frag_init(1, 1, 0) == -1 && errno == -EINVAL);
+    TEST_CHECK(IP_FRAG_DEFAULT_TIMEOUT_MS == 15000);
+}
+
+static void test_whole_packet_passes()
+{
+    uint8_t buf[BUF_SIZE];
+
+    _init(IP_FRAG_DEFAULT_FLOW_LIMIT, IP_FRAG_DEFAULT_TOTAL_LIMIT,
+          IP_FRAG_DEFAULT_TIMEOUT_MS);
+    size_t size = _ipv4(buf, "10.0.0.2", 1, 500);
+    TEST_CHECK(_feed(buf, size) == (int)size);
+    TEST_CHECK(FRAG_STAT(fragments) == 0);
+
+    /* fits mtu, handed on as is */
+    TEST_CHECK(ip_frag_fragment(buf, size, 1500, _collect, NULL) == 1);
+    TEST_CHECK(_out.size[0] == size && !memcmp(_out.data[0], buf, size));
+}
+
+static void test_ipv4_round_trip()
+{
+    uint8_t packet[BUF_SIZE];
+    uint8_t buf[BUF_SIZE];
+    int size = 0;
+
+    _init(IP_FRAG_DEFAULT_FLOW_LIMIT, IP_FRAG_DEFAULT_TOTAL_LIMIT,
+          IP_FRAG_DEFAULT_TIMEOUT_MS);
+    size_t total = _ipv4(packet, "10.0.0.2", 2, 3000);
+
+    TEST_CHECK(ip_frag_fragment(packet, total, 1280, _collect, NULL) == 3);
+    for (size_t i = 0; i < _out.count; i++) {
+        struct iphdr *ip = (struct iphdr *)_out.data[i];
+        uint16_t frag_off = ntohs(ip->frag_off);
+
+        TEST_CHECK(_out.size[i] <= 1280);
+        TEST_CHECK(ntohs(ip->tot_len) == _out.size[i]);
+        TEST_CHECK(ip_checksum(ip, sizeof(*ip)) == 0);
+        TEST_CHECK(!(frag_off & IP_MF) == (i + 1 == _out.count));
+    }
+
+    /* fragments may arrive in any order */
+    for (size_t i = _out.count; i-- > 0;) {
+        memcpy(buf, _out.data[i], _out.size[i]);
+        size = _feed(buf, _out.size[i]);
+        TEST_CHECK(!size == (i > 0));
+    }
+    TEST_CHECK(size == (int)total);
+    TEST_CHECK(!memcmp(buf + sizeof(struct iphdr),
+                       packet + sizeof(struct iphdr),
+                       total - sizeof(struct iphdr)));
+    TEST_CHECK(((struct iphdr *)buf)->frag_off == 0);
+    TEST_CHECK(ip_checksum(buf, sizeof(struct iphdr)) == 0);
+    TEST_CHECK(FRAG_STAT(fragments) == 3 && FRAG_STAT(reassembled) == 1);
+}
+
+static void test_ipv4_dont_fragment()
+{
+    uint8_t packet[BUF_SIZE];
+
+    _init(IP_FRAG_DEFAULT_FLOW_LIMIT, IP_FRAG_DEFAULT_TOTAL_LIMIT,
+          IP_FRAG_DEFAULT_TIMEOUT_MS);
+    size_t total = _ipv4(packet, "10.0.0.2", 3, 3000);
+    ((struct iphdr *)packet)->frag_off = htons(IP_DF);
+
+    TEST_CHECK(ip_frag_fragment(packet, total, 1280, _collect, NULL) == -1
+               && errno == -EMSGSIZE);
+    TEST_CHECK(_out.count == 0);
+}
+
+static void test_ipv4_options_copied_flag()
+{
+    uint8_t packet[BUF_SIZE];
+    struct iphdr *ip = (struct iphdr *)packet;
+    /* router alert has the copied flag, record route hasn't */
+    uint8_t const router_alert[] = { IPOPT_RA, 4, 0, 0 };
+    uint8_t const record_route[] = { IPOPT_RR, 7, 4, 0, 0, 0, 0 };
+    size_t header_size = sizeof(*ip) + 12;
+
+    _init(IP_FRAG_DEFAULT_FLOW_LIMIT, IP_FRAG_DEFAULT_TOTAL_LIMIT,
+          IP_FRAG_DEFAULT_TIMEOUT_MS);
+    size_t total = _ipv4(packet, "10.0.0.2", 4, 2000);
+    memcpy(packet + sizeof(*ip), record_route, sizeof(record_route));
+    memcpy(packet + sizeof(*ip) + sizeof(record_route), router_alert,
+           sizeof(router_alert));
+    packet[header_size - 1] = IPOPT_EOL;
+    ip->ihl = header_size / 4;
+    ip->check = 0;
+    ip->check = ip_checksum(ip, header_size);
+
+    TEST_CHECK(ip_frag_fragment(packet, total, 1000, _collect, NULL) == 3);
+
+    /* first fragment keeps every option */
+    struct iphdr *first = (struct iphdr *)_out.data[0];
+    TEST_CHECK(first->ihl * 4 == header_size);
+    TEST_CHECK(!memcmp(_out.data[0] + sizeof(*ip), packet + sizeof(*ip),
+                       header_size - sizeof(*ip)));
+
+    /* later ones only the copied ones, padded to 32 bit */
+    for (size_t i = 1; i < _out.count; i++) {
+        struct iphdr *later = (struct iphdr *)_out.data[i];
+        TEST_CHECK(later->ihl * 4 == sizeof(*ip) + sizeof(router_alert));
+        TEST_CHECK(!memcmp(_out.data[i] + sizeof(*ip), router_alert,
+                           sizeof(router_alert)));
+        TEST_CHECK(ip_checksum(later, later->ihl * 4) == 0);
+    }
+}
+
+static void test_duplicate_accepted()
+{
+    uint8_t buf[BUF_SIZE];
+
+    _init(IP_FRAG_DEFAULT_FLOW_LIMIT, IP_FRAG_DEFAULT_TOTAL_LIMIT,
+          IP_FRAG_DEFAULT_TIMEOUT_MS);
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.2", 5, 0, 1000, true)) == 0);
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.2", 5, 0, 1000, true)) == 0);
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.2", 5, 1000, 200, false))
+               == sizeof(struct iphdr) + 1200);
+    TEST_CHECK(buf[sizeof(struct iphdr) + 999] == (uint8_t)999);
+    TEST_CHECK(FRAG_STAT(dropped) == 0 && FRAG_STAT(reassembled) == 1);
+}
+
+static void test_overlap_drops_datagram()
+{
+    uint8_t buf[BUF_SIZE];
+
+    _init(IP_FRAG_DEFAULT_FLOW_LIMIT, IP_FRAG_DEFAULT_TOTAL_LIMIT,
+          IP_FRAG_DEFAULT_TIMEOUT_MS);
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.2", 6, 0, 1000, true)) == 0);
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.2", 6, 504, 1000, true)) == 0);
+    TEST_CHECK(FRAG_STAT(overlaps) == 1 && FRAG_STAT(dropped) == 1);
+
+    /* rest of the datagram doesn't complete it any more */
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.2", 6, 1000, 200, false)) == 0);
+    TEST_CHECK(FRAG_STAT(reassembled) == 0);
+}
+
+static void test_flow_limit()
+{
+    uint8_t buf[BUF_SIZE];
+
+    _init(4096, IP_FRAG_DEFAULT_TOTAL_LIMIT, IP_FRAG_DEFAULT_TIMEOUT_MS);
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.2", 7, 0, 1000, true)) == 0);
+    /* datagram would need 8k of buffer */
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.2", 7, 6000, 1000, true)) == 0);
+    TEST_CHECK(FRAG_STAT(dropped) == 1);
+
+    /* other flows still have their own budget */
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.3", 7, 0, 1000, true)) == 0);
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.3", 7, 1000, 8, false))
+               == sizeof(struct iphdr) + 1008);
+}
+
+static void test_total_limit_evicts_oldest()
+{
+    uint8_t buf[BUF_SIZE];
+
+    _init(IP_FRAG_DEFAULT_FLOW_LIMIT, 4096, IP_FRAG_DEFAULT_TIMEOUT_MS);
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.2", 8, 0, 1000, true)) == 0);
+    usleep(2000);
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.3", 8, 0, 1000, true)) == 0);
+    TEST_CHECK(FRAG_STAT(evictions) == 0);
+
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.4", 8, 0, 1000, true)) == 0);
+    TEST_CHECK(FRAG_STAT(evictions) == 1);
+
+    /* second flow completes, first one lost its head */
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.3", 8, 1000, 8, false))
+               == sizeof(struct iphdr) + 1008);
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.2", 8, 1000, 8, false)) == 0);
+}
+
+static void test_timeout()
+{
+    uint8_t buf[BUF_SIZE];
+
+    _init(IP_FRAG_DEFAULT_FLOW_LIMIT, IP_FRAG_DEFAULT_TOTAL_LIMIT, 50);
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.2", 9, 0, 1000, true)) == 0);
+    usleep(80 * 1000);
+
+    /* missing fragment came too late, head is gone */
+    TEST_CHECK(_feed(buf, _frag4(buf, "10.0.0.2", 9, 1000, 8, false)) == 0);
+    TEST_CHECK(FRAG_STAT(timeouts) == 1);
+    TEST_CHECK(FRAG_STAT(reassembled) == 0);
+}
+
+static void test_ipv6_round_trip()
+{
+    uint8_t packet[BUF_SIZE];
+    uint8_t buf[BUF_SIZE];
+    int size = 0;
+    size_t unfrag = sizeof(struct ip6_hdr) + 8;
+
+    _init(IP_FRAG_DEFAULT_FLOW_LIMIT, IP_FRAG_DEFAULT_TOTAL_LIMIT,
+          IP_FRAG_DEFAULT_TIMEOUT_MS);
+    size_t total = _ipv6(packet, 3000);
+
+    TEST_CHECK(ip_frag_fragment(packet, total, 1280, _collect, NULL) == 3);
+    for (size_t i = 0; i < _out.count; i++) {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)_out.data[i];
+        struct ip6_frag *fh = (struct ip6_frag *)(_out.data[i] + unfrag);
+
+        /* fragment header goes behind hop-by-hop header */
+        TEST_CHECK(_out.size[i] <= 1280);
+        TEST_CHECK(ip6->ip6_nxt == IPPROTO_HOPOPTS);
+        TEST_CHECK(_out.data[i][sizeof(*ip6)] == IPPROTO_FRAGMENT);
+        TEST_CHECK(fh->ip6f_nxt == IPPROTO_UDP);
+        TEST_CHECK(!(ntohs(fh->ip6f_offlg) & 1) == (i + 1 == _out.count));
+        TEST_CHECK(sizeof(*ip6) + ntohs(ip6->ip6_plen) == _out.size[i]);
+    }
+
+    for (size_t i = 0; i < _out.count; i++) {
+        memcpy(buf, _out.data[i], _out.size[i]);
+        size = _feed(buf, _out.size[i]);
+    }
+    TEST_CHECK(size == (int)total);
+    TEST_CHECK(!memcmp(buf, packet, total));
+}
+
+static void test_ipv6_atomic_fragment()
+{
+    uint8_t buf[BUF_SIZE];
+    struct ip6_hdr *ip6 = (struct ip6_hdr *)buf;
+    size_t unfrag = sizeof(*ip6) + 8;
+
+    _init(IP_FRAG_DEFAULT_FLOW_LIMIT, IP_FRAG_DEFAULT_TOTAL_LIMIT,
+          IP_FRAG_DEFAULT_TIMEOUT_MS);
+    size_t total = _ipv6(buf, 600);
+
+    /* fragment header with offset 0 and no more fragments */
+    memmove(buf + unfrag + 8, buf + unfrag, total - unfrag);
+    struct ip6_frag *fh = (struct ip6_frag *)(buf + unfrag);
+    fh->ip6f_nxt = IPPROTO_UDP;
+    fh->ip6f_reserved = 0;
+    fh->ip6f_offlg = 0;
+    fh->ip6f_ident = htonl(10);
+    buf[sizeof(*ip6)] = IPPROTO_FRAGMENT;
+    ip6->ip6_plen = htons(total + 8 - sizeof(*ip6));
+
+    TEST_CHECK(_feed(buf, total + 8) == (int)total);
+    TEST_CHECK(buf[sizeof(*ip6)] == IPPROTO_UDP);
+    TEST_CHECK(sizeof(*ip6) + ntohs(ip6->ip6_plen) == total);
+    TEST_CHECK(buf[unfrag] == (uint8_t)(unfrag * 3));
+    TEST_CHECK(FRAG_STAT(fragments) == 0);
+}
+
+int main()
+{
+    log_set_quiet(true);
+
+    TEST_RUN(test_init_limits);
+    TEST_RUN(test_whole_packet_passes);
+    TEST_RUN(test_ipv4_round_trip);
+    TEST_RUN(test_ipv4_dont_fragment);
+    TEST_RUN(test_ipv4_options_copied_flag);
+    TEST_RUN(test_duplicate_accepted);
+    TEST_RUN(test_overlap_drops_datagram);
+    TEST_RUN(test_flow_limit);
+    TEST_RUN(test_total_limit_evicts_oldest);
+    TEST_RUN(test_timeout);
+    TEST_RUN(test_ipv6_round_trip);
+    TEST_RUN(test_ipv6_atomic_fragment);
+
+    ip_frag_deinit();
+
+    return TEST_DONE();
+}
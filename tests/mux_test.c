@@ -0,0 +1,435 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "iov.h"
+#include "log.h"
+#include "mux.h"
+#include "mux_client.h"
+#include "packet_parser.h"
+#include "test.h"
+#include "upstream.h"
+#include "util.h"
+
+#define PACKET_SIZE 2048
+
+/* both ends of an upstream connection, [0] tuntap side, [1] server side */
+static int _fds[2];
+/* large, keep them off the stack */
+static struct mux_writer _writer;
+static struct mux_reader _reader;
+
+/* packets mux_client delivered towards tuntap */
+static struct
+{
+    uint8_t data[PACKET_SIZE];
+    size_t size;
+    size_t count;
+} _delivered;
+
+static void _connect()
+{
+    TEST_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, _fds) == 0);
+    fcntl(_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(_fds[1], F_SETFL, O_NONBLOCK);
+}
+
+static void _disconnect()
+{
+    close(_fds[0]);
+    close(_fds[1]);
+}
+
+/* wait for next frame, reading whatever arrives meanwhile */
+static int _next(struct mux_reader *r, struct mux_header *header,
+                 uint8_t **payload)
+{
+    for (int i = 0; i < 100; i++) {
+        if (mux_next(r, header, payload)) {
+            return 1;
+        }
+        struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+        if (poll(&pfd, 1, 10) == 1 && mux_read(r) <= 0) {
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+static void test_header_layout()
+{
+    uint8_t raw[MUX_HEADER_SIZE + 5];
+    uint8_t const expect[MUX_HEADER_SIZE] = { 0x01, 0x02, 0x03, 0x04,
+                                              MUX_DATA, IPPROTO_UDP,
+                                              0x00, 0x05 };
+
+    _connect();
+    mux_writer_init(&_writer, _fds[0], 0);
+    TEST_CHECK(mux_write(&_writer, 0x01020304, MUX_DATA, IPPROTO_UDP, "hello",
+                         5)
+               == 0);
+    TEST_CHECK(mux_flush(&_writer) == 0);
+
+    /* flow, type, proto, length, all network order */
+    TEST_CHECK(recv(_fds[1], raw, sizeof(raw), 0) == sizeof(raw));
+    TEST_CHECK(!memcmp(raw, expect, sizeof(expect)));
+    TEST_CHECK(!memcmp(raw + MUX_HEADER_SIZE, "hello", 5));
+    _disconnect();
+}
+
+static void test_round_trip()
+{
+    static uint8_t big[MUX_MAX_PAYLOAD];
+    struct mux_header header;
+    uint8_t *payload = NULL;
+
+    for (size_t i = 0; i < sizeof(big); i++) {
+        big[i] = i * 13;
+    }
+
+    _connect();
+    mux_writer_init(&_writer, _fds[0], 0);
+    mux_reader_init(&_reader, _fds[1]);
+
+    TEST_CHECK(mux_write(&_writer, 7, MUX_OPEN, IPPROTO_UDP, "\x0a\0\0\x01\0\x35",
+                         MUX_OPEN_SIZE)
+               == 0);
+    TEST_CHECK(mux_write(&_writer, 0, MUX_KEEPALIVE, 0, NULL, 0) == 0);
+    TEST_CHECK(mux_write(&_writer, 0xfffe0001, MUX_CLOSE, IPPROTO_UDP, NULL, 0)
+               == 0);
+    TEST_CHECK(mux_flush(&_writer) == 0);
+    /* largest frame, more than the socket may take at once */
+    TEST_CHECK(mux_write(&_writer, 8, MUX_DATA, IPPROTO_UDP, big, sizeof(big))
+               == 0);
+
+    TEST_CHECK(_next(&_reader, &header, &payload));
+    TEST_CHECK(header.flow == 7 && header.type == MUX_OPEN
+               && header.proto == IPPROTO_UDP
+               && header.length == MUX_OPEN_SIZE);
+    TEST_CHECK(!memcmp(payload, "\x0a\0\0\x01\0\x35", MUX_OPEN_SIZE));
+
+    TEST_CHECK(_next(&_reader, &header, &payload));
+    TEST_CHECK(header.flow == 0 && header.type == MUX_KEEPALIVE
+               && header.length == 0);
+
+    TEST_CHECK(_next(&_reader, &header, &payload));
+    TEST_CHECK(header.flow == 0xfffe0001 && header.type == MUX_CLOSE);
+
+    /* rest of big frame follows as reader makes room */
+    while (_writer.size && mux_flush(&_writer) < 0 && errno == EAGAIN) {
+        mux_read(&_reader);
+    }
+    TEST_CHECK(_next(&_reader, &header, &payload));
+    TEST_CHECK(header.flow == 8 && header.length == MUX_MAX_PAYLOAD);
+    TEST_CHECK(!memcmp(payload, big, sizeof(big)));
+
+    TEST_CHECK(!mux_next(&_reader, &header, &payload));
+    TEST_CHECK(_writer.frames == 4);
+    _disconnect();
+}
+
+static void test_split_frames()
+{
+    uint8_t raw[3 * MUX_HEADER_SIZE + 12];
+    struct mux_header header;
+    uint8_t *payload = NULL;
+    size_t frames = 0;
+
+    _connect();
+    mux_writer_init(&_writer, _fds[0], 0);
+    mux_write(&_writer, 1, MUX_DATA, IPPROTO_UDP, "abcd", 4);
+    mux_write(&_writer, 2, MUX_DATA, IPPROTO_UDP, "efghijkl", 8);
+    mux_write(&_writer, 3, MUX_CLOSE, IPPROTO_UDP, NULL, 0);
+    mux_flush(&_writer);
+    TEST_CHECK(recv(_fds[1], raw, sizeof(raw), 0) == sizeof(raw));
+    _disconnect();
+
+    /* one byte per read, header and payload torn anywhere */
+    _connect();
+    mux_reader_init(&_reader, _fds[1]);
+    for (size_t i = 0; i < sizeof(raw); i++) {
+        TEST_CHECK(send(_fds[0], raw + i, 1, 0) == 1);
+        TEST_CHECK(mux_read(&_reader) == 1);
+
+        while (mux_next(&_reader, &header, &payload)) {
+            frames++;
+            TEST_CHECK(header.flow == frames);
+            /* frame is only handed out once its last byte is in */
+            TEST_CHECK(i + 1 == (frames == 1   ? MUX_HEADER_SIZE + 4
+                                 : frames == 2 ? 2 * MUX_HEADER_SIZE + 12
+                                               : sizeof(raw)));
+        }
+    }
+    TEST_CHECK(frames == 3);
+    TEST_CHECK(!memcmp(payload - MUX_HEADER_SIZE, raw + 2 * MUX_HEADER_SIZE + 12,
+                       MUX_HEADER_SIZE));
+    _disconnect();
+}
+
+static void test_lengths()
+{
+    uint8_t raw[MUX_HEADER_SIZE + 100] = { 0, 0, 0, 9, MUX_DATA, IPPROTO_UDP,
+                                           0xff, 0xff };
+    struct mux_header header;
+    uint8_t *payload = NULL;
+
+    _connect();
+    mux_writer_init(&_writer, _fds[0], 0);
+    TEST_CHECK(mux_write(&_writer, 1, MUX_DATA, IPPROTO_UDP, raw,
+                         MUX_MAX_PAYLOAD + 1)
+                   == -1
+               && errno == -EMSGSIZE);
+    TEST_CHECK(_writer.size == 0 && _writer.frames == 0);
+
+    /* frame announcing the largest length waits for all of it */
+    mux_reader_init(&_reader, _fds[1]);
+    TEST_CHECK(send(_fds[0], raw, sizeof(raw), 0) == sizeof(raw));
+    TEST_CHECK(mux_read(&_reader) == sizeof(raw));
+    TEST_CHECK(!mux_next(&_reader, &header, &payload));
+    TEST_CHECK(_reader.head == 0);
+    _disconnect();
+}
+
+static void test_coalescing()
+{
+    uint8_t payload[1000] = { 0 };
+    uint8_t raw[MUX_COALESCE_BYTES * 2];
+    uint64_t now_us = util_now_us();
+
+    _connect();
+    mux_writer_init(&_writer, _fds[0], 5000);
+    TEST_CHECK(mux_writer_timeout_ms(&_writer, now_us) == -1);
+
+    /* small frames wait for company or their deadline */
+    mux_write(&_writer, 1, MUX_DATA, IPPROTO_UDP, payload, sizeof(payload));
+    TEST_CHECK(recv(_fds[1], raw, sizeof(raw), MSG_DONTWAIT) == -1);
+    TEST_CHECK(mux_writer_timeout_ms(&_writer, _writer.first_us) == 5);
+    TEST_CHECK(mux_flush_due(&_writer, _writer.first_us + 4999) == 0);
+    TEST_CHECK(_writer.size == MUX_HEADER_SIZE + sizeof(payload));
+    TEST_CHECK(mux_flush_due(&_writer, _writer.first_us + 5000) == 0);
+    TEST_CHECK(_writer.size == 0 && _writer.writes == 1);
+    TEST_CHECK(recv(_fds[1], raw, sizeof(raw), 0)
+               == MUX_HEADER_SIZE + sizeof(payload));
+
+    /* coalescing limit writes right away */
+    size_t frames = MUX_COALESCE_BYTES / (MUX_HEADER_SIZE + sizeof(payload)) + 1;
+    for (size_t i = 0; i < frames; i++) {
+        mux_write(&_writer, 1, MUX_DATA, IPPROTO_UDP, payload, sizeof(payload));
+    }
+    TEST_CHECK(_writer.size == 0 && _writer.writes == 2);
+    TEST_CHECK(recv(_fds[1], raw, sizeof(raw), 0)
+               == (ssize_t)(frames * (MUX_HEADER_SIZE + sizeof(payload))));
+    _disconnect();
+}
+
+/* client side */
+
+static int _deliver(struct iov_msg const *msg, void *arg)
+{
+    ssize_t size = iov_msg_flatten(msg, _delivered.data,
+                                   sizeof(_delivered.data));
+
+    TEST_CHECK(size > 0);
+    _delivered.size = size;
+    _delivered.count++;
+
+    return 0;
+}
+
+static size_t _udp(uint8_t *buf, uint16_t sport, char const *payload)
+{
+    struct iphdr *ip = (struct iphdr *)buf;
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+    size_t size = sizeof(*ip) + sizeof(*udp) + strlen(payload);
+
+    memset(buf, 0, sizeof(*ip) + sizeof(*udp));
+    ip->version = 4;
+    ip->ihl = sizeof(*ip) / 4;
+    ip->tot_len = htons(size);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr = inet_addr("10.0.0.2");
+    ip->daddr = inet_addr("8.8.8.8");
+    ip->check = ip_checksum(ip, sizeof(*ip));
+    udp->source = htons(sport);
+    udp->dest = htons(53);
+    udp->len = htons(size - sizeof(*ip));
+    memcpy(udp + 1, payload, strlen(payload));
+
+    return size;
+}
+
+static void _client_start()
+{
+    _connect();
+    TEST_CHECK(upstream_init(1) == 0);
+    TEST_CHECK(mux_client_init(1, 1, 0) == 0);
+    mux_client_set_connection(0, _fds[0]);
+    mux_writer_init(&_writer, _fds[1], 0);
+    mux_reader_init(&_reader, _fds[1]);
+    _delivered.count = 0;
+}
+
+static void _client_stop()
+{
+    mux_client_set_connection(0, -1);
+    mux_client_deinit();
+    _disconnect();
+}
+
+/* flow id server learns from OPEN of packet sent through client */
+static uint32_t _open(uint16_t sport, char const *payload)
+{
+    uint8_t buf[PACKET_SIZE];
+    struct mux_header header = { 0 };
+    uint8_t *data = NULL;
+
+    TEST_CHECK(mux_client_send(buf, _udp(buf, sport, payload), 0) == 0);
+    TEST_CHECK(mux_client_tick(util_now_us()) == 0);
+
+    TEST_CHECK(_next(&_reader, &header, &data));
+    TEST_CHECK(header.type == MUX_OPEN && header.length == MUX_OPEN_SIZE);
+    TEST_CHECK(!memcmp(data, &((struct iphdr *)buf)->daddr, 4));
+    TEST_CHECK(data[4] == 0 && data[5] == 53);
+    uint32_t flow = header.flow;
+
+    TEST_CHECK(_next(&_reader, &header, &data));
+    TEST_CHECK(header.type == MUX_DATA && header.flow == flow);
+    TEST_CHECK(header.length == strlen(payload));
+    TEST_CHECK(!memcmp(data, payload, strlen(payload)));
+
+    return flow;
+}
+
+/* server frame reaches client, returns packets delivered */
+static size_t _reply(uint32_t flow, uint8_t type, void const *payload,
+                     size_t size)
+{
+    uint64_t rx_ns = 0;
+    size_t before = _delivered.count;
+
+    TEST_CHECK(mux_write(&_writer, flow, type, IPPROTO_UDP, payload, size)
+               == 0);
+    TEST_CHECK(mux_flush(&_writer) == 0);
+    TEST_CHECK(mux_client_receive(0, _deliver, NULL, &rx_ns) >= 0);
+
+    return _delivered.count - before;
+}
+
+static void test_client_reply_packet()
+{
+    struct iphdr *ip = (struct iphdr *)_delivered.data;
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+
+    _client_start();
+    uint32_t flow = _open(4000, "query");
+
+    TEST_CHECK(_reply(flow, MUX_DATA, "answer", 6) == 1);
+    TEST_CHECK(_delivered.size == sizeof(*ip) + sizeof(*udp) + 6);
+    TEST_CHECK(ip->saddr == inet_addr("8.8.8.8"));
+    TEST_CHECK(ip->daddr == inet_addr("10.0.0.2"));
+    TEST_CHECK(ntohs(ip->tot_len) == _delivered.size);
+    TEST_CHECK(ip_checksum(ip, sizeof(*ip)) == 0);
+    TEST_CHECK(ntohs(udp->source) == 53 && ntohs(udp->dest) == 4000);
+    TEST_CHECK(ntohs(udp->len) == sizeof(*udp) + 6);
+    TEST_CHECK(!memcmp(udp + 1, "answer", 6));
+    _client_stop();
+}
+
+static void test_client_error_becomes_icmp()
+{
+    struct iphdr *ip = (struct iphdr *)_delivered.data;
+    struct icmphdr *icmp = (struct icmphdr *)(ip + 1);
+    struct iphdr *quote = (struct iphdr *)(icmp + 1);
+    struct udphdr *quote_udp = (struct udphdr *)(quote + 1);
+    uint8_t const error[MUX_ERROR_SIZE] = { ICMP_FRAG_NEEDED, 0, 0x05, 0x00 };
+
+    _client_start();
+    uint32_t flow = _open(4001, "big");
+
+    TEST_CHECK(_reply(flow, MUX_ERROR, error, sizeof(error)) == 1);
+    TEST_CHECK(ip->protocol == IPPROTO_ICMP);
+    TEST_CHECK(ip->saddr == inet_addr("8.8.8.8"));
+    TEST_CHECK(ip->daddr == inet_addr("10.0.0.2"));
+    TEST_CHECK(icmp->type == ICMP_DEST_UNREACH);
+    TEST_CHECK(icmp->code == ICMP_FRAG_NEEDED);
+    TEST_CHECK(ntohs(icmp->un.frag.mtu) == 0x500);
+    TEST_CHECK(ip_checksum(icmp, _delivered.size - sizeof(*ip)) == 0);
+    /* quote is the flow's packet as sender sent it */
+    TEST_CHECK(quote->saddr == inet_addr("10.0.0.2"));
+    TEST_CHECK(quote->daddr == inet_addr("8.8.8.8"));
+    TEST_CHECK(ntohs(quote_udp->source) == 4001);
+    TEST_CHECK(ntohs(quote_udp->dest) == 53);
+
+    /* error too short to carry code and mtu is ignored */
+    TEST_CHECK(_reply(flow, MUX_ERROR, error, 2) == 0);
+    _client_stop();
+}
+
+static void test_client_stale_generation()
+{
+    _client_start();
+    uint32_t old = _open(4002, "one");
+
+    /* server closes flow, frames still in flight for it go nowhere */
+    TEST_CHECK(_reply(old, MUX_CLOSE, NULL, 0) == 0);
+    TEST_CHECK(_reply(old, MUX_DATA, "late", 4) == 0);
+    TEST_CHECK(_reply(old, MUX_ERROR, "\x03\0\0\0", MUX_ERROR_SIZE) == 0);
+
+    /* same slot opens again under a new generation */
+    uint32_t flow = _open(4002, "two");
+    TEST_CHECK(flow != old && (flow & 0xffff) == (old & 0xffff));
+
+    /* a stale CLOSE doesn't end the new flow */
+    TEST_CHECK(_reply(old, MUX_CLOSE, NULL, 0) == 0);
+    TEST_CHECK(_reply(flow, MUX_DATA, "fresh", 5) == 1);
+    _client_stop();
+}
+
+static void test_client_split_reply()
+{
+    uint8_t raw[MUX_HEADER_SIZE + 6];
+    uint64_t rx_ns = 0;
+
+    _client_start();
+    uint32_t flow = _open(4003, "query");
+
+    mux_write(&_writer, flow, MUX_DATA, IPPROTO_UDP, "answer", 6);
+    memcpy(raw, _writer.buf, sizeof(raw));
+    _writer.size = 0;
+
+    for (size_t i = 0; i < sizeof(raw); i++) {
+        TEST_CHECK(send(_fds[1], raw + i, 1, 0) == 1);
+        TEST_CHECK(mux_client_receive(0, _deliver, NULL, &rx_ns)
+                   == (i + 1 == sizeof(raw)));
+    }
+    TEST_CHECK(_delivered.count == 1);
+    TEST_CHECK(!memcmp(_delivered.data + _delivered.size - 6, "answer", 6));
+    _client_stop();
+}
+
+int main()
+{
+    log_set_quiet(true);
+
+    TEST_RUN(test_header_layout);
+    TEST_RUN(test_round_trip);
+    TEST_RUN(test_split_frames);
+    TEST_RUN(test_lengths);
+    TEST_RUN(test_coalescing);
+    TEST_RUN(test_client_reply_packet);
+    TEST_RUN(test_client_error_becomes_icmp);
+    TEST_RUN(test_client_stale_generation);
+    TEST_RUN(test_client_split_reply);
+
+    return TEST_DONE();
+}
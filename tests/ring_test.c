@@ -0,0 +1,166 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "ring.h"
+#include "test.h"
+
+#define THREAD_ITEMS 1000000
+
+static bool _readable(struct ring const *r)
+{
+    struct pollfd pfd = { .fd = ring_fd(r), .events = POLLIN };
+
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+static void test_init_size()
+{
+    struct ring r;
+
+    TEST_CHECK(ring_init(&r, 0) == -1 && errno == -EINVAL);
+    TEST_CHECK(ring_init(&r, 3) == -1 && errno == -EINVAL);
+    TEST_CHECK(ring_init(&r, 8) == 0);
+    TEST_CHECK(ring_fd(&r) >= 0);
+    ring_deinit(&r);
+    TEST_CHECK(ring_fd(&r) == -1);
+}
+
+static void test_fifo_and_wrap()
+{
+    struct ring r;
+    uint32_t items[5];
+    uint32_t next = 0;
+    uint32_t expect = 0;
+    bool ordered = true;
+
+    ring_init(&r, 8);
+    /* indices run past size many times */
+    for (int round = 0; round < 100; round++) {
+        for (size_t i = 0; i < 5; i++) {
+            items[i] = next++;
+        }
+        TEST_CHECK(ring_push(&r, items, 5) == 5);
+
+        size_t popped = ring_pop(&r, items, 5);
+        TEST_CHECK(popped == 5);
+        for (size_t i = 0; i < popped; i++) {
+            ordered &= items[i] == expect++;
+        }
+    }
+    TEST_CHECK(ordered);
+    TEST_CHECK(ring_pop(&r, items, 5) == 0);
+    ring_deinit(&r);
+}
+
+static void test_full()
+{
+    struct ring r;
+    uint32_t items[10] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+    uint32_t out[10];
+
+    ring_init(&r, 8);
+    /* short push takes what fits */
+    TEST_CHECK(ring_push(&r, items, 10) == 8);
+    TEST_CHECK(r.full == 1);
+    TEST_CHECK(ring_push(&r, items, 1) == 0);
+    TEST_CHECK(r.full == 2);
+
+    TEST_CHECK(ring_pop(&r, out, 3) == 3);
+    TEST_CHECK(out[0] == 0 && out[2] == 2);
+    TEST_CHECK(ring_push(&r, items + 8, 2) == 2);
+    TEST_CHECK(ring_pop(&r, out, 10) == 7);
+    TEST_CHECK(out[0] == 3 && out[4] == 7 && out[5] == 8 && out[6] == 9);
+    ring_deinit(&r);
+}
+
+static void test_wakeup_only_when_empty()
+{
+    struct ring r;
+    uint32_t item = 1;
+    uint32_t out[4];
+
+    ring_init(&r, 8);
+    TEST_CHECK(!_readable(&r));
+
+    TEST_CHECK(ring_push(&r, &item, 1) == 1);
+    TEST_CHECK(_readable(&r));
+    TEST_CHECK(r.wakeups == 1);
+
+    /* busy ring makes no syscall */
+    ring_clear(&r);
+    TEST_CHECK(!_readable(&r));
+    TEST_CHECK(ring_push(&r, &item, 1) == 1);
+    TEST_CHECK(!_readable(&r));
+    TEST_CHECK(r.wakeups == 1);
+
+    /* drained ring wakes consumer again */
+    TEST_CHECK(ring_pop(&r, out, 4) == 2);
+    TEST_CHECK(ring_push(&r, &item, 1) == 1);
+    TEST_CHECK(_readable(&r));
+    TEST_CHECK(r.wakeups == 2);
+    ring_deinit(&r);
+}
+
+static void *_producer(void *arg)
+{
+    struct ring *r = arg;
+    uint32_t items[16];
+    uint32_t next = 0;
+
+    while (next < THREAD_ITEMS) {
+        size_t count = 0;
+        while (count < 16 && next + count < THREAD_ITEMS) {
+            items[count] = next + count;
+            count++;
+        }
+        next += ring_push(r, items, count);
+    }
+
+    return NULL;
+}
+
+static void test_threads_keep_order()
+{
+    struct ring r;
+    pthread_t producer;
+    uint32_t items[32];
+    uint32_t expect = 0;
+    bool ordered = true;
+
+    ring_init(&r, 64);
+    TEST_CHECK(pthread_create(&producer, NULL, _producer, &r) == 0);
+
+    /* consumer sleeps on eventfd the way stage threads do */
+    while (expect < THREAD_ITEMS) {
+        size_t popped = ring_pop(&r, items, 32);
+        if (!popped) {
+            struct pollfd pfd = { .fd = ring_fd(&r), .events = POLLIN };
+            poll(&pfd, 1, 100);
+            ring_clear(&r);
+            continue;
+        }
+        for (size_t i = 0; i < popped; i++) {
+            ordered &= items[i] == expect++;
+        }
+    }
+
+    pthread_join(producer, NULL);
+    TEST_CHECK(ordered);
+    TEST_CHECK(ring_pop(&r, items, 32) == 0);
+    ring_deinit(&r);
+}
+
+int main()
+{
+    log_set_quiet(true);
+
+    TEST_RUN(test_init_size);
+    TEST_RUN(test_fifo_and_wrap);
+    TEST_RUN(test_full);
+    TEST_RUN(test_wakeup_only_when_empty);
+    TEST_RUN(test_threads_keep_order);
+
+    return TEST_DONE();
+}
@@ -0,0 +1,282 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "membudget.h"
+#include "socks5.h"
+#include "test.h"
+
+#define STEP_US 2000
+
+static struct sockaddr_in _server;
+/* remote connect requests point at */
+static int _target_fd;
+static struct sockaddr_in _target;
+
+static void _listen(int *fd, struct sockaddr_in *addr)
+{
+    socklen_t size = sizeof(*addr);
+
+    *fd = socket(AF_INET, SOCK_STREAM, 0);
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr->sin_port = 0;
+    TEST_CHECK(bind(*fd, (struct sockaddr *)addr, sizeof(*addr)) == 0);
+    TEST_CHECK(listen(*fd, 4) == 0);
+    getsockname(*fd, (struct sockaddr *)addr, &size);
+}
+
+static void _credentials(char const *user, char const *password)
+{
+    struct config cfg;
+
+    config_copy(&cfg);
+    snprintf(cfg.user, sizeof(cfg.user), "%s", user);
+    snprintf(cfg.password, sizeof(cfg.password), "%s", password);
+    TEST_CHECK(config_publish(&cfg) == 0);
+}
+
+static int _client()
+{
+    struct timeval timeout = { 2, 0 };
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    setsockopt(fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    TEST_CHECK(connect(fd, (struct sockaddr *)&_server, sizeof(_server)) == 0);
+
+    return fd;
+}
+
+/* step bytes per segment, paced so server reads them one by one */
+static void _send(int fd, void const *buf, size_t size, size_t step)
+{
+    for (size_t done = 0; done < size; done += step) {
+        size_t len = size - done < step ? size - done : step;
+        TEST_CHECK(send(fd, (uint8_t const *)buf + done, len, MSG_NOSIGNAL)
+                   == (ssize_t)len);
+        usleep(STEP_US);
+    }
+}
+
+static void _expect(int fd, void const *reply, size_t size)
+{
+    uint8_t buf[512];
+    size_t got = 0;
+
+    while (got < size) {
+        ssize_t bytes = recv(fd, buf + got, size - got, 0);
+        if (bytes <= 0) {
+            break;
+        }
+        got += bytes;
+    }
+
+    TEST_CHECK(got == size);
+    TEST_CHECK(!memcmp(buf, reply, size));
+}
+
+static void _expect_closed(int fd)
+{
+    uint8_t buf[16];
+
+    TEST_CHECK(recv(fd, buf, sizeof(buf), 0) <= 0);
+}
+
+/* connect request for target, reply echoes its address */
+static size_t _request(uint8_t *buf)
+{
+    buf[0] = 0x05;
+    buf[1] = 0x01;
+    buf[2] = 0x00;
+    buf[3] = 0x01;
+    memcpy(buf + 4, &_target.sin_addr.s_addr, 4);
+    memcpy(buf + 8, &_target.sin_port, 2);
+
+    return 10;
+}
+
+static size_t _auth(uint8_t *buf, uint8_t version, char const *user,
+                    char const *password)
+{
+    size_t len = 0;
+
+    buf[len++] = version;
+    buf[len++] = strlen(user);
+    memcpy(buf + len, user, strlen(user));
+    len += strlen(user);
+    buf[len++] = strlen(password);
+    memcpy(buf + len, password, strlen(password));
+
+    return len + strlen(password);
+}
+
+/* request went through, server connected to target */
+static void _expect_connected(int fd)
+{
+    uint8_t reply[10];
+    int remote = -1;
+
+    _request(reply);
+    reply[1] = 0x00;
+    _expect(fd, reply, sizeof(reply));
+
+    remote = accept(_target_fd, NULL, NULL);
+    TEST_CHECK(remote >= 0);
+    close(remote);
+}
+
+static void test_byte_by_byte()
+{
+    uint8_t request[16];
+    int fd = -1;
+
+    _credentials("", "");
+    fd = _client();
+
+    _send(fd, "\x05\x02\x00\x02", 4, 1);
+    _expect(fd, "\x05\x00", 2);
+    _send(fd, request, _request(request), 1);
+    _expect_connected(fd);
+    close(fd);
+}
+
+static void test_auth_byte_by_byte()
+{
+    uint8_t msg[64];
+    uint8_t request[16];
+    int fd = -1;
+
+    _credentials("user", "secret");
+    fd = _client();
+
+    _send(fd, "\x05\x01\x02", 3, 1);
+    _expect(fd, "\x05\x02", 2);
+    _send(fd, msg, _auth(msg, 0x01, "user", "secret"), 1);
+    _expect(fd, "\x01\x00", 2);
+    _send(fd, request, _request(request), 1);
+    _expect_connected(fd);
+    close(fd);
+}
+
+static void test_partial_messages()
+{
+    uint8_t msg[64];
+    uint8_t request[16];
+    int fd = -1;
+
+    _credentials("user", "secret");
+    fd = _client();
+
+    /* greeting torn before its methods, auth torn inside both strings */
+    _send(fd, "\x05\x01\x02", 3, 2);
+    _expect(fd, "\x05\x02", 2);
+    _send(fd, msg, _auth(msg, 0x01, "user", "secret"), 3);
+    _expect(fd, "\x01\x00", 2);
+    /* request torn inside its address */
+    _send(fd, request, _request(request), 6);
+    _expect_connected(fd);
+    close(fd);
+}
+
+static void test_pipelined_partial()
+{
+    uint8_t msg[128];
+    size_t len = 0;
+    int fd = -1;
+
+    _credentials("user", "secret");
+    fd = _client();
+
+    /* everything at once, split in the middle of the auth message */
+    memcpy(msg, "\x05\x01\x02", 3);
+    len = 3;
+    len += _auth(msg + len, 0x01, "user", "secret");
+    len += _request(msg + len);
+    _send(fd, msg, 7, 7);
+    _expect(fd, "\x05\x02", 2);
+    _send(fd, msg + 7, len - 7, len - 7);
+    _expect(fd, "\x01\x00", 2);
+    _expect_connected(fd);
+    close(fd);
+}
+
+static void test_auth_wrong_version()
+{
+    uint8_t msg[64];
+    int fd = -1;
+
+    _credentials("user", "secret");
+    fd = _client();
+
+    _send(fd, "\x05\x01\x02", 3, 3);
+    _expect(fd, "\x05\x02", 2);
+    /* right credentials under socks version instead of subnegotiation */
+    _send(fd, msg, _auth(msg, 0x05, "user", "secret"), 1);
+    _expect(fd, "\x01\xff", 2);
+    _expect_closed(fd);
+    close(fd);
+}
+
+static void test_auth_wrong_password()
+{
+    uint8_t msg[64];
+    int fd = -1;
+
+    _credentials("user", "secret");
+    fd = _client();
+
+    _send(fd, "\x05\x01\x02", 3, 3);
+    _expect(fd, "\x05\x02", 2);
+    _send(fd, msg, _auth(msg, 0x01, "user", "secrex"), 4);
+    _expect(fd, "\x01\xff", 2);
+    _expect_closed(fd);
+    close(fd);
+}
+
+static void test_no_common_method()
+{
+    int fd = -1;
+
+    _credentials("user", "secret");
+    fd = _client();
+
+    _send(fd, "\x05\x01\x00", 3, 1);
+    _expect(fd, "\x05\xff", 2);
+    _expect_closed(fd);
+    close(fd);
+}
+
+int main()
+{
+    struct config cfg;
+    socklen_t size = sizeof(_server);
+
+    log_set_quiet(true);
+
+    config_defaults(&cfg);
+    TEST_CHECK(config_init(&cfg) == 0);
+    TEST_CHECK(membudget_init(64 << 20) == 0);
+    TEST_CHECK(socks5_init("127.0.0.1", 0) == 0);
+    getsockname(socks5_get_listener(), (struct sockaddr *)&_server, &size);
+    _listen(&_target_fd, &_target);
+
+    TEST_RUN(test_byte_by_byte);
+    TEST_RUN(test_auth_byte_by_byte);
+    TEST_RUN(test_partial_messages);
+    TEST_RUN(test_pipelined_partial);
+    TEST_RUN(test_auth_wrong_version);
+    TEST_RUN(test_auth_wrong_password);
+    TEST_RUN(test_no_common_method);
+
+    socks5_deinit();
+    close(_target_fd);
+
+    return TEST_DONE();
+}
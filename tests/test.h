@@ -0,0 +1,32 @@
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+
+/*
+ * Checks shared by module tests. A failed check reports its location and
+ * the test goes on, so one run lists every broken expectation; main returns
+ * TEST_DONE() which is non zero if anything failed.
+ */
+
+static int _test_failures;
+
+#define TEST_CHECK(cond)                                                       \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,   \
+                    #cond);                                                    \
+            _test_failures++;                                                  \
+        }                                                                      \
+    } while (0)
+
+#define TEST_RUN(fn)                                                           \
+    do {                                                                       \
+        int failures = _test_failures;                                         \
+        fn();                                                                  \
+        printf("%-40s %s\n", #fn, failures == _test_failures ? "ok" : "FAIL"); \
+    } while (0)
+
+#define TEST_DONE() (_test_failures ? 1 : 0)
+
+#endif /* __TEST_H__ */
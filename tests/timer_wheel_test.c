@@ -0,0 +1,231 @@
+#include "log.h"
+#include "test.h"
+#include "timer_wheel.h"
+
+#define TICK_MS 10
+
+struct fired
+{
+    size_t count;
+    uint64_t at_ms;
+    /* rearm period from callback, 0 for one shot */
+    uint64_t period_ms;
+    struct timer_wheel *wheel;
+};
+
+static uint64_t _now_ms;
+
+static void _fire(struct timer_wheel_timer *t, void *arg)
+{
+    struct fired *f = arg;
+
+    f->count++;
+    f->at_ms = _now_ms;
+    if (f->period_ms) {
+        timer_wheel_arm(f->wheel, t, _now_ms + f->period_ms);
+    }
+}
+
+/* step wheel one millisecond at a time, like a loop polling often */
+static void _run_until(struct timer_wheel *w, uint64_t until_ms)
+{
+    while (_now_ms < until_ms) {
+        _now_ms++;
+        timer_wheel_advance(w, _now_ms);
+    }
+}
+
+static void _init(struct timer_wheel *w)
+{
+    _now_ms = 1000;
+    timer_wheel_init(w, TICK_MS, _now_ms);
+}
+
+static void test_fires_at_deadline()
+{
+    struct timer_wheel w;
+    struct timer_wheel_timer t;
+    struct fired f = { 0 };
+
+    _init(&w);
+    timer_wheel_timer_init(&t, _fire, &f);
+    TEST_CHECK(!timer_wheel_armed(&t));
+
+    timer_wheel_arm(&w, &t, 1095);
+    TEST_CHECK(timer_wheel_armed(&t));
+    TEST_CHECK(w.armed == 1);
+
+    /* deadline is rounded up to the next tick, never fires early */
+    _run_until(&w, 1099);
+    TEST_CHECK(f.count == 0);
+    _run_until(&w, 1100);
+    TEST_CHECK(f.count == 1 && f.at_ms == 1100);
+    TEST_CHECK(!timer_wheel_armed(&t));
+    TEST_CHECK(w.armed == 0);
+
+    _run_until(&w, 2000);
+    TEST_CHECK(f.count == 1);
+}
+
+static void test_past_deadline_fires_next_tick()
+{
+    struct timer_wheel w;
+    struct timer_wheel_timer t;
+    struct fired f = { 0 };
+
+    _init(&w);
+    timer_wheel_timer_init(&t, _fire, &f);
+    timer_wheel_arm(&w, &t, 10);
+
+    TEST_CHECK(timer_wheel_advance(&w, _now_ms) == 0);
+    TEST_CHECK(timer_wheel_advance(&w, _now_ms + TICK_MS) == 1);
+    TEST_CHECK(f.count == 1);
+}
+
+static void test_cancel()
+{
+    struct timer_wheel w;
+    struct timer_wheel_timer t;
+    struct fired f = { 0 };
+
+    _init(&w);
+    timer_wheel_timer_init(&t, _fire, &f);
+    timer_wheel_arm(&w, &t, 1050);
+    timer_wheel_cancel(&w, &t);
+    TEST_CHECK(!timer_wheel_armed(&t));
+    TEST_CHECK(w.armed == 0);
+
+    /* cancelling twice is harmless */
+    timer_wheel_cancel(&w, &t);
+    TEST_CHECK(w.armed == 0);
+
+    _run_until(&w, 1200);
+    TEST_CHECK(f.count == 0);
+}
+
+static void test_rearm_moves_timer()
+{
+    struct timer_wheel w;
+    struct timer_wheel_timer t;
+    struct fired f = { 0 };
+
+    _init(&w);
+    timer_wheel_timer_init(&t, _fire, &f);
+    timer_wheel_arm(&w, &t, 1050);
+    timer_wheel_arm(&w, &t, 1500);
+    TEST_CHECK(w.armed == 1);
+
+    _run_until(&w, 1490);
+    TEST_CHECK(f.count == 0);
+    _run_until(&w, 1500);
+    TEST_CHECK(f.count == 1 && f.at_ms == 1500);
+}
+
+static void test_periodic_from_callback()
+{
+    struct timer_wheel w;
+    struct timer_wheel_timer t;
+    struct fired f = { 0 };
+
+    _init(&w);
+    f.period_ms = 100;
+    f.wheel = &w;
+    timer_wheel_timer_init(&t, _fire, &f);
+    timer_wheel_arm(&w, &t, 1100);
+
+    _run_until(&w, 2000);
+    TEST_CHECK(f.count == 10);
+    TEST_CHECK(timer_wheel_armed(&t));
+
+    f.period_ms = 0;
+    _run_until(&w, 2100);
+    TEST_CHECK(f.count == 11);
+    TEST_CHECK(!timer_wheel_armed(&t));
+}
+
+static void test_far_timer_cascades()
+{
+    struct timer_wheel w;
+    struct timer_wheel_timer t;
+    struct fired f = { 0 };
+    /* beyond two levels, lands in level 2 and cascades down twice */
+    uint64_t deadline_ms = 1000
+                         + TICK_MS * (3ull << (2 * TIMER_WHEEL_BITS)) + 7;
+
+    _init(&w);
+    timer_wheel_timer_init(&t, _fire, &f);
+    timer_wheel_arm(&w, &t, deadline_ms);
+
+    /* big steps, wheel still walks every tick */
+    TEST_CHECK(timer_wheel_advance(&w, deadline_ms - TICK_MS) == 0);
+    TEST_CHECK(f.count == 0);
+    _now_ms = deadline_ms + TICK_MS;
+    TEST_CHECK(timer_wheel_advance(&w, _now_ms) == 1);
+    TEST_CHECK(f.count == 1);
+}
+
+static void test_timeout()
+{
+    struct timer_wheel w;
+    struct timer_wheel_timer near;
+    struct timer_wheel_timer far;
+    struct fired f = { 0 };
+
+    _init(&w);
+    TEST_CHECK(timer_wheel_timeout_ms(&w, _now_ms) == -1);
+
+    timer_wheel_timer_init(&near, _fire, &f);
+    timer_wheel_arm(&w, &near, 1030);
+    TEST_CHECK(timer_wheel_timeout_ms(&w, _now_ms) == 30);
+    TEST_CHECK(timer_wheel_timeout_ms(&w, _now_ms + 5) == 25);
+    TEST_CHECK(timer_wheel_timeout_ms(&w, _now_ms + 100) == 0);
+    timer_wheel_cancel(&w, &near);
+
+    /* timers on coarser levels wake the loop no later than the next
+     * cascade, which is at most one level 0 round away */
+    timer_wheel_timer_init(&far, _fire, &f);
+    timer_wheel_arm(&w, &far, _now_ms + 100 * TIMER_WHEEL_SLOTS * TICK_MS);
+    int timeout = timer_wheel_timeout_ms(&w, _now_ms);
+    TEST_CHECK(timeout > 0 && timeout <= TIMER_WHEEL_SLOTS * TICK_MS);
+}
+
+static void test_many_timers_fire_once()
+{
+    static struct timer_wheel w;
+    static struct timer_wheel_timer t[1000];
+    static struct fired f[1000];
+    size_t late = 0;
+
+    _init(&w);
+    for (size_t i = 0; i < 1000; i++) {
+        timer_wheel_timer_init(&t[i], _fire, &f[i]);
+        timer_wheel_arm(&w, &t[i], 1000 + i * 37 % 5000);
+    }
+    TEST_CHECK(w.armed == 1000);
+
+    _run_until(&w, 7000);
+    for (size_t i = 0; i < 1000; i++) {
+        uint64_t deadline_ms = 1000 + i * 37 % 5000;
+        TEST_CHECK(f[i].count == 1);
+        TEST_CHECK(f[i].at_ms >= deadline_ms);
+        late += f[i].at_ms > deadline_ms + TICK_MS;
+    }
+    TEST_CHECK(late == 0);
+    TEST_CHECK(w.armed == 0);
+}
+
+int main()
+{
+    log_set_quiet(true);
+
+    TEST_RUN(test_fires_at_deadline);
+    TEST_RUN(test_past_deadline_fires_next_tick);
+    TEST_RUN(test_cancel);
+    TEST_RUN(test_rearm_moves_timer);
+    TEST_RUN(test_periodic_from_callback);
+    TEST_RUN(test_far_timer_cascades);
+    TEST_RUN(test_timeout);
+    TEST_RUN(test_many_timers_fire_once);
+
+    return TEST_DONE();
+}
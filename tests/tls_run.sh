@@ -0,0 +1,158 @@
+#! /bin/sh
+
+# upstream over tls against a local stand-in, same topology as perf_run.sh:
+#
+#   tp_client 10.201.0.2 --- 10.201.0.1 tp_proxy 10.201.1.1 --- 10.201.1.2 tp_server
+#                                       tunproxy                          10.202.0.1 (lo)
+#                                       tls_standin.py 127.0.0.1:1443
+#
+# tunproxy reaches its own socks5 listener through the stand-in, which
+# terminates tls with a throwaway ca. Each tls version runs udp load once
+# freely and once with the stand-in stopped for a while, so upstream socket
+# fills and tls writes come back short. Connection has to survive that.
+
+duration=${DURATION:-3}
+udp_rate=${UDP_RATE:-5000}
+udp_size=${UDP_SIZE:-1200}
+udp_flows=${UDP_FLOWS:-8}
+stall_ms=${STALL_MS:-1000}
+# received share of sent packets a run needs, in percent
+min_received=${MIN_RECEIVED:-50}
+
+script_dir=$(dirname "$(realpath $0)")
+repo_dir=$script_dir/..
+tunproxy=$repo_dir/tunproxy
+work=$(mktemp -d /tmp/tls_run.XXXXXX)
+
+client="ip netns exec tp_client"
+proxy="ip netns exec tp_proxy"
+server="ip netns exec tp_server"
+echo_addr=10.202.0.1:9000
+socks_addr=10.201.0.1:1080
+tls_addr=127.0.0.1:1443
+
+tunproxy_pid=""
+standin_pid=""
+failed=0
+
+cleanup() {
+    [ -n "$tunproxy_pid" ] && kill -INT $tunproxy_pid 2>/dev/null && wait $tunproxy_pid
+    [ -n "$standin_pid" ] && kill $standin_pid 2>/dev/null
+    for ns in tp_client tp_proxy tp_server; do
+        ip netns pids $ns 2>/dev/null | xargs -r kill 2>/dev/null
+        ip netns del $ns 2>/dev/null
+    done
+    rm -rf $work
+}
+
+# run udp load, fail when too little came back
+run_load() {
+    name=$1
+    out=$($client $work/loadgen udp $echo_addr -r $udp_rate -s $udp_size -c $udp_flows -t $duration) \
+        || { echo "$name: load generator failed"; return 1; }
+    echo "$name: $out"
+    sent=$(echo "$out" | sed -n 's/.* sent \([0-9]*\).*/\1/p')
+    received=$(echo "$out" | sed -n 's/.* received \([0-9]*\).*/\1/p')
+    [ $((received * 100)) -ge $((sent * min_received)) ] \
+        || { echo "$name: FAILED, received $received of $sent"; return 1; }
+}
+
+# one stand-in and tunproxy per tls version
+run_version() {
+    version=$1
+
+    $proxy python3 $script_dir/tls_standin.py $work/srv.pem $work/srv.key $tls_addr $socks_addr $version \
+        > $work/standin.out 2>&1 &
+    standin_pid=$!
+    sleep 0.5
+
+    $proxy $tunproxy --tls $tls_addr --tls-ca $work/ca.pem $socks_addr > $work/tunproxy.out 2>&1 &
+    tunproxy_pid=$!
+    sleep 1.5
+    if ! kill -0 $tunproxy_pid 2>/dev/null; then
+        tunproxy_pid=""
+        echo "tls $version: tunproxy didn't start:"
+        cat $work/tunproxy.out
+        return 1
+    fi
+    $proxy sysctl -qw net.ipv4.conf.tun0.rp_filter=0 2>/dev/null
+
+    run_load "tls $version" || failed=1
+
+    # stopped stand-in neither reads nor writes, upstream socket fills up
+    (sleep 0.5; kill -STOP $standin_pid; sleep $(awk "BEGIN { print $stall_ms / 1000 }"); kill -CONT $standin_pid) &
+    stall_pid=$!
+    run_load "tls $version stalled" || failed=1
+    wait $stall_pid
+
+    if grep -q "mux connection [0-9]* lost" "$work"/*[0-9][0-9][0-9][0-9] 2>/dev/null; then
+        echo "tls $version: FAILED, upstream connection was lost"
+        failed=1
+    fi
+    grep -ho "tls upstream .*" "$work"/*[0-9][0-9][0-9][0-9] 2>/dev/null | head -1
+
+    kill -INT $tunproxy_pid && wait $tunproxy_pid
+    tunproxy_pid=""
+    kill $standin_pid && wait $standin_pid 2>/dev/null
+    standin_pid=""
+    rm -f "$work"/*[0-9][0-9][0-9][0-9]
+}
+
+if [ "$(id -u)" != 0 ]; then
+    echo "needs root (network namespaces, tuntap)"
+    exit 1
+fi
+
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+make -C $repo_dir || exit 1
+gcc -O2 -Wall -Werror -pthread -I$repo_dir/src/stats -I$repo_dir/src/util -I$repo_dir/log/src \
+    $repo_dir/perf/loadgen.c $repo_dir/src/stats/stats.c $repo_dir/log/src/log.c \
+    -o $work/loadgen || exit 1
+
+# throwaway ca, endpoint certificate names the address tunproxy dials
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=tls_run ca" \
+    -keyout $work/ca.key -out $work/ca.pem 2>/dev/null || exit 1
+openssl req -newkey rsa:2048 -nodes -subj "/CN=tls_run" \
+    -keyout $work/srv.key -out $work/srv.csr 2>/dev/null || exit 1
+echo "subjectAltName=IP:${tls_addr%:*}" > $work/srv.ext
+openssl x509 -req -in $work/srv.csr -CA $work/ca.pem -CAkey $work/ca.key -CAcreateserial \
+    -days 1 -extfile $work/srv.ext -out $work/srv.pem 2>/dev/null || exit 1
+
+echo -n "setting up namespaces..."
+for ns in tp_client tp_proxy tp_server; do
+    ip netns del $ns 2>/dev/null
+    ip netns add $ns
+    ip -n $ns link set lo up
+done
+
+ip link add tp_c type veth peer name tp_pc
+ip link add tp_s type veth peer name tp_ps
+ip link set tp_c netns tp_client
+ip link set tp_pc netns tp_proxy
+ip link set tp_ps netns tp_proxy
+ip link set tp_s netns tp_server
+
+$client sh -c 'ip addr add 10.201.0.2/24 dev tp_c && ip link set tp_c up && ip route add default via 10.201.0.1'
+$proxy sh -c 'ip addr add 10.201.0.1/24 dev tp_pc && ip link set tp_pc up
+              ip addr add 10.201.1.1/24 dev tp_ps && ip link set tp_ps up
+              ip route add default via 10.201.1.2'
+$server sh -c 'ip addr add 10.201.1.2/24 dev tp_s && ip link set tp_s up
+               ip addr add 10.202.0.1/32 dev lo && ip route add default via 10.201.1.1'
+
+$proxy sysctl -qw net.ipv4.ip_forward=1
+$proxy sysctl -qw net.ipv4.conf.all.rp_filter=0
+$proxy sysctl -qw net.ipv4.conf.default.rp_filter=0
+echo "done"
+
+$server $work/loadgen udp-echo $echo_addr &
+sleep 0.2
+
+cd $work
+for version in 1.3 1.2; do
+    run_version $version || failed=1
+done
+
+[ $failed = 0 ] && echo "tls: ok" || echo "tls: FAILED"
+exit $failed
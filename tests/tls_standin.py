@@ -0,0 +1,66 @@
+#! /usr/bin/env python3
+
+# tls terminating stand-in for a socks5 proxy behind a tls endpoint: every
+# accepted connection is unwrapped and its bytes are pumped to upstream as is
+#
+#   tls_standin.py <cert> <key> <listen ip:port> <upstream ip:port> [1.2|1.3]
+
+import socket
+import ssl
+import sys
+import threading
+
+
+def address(text):
+    ip, port = text.rsplit(":", 1)
+    return ip, int(port)
+
+
+def pump(src, dst):
+    try:
+        while True:
+            data = src.recv(65536)
+            if not data:
+                break
+            dst.sendall(data)
+    except OSError:
+        pass
+    for s in (src, dst):
+        try:
+            s.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+
+
+def main():
+    if len(sys.argv) < 5:
+        print("usage: tls_standin.py <cert> <key> <listen ip:port> "
+              "<upstream ip:port> [1.2|1.3]", file=sys.stderr)
+        return 1
+
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    ctx.load_cert_chain(sys.argv[1], sys.argv[2])
+    if len(sys.argv) > 5 and sys.argv[5] == "1.2":
+        ctx.maximum_version = ssl.TLSVersion.TLSv1_2
+    upstream = address(sys.argv[4])
+
+    listener = socket.socket()
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(address(sys.argv[3]))
+    listener.listen(16)
+
+    while True:
+        conn, _ = listener.accept()
+        try:
+            tls = ctx.wrap_socket(conn, server_side=True)
+        except (OSError, ssl.SSLError) as e:
+            print("handshake failed:", e, flush=True)
+            conn.close()
+            continue
+        proxy = socket.create_connection(upstream)
+        threading.Thread(target=pump, args=(tls, proxy), daemon=True).start()
+        threading.Thread(target=pump, args=(proxy, tls), daemon=True).start()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
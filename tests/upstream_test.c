@@ -0,0 +1,123 @@
+#include <errno.h>
+
+#include "log.h"
+#include "test.h"
+#include "upstream.h"
+
+#define PICKS 200
+
+static int _picks_of(uint32_t ready, size_t server)
+{
+    int count = 0;
+
+    for (int i = 0; i < PICKS; i++) {
+        count += upstream_pick(ready) == (int)server;
+    }
+
+    return count;
+}
+
+static void test_init_limits()
+{
+    TEST_CHECK(upstream_init(0) == -1 && errno == -EINVAL);
+    TEST_CHECK(upstream_init(UPSTREAM_MAX_SERVERS + 1) == -1
+               && errno == -EINVAL);
+    TEST_CHECK(upstream_init(UPSTREAM_MAX_SERVERS) == 0);
+}
+
+static void test_pick_ready_only()
+{
+    upstream_init(3);
+
+    TEST_CHECK(upstream_pick(0) == -1);
+    /* bits of servers past count are ignored */
+    TEST_CHECK(upstream_pick(1u << 3) == -1);
+    TEST_CHECK(_picks_of(1u << 1, 1) == PICKS);
+    TEST_CHECK(_picks_of(1u << 0 | 1u << 2, 1) == 0);
+}
+
+static void test_rtt_ewma()
+{
+    upstream_init(1);
+
+    TEST_CHECK(upstream_rtt_us(0) == 0);
+    upstream_rtt(0, 1000);
+    TEST_CHECK(upstream_rtt_us(0) == 1000);
+    /* new sample weighs 1 / 2^UPSTREAM_RTT_SHIFT */
+    upstream_rtt(0, 1000 + (8 << UPSTREAM_RTT_SHIFT));
+    TEST_CHECK(upstream_rtt_us(0) == 1008);
+    upstream_rtt(0, 1008 - (8 << UPSTREAM_RTT_SHIFT));
+    TEST_CHECK(upstream_rtt_us(0) == 1000);
+
+    /* 0 stays reserved for unmeasured */
+    upstream_init(1);
+    upstream_rtt(0, 0);
+    TEST_CHECK(upstream_rtt_us(0) == 1);
+}
+
+static void test_pick_prefers_measured_and_faster()
+{
+    /* with two ready servers both are always compared */
+    upstream_init(2);
+    upstream_rtt(1, 500);
+    TEST_CHECK(_picks_of(3, 1) == PICKS);
+
+    upstream_rtt(0, 100);
+    TEST_CHECK(_picks_of(3, 0) == PICKS);
+}
+
+static void test_pick_spreads_equal_servers()
+{
+    upstream_init(4);
+    for (size_t i = 0; i < 4; i++) {
+        upstream_rtt(i, 1000);
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        int count = _picks_of(0xf, i);
+        TEST_CHECK(count > PICKS / 16 && count < PICKS / 2);
+    }
+}
+
+static void test_error_score()
+{
+    upstream_init(2);
+    upstream_rtt(0, 1000);
+    upstream_rtt(1, 2000);
+    TEST_CHECK(_picks_of(3, 0) == PICKS);
+
+    /* one failure weighs more than twice the rtt */
+    upstream_error(0);
+    TEST_CHECK(_picks_of(3, 1) == PICKS);
+
+    /* answered probes pull score back down */
+    for (int i = 0; i < 3; i++) {
+        upstream_rtt(0, 1000);
+    }
+    TEST_CHECK(_picks_of(3, 0) == PICKS);
+
+    /* server that kept failing is taken again once it answers again */
+    for (int i = 0; i < 100; i++) {
+        upstream_error(1);
+    }
+    TEST_CHECK(_picks_of(3, 0) == PICKS);
+    for (int i = 0; i < 100; i++) {
+        upstream_rtt(1, 2000);
+    }
+    upstream_rtt(0, 8000);
+    TEST_CHECK(_picks_of(3, 1) == PICKS);
+}
+
+int main()
+{
+    log_set_quiet(true);
+
+    TEST_RUN(test_init_limits);
+    TEST_RUN(test_pick_ready_only);
+    TEST_RUN(test_rtt_ewma);
+    TEST_RUN(test_pick_prefers_measured_and_faster);
+    TEST_RUN(test_pick_spreads_equal_servers);
+    TEST_RUN(test_error_score);
+
+    return TEST_DONE();
+}